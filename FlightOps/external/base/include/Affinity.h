@@ -0,0 +1,67 @@
+#ifndef __PETSYS_AFFINITY_HPP__DEFINED__
+#define __PETSYS_AFFINITY_HPP__DEFINED__
+
+#include <vector>
+#include <string>
+#include <sched.h>
+
+namespace PETSYS {
+
+	/*! CPU affinity policy of the threads of the event pipeline.
+	 * Each role (the RawReader thread, the ThreadPool workers and the raw data writer) can be given a list of CPUs.
+	 * Reader and writer threads are pinned to all the CPUs of their list, worker i to the i-th CPU of the workers' list.
+	 * A thread whose CPUs are all on one NUMA node takes its new EventBuffer storage from that node, see BufferPool.
+	 * Roles without CPUs are left to the scheduler, as is everything when no policy is set.
+	 */
+	class Affinity {
+	public:
+		enum Role { READER = 0, WORKER = 1, WRITER = 2 };
+		static const int N_ROLES = 3;
+
+		struct Policy {
+			int nWorkers;				// ThreadPool workers, 0 for the default
+			std::vector<int> cpus[N_ROLES];		// Empty to leave a role unpinned
+
+			Policy() : nWorkers(0) { };
+		};
+
+		/*! Parses a CPU list such as "0-7,16,18" (empty for none). Returns false if it is not valid. */
+		static bool parseCPUList(const char *s, std::vector<int> &cpus);
+
+		/*! Sets the policy, usually from SystemConfig::processing_affinity.
+		 * The environment overrides it: PETSYS_WORKERS, PETSYS_READER_CPUS, PETSYS_WORKER_CPUS and PETSYS_WRITER_CPUS.
+		 * Only pools created afterwards follow the new worker settings, so call it before the first processStep().
+		 */
+		static void setPolicy(const Policy &policy);
+		/*! The policy in effect, from the environment alone until setPolicy() is called */
+		static Policy getPolicy();
+
+		/*! Number of workers of a pool with the default size: nWorkers, or the size of the workers' CPU list, or the number of online CPUs */
+		static int getDefaultNWorkers();
+
+		/*! Pins the calling thread as set for role; index is the worker index.
+		 * Returns false if the role has no CPUs or the thread could not be pinned.
+		 */
+		static bool pinThread(Role role, int index = 0);
+
+		/*! Pins the calling thread as pinThread() while in scope, then restores its previous CPUs and NUMA node.
+		 * For threads the pipeline only borrows, such as the caller of RawReader::processStep().
+		 */
+		class ScopedPin {
+		public:
+			ScopedPin(Role role, int index = 0);
+			~ScopedPin();
+		private:
+			bool pinned;
+			cpu_set_t previousCPUs;
+			int previousNode;
+		};
+
+		/*! NUMA node of a CPU, 0 if the system does not tell */
+		static int getNode(int cpu);
+
+		static std::string toString(const std::vector<int> &cpus);
+	};
+
+}
+#endif // __PETSYS_AFFINITY_HPP__DEFINED__
@@ -0,0 +1,53 @@
+#ifndef __PETSYS_BUFFERPOOL_HPP__DEFINED__
+#define __PETSYS_BUFFERPOOL_HPP__DEFINED__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+namespace PETSYS {
+
+	/*! Process-wide recycling allocator for EventBuffer storage.
+	 * Blocks are grouped in power of two size classes (4 KiB and up).
+	 * Released blocks go to a small per-thread free list first (if they belong to the thread's node) and overflow into a shared,
+	 * per size class, free list. They are only returned to the system when the amount of
+	 * cached memory exceeds the configured limit, or when trim() is called.
+	 * Shared free lists are kept per NUMA node, plus one for threads not on a single node.
+	 * A thread on a single node (see Affinity::pinThread()) gets blocks whose pages it faulted in itself
+	 * when they were mapped, which places them on its node under the default memory policy
+	 * (not under e.g. numactl --interleave). A block always goes back to the list of the thread which mapped it,
+	 * whichever thread releases it, so blocks do not move between nodes.
+	 * Blocks of threads not on a single node are placed wherever they are first written.
+	 */
+	class BufferPool {
+	public:
+		struct Stats {
+			u_int64_t nAllocations;		// Blocks handed out
+			u_int64_t nPoolHits;		// ... of which were recycled
+			u_int64_t nReleases;		// Blocks given back
+			u_int64_t nFreed;		// ... of which were returned to the system
+			u_int64_t bytesInUse;		// Bytes currently handed out
+			u_int64_t bytesCached;		// Bytes sitting in free lists
+			u_int64_t peakBytesResident;	// Peak of bytesInUse + bytesCached
+		};
+
+		/*! Returns a block of at least minBytes; blockBytes is set to the actual block size,
+		 * which must be passed back to release()
+		 */
+		static void *allocate(size_t minBytes, size_t &blockBytes);
+		static void release(void *ptr, size_t blockBytes);
+
+		/*! Sets the NUMA node whose free lists the calling thread uses, -1 if it runs on more than one */
+		static void setThreadNode(int node);
+		static int getThreadNode();
+
+		static void setMaxCachedBytes(size_t maxBytes);
+		static size_t getMaxCachedBytes();
+		/*! Returns all blocks in the shared free lists to the system */
+		static void trim();
+
+		static Stats getStats();
+		static void report();
+	};
+
+}
+#endif // __PETSYS_BUFFERPOOL_HPP__DEFINED__
@@ -0,0 +1,36 @@
+#ifndef __PETSYS_CALIBRATIONKERNEL_HPP__DEFINED__
+#define __PETSYS_CALIBRATIONKERNEL_HPP__DEFINED__
+
+namespace PETSYS {
+
+	/*! Batched TDC and QDC solvers used by ProcessHit.
+	 * Inputs are gathered per hit into contiguous arrays by the caller.
+	 * The implementation (scalar, SSE4.1 or AVX2) is selected at runtime from the CPU features;
+	 * all of them perform the same floating point operations in the same order,
+	 * so results do not depend on the selected implementation.
+	 */
+	class CalibrationKernel {
+	public:
+		enum ISA { SCALAR = 0, SSE4 = 1, AVX2 = 2 };
+
+		// Newton-Raphson iteration budget and stopping step for the QDC solver
+		static const int QDC_MAX_ITERATIONS = 100;
+
+		static ISA getISA();
+		static const char *getISAName(ISA isa);
+		static bool isSupported(ISA isa);
+		/*! Selects an implementation, eg. for benchmarking; returns false if not supported by this CPU */
+		static bool setISA(ISA isa);
+
+		/*! q[i] = (-a1 + sqrt(a1^2 - 4 (a0 - fine) a2)) / (2 a2) */
+		static void solveTDC(int n, const float *a0, const float *a1, const float *a2, const float *fine, float *q);
+
+		/*! Solves P_i(t) = efine[i] by Newton-Raphson starting from t = ti[i],
+		 * where P_i(t) = p[0][i] + p[1][i] t + ... + p[9][i] t^9.
+		 * Each lane stops once a step is smaller than 0.05, or after QDC_MAX_ITERATIONS.
+		 */
+		static void solveQDC(int n, float * const p[10], const float *efine, const float *ti, float *tEq);
+	};
+
+}
+#endif // __PETSYS_CALIBRATIONKERNEL_HPP__DEFINED__
@@ -1,6 +1,7 @@
 #ifndef __PETSYS_COARSE_SORTER_HPP__DEFINED__
 #define __PETSYS_COARSE_SORTER_HPP__DEFINED__
 #include <Event.h>
+#include <ColumnarEventBuffer.h>
 #include <UnorderedEventHandler.h>
 #include <Instrumentation.h>
 #include <vector>
@@ -12,16 +13,33 @@ namespace PETSYS {
 	 * they are sorted with a tolerance of overalp/2.
 	 * Overlap/2 precision is good enough for the remainding of the software processing chain.
 	 * Having correct frame boundaries is convenient for modules which write out events grouped by frame.
+	 * Buffers are sorted in place and passed on, buffers already in order are passed on untouched.
 	 */
 	 
 	class CoarseSorter : public UnorderedEventHandler<RawHit, RawHit> {
 	public:
 		CoarseSorter (EventSink<RawHit> *sink);
 		void report();
+
+		/*! Sorts hits[0..N) in place, as handleEvents() does for a buffer.
+		 * Returns false if they were already in order.
+		 */
+		static bool sortInPlace(RawHit *hits, unsigned N);
 	protected:
 		virtual EventBuffer<RawHit> * handleEvents (EventBuffer<RawHit> *inBuffer);
 	private:
-		u_int64_t nSingleRead;
+		Metrics::Counter *nBuffersInOrder;
+	};
+
+	/*! CoarseSorter over structure-of-arrays buffers */
+	class ColumnarCoarseSorter : public UnorderedEventHandler<RawHitColumns, RawHitColumns> {
+	public:
+		ColumnarCoarseSorter (EventSink<RawHitColumns> *sink);
+		void report();
+	protected:
+		virtual EventBuffer<RawHitColumns> * handleEvents (EventBuffer<RawHitColumns> *inBuffer);
+	private:
+		Metrics::Counter *nBuffersInOrder;
 	};
 
 }
@@ -5,20 +5,40 @@
 #include <UnorderedEventHandler.h>
 #include <Instrumentation.h>
 #include <SystemConfig.h>
+#include <vector>
 
 namespace PETSYS {
 
+/*! Groups GammaPhoton into Coincidence, using the engine selected by sw_trigger:coincidence_engine.
+ * COINCIDENCE_ENGINE_SCAN compares each seed photon with every following photon,
+ * COINCIDENCE_ENGINE_INDEXED only visits photons from regions in coincidence with the seed's region;
+ * both produce the same coincidences.
+ * With sw_trigger:coincidence_max_photons 2 every allowed pair of photons is a coincidence.
+ * Above 2, each seed photon takes all later photons not yet taken in coincidence with it,
+ * and coincidences with more than coincidence_max_photons photons are rejected.
+ * Photons are stored by decreasing trigger region and Coincidence::seed tells which one is the seed;
+ * the other photons are only in coincidence with the seed, not necessarily with each other.
+ * With buffer overlap, SimpleGrouper already cuts buffers at a gap wider than the coincidence window,
+ * so coincidences are not lost at buffer boundaries.
+ */
 class CoincidenceGrouper : public UnorderedEventHandler<GammaPhoton, Coincidence> {
 public:
 	CoincidenceGrouper(SystemConfig *systemConfig, EventSink<Coincidence> *sink);
 	~CoincidenceGrouper();
 	virtual void report();
 	
-private:
+protected:
 	virtual EventBuffer<Coincidence> * handleEvents(EventBuffer<GammaPhoton> *inBuffer);
 		
+private:
 	SystemConfig *systemConfig;
-	u_int64_t nPrompts;
+
+	// Regions r2 with isCoincidenceAllowed(r, r2) are partners[partnerStart[r] .. partnerStart[r+1]-1]
+	std::vector<unsigned> partnerStart;
+	std::vector<unsigned> partners;
+
+	Metrics::Counter *nPrompts;
+	Metrics::Counter *nCoincidencesOverflow;
 };
 }
 #endif // __PETSYS__COINCIDENCEGROUPER_HPP__DEFINED__
@@ -0,0 +1,31 @@
+#ifndef __PETSYS_COLUMNARADAPTER_HPP__DEFINED__
+#define __PETSYS_COLUMNARADAPTER_HPP__DEFINED__
+
+#include <Event.h>
+#include <ColumnarEventBuffer.h>
+#include <UnorderedEventHandler.h>
+
+namespace PETSYS {
+
+	/*! Converts RawHit buffers into structure-of-arrays buffers, to feed a columnar chain */
+	class RawHitToColumns : public UnorderedEventHandler<RawHit, RawHitColumns> {
+	public:
+		RawHitToColumns(EventSink<RawHitColumns> *sink);
+	protected:
+		virtual EventBuffer<RawHitColumns> * handleEvents (EventBuffer<RawHit> *inBuffer);
+	};
+
+	/*! Converts structure-of-arrays Hit buffers back into Hit buffers, so that the groupers and writers,
+	 * which only take Hit buffers, can be used after a columnar chain.
+	 * The RawHits referenced by Hit::raw are materialized in an intermediate buffer
+	 * which is kept alive through the parent chain.
+	 */
+	class HitColumnsToHit : public UnorderedEventHandler<HitColumns, Hit> {
+	public:
+		HitColumnsToHit(EventSink<Hit> *sink);
+	protected:
+		virtual EventBuffer<Hit> * handleEvents (EventBuffer<HitColumns> *inBuffer);
+	};
+
+}
+#endif // __PETSYS_COLUMNARADAPTER_HPP__DEFINED__
@@ -0,0 +1,203 @@
+#ifndef __PETSYS_COLUMNAREVENTBUFFER_HPP__DEFINED__
+#define __PETSYS_COLUMNAREVENTBUFFER_HPP__DEFINED__
+#include "Event.h"
+#include "EventBuffer.h"
+
+namespace PETSYS {
+
+	/*! Tag types selecting the structure-of-arrays EventBuffer specializations.
+	 * EventBuffer<RawHitColumns> and EventBuffer<HitColumns> hold one 64 byte aligned array per field
+	 * of RawHit and Hit, so that stages only touch the fields they need.
+	 * They flow through EventSink, ThreadPool and the event handlers like any other EventBuffer.
+	 *
+	 * Only CoarseSorter and ProcessHit have columnar variants (ColumnarCoarseSorter, ColumnarProcessHit),
+	 * and no converter uses them yet: bench_stages is their only user. SimpleGrouper, CoincidenceGrouper
+	 * and the writers take Hit buffers, since GammaPhoton points at its Hits, so a columnar chain has to
+	 * end in HitColumnsToHit, which copies the hits back into the array-of-structures layout.
+	 */
+	struct RawHitColumns {};
+	struct HitColumns {};
+
+	/*! Storage management shared by the columnar buffers.
+	 * All columns live in a single BufferPool block.
+	 * Column pointers are invalidated by reserve() and by growing the buffer.
+	 */
+	class ColumnarEventBufferBase : public AbstractEventBuffer {
+	public:
+		size_t getSize() { return used; };
+		size_t getUsed() { return used; };
+		void setUsed(size_t n) { used = n; };
+		size_t getCapacity() { return capacity; };
+		size_t getFree() { return capacity - used; };
+
+		void reserve(size_t newCapacity);
+
+		/*! Bytes of storage per event, over all columns */
+		size_t getBytesPerEvent();
+
+		virtual ~ColumnarEventBufferBase();
+
+	protected:
+		struct Column {
+			void **ptr;
+			size_t elementSize;
+		};
+
+		ColumnarEventBufferBase(AbstractEventBuffer *parent);
+		ColumnarEventBufferBase(u_int64_t seqN, long long tMin);
+		void initColumns(Column *columns, int nColumns, unsigned initialCapacity);
+
+		size_t used;
+
+	private:
+		Column *columns;
+		int nColumns;
+		size_t capacity;
+		void *block;
+		size_t blockBytes;
+	};
+
+	template <>
+	class EventBuffer<RawHitColumns> : public ColumnarEventBufferBase {
+	public:
+		long long *time;
+		long long *timeEnd;
+		unsigned int *channelID;
+		unsigned long *frameID;
+		unsigned short *tcoarse;
+		unsigned short *ecoarse;
+		unsigned short *tfine;
+		unsigned short *efine;
+		unsigned short *tacID;
+		bool *qdcMode;
+		bool *valid;
+
+		EventBuffer(unsigned initialCapacity, AbstractEventBuffer *parent)
+			: ColumnarEventBufferBase(parent)
+		{
+			init(initialCapacity);
+		};
+
+		EventBuffer(unsigned initialCapacity, unsigned seqN, long long tMin)
+			: ColumnarEventBufferBase(seqN, tMin)
+		{
+			init(initialCapacity);
+		};
+
+		void get(size_t i, RawHit &hit) {
+			hit.valid = valid[i];
+			hit.qdcMode = qdcMode[i];
+			hit.time = time[i];
+			hit.timeEnd = timeEnd[i];
+			hit.channelID = channelID[i];
+			hit.frameID = frameID[i];
+			hit.tcoarse = tcoarse[i];
+			hit.ecoarse = ecoarse[i];
+			hit.tfine = tfine[i];
+			hit.efine = efine[i];
+			hit.tacID = tacID[i];
+		};
+
+		void set(size_t i, const RawHit &hit) {
+			valid[i] = hit.valid;
+			qdcMode[i] = hit.qdcMode;
+			time[i] = hit.time;
+			timeEnd[i] = hit.timeEnd;
+			channelID[i] = hit.channelID;
+			frameID[i] = hit.frameID;
+			tcoarse[i] = hit.tcoarse;
+			ecoarse[i] = hit.ecoarse;
+			tfine[i] = hit.tfine;
+			efine[i] = hit.efine;
+			tacID[i] = hit.tacID;
+		};
+
+		void push(const RawHit &hit) {
+			if(used >= getCapacity()) reserve(getCapacity() + ((getCapacity() / 10240) + 1) * 1024);
+			set(used, hit);
+			used++;
+		};
+
+	private:
+		void init(unsigned initialCapacity) {
+			columnList[0] = { (void **)&time, sizeof(*time) };
+			columnList[1] = { (void **)&timeEnd, sizeof(*timeEnd) };
+			columnList[2] = { (void **)&channelID, sizeof(*channelID) };
+			columnList[3] = { (void **)&frameID, sizeof(*frameID) };
+			columnList[4] = { (void **)&tcoarse, sizeof(*tcoarse) };
+			columnList[5] = { (void **)&ecoarse, sizeof(*ecoarse) };
+			columnList[6] = { (void **)&tfine, sizeof(*tfine) };
+			columnList[7] = { (void **)&efine, sizeof(*efine) };
+			columnList[8] = { (void **)&tacID, sizeof(*tacID) };
+			columnList[9] = { (void **)&qdcMode, sizeof(*qdcMode) };
+			columnList[10] = { (void **)&valid, sizeof(*valid) };
+			initColumns(columnList, 11, initialCapacity);
+		};
+
+		Column columnList[11];
+	};
+
+	template <>
+	class EventBuffer<HitColumns> : public ColumnarEventBufferBase {
+	public:
+		double *time;
+		double *timeEnd;
+		float *energy;
+		unsigned int *channelID;
+		unsigned int *rawIndex;		// Row of the originating hit in getRaw()
+		short *region;
+		short *xi;
+		short *yi;
+		float *x;
+		float *y;
+		float *z;
+		bool *valid;
+
+		/*! raw is the buffer holding the RawHits referenced by rawIndex, usually an ancestor of this buffer */
+		EventBuffer(unsigned initialCapacity, AbstractEventBuffer *parent, EventBuffer<RawHitColumns> *raw)
+			: ColumnarEventBufferBase(parent), raw(raw)
+		{
+			init(initialCapacity);
+		};
+
+		EventBuffer<RawHitColumns> *getRaw() {
+			return raw;
+		};
+
+		/*! Fills hit with the AoS view of row i; hit.raw is left untouched */
+		void get(size_t i, Hit &hit) {
+			hit.valid = valid[i];
+			hit.time = time[i];
+			hit.timeEnd = timeEnd[i];
+			hit.energy = energy[i];
+			hit.region = region[i];
+			hit.xi = xi[i];
+			hit.yi = yi[i];
+			hit.x = x[i];
+			hit.y = y[i];
+			hit.z = z[i];
+		};
+
+	private:
+		void init(unsigned initialCapacity) {
+			columnList[0] = { (void **)&time, sizeof(*time) };
+			columnList[1] = { (void **)&timeEnd, sizeof(*timeEnd) };
+			columnList[2] = { (void **)&energy, sizeof(*energy) };
+			columnList[3] = { (void **)&channelID, sizeof(*channelID) };
+			columnList[4] = { (void **)&rawIndex, sizeof(*rawIndex) };
+			columnList[5] = { (void **)&region, sizeof(*region) };
+			columnList[6] = { (void **)&xi, sizeof(*xi) };
+			columnList[7] = { (void **)&yi, sizeof(*yi) };
+			columnList[8] = { (void **)&x, sizeof(*x) };
+			columnList[9] = { (void **)&y, sizeof(*y) };
+			columnList[10] = { (void **)&z, sizeof(*z) };
+			columnList[11] = { (void **)&valid, sizeof(*valid) };
+			initColumns(columnList, 12, initialCapacity);
+		};
+
+		EventBuffer<RawHitColumns> *raw;
+		Column columnList[12];
+	};
+
+}
+#endif // __PETSYS_COLUMNAREVENTBUFFER_HPP__DEFINED__
@@ -50,7 +50,14 @@ namespace PETSYS {
 		};
 	};
 
+	/*
+	 * Photons and coincidences refer to their hits and photons through (pointer, count)
+	 * into an index array shared by the whole output buffer. The index array is an
+	 * EventBuffer<Hit *> (or EventBuffer<GammaPhoton *>) placed between the input and
+	 * the output buffers in the parent chain, so it lives as long as the output buffer.
+	 */
 	struct GammaPhoton {
+		// Largest number of hits per photon accounted for by SimpleGrouper
 		static const int maxHits = 256;
 		bool valid;
 		double time;
@@ -58,31 +65,38 @@ namespace PETSYS {
 		short region;
 		float x, y, z;
 		int nHits;
-		Hit *hits[maxHits];
+		Hit **hits;
+
+		inline Hit *getHit(int k) { return hits[k]; };
 
 		GammaPhoton() {
 			valid = false;
-			for(int i = 0; i < maxHits; i++)
-				hits[i] = NULL;
+			nHits = 0;
+			hits = NULL;
 		};
 	};
 
 	struct Coincidence {
-		static const int maxPhotons = 2;
 		bool valid;
 		double time;
 		int nPhotons;
-		GammaPhoton *photons[maxPhotons];
-		
+		GammaPhoton **photons;		// By decreasing trigger region
+		int seed;			// Index in photons of the photon each of the others is in coincidence with
+
+		inline GammaPhoton *getPhoton(int k) { return photons[k]; };
+		inline GammaPhoton *getSeed() { return photons[seed]; };
+
 		Coincidence() {
 			valid = false;
-			for(int i = 0; i < maxPhotons; i++)
-				photons[i] = NULL;
+			nPhotons = 0;
+			photons = NULL;
+			seed = 0;
 		};
 	};
 	
 	class EventStream {
 	public:
+		virtual ~EventStream() { };
 		//virtual bool isQDC(unsigned int gChannelID) = 0;
 		virtual double getFrequency() = 0;
 		virtual int getTriggerID() = 0;
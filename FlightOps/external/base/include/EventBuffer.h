@@ -1,19 +1,25 @@
 #ifndef __PETSYS_EVENTBUFFER_HPP__DEFINED__
 #define __PETSYS_EVENTBUFFER_HPP__DEFINED__
 #include "Event.h"
+#include "BufferPool.h"
 #include <stdlib.h>
+#include <string.h>
 
 namespace PETSYS {
 
 	class AbstractEventBuffer {
 	public:
 		AbstractEventBuffer(AbstractEventBuffer *parent) 
-		: parent(parent), bufferSeqN(parent->bufferSeqN), bufferTMin(parent->bufferTMin) 
+		: parent(parent), bufferSeqN(parent->bufferSeqN), bufferTMin(parent->bufferTMin),
+		  bufferLeadingOverlapEnd(parent->bufferLeadingOverlapEnd),
+		  bufferTrailingOverlapBegin(parent->bufferTrailingOverlapBegin),
+		  bufferTrailingOverlapEnd(parent->bufferTrailingOverlapEnd)
 		{
 		};
 		
 		AbstractEventBuffer(u_int64_t seqN, long long tMin)
-		: parent(NULL), bufferSeqN(seqN), bufferTMin(tMin)
+		: parent(NULL), bufferSeqN(seqN), bufferTMin(tMin),
+		  bufferLeadingOverlapEnd(tMin), bufferTrailingOverlapBegin(0), bufferTrailingOverlapEnd(0)
 		{
 		};
 
@@ -38,11 +44,49 @@ namespace PETSYS {
 			bufferTMax = t;
 		}
 
+		/*
+		 * Buffers may overlap their neighbours (see RawReader::setBufferOverlap).
+		 * Events in [getTMin(), getLeadingOverlapEnd()) are also at the end of the previous buffer,
+		 * events in [getTrailingOverlapBegin(), getTrailingOverlapEnd()) are copies of the start of the next one.
+		 * Times are absolute, like getTMin().
+		 */
+		long long getLeadingOverlapEnd() {
+			return bufferLeadingOverlapEnd;
+		};
+
+		long long getTrailingOverlapBegin() {
+			return bufferTrailingOverlapBegin;
+		};
+
+		long long getTrailingOverlapEnd() {
+			return bufferTrailingOverlapEnd;
+		};
+
+		bool hasLeadingOverlap() {
+			return bufferLeadingOverlapEnd > bufferTMin;
+		};
+
+		bool hasTrailingOverlap() {
+			return bufferTrailingOverlapEnd > bufferTrailingOverlapBegin;
+		};
+
+		void setLeadingOverlap(long long end) {
+			bufferLeadingOverlapEnd = end;
+		};
+
+		void setTrailingOverlap(long long begin, long long end) {
+			bufferTrailingOverlapBegin = begin;
+			bufferTrailingOverlapEnd = end;
+		};
+
 		private:
 		AbstractEventBuffer * parent;
 		u_int64_t bufferSeqN;
 		long long bufferTMin;
 		long long bufferTMax;
+		long long bufferLeadingOverlapEnd;
+		long long bufferTrailingOverlapBegin;
+		long long bufferTrailingOverlapEnd;
 		
 		
 	};
@@ -55,18 +99,22 @@ namespace PETSYS {
 			: AbstractEventBuffer(parent) 
 		{
 			initialCapacity = ((initialCapacity / 1024) + 1) * 1024;
-			buffer = (TEvent *)malloc(sizeof(TEvent)*initialCapacity);
-			capacity = initialCapacity;
+			buffer = NULL;
+			capacity = 0;
+			allocatedBytes = 0;
 			used = 0;
+			reserve(initialCapacity);
 		};
 		
 		EventBuffer(unsigned initialCapacity, unsigned seqN, long long tMin)
 			: AbstractEventBuffer(seqN, tMin) 
 		{
 			initialCapacity = ((initialCapacity / 1024) + 1) * 1024;
-			buffer = (TEvent *)malloc(sizeof(TEvent)*initialCapacity);
-			capacity = initialCapacity;
+			buffer = NULL;
+			capacity = 0;
+			allocatedBytes = 0;
 			used = 0;
+			reserve(initialCapacity);
 		};
 		
 		void setCapacity(size_t n) {
@@ -81,17 +129,22 @@ namespace PETSYS {
 			if (newCapacity <= capacity) 
 				return;
 			
-			TEvent * reBuffer = (TEvent *)realloc((void*)buffer, sizeof(TEvent)*newCapacity);
+			// Storage comes from the BufferPool size classes, so we may get more than we asked for
+			size_t newBytes;
+			TEvent * reBuffer = (TEvent *)BufferPool::allocate(sizeof(TEvent)*newCapacity, newBytes);
+			if(buffer != NULL) {
+				memcpy((void*)reBuffer, (void*)buffer, sizeof(TEvent)*capacity);
+				BufferPool::release((void*)buffer, allocatedBytes);
+			}
 			buffer = reBuffer;
-			capacity = newCapacity;			
+			allocatedBytes = newBytes;
+			capacity = newBytes / sizeof(TEvent);
 		};
 
 		TEvent &getWriteSlot() {
 			if(used >= capacity) {
 				size_t increment = ((capacity / 10240) + 1) * 1024;
-				capacity += increment;				
-				TEvent * reBuffer = (TEvent *)realloc((void*)buffer, sizeof(TEvent)*capacity);
-				buffer = reBuffer;
+				reserve(capacity + increment);
 			}
 			return buffer[used];	
 		};
@@ -134,13 +187,14 @@ namespace PETSYS {
 		};
 
 		virtual ~EventBuffer() {
-			free((void*)buffer);
+			BufferPool::release((void*)buffer, allocatedBytes);
 		};
 		
 
 	private:
 		TEvent *buffer;
 		size_t capacity;
+		size_t allocatedBytes;
 		size_t used;
 		
 		
@@ -33,7 +33,7 @@ namespace PETSYS {
 	class NullSink : public EventSink<TEventInput> {
 	public:
 		NullSink() { };
-		virtual void pushT0(double t0) {};
+		virtual void pushT0(double) {};
 		virtual void pushEvents(EventBuffer<TEventInput> *buffer) {
 			delete buffer;
 		};
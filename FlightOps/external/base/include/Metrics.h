@@ -0,0 +1,150 @@
+#ifndef __PETSYS_METRICS_HPP__DEFINED__
+#define __PETSYS_METRICS_HPP__DEFINED__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace PETSYS {
+
+	/*! Process-wide registry of pipeline metrics, each named by a stage and a metric name.
+	 * Counters and histograms are updated in per-thread shards, without locked instructions,
+	 * and the shards are merged when a snapshot is taken. Gauges hold a single value.
+	 * Metrics are never removed and count over the whole process, so that a poller can derive rates
+	 * from successive snapshots; StageMetrics gives the counts of one stage instance.
+	 */
+	class Metrics {
+	public:
+		class Counter {
+		public:
+			void add(u_int64_t n);
+			void increment() { add(1); };
+		private:
+			friend class Metrics;
+			Counter(unsigned slot) : slot(slot) {};
+			unsigned slot;
+		};
+
+		class Gauge {
+		public:
+			void set(int64_t v) { value.store(v, std::memory_order_relaxed); };
+			void add(int64_t n) { value.fetch_add(n, std::memory_order_relaxed); };
+			int64_t get() { return value.load(std::memory_order_relaxed); };
+		private:
+			friend class Metrics;
+			Gauge() : value(0) {};
+			std::atomic<int64_t> value;
+		};
+
+		/*! Distribution of values.
+		 * LOG2 histograms (such as latencies in ns) have bucket 0 for 0 and bucket k for [2^(k-1), 2^k),
+		 * LINEAR histograms (such as sizes) have bucket k for value k, the last bucket also taking larger values.
+		 */
+		class Histogram {
+		public:
+			enum Scale { LOG2, LINEAR };
+			void record(u_int64_t value, u_int64_t count = 1);
+		private:
+			friend class Metrics;
+			Histogram(unsigned slot, Scale scale, unsigned nBuckets) : slot(slot), scale(scale), nBuckets(nBuckets) {};
+			unsigned slot;		// nBuckets buckets followed by the sum of values
+			Scale scale;
+			unsigned nBuckets;
+		};
+
+		static const unsigned LOG2_BUCKETS = 65;
+
+		/*! Returns the metric with this stage and name, registering it on first use */
+		static Counter *counter(const char *stage, const char *name);
+		static Gauge *gauge(const char *stage, const char *name);
+		static Histogram *histogram(const char *stage, const char *name, Histogram::Scale scale = Histogram::LOG2, unsigned nBuckets = LOG2_BUCKETS);
+
+		/*! Registers a function called at each snapshot, before gauges are read, to publish values kept elsewhere */
+		static void addCollector(void (*collect)());
+
+		enum Type { COUNTER, GAUGE, HISTOGRAM };
+
+		struct Value {
+			std::string stage;
+			std::string name;
+			Type type;
+			int64_t value;			// Counter or gauge value, number of entries of a histogram
+			u_int64_t sum;			// Sum of the values recorded in a histogram
+			Histogram::Scale scale;
+			std::vector<u_int64_t> buckets;
+
+			/*! Lower bound of histogram bucket k */
+			u_int64_t getBucketLow(unsigned k) const;
+			/*! Upper end of the bucket holding the q quantile of a histogram, 0 if it is empty */
+			u_int64_t getQuantile(double q) const;
+		};
+
+		class Snapshot {
+		public:
+			double time;			// Wall clock, in seconds since the epoch
+			std::vector<Value> values;
+
+			/*! Returns the value of a metric, NULL if it has no entry in the snapshot */
+			const Value *find(const char *stage, const char *name) const;
+			/*! Returns the value of a counter or gauge, or the number of entries of a histogram, 0 if missing */
+			int64_t get(const char *stage, const char *name) const;
+			/*! Counters and histograms as counted since an earlier snapshot, gauges unchanged */
+			Snapshot since(const Snapshot &earlier) const;
+
+			std::string toJSON() const;
+		};
+
+		/*! Returns all metrics, or those of one stage */
+		static Snapshot snapshot(const char *stage = NULL);
+
+		/*! Writes snapshot().toJSON() to fileName, replacing the file in one step for readers polling it */
+		static bool writeJSON(const char *fileName);
+
+		/*! Monotonic clock in ns, for latencies */
+		static inline u_int64_t now() {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return u_int64_t(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+		};
+	};
+
+	/*! Metrics of one stage instance.
+	 * Each live instance of a stage has its own label: the stage name for the first one,
+	 * then "<stage>#2", "<stage>#3"... (as for the pipelines of parallel steps).
+	 * A label is reused once its instance is deleted, so snapshot() gives the counts of this instance
+	 * since it was created, or since restart(). Totals of a stage are the sum over its labels.
+	 */
+	class StageMetrics {
+	public:
+		StageMetrics(const char *stage);
+		~StageMetrics();
+
+		/*! Label of this instance, under which its metrics are registered */
+		const char *getStage() { return stage.c_str(); };
+		Metrics::Counter *counter(const char *name) { return Metrics::counter(stage.c_str(), name); };
+		Metrics::Gauge *gauge(const char *name) { return Metrics::gauge(stage.c_str(), name); };
+		Metrics::Histogram *histogram(const char *name, Metrics::Histogram::Scale scale = Metrics::Histogram::LOG2, unsigned nBuckets = Metrics::LOG2_BUCKETS) {
+			return Metrics::histogram(stage.c_str(), name, scale, nBuckets);
+		};
+
+		Metrics::Snapshot snapshot();
+		/*! Starts counting from now, for a stage reused in the next step */
+		void restart();
+		/*! Value of one metric of this stage in a snapshot */
+		int64_t get(const Metrics::Snapshot &s, const char *name) { return s.get(stage.c_str(), name); };
+
+	private:
+		StageMetrics(const StageMetrics &) = delete;
+		StageMetrics &operator=(const StageMetrics &) = delete;
+
+		std::string name;
+		unsigned instance;
+		std::string stage;
+		Metrics::Snapshot baseline;
+	};
+
+}
+#endif // __PETSYS_METRICS_HPP__DEFINED__
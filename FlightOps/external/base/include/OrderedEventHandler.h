@@ -2,75 +2,171 @@
 #define __PETSYS_ORDEREDEVENTHANDLER_HPP__DEFINED__
 #include "EventSourceSink.h"
 #include "EventBuffer.h"
+#include "Metrics.h"
+#include "Trace.h"
 #include <pthread.h>
-#include <map>
+#include <atomic>
 
 namespace PETSYS {
 
+	/*! Calls handleEvents() on buffers strictly in sequence number order.
+	 * Workers deposit their buffer in a ring indexed by sequence number and return immediately.
+	 * Whichever worker deposits the next expected buffer becomes the drainer:
+	 * it handles (and pushes downstream) the whole in-order run currently available.
+	 * Only buffers running more than RING_SIZE ahead of the expected one have to wait.
+	 */
 	template <class TEventInput, class TEventOutput>
-	class OrderedEventHandler : 
+	class OrderedEventHandler :
 		public EventSink<TEventInput>,
 		public EventSource<TEventOutput> {
 	public:
-		OrderedEventHandler(EventSink<TEventOutput> *sink) : 
+		/*! With a stage name, the stage's buffers, events, handleEvents() latency and
+		 * waits for the ordering window are published in the metrics registry.
+		 * The stage name also labels the stage in traces (see Trace).
+		 */
+		OrderedEventHandler(EventSink<TEventOutput> *sink, const char *stage = NULL) :
 		EventSource<TEventOutput>(sink) {
+			traceName = Trace::intern(stage != NULL ? stage : "OrderedEventHandler");
+			metrics = NULL;
+			if(stage != NULL) {
+				metrics = new StageMetrics(stage);
+				nBuffers = metrics->counter("buffers");
+				nEvents = metrics->counter("events");
+				nWindowWaits = metrics->counter("window_waits");
+				latency = metrics->histogram("buffer_latency_ns");
+			}
 			pthread_mutex_init(&lock, NULL);
+			pthread_cond_init(&cond_advanced, NULL);
 			expectedSeqN = 0;
-			queue = std::map<size_t, pthread_cond_t *>();
+			draining = false;
+			nWindowWaiting = 0;
+			for(size_t n = 0; n < RING_SIZE; n++)
+				ring[n] = NULL;
 		};
-		
+
 		~OrderedEventHandler() {
+			delete metrics;
+			pthread_cond_destroy(&cond_advanced);
 			pthread_mutex_destroy(&lock);
 		};
-		
+
+		/*! Called as a step starts, the stage's metrics then cover this step only */
 		virtual void pushT0(double t0) {
+			if(metrics != NULL) metrics->restart();
 			this->sink->pushT0(t0);
 		};
-		
+
 		virtual void pushEvents(EventBuffer<TEventInput> *buffer) {
-			size_t mySeqN = buffer->getSeqN();
-			pthread_cond_t cond;
-			pthread_cond_init(&cond, NULL);
-			pthread_mutex_lock(&lock);
-			queue[mySeqN] = &cond;
-			while(mySeqN != expectedSeqN) {
-				// Not our turn yet
-				pthread_cond_wait(&cond, &lock);
-			}
-			queue.erase(mySeqN);
-			pthread_cond_destroy(&cond);
-			pthread_mutex_unlock(&lock);
-			// Process the data
-			auto newBuffer = handleEvents(buffer);
-		
-			pthread_mutex_lock(&lock);
-			// Increment expected sequence number and signal any waiting workers
-			expectedSeqN += 1;
-			if(queue.count(expectedSeqN) > 0) {
-				pthread_cond_signal(queue[expectedSeqN]);
+			u_int64_t mySeqN = buffer->getSeqN();
+
+			if((mySeqN - expectedSeqN.load()) >= RING_SIZE) {
+				// Too far ahead of the expected buffer, wait for the window to advance
+				if(metrics != NULL) nWindowWaits->increment();
+				pthread_mutex_lock(&lock);
+				nWindowWaiting += 1;
+				while((mySeqN - expectedSeqN.load()) >= RING_SIZE) {
+					pthread_cond_wait(&cond_advanced, &lock);
+				}
+				nWindowWaiting -= 1;
+				pthread_mutex_unlock(&lock);
 			}
-			pthread_mutex_unlock(&lock);
 
-			this->sink->pushEvents(newBuffer);
+			ring[mySeqN % RING_SIZE].store(buffer);
+			drain();
 		};
-		
-		
+
+
+		/*! Called once all buffers of a step were pushed, the next step starts over from sequence number 0 */
 		virtual void finish() {
+			expectedSeqN.store(0);
 			this->sink->finish();
 		};
-		
+
 		virtual void report() {
 			this->sink->report();
 		};
-		
+
 	protected:
-		virtual EventBuffer<TEventOutput> * handleEvents(EventBuffer<TEventInput> *inBuffer) = 0;		
+		virtual EventBuffer<TEventOutput> * handleEvents(EventBuffer<TEventInput> *inBuffer) = 0;
+
+		StageMetrics *metrics;
 
 	private:
-		u_int64_t expectedSeqN;
+		Metrics::Counter *nBuffers;
+		Metrics::Counter *nEvents;
+		Metrics::Counter *nWindowWaits;
+		Metrics::Histogram *latency;
+		const char *traceName;
+
+		static const size_t RING_SIZE = 4096;
+
+		void drain() {
+			do {
+				// Someone else is draining and will pick up our buffer
+				if(draining.exchange(true)) return;
+
+				bool advanced = false;
+				while(true) {
+					u_int64_t seqN = expectedSeqN.load();
+					EventBuffer<TEventInput> *buffer = ring[seqN % RING_SIZE].exchange(NULL);
+					if(buffer == NULL) break;
+
+					EventBuffer<TEventOutput> *newBuffer;
+					if(Trace::isEnabled()) {
+						newBuffer = handleEventsTraced(buffer);
+					}
+					else if(metrics != NULL) {
+						size_t N = buffer->getSize();
+						u_int64_t t0 = Metrics::now();
+						newBuffer = handleEvents(buffer);
+						latency->record(Metrics::now() - t0);
+						nBuffers->increment();
+						nEvents->add(N);
+					}
+					else {
+						newBuffer = handleEvents(buffer);
+					}
+					this->sink->pushEvents(newBuffer);
+					expectedSeqN.store(seqN + 1);
+					advanced = true;
+				}
+
+				draining.store(false);
+
+				if(advanced && nWindowWaiting.load() > 0) {
+					pthread_mutex_lock(&lock);
+					pthread_cond_broadcast(&cond_advanced);
+					pthread_mutex_unlock(&lock);
+				}
+
+				// Recheck: the next buffer may have been deposited while we were releasing the drainer role
+			} while(ring[expectedSeqN.load() % RING_SIZE].load() != NULL);
+		};
+
+		// Buffers wait in the ring for their turn, so the span only covers handleEvents()
+		EventBuffer<TEventOutput> *handleEventsTraced(EventBuffer<TEventInput> *buffer) {
+			size_t N = buffer->getSize();
+			u_int64_t seqN = buffer->getSeqN();
+			Trace::begin(traceName, seqN, N);
+			u_int64_t t0 = Metrics::now();
+			EventBuffer<TEventOutput> *newBuffer = handleEvents(buffer);
+			if(metrics != NULL) {
+				latency->record(Metrics::now() - t0);
+				nBuffers->increment();
+				nEvents->add(N);
+			}
+			Trace::end(traceName, seqN, newBuffer != NULL ? newBuffer->getSize() : 0);
+			return newBuffer;
+		};
+
+		std::atomic<u_int64_t> expectedSeqN;
+		std::atomic<bool> draining;
+		std::atomic<EventBuffer<TEventInput> *> ring[RING_SIZE];
+
+		std::atomic<int> nWindowWaiting;
 		pthread_mutex_t lock;
-		std::map<size_t, pthread_cond_t *> queue;
-		
+		pthread_cond_t cond_advanced;
+
 	};
 
 }
@@ -3,32 +3,98 @@
 
 #include <UnorderedEventHandler.h>
 #include <Event.h>
+#include <ColumnarEventBuffer.h>
 #include <SystemConfig.h>
 #include <Instrumentation.h>
 
 
 namespace PETSYS {
-	
-class ProcessHit : public UnorderedEventHandler<RawHit, Hit> {
+
+/*! Calibration and accounting shared by ProcessHit and ColumnarProcessHit.
+ * The per hit transform lives in ProcessHit.cpp and runs on batches of hits,
+ * with the TDC and QDC solvers in CalibrationKernel.
+ */
+class HitCalibrator {
+public:
+	struct Counters {
+		u_int64_t nReceived;
+		u_int64_t nReceivedInvalid;
+		u_int64_t nTDCCalibrationMissing;
+		u_int64_t nQDCCalibrationMissing;
+		u_int64_t nEnergyCalibrationMissing;
+		u_int64_t nXYZMissing;
+		u_int64_t nSent;
+
+		Counters() {
+			nReceived = 0;
+			nReceivedInvalid = 0;
+			nTDCCalibrationMissing = 0;
+			nQDCCalibrationMissing = 0;
+			nEnergyCalibrationMissing = 0;
+			nXYZMissing = 0;
+			nSent = 0;
+		};
+
+		inline void account(uint8_t eventFlags) {
+			nReceived += 1;
+			if((eventFlags & 0x1) != 0) nReceivedInvalid += 1;
+			if((eventFlags & 0x2) != 0) nTDCCalibrationMissing += 1;
+			if((eventFlags & 0x4) != 0) nQDCCalibrationMissing += 1;
+			if((eventFlags & 0x8) != 0) nXYZMissing += 1;
+			if((eventFlags & 0x16) != 0) nEnergyCalibrationMissing += 1;
+			if(eventFlags == 0) nSent += 1;
+		};
+	};
+
+	/*! Counts hits in the metrics of the stage doing the calibration */
+	HitCalibrator(SystemConfig *systemConfig, EventStream *eventStream, StageMetrics *metrics);
+
+	SystemConfig *getSystemConfig() { return systemConfig; };
+	EventStream *getEventStream() { return eventStream; };
+
+	/*! Calibrates hits[0..N) and appends the hits to keep to outBuffer, pointing back into hits */
+	void calibrate(RawHit *hits, unsigned N, EventBuffer<Hit> *outBuffer, Counters &counters);
+
+	/*! Adds the counters of one buffer to the totals */
+	void accumulate(Counters &local);
+	void report();
+
 private:
 	SystemConfig *systemConfig;
 	EventStream *eventStream;
-	
-	u_int64_t nReceived;
-	u_int64_t nReceivedInvalid;
-	u_int64_t nTDCCalibrationMissing;
-	u_int64_t nQDCCalibrationMissing;
-	u_int64_t nEnergyCalibrationMissing;
-	u_int64_t nXYZMissing;
-	u_int64_t nSent;
+	StageMetrics *metrics;
+	Metrics::Counter *nReceived;
+	Metrics::Counter *nReceivedInvalid;
+	Metrics::Counter *nTDCCalibrationMissing;
+	Metrics::Counter *nQDCCalibrationMissing;
+	Metrics::Counter *nEnergyCalibrationMissing;
+	Metrics::Counter *nXYZMissing;
+	Metrics::Counter *nSent;
+};
+
+class ProcessHit : public UnorderedEventHandler<RawHit, Hit> {
+private:
+	HitCalibrator calibrator;
 public:
 	ProcessHit(SystemConfig *systemConfig, EventStream *eventStream, EventSink<Hit> *sink);
 	virtual void report();
-	
+
 protected:
 	virtual EventBuffer<Hit> * handleEvents (EventBuffer<RawHit> *inBuffer);
 };
-	
+
+/*! ProcessHit over structure-of-arrays buffers */
+class ColumnarProcessHit : public UnorderedEventHandler<RawHitColumns, HitColumns> {
+private:
+	HitCalibrator calibrator;
+public:
+	ColumnarProcessHit(SystemConfig *systemConfig, EventStream *eventStream, EventSink<HitColumns> *sink);
+	virtual void report();
+
+protected:
+	virtual EventBuffer<HitColumns> * handleEvents (EventBuffer<RawHitColumns> *inBuffer);
+};
+
 }
 
 #endif // __PETSYS__PROCESS_HIT_HPP__DEFINED__
@@ -0,0 +1,93 @@
+#ifndef __PETSYS_QDCINVERSIONCACHE_HPP__DEFINED__
+#define __PETSYS_QDCINVERSIONCACHE_HPP__DEFINED__
+
+#include <SystemConfig.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+namespace PETSYS {
+
+	/*! Precomputed QDC inversion for one (channel, TAC).
+	 * tEq[efine] is the solution of P(t_eq) = efine, or NaN where the exact solver has to be used.
+	 * It is solved until the Newton–Raphson step is below 1E-3 clocks, where the exact solver stops below 0.05,
+	 * so the two differ by about how far the exact solver stops from the root: bench_stages checks that this
+	 * stays under 0.05 clocks where t_eq - ti is on the energy grid. Further from ti the exact solver may run out
+	 * of iterations before reaching t_eq, which the tables do not.
+	 * With energy calibration, energy[] samples it on a uniform grid of E = t_eq - ti. The calibrated energy only
+	 * depends on the integration time ti through E, so this one grid covers every integration time.
+	 */
+	struct QDCInversionTable {
+		static const unsigned N_EFINE = 1024;
+
+		float tEq[N_EFINE];
+
+		float energyMin;
+		float energyInvStep;
+		unsigned nEnergy;
+		float *energy;		// NULL without energy calibration
+
+		inline bool solve(unsigned short efine, float &t) const {
+			if(efine >= N_EFINE) return false;
+			t = tEq[efine];
+			return t == t;
+		};
+
+		inline bool calibrateEnergy(float e, float &calibrated) const {
+			if(energy == NULL) return false;
+			float x = (e - energyMin) * energyInvStep;
+			if(!(x >= 0) || !(x < nEnergy - 1)) return false;
+			unsigned i = (unsigned)x;
+			float f = x - i;
+			calibrated = energy[i] + f * (energy[i+1] - energy[i]);
+			return calibrated == calibrated;
+		};
+	};
+
+	/*! Lazily built QDCInversionTable for every (channel, TAC), within a memory budget.
+	 * Tables are published through SystemConfig::QdcTacConfig::qdcInversion;
+	 * once the budget is spent, further channels keep using the exact solver.
+	 */
+	class QDCInversionCache {
+	public:
+		struct Settings {
+			size_t maxBytes;
+			float energyMin;
+			float energyMax;
+			float energyStep;
+		};
+
+		QDCInversionCache(Settings settings, bool useEnergyCalibration);
+		~QDCInversionCache();
+
+		/*! Returns the table for one (channel, TAC), or NULL if the exact solver has to be used */
+		inline const QDCInversionTable *get(SystemConfig::QdcTacConfig &qc) {
+			QDCInversionTable *table = __atomic_load_n(&qc.qdcInversion, __ATOMIC_ACQUIRE);
+			if(table == NULL) table = build(qc);
+			return (table == &unavailable) ? NULL : table;
+		};
+
+		void report();
+
+	private:
+		QDCInversionTable *build(SystemConfig::QdcTacConfig &qc);
+		QDCInversionTable *makeTable(SystemConfig::QacConfig &cq, SystemConfig::EnergyConfig &cen);
+		size_t getTableBytes();
+
+		Settings settings;
+		bool useEnergyCalibration;
+
+		// Published in place of a table when the exact solver has to be used
+		static QDCInversionTable unavailable;
+
+		pthread_mutex_t lock;
+		std::vector<QDCInversionTable *> tables;
+
+		std::atomic<size_t> bytesUsed;
+		std::atomic<u_int64_t> nBuilt;
+		std::atomic<u_int64_t> nOverBudget;
+		std::atomic<u_int64_t> nNotInvertible;
+	};
+
+}
+#endif // __PETSYS_QDCINVERSIONCACHE_HPP__DEFINED__
@@ -5,31 +5,48 @@
 #include <UnorderedEventHandler.h>
 #include <Event.h>
 #include <Instrumentation.h>
+#include <vector>
 
 namespace PETSYS {
 	
+/*! Groups hits into GammaPhoton, using the engine selected by sw_trigger:group_engine.
+ * GROUP_ENGINE_SCAN compares each seed hit with every following hit,
+ * GROUP_ENGINE_INDEXED only visits hits from the seed's multi-hit neighbour regions;
+ * both produce the same photons.
+ * Buffers with an overlap (RawReader::setBufferOverlap) are cut in it so that each hit is grouped once,
+ * with photons and coincidences not depending on the buffer boundaries.
+ */
 class SimpleGrouper : public UnorderedEventHandler<Hit, GammaPhoton> {
 public:
 	SimpleGrouper(SystemConfig *systemConfig, EventSink<GammaPhoton> *sink);
 	~SimpleGrouper();
 	
 	virtual void report();
+
+	//! Buffer overlap, in frames, for RawReader::setBufferOverlap
+	static unsigned getBufferOverlapFrames(SystemConfig *systemConfig);
 	
 protected:
 	virtual EventBuffer<GammaPhoton> * handleEvents(EventBuffer<Hit> *inBuffer);
 		
 private:
 	SystemConfig *systemConfig;
+
+	// Regions r2 with isMultiHitAllowed(r2, r) are neighbours[neighbourStart[r] .. neighbourStart[r+1]-1]
+	std::vector<unsigned> neighbourStart;
+	std::vector<unsigned> neighbours;
 	
-	u_int64_t nHitsReceived;
-	u_int64_t nHitsReceivedValid;
-	u_int64_t nPhotonsFound;
-	u_int64_t nPhotonsHits[GammaPhoton::maxHits];
-	u_int64_t nPhotonsHitsOverflow;
-	u_int64_t nPhotonsHitsUnderflow;
-	u_int64_t nPhotonsLowEnergy;
-	u_int64_t nPhotonsHighEnergy;
-	u_int64_t nPhotonsPassed;
+	Metrics::Counter *nHitsReceived;
+	Metrics::Counter *nHitsReceivedValid;
+	Metrics::Counter *nPhotonsFound;
+	Metrics::Histogram *nPhotonsHits;		// Photons found by number of hits
+	Metrics::Counter *nPhotonsHitsOverflow;
+	Metrics::Counter *nPhotonsHitsUnderflow;
+	Metrics::Counter *nPhotonsLowEnergy;
+	Metrics::Counter *nPhotonsHighEnergy;
+	Metrics::Counter *nPhotonsPassed;
+	Metrics::Counter *nOverlapsStitched;
+	Metrics::Counter *nOverlapsSplit;
 };
 
 }
@@ -3,9 +3,14 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string>
+#include <Affinity.h>
 
 namespace PETSYS {
 
+	struct QDCInversionTable;
+	class QDCInversionCache;
+
 	class SystemConfig {
 	public:
 		static const u_int64_t LOAD_ALL			= 0xFFFFFFFFFFFFFFFFULL;
@@ -51,9 +56,36 @@ namespace PETSYS {
 			QacConfig qac_Q[4];
 			EnergyConfig eCal[4];
 		};
+
+		/*
+		 * Compact copies of ChannelConfig used per hit, built once the configuration is loaded.
+		 * Channels are numbered by a dense index (see getChannelIndex) and the per TAC
+		 * coefficients are stored contiguously, split by what each acquisition mode needs,
+		 * so that the working set stays small with thousands of channels.
+		 */
+		struct TdcTacConfig {
+			TacConfig t;
+			TacConfig e;
+		};
+		struct QdcTacConfig {
+			QacConfig q;
+			EnergyConfig energy;
+			QDCInversionTable *qdcInversion;	// Built on first use by QDCInversionCache
+		};
+		struct ChannelGeometry {
+			float x, y, z;
+			int xi, yi;
+			int triggerRegion;
+			float t0;
+		};
+
+		// Dense index of channels without any configuration
+		static const unsigned NULL_CHANNEL_INDEX = 0;
 	       
 
 		// Software trigger configuration
+		enum GroupEngine { GROUP_ENGINE_SCAN, GROUP_ENGINE_INDEXED };
+		GroupEngine sw_trigger_group_engine;
 		int sw_trigger_group_max_hits;
 		int sw_trigger_group_min_hits;
 		float sw_trigger_group_min_energy;
@@ -61,6 +93,19 @@ namespace PETSYS {
 		float sw_trigger_group_max_distance;
 		double sw_trigger_group_time_window;
 		double sw_trigger_coincidence_time_window;
+		enum CoincidenceEngine { COINCIDENCE_ENGINE_SCAN, COINCIDENCE_ENGINE_INDEXED };
+		CoincidenceEngine sw_trigger_coincidence_engine;
+		int sw_trigger_coincidence_max_photons;
+
+		// Processing pipeline configuration
+		bool processing_fused_decode;
+		std::string processing_trace_file_prefix;	// Empty if tracing is disabled
+		int processing_trace_events_per_thread;
+		int processing_buffer_size;			// Events per RawReader buffer (RawReader::DEFAULT_BUFFER_SIZE by default), 0 for adaptive
+		int processing_buffer_size_min;
+		int processing_buffer_size_max;
+		int processing_parallel_steps;			// Steps of a raw file processed concurrently
+		Affinity::Policy processing_affinity;		// Pass to Affinity::setPolicy()
 		
 
 		static SystemConfig *fromFile(const char *configFileName);
@@ -71,7 +116,10 @@ namespace PETSYS {
 		inline bool useEnergyCalibration() { return hasEnergyCalibration; };
 		inline bool useTimeOffsetCalibration() { return hasTimeOffsetCalibration; };
 		inline bool useXYZ() { return hasXYZ; };
+		/*! NULL if QDC calibration is not loaded or the lookup tables are disabled */
+		inline QDCInversionCache *getQDCInversionCache() { return qdcInversionCache; };
 		
+		// Configuration as loaded from the tables, per hit code should use the dense index below
 		inline SystemConfig::ChannelConfig &getChannelConfig(unsigned channelID) {
 			unsigned indexH = channelID / 4096;
 			unsigned indexL= channelID % 4096;
@@ -83,21 +131,46 @@ namespace PETSYS {
 				return ptr[indexL];
 		};
 
+		inline unsigned getChannelIndex(unsigned channelID) {
+			unsigned *page = channelIndex[channelID / 4096];
+			return (page == NULL) ? NULL_CHANNEL_INDEX : page[channelID % 4096];
+		};
+
+		// Number of dense channel indexes, including NULL_CHANNEL_INDEX
+		inline unsigned getNChannels() { return nChannels; };
+
+		inline TdcTacConfig &getTdcConfig(unsigned index, unsigned tacID) {
+			return tdcConfig[index * 4 + tacID];
+		};
+
+		// Only available if QDC calibration is loaded
+		inline QdcTacConfig &getQdcConfig(unsigned index, unsigned tacID) {
+			return qdcConfig[index * 4 + tacID];
+		};
+
+		inline ChannelGeometry &getChannelGeometry(unsigned index) {
+			return channelGeometry[index];
+		};
+
 		inline bool isCoincidenceAllowed(int r1, int r2) {
-			if ((r1 < 0) || (r2 < 0)) return false;
-			return coincidenceTriggerMap[r1 * MAX_TRIGGER_REGIONS + r2];
+			return testTriggerMap(coincidenceTriggerMap, r1, r2);
 		};
 
 		inline bool isMultiHitAllowed(int r1, int r2) {
-			if ((r1 < 0) || (r2 < 0)) return false;
-			return multihitTriggerMap[r1 * MAX_TRIGGER_REGIONS + r2];
+			return testTriggerMap(multihitTriggerMap, r1, r2);
 		};
 
+		// Trigger regions 0 .. getNTriggerRegions()-1 appear in the trigger map
+		inline unsigned getNTriggerRegions() { return nTriggerRegions; };
+
 		SystemConfig();
 		~SystemConfig();
 		
 	private:
 		void touchChannelConfig(unsigned channelID);
+		void buildChannelIndex();
+		void copyChannel(unsigned index, ChannelConfig &cc);
+		void freeChannelIndex();
 		static void loadTDCCalibration(SystemConfig *config, const char *fn);
 		static void loadQDCCalibration(SystemConfig *config, const char *fn);
 		static void loadEnergyCalibration(SystemConfig *config, const char *fn);
@@ -113,10 +186,31 @@ namespace PETSYS {
 		
 		ChannelConfig **channelConfig;
 		ChannelConfig nullChannelConfig;
+		QDCInversionCache *qdcInversionCache;
+
+		unsigned **channelIndex;
+		unsigned nChannels;
+		TdcTacConfig *tdcConfig;
+		QdcTacConfig *qdcConfig;
+		ChannelGeometry *channelGeometry;
 		
 		static const unsigned MAX_TRIGGER_REGIONS = 4096; // 1024 FEB/D x 4 regions
-		bool *coincidenceTriggerMap;
-		bool *multihitTriggerMap;
+
+		/*
+		 * Trigger maps are nTriggerRegions x nTriggerRegions bit matrices,
+		 * sized to the highest region in the trigger map file.
+		 * Regions outside the matrix (or negative) are never allowed.
+		 */
+		unsigned nTriggerRegions;
+		u_int64_t *coincidenceTriggerMap;
+		u_int64_t *multihitTriggerMap;
+
+		inline bool testTriggerMap(const u_int64_t *map, int r1, int r2) {
+			if(((unsigned)r1 >= nTriggerRegions) || ((unsigned)r2 >= nTriggerRegions)) return false;
+			unsigned bit = (unsigned)r1 * nTriggerRegions + (unsigned)r2;
+			return ((map[bit / 64] >> (bit % 64)) & 1) != 0;
+		};
+		static void setTriggerMap(u_int64_t *map, unsigned nRegions, unsigned r1, unsigned r2, bool value);
 		
 	};
 	
@@ -1,74 +1,175 @@
 #ifndef __PETSYS_THREADPOOL_HPP__DEFINED__
 #define __PETSYS_THREADPOOL_HPP__DEFINED__
 
-#include <deque>
+#include <atomic>
 #include <vector>
 #include <pthread.h>
 #include "EventSourceSink.h"
 #include "EventBuffer.h"
+#include "Metrics.h"
+#include "Trace.h"
 
 namespace PETSYS {
-	
+
+	class TaskGroup;
+
+	/*! Work-stealing thread pool.
+	 * Each worker owns a bounded lock-free job queue. Jobs are distributed round-robin over
+	 * the workers' queues and idle workers steal from their peers.
+	 * Jobs are queued through a TaskGroup, one per pipeline, which bounds the number of its queued
+	 * (not yet started) jobs and waits for their completion. Several pipelines can share a pool:
+	 * jobs run roughly in the order they were queued, and each pipeline can only have maxQueueSize jobs
+	 * waiting, so a fast producer cannot crowd out the others.
+	 * Locks and condition variables are only used to park idle or blocked threads.
+	 */
 	class BaseThreadPool {
 	private:
+		struct job_t{
+			void *b;
+			void *s;
+			void (*run)(void *b, void *s);
+			TaskGroup *group;
+		};
+
+		class JobQueue;
+
 		struct worker_t{
 			BaseThreadPool *pool;
 			pthread_t thread;
-			bool isBusy;
+			int index;
+			JobQueue *queue;
 		};
 
-		struct job_t{
-			void *b;
-			void *s;
-		};
 	public:
-		BaseThreadPool();
+		/*! nWorkers and maxQueueSize default to Affinity::getDefaultNWorkers() and nCPU/4 when <= 0.
+		 * Workers are pinned as set by the Affinity policy.
+		 * maxQueueSize is the default for the task groups of this pool.
+		 */
+		BaseThreadPool(int nWorkers = 0, int maxQueueSize = 0);
+		/*! All task groups must have completed */
 		virtual ~BaseThreadPool();
-		void completeQueue();
-		
-	protected:
-		void queueTask(void *buffer, void *sink);
-		virtual void runTask(void *b, void *s) = 0;
-		
-		
-	
+
+		/*! Pool shared by the whole process, created with the default sizes on first use and never deleted */
+		static BaseThreadPool *getShared();
+
+		int getNWorkers() { return nWorkers; };
+		int getMaxQueueSize() { return maxQueueSize; };
+
 	private:
+		friend class TaskGroup;
+		void queueJob(const job_t &job);
+
 		int maxQueueSize;
-		std::deque<job_t> queue;
 
 		int nWorkers;
 		worker_t *workers;
+		std::atomic<unsigned> nextWorker;
+
+		// Jobs sitting in worker queues
+		std::atomic<long> nQueued;
+
+		// Number of threads parked on each condition
+		std::atomic<int> nIdleWaiting;
 
 		pthread_mutex_t lock;
 		pthread_cond_t cond_queued;
+		std::atomic<bool> terminate;
+
+		// Totals over all pools
+		Metrics::Gauge *mQueued;
+		Metrics::Gauge *mRunning;
+		Metrics::Counter *mAdmissionWaits;
+
+		bool findJob(worker_t *self, job_t &job);
+		static void *thread_routine(void *);
+
+
+
+	};
+
+	/*! The jobs of one pipeline in a pool */
+	class TaskGroup {
+	public:
+		/*! maxQueueSize defaults to the pool's when <= 0 */
+		TaskGroup(BaseThreadPool *pool, int maxQueueSize = 0);
+		/*! Waits for the jobs still pending */
+		~TaskGroup();
+
+		/*! Has a worker call sink->pushEvents(buffer), blocking while maxQueueSize jobs of this group are waiting */
+		template <class TEvent>
+		void queueTask(EventBuffer<TEvent> *buffer, EventSink<TEvent> *sink) {
+			queueJob((void *)buffer, (void *)sink, runTask<TEvent>);
+		};
+
+		/*! Waits until all jobs queued so far have run */
+		void complete();
+
+		BaseThreadPool *getPool() { return pool; };
+		/*! Jobs run so far and the time spent running them, summed over the workers, in ns */
+		u_int64_t getNTasksCompleted() { return nTasksCompleted.load(std::memory_order_relaxed); };
+		u_int64_t getBusyTime() { return busyTime.load(std::memory_order_relaxed); };
+
+	private:
+		friend class BaseThreadPool;
+		void queueJob(void *buffer, void *sink, void (*run)(void *, void *));
+		void dequeued();
+		void completed(u_int64_t time);
+
+		template <class TEvent>
+		static void runTask(void *b, void *s) {
+			auto buffer = (EventBuffer<TEvent> *)b;
+			auto sink = (EventSink<TEvent> *)s;
+			if(Trace::isEnabled()) {
+				// The whole chain below the pool, the buffer is gone when it returns
+				u_int64_t seqN = buffer->getSeqN();
+				Trace::begin("ThreadPool task", seqN, buffer->getSize());
+				sink->pushEvents(buffer);
+				Trace::end("ThreadPool task", seqN, 0);
+				return;
+			}
+			sink->pushEvents(buffer);
+		};
+
+		BaseThreadPool *pool;
+		int maxQueueSize;
+
+		// Jobs sitting in worker queues
+		std::atomic<long> nQueued;
+		// Jobs queued or running
+		std::atomic<long> nPending;
+
+		std::atomic<u_int64_t> nTasksCompleted;
+		std::atomic<u_int64_t> busyTime;
+
+		// Number of threads parked on each condition, with the pool's lock
+		std::atomic<int> nAdmissionWaiting;
+		std::atomic<int> nCompletionWaiting;
+		// Workers between completing a job and their last access to the group
+		std::atomic<int> nCompleting;
 		pthread_cond_t cond_dequeued;
 		pthread_cond_t cond_completed;
-		bool terminate;
-		
-		static void *thread_routine(void *);
-		
-		
-		
 	};
-	
+
+	/*! A pool with a single task group, for a pipeline of its own */
 	template <class TEvent>
 	class ThreadPool : public BaseThreadPool {
-	public:	
-		ThreadPool() { };
+	public:
+		ThreadPool(int nWorkers = 0, int maxQueueSize = 0) : BaseThreadPool(nWorkers, maxQueueSize), tasks(this) { };
 		virtual ~ThreadPool() { };
-		
+
 		void queueTask(EventBuffer<TEvent> *buffer, EventSink<TEvent> *sink) {
-			BaseThreadPool::queueTask((void *)buffer, (void *)sink);
+			tasks.queueTask(buffer, sink);
 		};
-		
-	private: 
-		virtual void runTask(void *b, void *s) {
-			auto buffer = (EventBuffer<TEvent> *)b;
-			auto sink = (EventSink<TEvent> *)s;
-			sink->pushEvents(buffer);
-			
-		}
-		
+
+		void completeQueue() {
+			tasks.complete();
+		};
+
+		u_int64_t getNTasksCompleted() { return tasks.getNTasksCompleted(); };
+		u_int64_t getBusyTime() { return tasks.getBusyTime(); };
+
+	private:
+		TaskGroup tasks;
 	};
 }
 
@@ -0,0 +1,45 @@
+#ifndef __PETSYS_TRACE_HPP__DEFINED__
+#define __PETSYS_TRACE_HPP__DEFINED__
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <atomic>
+
+namespace PETSYS {
+
+	/*! Optional tracing of the buffers going through the pipeline, written as a Chrome/Perfetto JSON trace.
+	 * Event handlers and ThreadPool workers emit begin/end events carrying the buffer sequence number
+	 * and the input/output sizes. Each thread writes its events into its own ring buffer, without locks,
+	 * keeping the most recent ones; the rings are written out by writeJSON().
+	 * When tracing is not enabled, the only cost is the isEnabled() test.
+	 */
+	class Trace {
+	public:
+		/*! Starts tracing, keeping up to eventsPerThread events in each thread's ring */
+		static void enable(size_t eventsPerThread = DEFAULT_EVENTS_PER_THREAD);
+		static void disable();
+		static inline bool isEnabled() { return enabled.load(std::memory_order_relaxed); };
+
+		/*! Returns a copy of name which lives as long as the process, for names of objects which may be deleted before the trace is written */
+		static const char *intern(const char *name);
+		/*! Names the calling thread in the trace */
+		static void setThreadName(const char *name);
+
+		/*! name must live until the trace is written, see intern() */
+		static void begin(const char *name, u_int64_t seqN, u_int64_t size);
+		static void end(const char *name, u_int64_t seqN, u_int64_t size);
+		static void instant(const char *name, u_int64_t seqN, u_int64_t size);
+
+		/*! Writes the events recorded so far to fileName and clears them.
+		 * Call between steps, while no buffers are in flight, since rings are read without locks.
+		 */
+		static bool writeJSON(const char *fileName);
+
+		static const size_t DEFAULT_EVENTS_PER_THREAD = 65536;
+
+	private:
+		static std::atomic<bool> enabled;
+	};
+
+}
+#endif // __PETSYS_TRACE_HPP__DEFINED__
@@ -2,6 +2,8 @@
 #define __PETSYS_UNORDEREDEVENTHANDLER_HPP__DEFINED__
 #include "EventSourceSink.h"
 #include "EventBuffer.h"
+#include "Metrics.h"
+#include "Trace.h"
 #include <pthread.h>
 
 namespace PETSYS {
@@ -11,19 +13,47 @@ namespace PETSYS {
 		public EventSink<TEventInput>,
 		public EventSource<TEventOutput> {
 	public:
-		UnorderedEventHandler(EventSink<TEventOutput> *sink) : 
+		/*! With a stage name, the stage's buffers, events and handleEvents() latency
+		 * are published in the metrics registry, where the stage can also keep its own metrics.
+		 * The stage name also labels the stage in traces (see Trace).
+		 */
+		UnorderedEventHandler(EventSink<TEventOutput> *sink, const char *stage = NULL) : 
 		EventSource<TEventOutput>(sink) {
+			traceName = Trace::intern(stage != NULL ? stage : "UnorderedEventHandler");
+			metrics = NULL;
+			if(stage != NULL) {
+				metrics = new StageMetrics(stage);
+				nBuffers = metrics->counter("buffers");
+				nEvents = metrics->counter("events");
+				latency = metrics->histogram("buffer_latency_ns");
+			}
 		};
 		
 		~UnorderedEventHandler() {
+			delete metrics;
 		};
 		
+		/*! Called as a step starts, the stage's report then covers this step only */
 		virtual void pushT0(double t0) {
+			if(metrics != NULL) metrics->restart();
 			this->sink->pushT0(t0);
 		};
 		
 		virtual void pushEvents(EventBuffer<TEventInput> *buffer) {
+			if(Trace::isEnabled()) {
+				pushEventsTraced(buffer);
+				return;
+			}
+			if(metrics == NULL) {
+				this->sink->pushEvents(handleEvents(buffer));
+				return;
+			}
+			size_t N = buffer->getSize();
+			u_int64_t t0 = Metrics::now();
 			auto newBuffer = handleEvents(buffer);
+			latency->record(Metrics::now() - t0);
+			nBuffers->increment();
+			nEvents->add(N);
 			this->sink->pushEvents(newBuffer);
 		};
 		
@@ -33,12 +63,46 @@ namespace PETSYS {
 		};
 		
 		virtual void report() {
+			if(metrics != NULL) {
+				Metrics::Snapshot s = metrics->snapshot();
+				const Metrics::Value *v = s.find(metrics->getStage(), "buffer_latency_ns");
+				if(v != NULL && v->value > 0) {
+					fprintf(stderr, " buffer latency\n");
+					fprintf(stderr, "  %10ld buffers\n", v->value);
+					fprintf(stderr, "  %10.1f us mean\n", 1E-3 * v->sum / v->value);
+					fprintf(stderr, "  %10.1f us or less for 99%%\n", 1E-3 * v->getQuantile(0.99));
+				}
+			}
 			this->sink->report();
 		};
 		
 	protected:
 		virtual EventBuffer<TEventOutput> * handleEvents(EventBuffer<TEventInput> *inBuffer) = 0;		
 
+		StageMetrics *metrics;
+
+	private:
+		Metrics::Counter *nBuffers;
+		Metrics::Counter *nEvents;
+		Metrics::Histogram *latency;
+		const char *traceName;
+
+		// The span covers handleEvents() only, the downstream stages being traced on their own
+		void pushEventsTraced(EventBuffer<TEventInput> *buffer) {
+			size_t N = buffer->getSize();
+			u_int64_t seqN = buffer->getSeqN();
+			Trace::begin(traceName, seqN, N);
+			u_int64_t t0 = Metrics::now();
+			auto newBuffer = handleEvents(buffer);
+			if(metrics != NULL) {
+				latency->record(Metrics::now() - t0);
+				nBuffers->increment();
+				nEvents->add(N);
+			}
+			Trace::end(traceName, seqN, newBuffer != NULL ? newBuffer->getSize() : 0);
+			this->sink->pushEvents(newBuffer);
+		};
+
 	};
 
 }
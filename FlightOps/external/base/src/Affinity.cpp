@@ -0,0 +1,214 @@
+#include "Affinity.h"
+#include "BufferPool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sstream>
+
+using namespace PETSYS;
+using namespace std;
+
+namespace {
+
+	const char *ROLE_NAMES[Affinity::N_ROLES] = { "reader", "worker", "writer" };
+	const char *ROLE_ENVIRONMENT[Affinity::N_ROLES] = { "PETSYS_READER_CPUS", "PETSYS_WORKER_CPUS", "PETSYS_WRITER_CPUS" };
+
+	struct State {
+		pthread_mutex_t lock;
+		Affinity::Policy policy;
+		bool nodesKnown;
+		vector<int> cpuNode;
+
+		State() : nodesKnown(false) {
+			pthread_mutex_init(&lock, NULL);
+		};
+	};
+
+	// Settings given in the environment replace those of policy; invalid ones are ignored with a warning
+	void applyEnvironment(Affinity::Policy &policy)
+	{
+		const char *s = getenv("PETSYS_WORKERS");
+		if(s != NULL && *s != 0) {
+			char *end;
+			long n = strtol(s, &end, 10);
+			if(*end == 0 && n >= 0)
+				policy.nWorkers = n;
+			else
+				fprintf(stderr, "WARNING: ignoring invalid PETSYS_WORKERS '%s'\n", s);
+		}
+
+		for(int role = 0; role < Affinity::N_ROLES; role++) {
+			s = getenv(ROLE_ENVIRONMENT[role]);
+			if(s == NULL) continue;
+			vector<int> cpus;
+			if(Affinity::parseCPUList(s, cpus))
+				policy.cpus[role] = cpus;
+			else
+				fprintf(stderr, "WARNING: ignoring invalid %s '%s'\n", ROLE_ENVIRONMENT[role], s);
+		}
+	}
+
+	// Never destroyed: pool workers may pin themselves during exit
+	State &state()
+	{
+		static State *s = []() {
+			State *s = new State();
+			applyEnvironment(s->policy);
+			return s;
+		}();
+		return *s;
+	}
+
+	// Reads /sys/devices/system/node/node<N>/cpulist; call with the lock held
+	void readNodes(State &s)
+	{
+		s.nodesKnown = true;
+		for(int node = 0; ; node++) {
+			char fName[128];
+			snprintf(fName, sizeof(fName), "/sys/devices/system/node/node%d/cpulist", node);
+			FILE *f = fopen(fName, "r");
+			if(f == NULL) break;
+			char line[4096];
+			vector<int> cpus;
+			if(fgets(line, sizeof(line), f) != NULL) {
+				line[strcspn(line, "\n")] = 0;
+				Affinity::parseCPUList(line, cpus);
+			}
+			fclose(f);
+			for(int cpu : cpus) {
+				if(cpu >= (int)s.cpuNode.size()) s.cpuNode.resize(cpu + 1, 0);
+				s.cpuNode[cpu] = node;
+			}
+		}
+	}
+}
+
+bool Affinity::parseCPUList(const char *s, vector<int> &cpus)
+{
+	cpus.clear();
+	const char *p = s;
+	while(*p == ' ') p++;
+	if(*p == 0) return true;
+
+	while(true) {
+		char *end;
+		long first = strtol(p, &end, 10);
+		if(end == p || first < 0 || first >= CPU_SETSIZE) return false;
+		long last = first;
+		p = end;
+		if(*p == '-') {
+			p++;
+			last = strtol(p, &end, 10);
+			if(end == p || last < first || last >= CPU_SETSIZE) return false;
+			p = end;
+		}
+		for(long cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
+
+		while(*p == ' ') p++;
+		if(*p == 0) return true;
+		if(*p != ',') return false;
+		p++;
+	}
+}
+
+void Affinity::setPolicy(const Policy &policy)
+{
+	Policy p = policy;
+	applyEnvironment(p);
+	State &s = state();
+	pthread_mutex_lock(&s.lock);
+	s.policy = p;
+	pthread_mutex_unlock(&s.lock);
+}
+
+Affinity::Policy Affinity::getPolicy()
+{
+	State &s = state();
+	pthread_mutex_lock(&s.lock);
+	Policy p = s.policy;
+	pthread_mutex_unlock(&s.lock);
+	return p;
+}
+
+int Affinity::getDefaultNWorkers()
+{
+	Policy p = getPolicy();
+	if(p.nWorkers > 0) return p.nWorkers;
+	if(!p.cpus[WORKER].empty()) return p.cpus[WORKER].size();
+	int nCPU = sysconf(_SC_NPROCESSORS_ONLN);
+	return (nCPU > 0) ? nCPU : 1;
+}
+
+bool Affinity::pinThread(Role role, int index)
+{
+	Policy p = getPolicy();
+	const vector<int> &roleCPUs = p.cpus[role];
+	if(roleCPUs.empty()) return false;
+
+	vector<int> cpus;
+	if(role == WORKER)
+		cpus.push_back(roleCPUs[index % roleCPUs.size()]);
+	else
+		cpus = roleCPUs;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(int cpu : cpus) CPU_SET(cpu, &set);
+	int r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if(r != 0) {
+		fprintf(stderr, "WARNING: could not pin %s thread to CPUs %s: %s\n", ROLE_NAMES[role], toString(cpus).c_str(), strerror(r));
+		return false;
+	}
+
+	// Storage of new buffers comes from the thread's NUMA node, if it only runs on one
+	int node = getNode(cpus[0]);
+	for(int cpu : cpus) {
+		if(getNode(cpu) != node) node = -1;
+	}
+	BufferPool::setThreadNode(node);
+	return true;
+}
+
+Affinity::ScopedPin::ScopedPin(Role role, int index)
+: pinned(false), previousNode(BufferPool::getThreadNode())
+{
+	if(getPolicy().cpus[role].empty()) return;
+	// Without the previous CPUs the thread could not be given them back, so leave it alone
+	if(pthread_getaffinity_np(pthread_self(), sizeof(previousCPUs), &previousCPUs) != 0) return;
+	pinned = pinThread(role, index);
+}
+
+Affinity::ScopedPin::~ScopedPin()
+{
+	if(!pinned) return;
+	pthread_setaffinity_np(pthread_self(), sizeof(previousCPUs), &previousCPUs);
+	BufferPool::setThreadNode(previousNode);
+}
+
+int Affinity::getNode(int cpu)
+{
+	State &s = state();
+	pthread_mutex_lock(&s.lock);
+	if(!s.nodesKnown) readNodes(s);
+	int node = (cpu >= 0 && cpu < (int)s.cpuNode.size()) ? s.cpuNode[cpu] : 0;
+	pthread_mutex_unlock(&s.lock);
+	return node;
+}
+
+string Affinity::toString(const vector<int> &cpus)
+{
+	ostringstream out;
+	for(size_t i = 0; i < cpus.size(); ) {
+		size_t j = i;
+		while(j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) j++;
+		if(i > 0) out << ",";
+		out << cpus[i];
+		if(j > i) out << "-" << cpus[j];
+		i = j + 1;
+	}
+	return out.str();
+}
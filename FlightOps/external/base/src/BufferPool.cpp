@@ -0,0 +1,322 @@
+#include "BufferPool.h"
+#include "Metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <new>
+#include <vector>
+
+using namespace PETSYS;
+using namespace std;
+
+namespace {
+
+	const unsigned N_CLASSES = 20;			// 4 KiB ... 2 GiB
+	const size_t MIN_BLOCK_SIZE = 4096;
+	const size_t MAX_THREAD_CACHE_BLOCKS = 4;	// per size class
+	const size_t DEFAULT_MAX_CACHED_BYTES = 1024UL*1024*1024;
+	const unsigned MAX_NODES = 16;
+	const unsigned N_LISTS = MAX_NODES + 1;		// One per NUMA node, and one for blocks of threads not on a single node
+	const unsigned UNPINNED_LIST = MAX_NODES;
+
+	/*
+	 * Pooled blocks are mapped with a page in front of them, whose end holds the BlockHeader.
+	 * The list a block belongs to is set when it is mapped and never changes, whichever thread releases it.
+	 */
+	const size_t HEADER_BYTES = 4096;
+	struct BlockHeader {
+		unsigned list;
+	};
+
+	// Free lists per NUMA node and size class
+	struct SharedLists {
+		pthread_mutex_t lock[N_LISTS][N_CLASSES];
+		vector<void *> lists[N_LISTS][N_CLASSES];
+
+		atomic<size_t> maxCachedBytes;
+		atomic<u_int64_t> nAllocations;
+		atomic<u_int64_t> nPoolHits;
+		atomic<u_int64_t> nReleases;
+		atomic<u_int64_t> nFreed;
+		atomic<u_int64_t> bytesInUse;
+		atomic<u_int64_t> bytesCached;
+		atomic<u_int64_t> peakBytesResident;
+
+		SharedLists() {
+			for(unsigned list = 0; list < N_LISTS; list++)
+				for(unsigned k = 0; k < N_CLASSES; k++)
+					pthread_mutex_init(&lock[list][k], NULL);
+			maxCachedBytes = DEFAULT_MAX_CACHED_BYTES;
+			nAllocations = 0;
+			nPoolHits = 0;
+			nReleases = 0;
+			nFreed = 0;
+			bytesInUse = 0;
+			bytesCached = 0;
+			peakBytesResident = 0;
+		};
+	};
+
+	// Publishes the pool statistics as gauges at each metrics snapshot
+	void collectMetrics()
+	{
+		BufferPool::Stats stats = BufferPool::getStats();
+		Metrics::gauge("BufferPool", "allocations")->set(stats.nAllocations);
+		Metrics::gauge("BufferPool", "pool_hits")->set(stats.nPoolHits);
+		Metrics::gauge("BufferPool", "releases")->set(stats.nReleases);
+		Metrics::gauge("BufferPool", "freed")->set(stats.nFreed);
+		Metrics::gauge("BufferPool", "bytes_in_use")->set(stats.bytesInUse);
+		Metrics::gauge("BufferPool", "bytes_cached")->set(stats.bytesCached);
+		Metrics::gauge("BufferPool", "peak_bytes_resident")->set(stats.peakBytesResident);
+	}
+
+	// Never destroyed: blocks may still be released by thread_local caches during exit
+	SharedLists &shared()
+	{
+		static SharedLists *s = new SharedLists();
+		return *s;
+	}
+
+	struct RegisterCollector {
+		RegisterCollector() { Metrics::addCollector(collectMetrics); };
+	} registerCollector;
+
+	size_t classSize(unsigned k)
+	{
+		return MIN_BLOCK_SIZE << k;
+	}
+
+	// Smallest class which holds minBytes, or N_CLASSES if too large to be pooled
+	unsigned classFor(size_t minBytes)
+	{
+		unsigned k = 0;
+		while(k < N_CLASSES && classSize(k) < minBytes) k++;
+		return k;
+	}
+
+	// NUMA node of the calling thread, see BufferPool::setThreadNode()
+	thread_local int threadNode = -1;
+
+	// Lists of the calling thread: those of its node, or the unpinned ones if it is not on a single (known) node
+	unsigned threadList()
+	{
+		return (threadNode >= 0 && threadNode < (int)MAX_NODES) ? threadNode : UNPINNED_LIST;
+	}
+
+	BlockHeader *headerOf(void *ptr)
+	{
+		return (BlockHeader *)((char *)ptr - sizeof(BlockHeader));
+	}
+
+	/*
+	 * Maps a new block of class k for the calling thread's list.
+	 * A thread on a single node faults the pages in right away (MAP_POPULATE), so that, under the default
+	 * memory policy, they are placed on its node whichever thread writes them first.
+	 * Pages of other threads' blocks are placed wherever they are first written.
+	 */
+	void *mapBlock(unsigned k)
+	{
+		unsigned list = threadList();
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+		if(list != UNPINNED_LIST) flags |= MAP_POPULATE;
+		void *base = mmap(NULL, HEADER_BYTES + classSize(k), PROT_READ | PROT_WRITE, flags, -1, 0);
+		if(base == MAP_FAILED) throw std::bad_alloc();
+		void *ptr = (char *)base + HEADER_BYTES;
+		headerOf(ptr)->list = list;
+		return ptr;
+	}
+
+	void unmapBlock(unsigned k, void *ptr)
+	{
+		munmap((char *)ptr - HEADER_BYTES, HEADER_BYTES + classSize(k));
+	}
+
+	void updatePeak(SharedLists &s)
+	{
+		u_int64_t resident = s.bytesInUse.load(memory_order_relaxed) + s.bytesCached.load(memory_order_relaxed);
+		u_int64_t peak = s.peakBytesResident.load(memory_order_relaxed);
+		while(resident > peak && !s.peakBytesResident.compare_exchange_weak(peak, resident, memory_order_relaxed));
+	}
+
+	// Push a block to the shared list of class k it belongs to, or unmap it if the cache is over its limit
+	void releaseShared(SharedLists &s, unsigned k, void *ptr)
+	{
+		unsigned list = headerOf(ptr)->list;
+		size_t size = classSize(k);
+		if(s.bytesCached.load(memory_order_relaxed) + size > s.maxCachedBytes.load(memory_order_relaxed)) {
+			unmapBlock(k, ptr);
+			s.nFreed.fetch_add(1, memory_order_relaxed);
+			return;
+		}
+		pthread_mutex_lock(&s.lock[list][k]);
+		s.lists[list][k].push_back(ptr);
+		pthread_mutex_unlock(&s.lock[list][k]);
+		s.bytesCached.fetch_add(size, memory_order_relaxed);
+	}
+
+	// Only holds blocks of the thread's list
+	struct ThreadCache {
+		vector<void *> lists[N_CLASSES];
+
+		// Hands the blocks over to the shared lists
+		void flush() {
+			SharedLists &s = shared();
+			for(unsigned k = 0; k < N_CLASSES; k++) {
+				for(auto ptr : lists[k]) {
+					s.bytesCached.fetch_sub(classSize(k), memory_order_relaxed);
+					releaseShared(s, k, ptr);
+				}
+				lists[k].clear();
+			}
+		};
+
+		~ThreadCache() {
+			flush();
+		};
+	};
+
+	thread_local ThreadCache threadCache;
+}
+
+void *BufferPool::allocate(size_t minBytes, size_t &blockBytes)
+{
+	SharedLists &s = shared();
+	s.nAllocations.fetch_add(1, memory_order_relaxed);
+
+	unsigned k = classFor(minBytes);
+	if(k >= N_CLASSES) {
+		// Too large to be pooled
+		blockBytes = minBytes;
+		s.bytesInUse.fetch_add(blockBytes, memory_order_relaxed);
+		updatePeak(s);
+		return malloc(blockBytes);
+	}
+
+	blockBytes = classSize(k);
+	void *ptr = NULL;
+
+	vector<void *> &local = threadCache.lists[k];
+	if(!local.empty()) {
+		ptr = local.back();
+		local.pop_back();
+	}
+	else {
+		unsigned list = threadList();
+		pthread_mutex_lock(&s.lock[list][k]);
+		if(!s.lists[list][k].empty()) {
+			ptr = s.lists[list][k].back();
+			s.lists[list][k].pop_back();
+		}
+		pthread_mutex_unlock(&s.lock[list][k]);
+	}
+
+	if(ptr != NULL) {
+		s.nPoolHits.fetch_add(1, memory_order_relaxed);
+		s.bytesCached.fetch_sub(blockBytes, memory_order_relaxed);
+		s.bytesInUse.fetch_add(blockBytes, memory_order_relaxed);
+		return ptr;
+	}
+
+	ptr = mapBlock(k);
+	s.bytesInUse.fetch_add(blockBytes, memory_order_relaxed);
+	updatePeak(s);
+	return ptr;
+}
+
+void BufferPool::release(void *ptr, size_t blockBytes)
+{
+	if(ptr == NULL) return;
+
+	SharedLists &s = shared();
+	s.nReleases.fetch_add(1, memory_order_relaxed);
+	s.bytesInUse.fetch_sub(blockBytes, memory_order_relaxed);
+
+	unsigned k = classFor(blockBytes);
+	if(k >= N_CLASSES || classSize(k) != blockBytes) {
+		// Not a pooled block
+		free(ptr);
+		s.nFreed.fetch_add(1, memory_order_relaxed);
+		return;
+	}
+
+	// Blocks of other lists go straight back to their own
+	vector<void *> &local = threadCache.lists[k];
+	if(headerOf(ptr)->list == threadList() && local.size() < MAX_THREAD_CACHE_BLOCKS && s.bytesCached.load(memory_order_relaxed) + blockBytes <= s.maxCachedBytes.load(memory_order_relaxed)) {
+		local.push_back(ptr);
+		s.bytesCached.fetch_add(blockBytes, memory_order_relaxed);
+		return;
+	}
+
+	releaseShared(s, k, ptr);
+}
+
+void BufferPool::setMaxCachedBytes(size_t maxBytes)
+{
+	shared().maxCachedBytes = maxBytes;
+}
+
+size_t BufferPool::getMaxCachedBytes()
+{
+	return shared().maxCachedBytes;
+}
+
+void BufferPool::trim()
+{
+	SharedLists &s = shared();
+	for(unsigned list = 0; list < N_LISTS; list++) {
+		for(unsigned k = 0; k < N_CLASSES; k++) {
+			pthread_mutex_lock(&s.lock[list][k]);
+			for(auto ptr : s.lists[list][k]) {
+				unmapBlock(k, ptr);
+				s.nFreed.fetch_add(1, memory_order_relaxed);
+				s.bytesCached.fetch_sub(classSize(k), memory_order_relaxed);
+			}
+			s.lists[list][k].clear();
+			pthread_mutex_unlock(&s.lock[list][k]);
+		}
+	}
+}
+
+void BufferPool::setThreadNode(int node)
+{
+	if(node == threadNode) return;
+	// The thread cache only holds blocks of the thread's list
+	threadCache.flush();
+	threadNode = node;
+}
+
+int BufferPool::getThreadNode()
+{
+	return threadNode;
+}
+
+BufferPool::Stats BufferPool::getStats()
+{
+	SharedLists &s = shared();
+	Stats stats;
+	stats.nAllocations = s.nAllocations;
+	stats.nPoolHits = s.nPoolHits;
+	stats.nReleases = s.nReleases;
+	stats.nFreed = s.nFreed;
+	stats.bytesInUse = s.bytesInUse;
+	stats.bytesCached = s.bytesCached;
+	stats.peakBytesResident = s.peakBytesResident;
+	return stats;
+}
+
+void BufferPool::report()
+{
+	Stats stats = getStats();
+	fprintf(stderr, ">> BufferPool report\n");
+	fprintf(stderr, " buffers allocated\n");
+	fprintf(stderr, "  %10lu total\n", stats.nAllocations);
+	// Nothing allocated yet, e.g. for an empty step
+	double recycled = (stats.nAllocations > 0) ? 100.0 * stats.nPoolHits / stats.nAllocations : 0;
+	fprintf(stderr, "  %10lu (%4.1f%%) recycled\n", stats.nPoolHits, recycled);
+	fprintf(stderr, " resident memory\n");
+	fprintf(stderr, "  %10.1f MiB in use\n", stats.bytesInUse / 1048576.0);
+	fprintf(stderr, "  %10.1f MiB cached\n", stats.bytesCached / 1048576.0);
+	fprintf(stderr, "  %10.1f MiB peak\n", stats.peakBytesResident / 1048576.0);
+}
@@ -0,0 +1,262 @@
+#include "CalibrationKernel.h"
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PETSYS_CALIBRATION_X86
+#include <immintrin.h>
+#endif
+
+using namespace PETSYS;
+
+/*
+ * The QDC polynomial and its derivative are evaluated with Horner's scheme.
+ * Lanes keep iterating until their own step falls below the stopping step,
+ * so every implementation converges to the same value as the scalar one.
+ *
+ * fabs(delta) > 0.05 with delta promoted to double holds exactly when fabs(delta) >= 0.05f,
+ * which is what the vector implementations can test for.
+ *
+ * The AVX2 implementations clear the upper halves of the YMM registers before handing the tail
+ * to the SSE4.1 one, which also returns to the caller: legacy SSE code running with them dirty
+ * pays a transition penalty on every instruction. The compiler does not always insert this itself.
+ */
+static const float QDC_STOP_STEP = 0.05f;
+static const float QDC_MAX_STEP = 10.0f;
+
+static void solveTDC_scalar(int n, const float *a0, const float *a1, const float *a2, const float *fine, float *q)
+{
+	for(int i = 0; i < n; i++) {
+		q[i] = ( -a1[i] + sqrtf((a1[i] * a1[i]) - (4.0f * (a0[i] - fine[i]) * a2[i]))) / (2.0f * a2[i]);
+	}
+}
+
+static void solveQDC_scalar(int n, float * const p[10], const float *efine, const float *ti, float *tEq)
+{
+	for(int i = 0; i < n; i++) {
+		float c0 = p[0][i] - efine[i];
+		float t = ti[i];
+		for(int iter = 0; iter < CalibrationKernel::QDC_MAX_ITERATIONS; iter++) {
+			float f = p[9][i];
+			float fd = 9.0f * p[9][i];
+			for(int k = 8; k >= 1; k--) {
+				f = f * t + p[k][i];
+				fd = fd * t + float(k) * p[k][i];
+			}
+			f = f * t + c0;
+
+			float delta = -f / fd;
+			if(delta < -QDC_MAX_STEP) delta = -QDC_MAX_STEP;
+			if(delta > QDC_MAX_STEP) delta = QDC_MAX_STEP;
+			t = t + delta;
+			if(!(fabsf(delta) >= QDC_STOP_STEP)) break;
+		}
+		tEq[i] = t;
+	}
+}
+
+#ifdef PETSYS_CALIBRATION_X86
+
+__attribute__((target("sse4.1")))
+static void solveTDC_sse4(int n, const float *a0, const float *a1, const float *a2, const float *fine, float *q)
+{
+	const __m128 four = _mm_set1_ps(4.0f);
+	const __m128 two = _mm_set1_ps(2.0f);
+	const __m128 signMask = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+	int i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m128 vA0 = _mm_loadu_ps(a0 + i);
+		__m128 vA1 = _mm_loadu_ps(a1 + i);
+		__m128 vA2 = _mm_loadu_ps(a2 + i);
+		__m128 vFine = _mm_loadu_ps(fine + i);
+		__m128 d = _mm_sub_ps(_mm_mul_ps(vA1, vA1), _mm_mul_ps(_mm_mul_ps(four, _mm_sub_ps(vA0, vFine)), vA2));
+		__m128 r = _mm_div_ps(_mm_add_ps(_mm_xor_ps(vA1, signMask), _mm_sqrt_ps(d)), _mm_mul_ps(two, vA2));
+		_mm_storeu_ps(q + i, r);
+	}
+	solveTDC_scalar(n - i, a0 + i, a1 + i, a2 + i, fine + i, q + i);
+}
+
+__attribute__((target("sse4.1")))
+static void solveQDC_sse4(int n, float * const p[10], const float *efine, const float *ti, float *tEq)
+{
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	const __m128 stopStep = _mm_set1_ps(QDC_STOP_STEP);
+	const __m128 maxStep = _mm_set1_ps(QDC_MAX_STEP);
+	const __m128 minStep = _mm_set1_ps(-QDC_MAX_STEP);
+	const __m128 signMask = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+	int i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m128 c[10], cd[10];
+		for(int k = 1; k < 10; k++) {
+			c[k] = _mm_loadu_ps(p[k] + i);
+			cd[k] = _mm_mul_ps(_mm_set1_ps(float(k)), c[k]);
+		}
+		c[0] = _mm_sub_ps(_mm_loadu_ps(p[0] + i), _mm_loadu_ps(efine + i));
+
+		__m128 t = _mm_loadu_ps(ti + i);
+		__m128 active = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for(int iter = 0; iter < CalibrationKernel::QDC_MAX_ITERATIONS; iter++) {
+			__m128 f = c[9];
+			__m128 fd = cd[9];
+			for(int k = 8; k >= 1; k--) {
+				f = _mm_add_ps(_mm_mul_ps(f, t), c[k]);
+				fd = _mm_add_ps(_mm_mul_ps(fd, t), cd[k]);
+			}
+			f = _mm_add_ps(_mm_mul_ps(f, t), c[0]);
+
+			__m128 delta = _mm_div_ps(_mm_xor_ps(f, signMask), fd);
+			delta = _mm_min_ps(maxStep, _mm_max_ps(minStep, delta));
+			t = _mm_blendv_ps(t, _mm_add_ps(t, delta), active);
+			active = _mm_and_ps(active, _mm_cmpge_ps(_mm_and_ps(delta, absMask), stopStep));
+			if(_mm_movemask_ps(active) == 0) break;
+		}
+		_mm_storeu_ps(tEq + i, t);
+	}
+	float * tail[10];
+	for(int k = 0; k < 10; k++) tail[k] = p[k] + i;
+	solveQDC_scalar(n - i, tail, efine + i, ti + i, tEq + i);
+}
+
+__attribute__((target("avx2")))
+static void solveTDC_avx2(int n, const float *a0, const float *a1, const float *a2, const float *fine, float *q)
+{
+	const __m256 four = _mm256_set1_ps(4.0f);
+	const __m256 two = _mm256_set1_ps(2.0f);
+	const __m256 signMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x80000000));
+	int i = 0;
+	for(; i + 8 <= n; i += 8) {
+		__m256 vA0 = _mm256_loadu_ps(a0 + i);
+		__m256 vA1 = _mm256_loadu_ps(a1 + i);
+		__m256 vA2 = _mm256_loadu_ps(a2 + i);
+		__m256 vFine = _mm256_loadu_ps(fine + i);
+		__m256 d = _mm256_sub_ps(_mm256_mul_ps(vA1, vA1), _mm256_mul_ps(_mm256_mul_ps(four, _mm256_sub_ps(vA0, vFine)), vA2));
+		__m256 r = _mm256_div_ps(_mm256_add_ps(_mm256_xor_ps(vA1, signMask), _mm256_sqrt_ps(d)), _mm256_mul_ps(two, vA2));
+		_mm256_storeu_ps(q + i, r);
+	}
+	_mm256_zeroupper();
+	solveTDC_sse4(n - i, a0 + i, a1 + i, a2 + i, fine + i, q + i);
+}
+
+__attribute__((target("avx2")))
+static void solveQDC_avx2(int n, float * const p[10], const float *efine, const float *ti, float *tEq)
+{
+	const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+	const __m256 stopStep = _mm256_set1_ps(QDC_STOP_STEP);
+	const __m256 maxStep = _mm256_set1_ps(QDC_MAX_STEP);
+	const __m256 minStep = _mm256_set1_ps(-QDC_MAX_STEP);
+	const __m256 signMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x80000000));
+	int i = 0;
+	for(; i + 8 <= n; i += 8) {
+		__m256 c[10], cd[10];
+		for(int k = 1; k < 10; k++) {
+			c[k] = _mm256_loadu_ps(p[k] + i);
+			cd[k] = _mm256_mul_ps(_mm256_set1_ps(float(k)), c[k]);
+		}
+		c[0] = _mm256_sub_ps(_mm256_loadu_ps(p[0] + i), _mm256_loadu_ps(efine + i));
+
+		__m256 t = _mm256_loadu_ps(ti + i);
+		__m256 active = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for(int iter = 0; iter < CalibrationKernel::QDC_MAX_ITERATIONS; iter++) {
+			__m256 f = c[9];
+			__m256 fd = cd[9];
+			for(int k = 8; k >= 1; k--) {
+				f = _mm256_add_ps(_mm256_mul_ps(f, t), c[k]);
+				fd = _mm256_add_ps(_mm256_mul_ps(fd, t), cd[k]);
+			}
+			f = _mm256_add_ps(_mm256_mul_ps(f, t), c[0]);
+
+			__m256 delta = _mm256_div_ps(_mm256_xor_ps(f, signMask), fd);
+			delta = _mm256_min_ps(maxStep, _mm256_max_ps(minStep, delta));
+			t = _mm256_blendv_ps(t, _mm256_add_ps(t, delta), active);
+			active = _mm256_and_ps(active, _mm256_cmp_ps(_mm256_and_ps(delta, absMask), stopStep, _CMP_GE_OQ));
+			if(_mm256_movemask_ps(active) == 0) break;
+		}
+		_mm256_storeu_ps(tEq + i, t);
+	}
+	float * tail[10];
+	for(int k = 0; k < 10; k++) tail[k] = p[k] + i;
+	_mm256_zeroupper();
+	solveQDC_sse4(n - i, tail, efine + i, ti + i, tEq + i);
+}
+
+#endif // PETSYS_CALIBRATION_X86
+
+typedef void (*SolveTDCFunction)(int, const float *, const float *, const float *, const float *, float *);
+typedef void (*SolveQDCFunction)(int, float * const *, const float *, const float *, float *);
+
+struct KernelImplementation {
+	CalibrationKernel::ISA isa;
+	SolveTDCFunction solveTDC;
+	SolveQDCFunction solveQDC;
+};
+
+static KernelImplementation implementations[] = {
+	{ CalibrationKernel::SCALAR, solveTDC_scalar, solveQDC_scalar },
+#ifdef PETSYS_CALIBRATION_X86
+	{ CalibrationKernel::SSE4, solveTDC_sse4, solveQDC_sse4 },
+	{ CalibrationKernel::AVX2, solveTDC_avx2, solveQDC_avx2 },
+#endif
+};
+
+static const int nImplementations = sizeof(implementations) / sizeof(KernelImplementation);
+
+static const KernelImplementation *selectBest()
+{
+	const KernelImplementation *best = &implementations[0];
+	for(int i = 0; i < nImplementations; i++) {
+		if(CalibrationKernel::isSupported(implementations[i].isa))
+			best = &implementations[i];
+	}
+	return best;
+}
+
+static const KernelImplementation *current = selectBest();
+
+bool CalibrationKernel::isSupported(ISA isa)
+{
+	switch(isa) {
+	case SCALAR:	return true;
+#ifdef PETSYS_CALIBRATION_X86
+	// May run from a static initializer, before libgcc has probed the CPU
+	case SSE4:	__builtin_cpu_init(); return __builtin_cpu_supports("sse4.1");
+	case AVX2:	__builtin_cpu_init(); return __builtin_cpu_supports("avx2");
+#endif
+	default:	return false;
+	}
+}
+
+CalibrationKernel::ISA CalibrationKernel::getISA()
+{
+	return current->isa;
+}
+
+const char *CalibrationKernel::getISAName(ISA isa)
+{
+	switch(isa) {
+	case SCALAR:	return "scalar";
+	case SSE4:	return "sse4.1";
+	case AVX2:	return "avx2";
+	default:	return "unknown";
+	}
+}
+
+bool CalibrationKernel::setISA(ISA isa)
+{
+	if(!isSupported(isa)) return false;
+	for(int i = 0; i < nImplementations; i++) {
+		if(implementations[i].isa == isa) {
+			current = &implementations[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+void CalibrationKernel::solveTDC(int n, const float *a0, const float *a1, const float *a2, const float *fine, float *q)
+{
+	current->solveTDC(n, a0, a1, a2, fine, q);
+}
+
+void CalibrationKernel::solveQDC(int n, float * const p[10], const float *efine, const float *ti, float *tEq)
+{
+	current->solveQDC(n, p, efine, ti, tEq);
+}
@@ -2,66 +2,241 @@
 #include <vector>
 #include <algorithm>
 #include <functional>
+#include <string.h>
 
 using namespace std;
 using namespace PETSYS;
 
-CoarseSorter::CoarseSorter(EventSink<RawHit> *sink) :
-	UnorderedEventHandler<RawHit, RawHit>(sink)
+/*
+ * Hits arrive grouped by frame, frames in increasing order, with
+ * time = frameID * 1024 + tcoarse. Sorting therefore only has to reorder hits
+ * inside each frame, which is done in a single pass while the frame is in cache:
+ * short frames use insertion sort, longer frames an LSD radix sort on tcoarse.
+ * Buffers whose frames turn out not to be in order get an LSD radix sort on the
+ * whole time tag afterwards. All of them are stable, and frames already in order
+ * are not moved.
+ */
+static const unsigned FRAME_BITS = 10;
+static const unsigned INSERTION_SORT_MAX = 16;
+static const unsigned SHORT_FRAME_MAX = 512;
+static const unsigned RADIX_BITS = 11;
+
+// Scratch space reused by each worker thread
+static thread_local vector<unsigned> permutation;
+static thread_local vector<unsigned> scratchOrder;
+static thread_local vector<char> scratchColumn;
+static thread_local vector<unsigned> bufferOrder;
+
+template <class TKey>
+static void insertionSort(unsigned *order, unsigned n, TKey key)
 {
-	nSingleRead = 0;
+	for(unsigned i = 1; i < n; i++) {
+		unsigned v = order[i];
+		long long k = key(v);
+		unsigned j = i;
+		for(; j > 0 && key(order[j-1]) > k; j--)
+			order[j] = order[j-1];
+		order[j] = v;
+	}
 }
 
-struct SortEntry {
-        long long time;
-        RawHit *p;
-};
+// Stable counting sort of order[0..n) on ((key - offset) >> shift) % 2^bits
+template <class TKey>
+static void countingSort(unsigned *order, unsigned n, TKey key, long long offset, unsigned shift, unsigned bits, unsigned *tmp)
+{
+	unsigned nBuckets = 1U << bits;
+	unsigned count[1U << RADIX_BITS];
+	for(unsigned b = 0; b < nBuckets; b++) count[b] = 0;
+	for(unsigned i = 0; i < n; i++)
+		count[((key(order[i]) - offset) >> shift) & (nBuckets - 1)] += 1;
+	unsigned sum = 0;
+	for(unsigned b = 0; b < nBuckets; b++) {
+		unsigned c = count[b];
+		count[b] = sum;
+		sum += c;
+	}
+	for(unsigned i = 0; i < n; i++)
+		tmp[count[((key(order[i]) - offset) >> shift) & (nBuckets - 1)]++] = order[i];
+	memcpy(order, tmp, n * sizeof(unsigned));
+}
+
+/*
+ * Sorts hits 0..N-1 by key(), through apply().
+ * apply(begin, n, order) gets the sorted order of hits begin..begin+n-1 each time a range is sorted;
+ * a final call for the whole buffer, if any, refers to the hits as key() sees them by then.
+ * Returns false if the buffer was already in order.
+ */
+template <class TKey, class TApply>
+static bool frameSort(unsigned N, TKey key, TApply apply)
+{
+	bool moved = false;
+	bool framesInOrder = true;
+	long long tMin = N > 0 ? key(0) : 0;
+	long long tMax = tMin;
+
+	unsigned begin = 0;
+	long long lastFrame = (N > 0) ? (key(0) >> FRAME_BITS) : 0;
+	while(begin < N) {
+		long long frame = key(begin) >> FRAME_BITS;
+		if(frame < lastFrame) framesInOrder = false;
+		lastFrame = frame;
+
+		bool frameInOrder = true;
+		unsigned end = begin + 1;
+		for(; end < N && (key(end) >> FRAME_BITS) == frame; end++) {
+			if(key(end) < key(end-1)) frameInOrder = false;
+		}
+		// Bounds of this frame, for the fallback sort
+		tMin = min(tMin, frame << FRAME_BITS);
+		tMax = max(tMax, ((frame + 1) << FRAME_BITS) - 1);
 
-static bool operator< (SortEntry lhs, SortEntry rhs) { return lhs.time < rhs.time; }
+		unsigned n = end - begin;
+		if(!frameInOrder) {
+			permutation.resize(n);
+			scratchOrder.resize(n);
+			unsigned *order = permutation.data();
+			for(unsigned i = 0; i < n; i++) order[i] = begin + i;
 
+			if(n <= INSERTION_SORT_MAX) {
+				insertionSort(order, n, key);
+			}
+			else if(n <= SHORT_FRAME_MAX) {
+				countingSort(order, n, key, 0, 0, FRAME_BITS / 2, scratchOrder.data());
+				countingSort(order, n, key, 0, FRAME_BITS / 2, FRAME_BITS / 2, scratchOrder.data());
+			}
+			else {
+				countingSort(order, n, key, 0, 0, FRAME_BITS, scratchOrder.data());
+			}
+			apply(begin, n, order);
+			moved = true;
+		}
+		begin = end;
+	}
+
+	if(!framesInOrder) {
+		permutation.resize(N);
+		scratchOrder.resize(N);
+		unsigned *order = permutation.data();
+		for(unsigned i = 0; i < N; i++) order[i] = i;
+		unsigned long long range = tMax - tMin;
+		for(unsigned shift = 0; shift == 0 || (range >> shift) != 0; shift += RADIX_BITS)
+			countingSort(order, N, key, tMin, shift, RADIX_BITS, scratchOrder.data());
+		apply(0, N, order);
+		moved = true;
+	}
+	return moved;
+}
+
+CoarseSorter::CoarseSorter(EventSink<RawHit> *sink) :
+	UnorderedEventHandler<RawHit, RawHit>(sink, "CoarseSorter")
+{
+	nBuffersInOrder = metrics->counter("buffers_in_order");
+}
+
+bool CoarseSorter::sortInPlace(RawHit *hits, unsigned N)
+{
+	auto key = [hits](unsigned i) { return hits[i].time; };
+	auto apply = [hits](unsigned begin, unsigned n, unsigned *order) {
+		// Follow each cycle of the permutation
+		for(unsigned i = 0; i < n; i++) order[i] -= begin;
+		RawHit *p = hits + begin;
+		for(unsigned i = 0; i < n; i++) {
+			if(order[i] == i) continue;
+			RawHit tmp = p[i];
+			unsigned j = i;
+			while(order[j] != i) {
+				unsigned k = order[j];
+				p[j] = p[k];
+				order[j] = j;
+				j = k;
+			}
+			p[j] = tmp;
+			order[j] = j;
+		}
+	};
+	return frameSort(N, key, apply);
+}
 
 EventBuffer<RawHit> * CoarseSorter::handleEvents (EventBuffer<RawHit> *inBuffer)
 {
 	unsigned N =  inBuffer->getSize();
-	EventBuffer<RawHit> * outBuffer = new EventBuffer<RawHit>(N, inBuffer);
-	u_int64_t lSingleRead = 0;
-	
-	vector<SortEntry> sortList;
-	sortList.reserve(N);
-
-	auto pi = inBuffer->getPtr();
-	auto pe = pi + N;
-
-	for(; pi < pe; pi++) {
-		SortEntry entry = {
-			.time = pi->time,
-			.p = pi
-		};
-		sortList.push_back(entry);
-	}
-	
-	sort(sortList.begin(), sortList.end());
-	
-	auto po = outBuffer->getPtr();
-	for(auto iter = sortList.begin(); iter != sortList.end(); iter++) {
-		auto p = (*iter).p;
-		*po = *p;
-		po++;
-		lSingleRead++;
-	}
 
-	
-	atomicAdd(nSingleRead, lSingleRead);
+	// Sort in place and pass the input buffer on
+	if(!sortInPlace(inBuffer->getPtr(), N))
+		nBuffersInOrder->increment();
 
-	outBuffer->setUsed(lSingleRead);
-	return outBuffer;
+	return inBuffer;
 }
 
 void CoarseSorter::report()
 {
-	u_int64_t nTotal = nSingleRead;
+	Metrics::Snapshot s = metrics->snapshot();
 	fprintf(stderr, ">> CoarseSorter report\n");
 	fprintf(stderr, " events passed\n");
-	fprintf(stderr, "  %10lu\n", nSingleRead);
+	fprintf(stderr, "  %10ld\n", metrics->get(s, "events"));
+	fprintf(stderr, "  %10ld buffers already in order\n", metrics->get(s, "buffers_in_order"));
 	UnorderedEventHandler<RawHit, RawHit>::report();
 }
+
+ColumnarCoarseSorter::ColumnarCoarseSorter(EventSink<RawHitColumns> *sink) :
+	UnorderedEventHandler<RawHitColumns, RawHitColumns>(sink, "ColumnarCoarseSorter")
+{
+	nBuffersInOrder = metrics->counter("buffers_in_order");
+}
+
+// Reorders column[0..n) in place through the scratch space
+template <class T>
+static void permuteColumn(T *column, unsigned n, const unsigned *order)
+{
+	scratchColumn.resize(n * sizeof(T));
+	T *tmp = (T *)scratchColumn.data();
+	for(unsigned i = 0; i < n; i++)
+		tmp[i] = column[order[i]];
+	memcpy(column, tmp, n * sizeof(T));
+}
+
+EventBuffer<RawHitColumns> * ColumnarCoarseSorter::handleEvents (EventBuffer<RawHitColumns> *inBuffer)
+{
+	unsigned N =  inBuffer->getSize();
+	EventBuffer<RawHitColumns> *b = inBuffer;
+
+	// Sort on the time column alone, collecting the permutation for the whole buffer,
+	// then reorder every column in place once
+	bufferOrder.resize(N);
+	unsigned *global = bufferOrder.data();
+	for(unsigned i = 0; i < N; i++) global[i] = i;
+
+	long long *time = inBuffer->time;
+	auto key = [time](unsigned i) { return time[i]; };
+	auto apply = [global](unsigned begin, unsigned n, unsigned *order) {
+		memcpy(global + begin, order, n * sizeof(unsigned));
+	};
+	if(!frameSort(N, key, apply)) {
+		nBuffersInOrder->increment();
+	}
+	else {
+		permuteColumn(b->time, N, global);
+		permuteColumn(b->timeEnd, N, global);
+		permuteColumn(b->channelID, N, global);
+		permuteColumn(b->frameID, N, global);
+		permuteColumn(b->tcoarse, N, global);
+		permuteColumn(b->ecoarse, N, global);
+		permuteColumn(b->tfine, N, global);
+		permuteColumn(b->efine, N, global);
+		permuteColumn(b->tacID, N, global);
+		permuteColumn(b->qdcMode, N, global);
+		permuteColumn(b->valid, N, global);
+	}
+
+	return inBuffer;
+}
+
+void ColumnarCoarseSorter::report()
+{
+	Metrics::Snapshot s = metrics->snapshot();
+	fprintf(stderr, ">> ColumnarCoarseSorter report\n");
+	fprintf(stderr, " events passed\n");
+	fprintf(stderr, "  %10ld\n", metrics->get(s, "events"));
+	fprintf(stderr, "  %10ld buffers already in order\n", metrics->get(s, "buffers_in_order"));
+	UnorderedEventHandler<RawHitColumns, RawHitColumns>::report();
+}
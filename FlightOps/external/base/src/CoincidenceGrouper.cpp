@@ -1,12 +1,27 @@
 #include "CoincidenceGrouper.h"
+#include <vector>
+#include <algorithm>
 #include <math.h>
 
 using namespace PETSYS;
+using namespace std;
 
 CoincidenceGrouper::CoincidenceGrouper(SystemConfig *systemConfig, EventSink<Coincidence> *sink)
-	: systemConfig(systemConfig), UnorderedEventHandler<GammaPhoton, Coincidence>(sink)
+	: systemConfig(systemConfig), UnorderedEventHandler<GammaPhoton, Coincidence>(sink, "CoincidenceGrouper")
 {
-	nPrompts = 0;
+	nPrompts = metrics->counter("prompts");
+	nCoincidencesOverflow = metrics->counter("coincidences_overflow");
+
+	// Regions r2 in coincidence with each trigger region, used by the indexed engine
+	unsigned nRegions = systemConfig->getNTriggerRegions();
+	partnerStart.push_back(0);
+	for(unsigned r = 0; r < nRegions; r++) {
+		for(unsigned r2 = 0; r2 < nRegions; r2++) {
+			if(systemConfig->isCoincidenceAllowed(r, r2))
+				partners.push_back(r2);
+		}
+		partnerStart.push_back(partners.size());
+	}
 }
 
 CoincidenceGrouper::~CoincidenceGrouper()
@@ -15,41 +30,258 @@ CoincidenceGrouper::~CoincidenceGrouper()
 
 void CoincidenceGrouper::report()
 {
+	Metrics::Snapshot s = metrics->snapshot();
 	printf(">> CoincidenceGrouper report\n");
 	printf(" prompts passed\n");
-	printf("  %10lu \n", nPrompts);
+	printf("  %10ld \n", metrics->get(s, "prompts"));
+	if(systemConfig->sw_trigger_coincidence_max_photons > 2) {
+		printf(" prompts rejected\n");
+		printf("  %10ld with more than %d photons\n", metrics->get(s, "coincidences_overflow"), systemConfig->sw_trigger_coincidence_max_photons);
+	}
 	UnorderedEventHandler<GammaPhoton, Coincidence>::report();
 }
 
-EventBuffer<Coincidence> * CoincidenceGrouper::handleEvents(EventBuffer<GammaPhoton> *inBuffer)
+struct CoincidenceParameters {
+	double cWindow;
+	double scanLimit;
+	int maxPhotons;
+	// Every allowed pair is a coincidence, otherwise photons are grouped once into coincidences of up to maxPhotons
+	bool pairs;
+};
+
+struct CoincidenceCounters {
+	u_int64_t lPrompts;
+	u_int64_t lCoincidencesOverflow;
+};
+
+// Scratch space reused by each worker thread
+static thread_local vector<char> taken;
+static thread_local vector<unsigned> regionStart;
+static thread_local vector<unsigned> regionPhotons;
+static thread_local vector<unsigned> regionCursor;
+static thread_local vector<unsigned> candidates;
+static thread_local vector<GammaPhoton *> members;
+
+/*
+ * Emits the coincidences of seed photon i with the candidates j (in buffer order).
+ * Photons of a coincidence are in order of decreasing region, and the later photon first within a region.
+ */
+static void emitCoincidences(GammaPhoton *buffer, unsigned i, const vector<unsigned> &candidates, const CoincidenceParameters &p,
+		EventBuffer<GammaPhoton *> *photonIndex, EventBuffer<Coincidence> *outBuffer, CoincidenceCounters &c)
 {
-	double cWindow = systemConfig->sw_trigger_coincidence_time_window;
-	
-	unsigned N =  inBuffer->getSize();
-	EventBuffer<Coincidence> * outBuffer = new EventBuffer<Coincidence>(N, inBuffer);
+	if(candidates.empty()) return;
+
+	if(p.pairs) {
+		GammaPhoton &photon1 = buffer[i];
+		for(unsigned j : candidates) {
+			GammaPhoton &photon2 = buffer[j];
+			Coincidence &coincidence = outBuffer->getWriteSlot();
+			coincidence.nPhotons = 2;
+
+			bool first1 = photon1.region > photon2.region;
+			photonIndex->getWriteSlot() = first1 ? &photon1 : &photon2;
+			photonIndex->pushWriteSlot();
+			photonIndex->getWriteSlot() = first1 ? &photon2 : &photon1;
+			photonIndex->pushWriteSlot();
+			coincidence.seed = first1 ? 0 : 1;
+			coincidence.valid = true;
+			outBuffer->pushWriteSlot();
+			c.lPrompts++;
+		}
+		return;
+	}
+
+	int nPhotons = 1 + candidates.size();
+	if(nPhotons > p.maxPhotons) {
+		c.lCoincidencesOverflow++;
+		return;
+	}
+
+	members.clear();
+	for(auto k = candidates.rbegin(); k != candidates.rend(); k++)
+		members.push_back(&buffer[*k]);
+	members.push_back(&buffer[i]);
+	stable_sort(members.begin(), members.end(), [](GammaPhoton *a, GammaPhoton *b) { return a->region > b->region; });
+
+	Coincidence &coincidence = outBuffer->getWriteSlot();
+	coincidence.nPhotons = nPhotons;
+	// The other photons were only checked against the seed, which need not be in the highest region
+	for(int k = 0; k < nPhotons; k++) {
+		if(members[k] == &buffer[i]) coincidence.seed = k;
+		photonIndex->getWriteSlot() = members[k];
+		photonIndex->pushWriteSlot();
+	}
+	coincidence.valid = true;
+	outBuffer->pushWriteSlot();
+	c.lPrompts++;
+}
+
+// Visiting one partner region costs about as much as checking this many photons
+static const unsigned PARTNER_COST = 8;
+
+// Compares each seed photon with all following photons, until one is too late
+static void coincidenceScan(SystemConfig *systemConfig, GammaPhoton *buffer, unsigned N, const CoincidenceParameters &p,
+		EventBuffer<GammaPhoton *> *photonIndex, EventBuffer<Coincidence> *outBuffer, CoincidenceCounters &c)
+{
+	taken.assign(N, 0);
 
-	u_int64_t lPrompts = 0;
 	for(unsigned i = 0; i < N; i++) {
-		GammaPhoton &photon1 = inBuffer->get(i);
+		if(taken[i]) continue;
+		GammaPhoton &photon1 = buffer[i];
+
+		candidates.clear();
 		for(unsigned j = i+1; j < N; j++) {
-			GammaPhoton &photon2 = inBuffer->get(j);			
-			if ((photon2.time - photon1.time) > (cWindow + MAX_UNORDER)) break;
-			
+			GammaPhoton &photon2 = buffer[j];
+			if ((photon2.time - photon1.time) > p.scanLimit) break;
+			if(taken[j]) continue;
+
 			if(!systemConfig->isCoincidenceAllowed(photon1.region, photon2.region)) continue;
-			
-			if(fabs(photon1.time - photon2.time) <= cWindow) {
-				Coincidence &c = outBuffer->getWriteSlot();
-				c.nPhotons = 2;
-				
-				bool first1 = photon1.region > photon2.region;
-				c.photons[0] = first1 ? &photon1 : &photon2;
-				c.photons[1] = first1 ? &photon2 : &photon1;
-				c.valid = true;
-				outBuffer->pushWriteSlot();
-				lPrompts++;
+
+			if(fabs(photon1.time - photon2.time) <= p.cWindow) {
+				candidates.push_back(j);
+				if(!p.pairs) taken[j] = true;
 			}
 		}
+
+		emitCoincidences(buffer, i, candidates, p, photonIndex, outBuffer, c);
+	}
+}
+
+// Lists photons by trigger region, in buffer order, and points each region's cursor at its start
+static void bucketByRegion(GammaPhoton *buffer, unsigned N, unsigned nRegions)
+{
+	regionStart.assign(nRegions + 1, 0);
+	for(unsigned i = 0; i < N; i++) {
+		GammaPhoton &photon = buffer[i];
+		if((unsigned)photon.region < nRegions)
+			regionStart[photon.region + 1] += 1;
+	}
+	for(unsigned r = 0; r < nRegions; r++)
+		regionStart[r + 1] += regionStart[r];
+	regionCursor.assign(regionStart.begin(), regionStart.end() - 1);
+	regionPhotons.resize(regionStart[nRegions]);
+	for(unsigned i = 0; i < N; i++) {
+		GammaPhoton &photon = buffer[i];
+		if((unsigned)photon.region < nRegions)
+			regionPhotons[regionCursor[photon.region]++] = i;
 	}
-	atomicAdd(nPrompts, lPrompts);
+	regionCursor.assign(regionStart.begin(), regionStart.end() - 1);
+}
+
+/*
+ * Same coincidences as coincidenceScan, but only visiting photons from regions in coincidence with the seed.
+ *
+ * For each seed the time slice to search is the buffer range up to the photon where coincidenceScan would stop:
+ * the first later photon which is more than cWindow + MAX_UNORDER after the seed. That limit only moves forward
+ * while seeds come in time order, so it is found incrementally.
+ * Short slices are walked, testing the time window before the trigger map. For longer slices photons are
+ * bucketed by trigger region (once per buffer, when first needed) and the buckets of the seed's partner regions
+ * are joined with the slice through a cursor per region.
+ */
+static void coincidenceIndexed(SystemConfig *systemConfig, const vector<unsigned> &partnerStart, const vector<unsigned> &partners,
+		GammaPhoton *buffer, unsigned N, const CoincidenceParameters &p,
+		EventBuffer<GammaPhoton *> *photonIndex, EventBuffer<Coincidence> *outBuffer, CoincidenceCounters &c)
+{
+	unsigned nRegions = partnerStart.size() - 1;
+	bool bucketed = false;
+
+	taken.assign(N, 0);
+
+	unsigned sliceEnd = 0;
+	double sliceSeedTime = 0;
+
+	for(unsigned i = 0; i < N; i++) {
+		if(taken[i]) continue;
+		GammaPhoton &photon1 = buffer[i];
+
+		// Photons before the previous limit were not too late for the previous seed,
+		// so they are not too late for this one if it is not earlier
+		unsigned j = (sliceEnd > i && photon1.time >= sliceSeedTime) ? sliceEnd : i + 1;
+		for(; j < N; j++) {
+			if((buffer[j].time - photon1.time) > p.scanLimit) break;
+		}
+		sliceEnd = j;
+		sliceSeedTime = photon1.time;
+
+		candidates.clear();
+		bool merged = false;
+		unsigned nPartners = 0;
+		if((unsigned)photon1.region < nRegions)
+			nPartners = partnerStart[photon1.region + 1] - partnerStart[photon1.region];
+
+		if(nPartners * PARTNER_COST > sliceEnd - i) {
+			// Most photons in the slice are outside the window, which is cheaper to test than the trigger map
+			for(unsigned j2 = i + 1; j2 < sliceEnd; j2++) {
+				GammaPhoton &photon2 = buffer[j2];
+				if(fabs(photon1.time - photon2.time) > p.cWindow) continue;
+				if(taken[j2]) continue;
+				if(systemConfig->isCoincidenceAllowed(photon1.region, photon2.region))
+					candidates.push_back(j2);
+			}
+		}
+		else if(nPartners > 0) {
+			if(!bucketed) {
+				bucketByRegion(buffer, N, nRegions);
+				bucketed = true;
+			}
+			for(unsigned n = partnerStart[photon1.region]; n < partnerStart[photon1.region + 1]; n++) {
+				unsigned r = partners[n];
+				unsigned k = regionCursor[r];
+				unsigned end = regionStart[r + 1];
+				while(k < end && regionPhotons[k] <= i) k++;
+				regionCursor[r] = k;
+
+				size_t before = candidates.size();
+				for(; k < end && regionPhotons[k] < sliceEnd; k++) {
+					unsigned j2 = regionPhotons[k];
+					if(taken[j2]) continue;
+					if(fabs(photon1.time - buffer[j2].time) <= p.cWindow)
+						candidates.push_back(j2);
+				}
+				if(before > 0 && candidates.size() > before) merged = true;
+			}
+		}
+		if(merged) sort(candidates.begin(), candidates.end());
+
+		if(!p.pairs) {
+			for(unsigned j2 : candidates)
+				taken[j2] = true;
+		}
+
+		emitCoincidences(buffer, i, candidates, p, photonIndex, outBuffer, c);
+	}
+}
+
+EventBuffer<Coincidence> * CoincidenceGrouper::handleEvents(EventBuffer<GammaPhoton> *inBuffer)
+{
+	CoincidenceParameters p;
+	p.cWindow = systemConfig->sw_trigger_coincidence_time_window;
+	p.scanLimit = p.cWindow + MAX_UNORDER;
+	p.maxPhotons = systemConfig->sw_trigger_coincidence_max_photons;
+	p.pairs = (p.maxPhotons <= 2);
+
+	CoincidenceCounters c;
+	c.lPrompts = 0;
+	c.lCoincidencesOverflow = 0;
+
+	unsigned N =  inBuffer->getSize();
+	EventBuffer<GammaPhoton *> * photonIndex = new EventBuffer<GammaPhoton *>(2 * N, inBuffer);
+	EventBuffer<Coincidence> * outBuffer = new EventBuffer<Coincidence>(N, photonIndex);
+
+	if(systemConfig->sw_trigger_coincidence_engine == SystemConfig::COINCIDENCE_ENGINE_INDEXED)
+		coincidenceIndexed(systemConfig, partnerStart, partners, inBuffer->getPtr(), N, p, photonIndex, outBuffer, c);
+	else
+		coincidenceScan(systemConfig, inBuffer->getPtr(), N, p, photonIndex, outBuffer, c);
+
+	// The photon index may have moved while growing, so point the coincidences into it only now
+	GammaPhoton **photons = photonIndex->getPtr();
+	for(unsigned k = 0; k < outBuffer->getSize(); k++) {
+		Coincidence &coincidence = outBuffer->get(k);
+		coincidence.photons = photons;
+		photons += coincidence.nPhotons;
+	}
+
+	nPrompts->add(c.lPrompts);
+	nCoincidencesOverflow->add(c.lCoincidencesOverflow);
 	return outBuffer;
 }
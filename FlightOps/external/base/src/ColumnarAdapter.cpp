@@ -0,0 +1,46 @@
+#include "ColumnarAdapter.h"
+
+using namespace PETSYS;
+
+RawHitToColumns::RawHitToColumns(EventSink<RawHitColumns> *sink) :
+	UnorderedEventHandler<RawHit, RawHitColumns>(sink)
+{
+}
+
+EventBuffer<RawHitColumns> * RawHitToColumns::handleEvents (EventBuffer<RawHit> *inBuffer)
+{
+	unsigned N = inBuffer->getSize();
+	EventBuffer<RawHitColumns> *outBuffer = new EventBuffer<RawHitColumns>(N, inBuffer);
+
+	RawHit *pi = inBuffer->getPtr();
+	for(unsigned n = 0; n < N; n++) {
+		outBuffer->set(n, pi[n]);
+	}
+	outBuffer->setUsed(N);
+	return outBuffer;
+}
+
+HitColumnsToHit::HitColumnsToHit(EventSink<Hit> *sink) :
+	UnorderedEventHandler<HitColumns, Hit>(sink)
+{
+}
+
+EventBuffer<Hit> * HitColumnsToHit::handleEvents (EventBuffer<HitColumns> *inBuffer)
+{
+	unsigned N = inBuffer->getSize();
+	EventBuffer<RawHitColumns> *raw = inBuffer->getRaw();
+
+	EventBuffer<RawHit> *rawBuffer = new EventBuffer<RawHit>(N, inBuffer);
+	EventBuffer<Hit> *outBuffer = new EventBuffer<Hit>(N, rawBuffer);
+
+	RawHit *pr = rawBuffer->getPtr();
+	Hit *po = outBuffer->getPtr();
+	for(unsigned n = 0; n < N; n++) {
+		raw->get(inBuffer->rawIndex[n], pr[n]);
+		inBuffer->get(n, po[n]);
+		po[n].raw = &pr[n];
+	}
+	rawBuffer->setUsed(N);
+	outBuffer->setUsed(N);
+	return outBuffer;
+}
@@ -0,0 +1,70 @@
+#include "ColumnarEventBuffer.h"
+#include <string.h>
+
+using namespace PETSYS;
+
+static const size_t COLUMN_ALIGNMENT = 64;
+
+static size_t alignUp(size_t n)
+{
+	return ((n + COLUMN_ALIGNMENT - 1) / COLUMN_ALIGNMENT) * COLUMN_ALIGNMENT;
+}
+
+ColumnarEventBufferBase::ColumnarEventBufferBase(AbstractEventBuffer *parent)
+	: AbstractEventBuffer(parent), used(0), columns(NULL), nColumns(0), capacity(0), block(NULL), blockBytes(0)
+{
+}
+
+ColumnarEventBufferBase::ColumnarEventBufferBase(u_int64_t seqN, long long tMin)
+	: AbstractEventBuffer(seqN, tMin), used(0), columns(NULL), nColumns(0), capacity(0), block(NULL), blockBytes(0)
+{
+}
+
+ColumnarEventBufferBase::~ColumnarEventBufferBase()
+{
+	BufferPool::release(block, blockBytes);
+}
+
+void ColumnarEventBufferBase::initColumns(Column *columns, int nColumns, unsigned initialCapacity)
+{
+	this->columns = columns;
+	this->nColumns = nColumns;
+	for(int c = 0; c < nColumns; c++)
+		*columns[c].ptr = NULL;
+	reserve(((initialCapacity / 1024) + 1) * 1024);
+}
+
+size_t ColumnarEventBufferBase::getBytesPerEvent()
+{
+	size_t bytes = 0;
+	for(int c = 0; c < nColumns; c++)
+		bytes += columns[c].elementSize;
+	return bytes;
+}
+
+void ColumnarEventBufferBase::reserve(size_t newCapacity)
+{
+	if(newCapacity <= capacity)
+		return;
+
+	// Every column starts on an aligned boundary
+	size_t totalBytes = 0;
+	for(int c = 0; c < nColumns; c++)
+		totalBytes += alignUp(columns[c].elementSize * newCapacity);
+
+	size_t newBlockBytes;
+	char *newBlock = (char *)BufferPool::allocate(totalBytes + COLUMN_ALIGNMENT, newBlockBytes);
+	char *p = (char *)alignUp((size_t)newBlock);
+	for(int c = 0; c < nColumns; c++) {
+		void *column = (void *)p;
+		if(*columns[c].ptr != NULL)
+			memcpy(column, *columns[c].ptr, columns[c].elementSize * used);
+		*columns[c].ptr = column;
+		p += alignUp(columns[c].elementSize * newCapacity);
+	}
+
+	BufferPool::release(block, blockBytes);
+	block = newBlock;
+	blockBytes = newBlockBytes;
+	capacity = newCapacity;
+}
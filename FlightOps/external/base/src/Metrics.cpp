@@ -0,0 +1,401 @@
+#include "Metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <map>
+#include <sstream>
+
+using namespace PETSYS;
+using namespace std;
+
+namespace {
+
+	const unsigned BLOCK_SLOTS = 1024;
+	const unsigned MAX_BLOCKS = 256;		// 256 Ki slots
+
+	// Slots of one thread, in blocks allocated on first use
+	struct Shard {
+		atomic<atomic<u_int64_t> *> blocks[MAX_BLOCKS];
+
+		Shard() {
+			for(unsigned b = 0; b < MAX_BLOCKS; b++)
+				blocks[b].store(NULL, memory_order_relaxed);
+		};
+		~Shard() {
+			for(unsigned b = 0; b < MAX_BLOCKS; b++)
+				delete [] blocks[b].load(memory_order_relaxed);
+		};
+
+		u_int64_t get(unsigned slot) {
+			atomic<u_int64_t> *block = blocks[slot / BLOCK_SLOTS].load(memory_order_acquire);
+			return (block != NULL) ? block[slot % BLOCK_SLOTS].load(memory_order_relaxed) : 0;
+		};
+
+		atomic<u_int64_t> &at(unsigned slot) {
+			unsigned b = slot / BLOCK_SLOTS;
+			atomic<u_int64_t> *block = blocks[b].load(memory_order_relaxed);
+			if(block == NULL) {
+				block = new atomic<u_int64_t>[BLOCK_SLOTS];
+				for(unsigned k = 0; k < BLOCK_SLOTS; k++)
+					block[k].store(0, memory_order_relaxed);
+				blocks[b].store(block, memory_order_release);
+			}
+			return block[slot % BLOCK_SLOTS];
+		};
+	};
+
+	struct Entry {
+		string stage;
+		string name;
+		Metrics::Type type;
+		void *metric;
+	};
+
+	struct Registry {
+		pthread_mutex_t lock;
+		vector<Entry> entries;
+		unsigned nSlots;
+		vector<Shard *> shards;
+		Shard retired;				// Counts of threads which have exited
+		vector<void (*)()> collectors;
+		map<string, vector<bool> > instances;	// Labels of each stage in use by a StageMetrics
+
+		Registry() {
+			pthread_mutex_init(&lock, NULL);
+			nSlots = 0;
+		};
+	};
+
+	// Never destroyed: thread_local shards are merged into it during exit
+	Registry &registry()
+	{
+		static Registry *r = new Registry();
+		return *r;
+	}
+
+	// Registers the calling thread's shard on first use and merges it into the registry when the thread exits
+	struct LocalShard {
+		Shard *shard;
+
+		LocalShard() {
+			shard = new Shard();
+			Registry &r = registry();
+			pthread_mutex_lock(&r.lock);
+			r.shards.push_back(shard);
+			pthread_mutex_unlock(&r.lock);
+		};
+
+		~LocalShard() {
+			Registry &r = registry();
+			pthread_mutex_lock(&r.lock);
+			for(unsigned slot = 0; slot < r.nSlots; slot++) {
+				u_int64_t v = shard->get(slot);
+				if(v == 0) continue;
+				atomic<u_int64_t> &total = r.retired.at(slot);
+				total.store(total.load(memory_order_relaxed) + v, memory_order_relaxed);
+			}
+			for(auto i = r.shards.begin(); i != r.shards.end(); i++) {
+				if(*i == shard) {
+					r.shards.erase(i);
+					break;
+				}
+			}
+			pthread_mutex_unlock(&r.lock);
+			delete shard;
+		};
+	};
+
+	thread_local LocalShard localShard;
+
+	// Only the owner thread writes its shard, so a plain load and store is enough
+	inline void addToSlot(unsigned slot, u_int64_t n)
+	{
+		atomic<u_int64_t> &v = localShard.shard->at(slot);
+		v.store(v.load(memory_order_relaxed) + n, memory_order_relaxed);
+	}
+
+	// Call with the registry locked
+	u_int64_t sumSlot(Registry &r, unsigned slot)
+	{
+		u_int64_t sum = r.retired.get(slot);
+		for(Shard *shard : r.shards)
+			sum += shard->get(slot);
+		return sum;
+	}
+
+	// Returns the registered metric, or registers the one made by create(slot)
+	template <class TMetric, class TCreate>
+	TMetric *findOrRegister(const char *stage, const char *name, Metrics::Type type, unsigned nSlots, TCreate create)
+	{
+		Registry &r = registry();
+		pthread_mutex_lock(&r.lock);
+		for(Entry &e : r.entries) {
+			if(e.type == type && e.stage == stage && e.name == name) {
+				pthread_mutex_unlock(&r.lock);
+				return (TMetric *)e.metric;
+			}
+		}
+		if(r.nSlots + nSlots > BLOCK_SLOTS * MAX_BLOCKS) {
+			pthread_mutex_unlock(&r.lock);
+			fprintf(stderr, "ERROR: too many metrics, could not register %s.%s\n", stage, name);
+			abort();
+		}
+		TMetric *metric = create(r.nSlots);
+		r.nSlots += nSlots;
+		Entry e = { stage, name, type, metric };
+		r.entries.push_back(e);
+		pthread_mutex_unlock(&r.lock);
+		return metric;
+	}
+
+	void appendJSONString(ostringstream &out, const string &s)
+	{
+		out << '"';
+		for(char c : s) {
+			if(c == '"' || c == '\\') out << '\\';
+			out << c;
+		}
+		out << '"';
+	}
+}
+
+void Metrics::Counter::add(u_int64_t n)
+{
+	addToSlot(slot, n);
+}
+
+void Metrics::Histogram::record(u_int64_t value, u_int64_t count)
+{
+	unsigned k;
+	if(scale == LOG2)
+		k = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+	else
+		k = (value < nBuckets) ? value : nBuckets - 1;
+	addToSlot(slot + k, count);
+	addToSlot(slot + nBuckets, value * count);
+}
+
+Metrics::Counter *Metrics::counter(const char *stage, const char *name)
+{
+	return findOrRegister<Counter>(stage, name, COUNTER, 1, [](unsigned slot) { return new Counter(slot); });
+}
+
+Metrics::Gauge *Metrics::gauge(const char *stage, const char *name)
+{
+	return findOrRegister<Gauge>(stage, name, GAUGE, 0, [](unsigned) { return new Gauge(); });
+}
+
+Metrics::Histogram *Metrics::histogram(const char *stage, const char *name, Histogram::Scale scale, unsigned nBuckets)
+{
+	if(scale == Histogram::LOG2) nBuckets = LOG2_BUCKETS;
+	return findOrRegister<Histogram>(stage, name, HISTOGRAM, nBuckets + 1,
+		[scale, nBuckets](unsigned slot) { return new Histogram(slot, scale, nBuckets); });
+}
+
+void Metrics::addCollector(void (*collect)())
+{
+	Registry &r = registry();
+	pthread_mutex_lock(&r.lock);
+	r.collectors.push_back(collect);
+	pthread_mutex_unlock(&r.lock);
+}
+
+Metrics::Snapshot Metrics::snapshot(const char *stage)
+{
+	Registry &r = registry();
+	pthread_mutex_lock(&r.lock);
+	vector<void (*)()> collectors = r.collectors;
+	pthread_mutex_unlock(&r.lock);
+	for(auto collect : collectors)
+		collect();
+
+	Snapshot s;
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	s.time = tv.tv_sec + tv.tv_usec * 1E-6;
+
+	pthread_mutex_lock(&r.lock);
+	for(Entry &e : r.entries) {
+		if(stage != NULL && e.stage != stage) continue;
+		Value v;
+		v.stage = e.stage;
+		v.name = e.name;
+		v.type = e.type;
+		v.value = 0;
+		v.sum = 0;
+		v.scale = Histogram::LOG2;
+		if(e.type == COUNTER) {
+			v.value = sumSlot(r, ((Counter *)e.metric)->slot);
+		}
+		else if(e.type == GAUGE) {
+			v.value = ((Gauge *)e.metric)->get();
+		}
+		else {
+			Histogram *h = (Histogram *)e.metric;
+			v.scale = h->scale;
+			v.buckets.resize(h->nBuckets);
+			for(unsigned k = 0; k < h->nBuckets; k++) {
+				v.buckets[k] = sumSlot(r, h->slot + k);
+				v.value += v.buckets[k];
+			}
+			v.sum = sumSlot(r, h->slot + h->nBuckets);
+		}
+		s.values.push_back(v);
+	}
+	pthread_mutex_unlock(&r.lock);
+	return s;
+}
+
+bool Metrics::writeJSON(const char *fileName)
+{
+	string json = snapshot().toJSON();
+	string tmpName = string(fileName) + ".tmp";
+	FILE *f = fopen(tmpName.c_str(), "w");
+	if(f == NULL) return false;
+	bool ok = fwrite(json.data(), 1, json.size(), f) == json.size();
+	ok = (fclose(f) == 0) && ok;
+	if(!ok || rename(tmpName.c_str(), fileName) != 0) {
+		remove(tmpName.c_str());
+		return false;
+	}
+	return true;
+}
+
+u_int64_t Metrics::Value::getBucketLow(unsigned k) const
+{
+	if(scale == Histogram::LINEAR) return k;
+	return (k == 0) ? 0 : (1ULL << (k - 1));
+}
+
+u_int64_t Metrics::Value::getQuantile(double q) const
+{
+	if(value <= 0) return 0;
+	u_int64_t rank = q * value;
+	u_int64_t n = 0;
+	for(unsigned k = 0; k < buckets.size(); k++) {
+		n += buckets[k];
+		if(n > rank) {
+			if(scale == Histogram::LINEAR) return k;
+			return (k == 0) ? 0 : ((k < 64) ? (1ULL << k) - 1 : ~0ULL);
+		}
+	}
+	return getBucketLow(buckets.size() - 1);
+}
+
+const Metrics::Value *Metrics::Snapshot::find(const char *stage, const char *name) const
+{
+	for(const Value &v : values) {
+		if(v.stage == stage && v.name == name)
+			return &v;
+	}
+	return NULL;
+}
+
+int64_t Metrics::Snapshot::get(const char *stage, const char *name) const
+{
+	const Value *v = find(stage, name);
+	return (v != NULL) ? v->value : 0;
+}
+
+Metrics::Snapshot Metrics::Snapshot::since(const Snapshot &earlier) const
+{
+	Snapshot s = *this;
+	for(Value &v : s.values) {
+		if(v.type == GAUGE) continue;
+		const Value *e = earlier.find(v.stage.c_str(), v.name.c_str());
+		if(e == NULL) continue;
+		v.value -= e->value;
+		v.sum -= e->sum;
+		for(unsigned k = 0; k < v.buckets.size() && k < e->buckets.size(); k++)
+			v.buckets[k] -= e->buckets[k];
+	}
+	return s;
+}
+
+/*
+ * {"time": t, "stages": {"<stage>": {"<counter or gauge>": n,
+ *   "<histogram>": {"count": n, "sum": s, "p50": x, "p99": x, "buckets": [[low, n], ...]}}}}
+ * with only non empty histogram buckets listed.
+ */
+string Metrics::Snapshot::toJSON() const
+{
+	ostringstream out;
+	out.precision(15);
+	out << "{\"time\": " << time << ", \"stages\": {";
+
+	// Values of a stage are listed together, stages in order of first registration
+	vector<string> stages;
+	for(const Value &v : values) {
+		bool known = false;
+		for(const string &stage : stages) known = known || (stage == v.stage);
+		if(!known) stages.push_back(v.stage);
+	}
+
+	for(unsigned i = 0; i < stages.size(); i++) {
+		if(i > 0) out << ", ";
+		appendJSONString(out, stages[i]);
+		out << ": {";
+		bool first = true;
+		for(const Value &v : values) {
+			if(v.stage != stages[i]) continue;
+			if(!first) out << ", ";
+			first = false;
+			appendJSONString(out, v.name);
+			out << ": ";
+			if(v.type != HISTOGRAM) {
+				out << v.value;
+				continue;
+			}
+			out << "{\"count\": " << v.value << ", \"sum\": " << v.sum;
+			out << ", \"p50\": " << v.getQuantile(0.50) << ", \"p99\": " << v.getQuantile(0.99);
+			out << ", \"buckets\": [";
+			bool firstBucket = true;
+			for(unsigned k = 0; k < v.buckets.size(); k++) {
+				if(v.buckets[k] == 0) continue;
+				if(!firstBucket) out << ", ";
+				firstBucket = false;
+				out << "[" << v.getBucketLow(k) << ", " << v.buckets[k] << "]";
+			}
+			out << "]}";
+		}
+		out << "}";
+	}
+	out << "}}\n";
+	return out.str();
+}
+
+StageMetrics::StageMetrics(const char *stage) :
+	name(stage)
+{
+	// Lowest label not in use by another instance of the stage
+	Registry &r = registry();
+	pthread_mutex_lock(&r.lock);
+	vector<bool> &inUse = r.instances[name];
+	instance = 0;
+	while(instance < inUse.size() && inUse[instance]) instance++;
+	if(instance == inUse.size()) inUse.push_back(true);
+	inUse[instance] = true;
+	pthread_mutex_unlock(&r.lock);
+
+	this->stage = (instance == 0) ? name : name + "#" + to_string(instance + 1);
+	baseline = Metrics::snapshot(this->stage.c_str());
+}
+
+StageMetrics::~StageMetrics()
+{
+	Registry &r = registry();
+	pthread_mutex_lock(&r.lock);
+	r.instances[name][instance] = false;
+	pthread_mutex_unlock(&r.lock);
+}
+
+Metrics::Snapshot StageMetrics::snapshot()
+{
+	return Metrics::snapshot(stage.c_str()).since(baseline);
+}
+
+void StageMetrics::restart()
+{
+	baseline = Metrics::snapshot(stage.c_str());
+}
@@ -1,205 +1,471 @@
 #include "ProcessHit.h"
+#include <CalibrationKernel.h>
+#include <QDCInversionCache.h>
+#include <algorithm>
+#include <array>
+#include <utility>
 #include <math.h>
 using namespace PETSYS;
 
-ProcessHit::ProcessHit(SystemConfig *systemConfig, EventStream *eventStream, EventSink<Hit> *sink) :
-UnorderedEventHandler<RawHit, Hit>(sink), systemConfig(systemConfig), eventStream(eventStream)
+// Calibration modes, from the SystemConfig flags which are constant over a buffer
+static const unsigned MODE_TDC = 0x1;
+static const unsigned MODE_QDC = 0x2;
+static const unsigned MODE_ENERGY = 0x4;
+static const unsigned MODE_TIME_OFFSET = 0x8;
+static const unsigned MODE_XYZ = 0x10;
+static const unsigned N_MODES = 0x20;
+
+namespace {
+	struct CalibrationBatch;
+	struct CalibrationContext;
+	typedef void (*CalibrateBatchFunction)(const CalibrationContext &ctx, CalibrationBatch &b, unsigned n);
+
+	// Settings which are constant over one buffer
+	struct CalibrationContext {
+		SystemConfig *systemConfig;
+		int triggerID;
+		float clockPeriod;
+		unsigned mode;
+		CalibrateBatchFunction calibrateBatch;	// Specialization of calibrateBatch() for mode
+		QDCInversionCache *qdcInversion;
+	};
+
+	struct HitInput {
+		bool valid;
+		bool qdcMode;
+		long long time;
+		long long timeEnd;
+		unsigned int channelID;
+		unsigned short tfine;
+		unsigned short efine;
+		unsigned short tacID;
+	};
+
+	struct HitOutput {
+		double time;
+		double timeEnd;
+		float energy;
+		short region;
+		short xi;
+		short yi;
+		float x;
+		float y;
+		float z;
+	};
+
+	// A batch of hits, with the calibration inputs laid out for CalibrationKernel
+	struct CalibrationBatch {
+		static constexpr unsigned SIZE = 128;
+
+		HitInput in[SIZE];
+		HitOutput out[SIZE];
+		uint8_t eventFlags[SIZE];
+		int channelIndex[SIZE];		// Dense channel index, -1 for trigger hits
+
+		// Hits of each kind, calibrated in separate runs
+		unsigned nToT, nQDCMode, nTrigger;
+		unsigned totHits[SIZE], qdcModeHits[SIZE], triggerHits[SIZE];
+
+		float tA0[SIZE], tA1[SIZE], tA2[SIZE], tFine[SIZE], tQ[SIZE];
+		float eA0[SIZE], eA1[SIZE], eA2[SIZE], eFine[SIZE], eQ[SIZE];
+
+		// QDC mode hits only
+		unsigned nQDC;
+		unsigned qdcIndex[SIZE];
+		float qP[10][SIZE];
+		float qEfine[SIZE], qTi[SIZE], qTeq[SIZE];
+	};
+}
+
+// Converts t_eq into energy, with energy calibration if loaded
+template <unsigned MODE>
+static inline void finishQDC(SystemConfig::QdcTacConfig &qc, HitOutput &out,
+	float t_eq, float ti, const QDCInversionTable *table, uint8_t &eventFlags)
 {
-	nReceived = 0;
-	nReceivedInvalid = 0;
-	nTDCCalibrationMissing = 0;
-	nQDCCalibrationMissing = 0;
-	nXYZMissing = 0;
-	nEnergyCalibrationMissing = 0;
-	nSent = 0;
+	SystemConfig::QacConfig &cq = qc.q;
+	SystemConfig::EnergyConfig &cen = qc.energy;
+
+	// Express energy as t_eq - actual integration time
+	// WARNING Adding 1.0 clock to shift spectrum into positive range
+	// .. needs better understanding.
+	out.energy = t_eq - ti;
+	if(cq.p1 == 0) eventFlags |= 0x4;
+
+	if(MODE & MODE_ENERGY){
+		float Energy;
+		if(table == NULL || !table->calibrateEnergy(out.energy, Energy))
+			Energy =  cen.p0 * pow(cen.p1,pow(out.energy,cen.p2)) + cen.p3 * out.energy - cen.p0;
+		out.energy = Energy;
+		if(cen.p0 == 0) eventFlags |= 0x16;
+	}
 }
 
-EventBuffer<Hit> * ProcessHit::handleEvents (EventBuffer<RawHit> *inBuffer)
+static inline void calibrateTriggerHit(CalibrationBatch &b, unsigned j)
 {
-	// TODO Add instrumentation
-	unsigned N =  inBuffer->getSize();
+	HitInput &in = b.in[j];
+	HitOutput &out = b.out[j];
+	out.time = in.time;
+	out.time -= (in.tfine - 27) * 0.25;
+	out.timeEnd = out.time;
+	out.energy = (in.efine == 28) ? 1 : -1;
+	out.region = -1;
+	out.x = out.y = out.z = 0.0;
+	out.xi = out.yi = 0;
+}
 
-	EventBuffer<Hit> * outBuffer = new EventBuffer<Hit>(N, inBuffer);
+// Applies time calibration and ToT energy to hit j, queues QDC mode hits outside the lookup tables for the exact solver
+template <unsigned MODE, bool QDC_MODE>
+static inline void calibrateHit(const CalibrationContext &ctx, CalibrationBatch &b, unsigned j)
+{
+	HitInput &in = b.in[j];
+	HitOutput &out = b.out[j];
+	unsigned index = b.channelIndex[j];
+	SystemConfig::TdcTacConfig &tdc = ctx.systemConfig->getTdcConfig(index, in.tacID);
+	SystemConfig::TacConfig &ct = tdc.t;
+	SystemConfig::TacConfig &ce = tdc.e;
+	SystemConfig::ChannelGeometry &cg = ctx.systemConfig->getChannelGeometry(index);
+
+	out.time = in.time;
+	if(MODE & MODE_TDC) {
+		out.time = double(in.time) - b.tQ[j] - ct.t0;
+		if(MODE & MODE_TIME_OFFSET)
+			out.time -= double(cg.t0)/ctx.clockPeriod;
 
-	int triggerID = eventStream->getTriggerID();
-	float clockPeriod = 1./eventStream->getFrequency()*1e12;
-
-	bool useTDC = systemConfig->useTDCCalibration();
-	bool useQDC = systemConfig->useQDCCalibration();
-	bool useEnergyCal = systemConfig->useEnergyCalibration();
-	bool useTimeOffsetCal = systemConfig->useTimeOffsetCalibration();
-	bool useXYZ = systemConfig->useXYZ();
-	//intf("%d\n", N);
-	u_int64_t lReceived = 0;
-	u_int64_t lReceivedInvalid = 0;
-	u_int64_t lTDCCalibrationMissing = 0;
-	u_int64_t lQDCCalibrationMissing = 0;
-	u_int64_t lEnergyCalibrationMissing = 0;
-	u_int64_t lXYZMissing = 0;
-	u_int64_t lSent = 0;
-	
-	for(int i = 0; i < N; i++) {
-		RawHit &in = inBuffer->get(i);
-		Hit &out = outBuffer->getWriteSlot();
-		out.raw = &in;
-		
-		uint8_t eventFlags = in.valid ? 0x0 : 0x1;
-		
-		if((in.channelID >> 12) == triggerID) {
-			// This event comes from the trigger
-			out.time = in.time;
-			out.time -= (in.tfine - 27) * 0.25;
-			out.timeEnd = out.time;
-			out.energy = (in.efine == 28) ? 1 : -1;
-			out.region = -1;
-			out.x = out.y = out.z = 0.0;
-			out.xi = out.yi = 0;
+		b.eventFlags[j] |= (ct.a1 == 0) ? 0x2 : 0x0;
+	}
+	if(!QDC_MODE) {
+		out.timeEnd = in.timeEnd;
+		if(MODE & MODE_TDC) {
+			out.timeEnd = double(in.timeEnd) - b.eQ[j] - ce.t0;
+			b.eventFlags[j] |= (ce.a1 == 0) ? 0x2 : 0x0;
 		}
-		else {
-	      		
-			SystemConfig::ChannelConfig &cc = systemConfig->getChannelConfig(in.channelID);
-			SystemConfig::TacConfig &ct = cc.tac_T[in.tacID];
-			SystemConfig::TacConfig &ce = cc.tac_E[in.tacID];
-			SystemConfig::QacConfig &cq = cc.qac_Q[in.tacID];
-			SystemConfig::EnergyConfig &cen = cc.eCal[in.tacID];
-	       
-			
-			out.time = in.time;
-			if(useTDC) {
-				float q_T = ( -ct.a1 + sqrtf((ct.a1 * ct.a1) - (4.0f * (ct.a0 - in.tfine) * ct.a2))) / (2.0f * ct.a2) ;
-				out.time = double(in.time) - q_T - ct.t0;
-				if(useTimeOffsetCal)
-					out.time -= double(cc.t0)/clockPeriod; 
-				
-				
-				if(ct.a1 == 0) eventFlags |= 0x2;
-			}
-			if(!in.qdcMode) {
-				out.timeEnd = in.timeEnd;
-				if(useTDC) {
-					float q_E = ( -ce.a1 + sqrtf((ce.a1 * ce.a1) - (4.0f * (ce.a0 - in.efine) * ce.a2))) / (2.0f * ce.a2) ;
-					out.timeEnd = double(in.timeEnd) - q_E - ce.t0;
-					if(ce.a1 == 0) eventFlags |= 0x2;
-				}
-				out.energy = out.timeEnd - out.time;
+		out.energy = out.timeEnd - out.time;
+	}
+	else {
+		out.timeEnd = in.timeEnd;
+		out.energy = in.efine;
+
+		if(MODE & MODE_QDC) {
+			SystemConfig::QdcTacConfig &qc = ctx.systemConfig->getQdcConfig(index, in.tacID);
+			SystemConfig::QacConfig &cq = qc.q;
+			float ti = (out.timeEnd - out.time);
+			const QDCInversionTable *table = (ctx.qdcInversion != NULL) ? ctx.qdcInversion->get(qc) : NULL;
+			float t_eq;
+			if(table != NULL && table->solve(in.efine, t_eq)) {
+				finishQDC<MODE>(qc, out, t_eq, ti, table, b.eventFlags[j]);
 			}
 			else {
-				
-				out.timeEnd = in.timeEnd;
-				out.energy = in.efine;
-			
-				if(useQDC) {
-				
-					float ti = (out.timeEnd - out.time);
-					
-					// Convert ADC into equivalent DC integration time t_eq
-					// Solve P(t_eq) - in.efine = 0 using Newton–Raphson method
-					// 5 iterations are more than enought
-					float p0 = cq.p0 - in.efine;
-					float t_eq = ti;
-					float delta = 0;
-					int iter = 0;
-					do {
-						float f = (cq.p0 - in.efine) +
-							cq.p1 * t_eq + 
-							cq.p2 * t_eq * t_eq + 
-							cq.p3 * t_eq * t_eq * t_eq + 
-							cq.p4 * t_eq * t_eq * t_eq * t_eq +
-							cq.p5 * t_eq * t_eq * t_eq * t_eq * t_eq + 
-							cq.p6 * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq + 
-							cq.p7 * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq + 
-							cq.p8 * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq +
-							cq.p9 * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq;
-
-						float f_ = cq.p1 +
-							cq.p2 * t_eq * 2 + 
-							cq.p3 * t_eq * t_eq * 3 + 
-							cq.p4 * t_eq * t_eq * t_eq * 4 +
-							cq.p5 * t_eq * t_eq * t_eq * t_eq * 5 + 
-							cq.p6 * t_eq * t_eq * t_eq * t_eq * t_eq * 6 + 
-							cq.p7 * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq * 7 + 
-							cq.p8 * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq * 8 +
-							cq.p9 * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq * t_eq * 9;
-
-						delta = - f / f_;
-
-						// Avoid very large steps
-						if(delta < -10.0) delta = -10.0;
-						if(delta > +10.0) delta = +10.0;
-
-						t_eq = t_eq + delta;
-						iter += 1;
-					} while ((fabs(delta) > 0.05) && (iter < 100));
-					
-					// Express energy as t_eq - actual integration time
-					// WARNING Adding 1.0 clock to shift spectrum into positive range
-					// .. needs better understanding.
-					out.energy = t_eq - ti ;
-					if(cq.p1 == 0) eventFlags |= 0x4;
-				
-					if(useEnergyCal){
-						float Energy =  cen.p0 * pow(cen.p1,pow(out.energy,cen.p2)) + cen.p3 * out.energy - cen.p0;	 
-						out.energy = Energy;
-						if(cen.p0 == 0) eventFlags |= 0x16;
-					}
-				
-				}
+				// Outside the lookup table, queue for the exact solver
+				unsigned k = b.nQDC++;
+				b.qdcIndex[k] = j;
+				b.qP[0][k] = cq.p0;
+				b.qP[1][k] = cq.p1;
+				b.qP[2][k] = cq.p2;
+				b.qP[3][k] = cq.p3;
+				b.qP[4][k] = cq.p4;
+				b.qP[5][k] = cq.p5;
+				b.qP[6][k] = cq.p6;
+				b.qP[7][k] = cq.p7;
+				b.qP[8][k] = cq.p8;
+				b.qP[9][k] = cq.p9;
+				b.qEfine[k] = in.efine;
+				b.qTi[k] = ti;
 			}
-			
-			out.region = -1;
-			out.x = out.y = out.z = 0.0;
-			out.xi = out.yi = 0;
-			if(useXYZ) {
-				out.region = cc.triggerRegion;
-				out.x = cc.x;
-				out.y = cc.y;
-				out.z = cc.z;
-				out.xi = cc.xi;
-				out.yi = cc.yi;
-				if(cc.triggerRegion == -1) eventFlags |= 0x8;
-			}
-			
 		}
-		
-			lReceived += 1;
-			if((eventFlags & 0x1) != 0) lReceivedInvalid += 1;
-			if((eventFlags & 0x2) != 0) lTDCCalibrationMissing += 1;
-			if((eventFlags & 0x4) != 0) lQDCCalibrationMissing += 1;
-			if((eventFlags & 0x8) != 0) lXYZMissing += 1;
-			if((eventFlags & 0x16) != 0) lEnergyCalibrationMissing += 1;
-
-		if(eventFlags == 0) {
+	}
+
+	if(MODE & MODE_XYZ) {
+		out.region = cg.triggerRegion;
+		out.x = cg.x;
+		out.y = cg.y;
+		out.z = cg.z;
+		out.xi = cg.xi;
+		out.yi = cg.yi;
+		b.eventFlags[j] |= (cg.triggerRegion == -1) ? 0x8 : 0x0;
+	}
+	else {
+		out.region = -1;
+		out.x = out.y = out.z = 0.0;
+		out.xi = out.yi = 0;
+	}
+}
+
+/*
+ * Calibrates b.in[0..n) into b.out[0..n) and sets their event flags (0 if the hit is to be kept).
+ * There is one instantiation per calibration mode, so the mode is not tested per hit,
+ * and hits are calibrated in one run per kind (ToT, QDC mode, trigger) instead of branching on it.
+ */
+template <unsigned MODE>
+static void calibrateBatch(const CalibrationContext &ctx, CalibrationBatch &b, unsigned n)
+{
+	// Gather the per channel coefficients for the TDC solver
+	b.nToT = b.nQDCMode = b.nTrigger = 0;
+	for(unsigned j = 0; j < n; j++) {
+		HitInput &in = b.in[j];
+		b.eventFlags[j] = in.valid ? 0x0 : 0x1;
+
+		if((in.channelID >> 12) == (unsigned)ctx.triggerID) {
+			// Trigger hits are not TDC calibrated, feed the solver a harmless lane
+			b.triggerHits[b.nTrigger++] = j;
+			b.channelIndex[j] = -1;
+			b.tA0[j] = b.eA0[j] = 0;
+			b.tA1[j] = b.eA1[j] = 0;
+			b.tA2[j] = b.eA2[j] = 1;
+			b.tFine[j] = b.eFine[j] = 0;
+			continue;
+		}
+
+		if(in.qdcMode)
+			b.qdcModeHits[b.nQDCMode++] = j;
+		else
+			b.totHits[b.nToT++] = j;
+
+		unsigned index = ctx.systemConfig->getChannelIndex(in.channelID);
+		SystemConfig::TdcTacConfig &tdc = ctx.systemConfig->getTdcConfig(index, in.tacID);
+		SystemConfig::TacConfig &ct = tdc.t;
+		SystemConfig::TacConfig &ce = tdc.e;
+		b.channelIndex[j] = index;
+		b.tA0[j] = ct.a0;
+		b.tA1[j] = ct.a1;
+		b.tA2[j] = ct.a2;
+		b.tFine[j] = in.tfine;
+		b.eA0[j] = ce.a0;
+		b.eA1[j] = ce.a1;
+		b.eA2[j] = ce.a2;
+		b.eFine[j] = in.efine;
+	}
+
+	if(MODE & MODE_TDC) {
+		CalibrationKernel::solveTDC(n, b.tA0, b.tA1, b.tA2, b.tFine, b.tQ);
+		CalibrationKernel::solveTDC(n, b.eA0, b.eA1, b.eA2, b.eFine, b.eQ);
+	}
+
+	// Apply time calibration and energy, queue QDC hits for the Newton–Raphson solver
+	b.nQDC = 0;
+	for(unsigned k = 0; k < b.nTrigger; k++)
+		calibrateTriggerHit(b, b.triggerHits[k]);
+	for(unsigned k = 0; k < b.nToT; k++)
+		calibrateHit<MODE, false>(ctx, b, b.totHits[k]);
+	for(unsigned k = 0; k < b.nQDCMode; k++)
+		calibrateHit<MODE, true>(ctx, b, b.qdcModeHits[k]);
+
+	if(!(MODE & MODE_QDC) || b.nQDC == 0)
+		return;
+
+	// Convert ADC into equivalent DC integration time t_eq
+	float *qP[10];
+	for(int k = 0; k < 10; k++) qP[k] = b.qP[k];
+	CalibrationKernel::solveQDC(b.nQDC, qP, b.qEfine, b.qTi, b.qTeq);
+
+	for(unsigned k = 0; k < b.nQDC; k++) {
+		unsigned j = b.qdcIndex[k];
+		HitInput &in = b.in[j];
+		HitOutput &out = b.out[j];
+		SystemConfig::QdcTacConfig &qc = ctx.systemConfig->getQdcConfig(b.channelIndex[j], in.tacID);
+		const QDCInversionTable *table = (ctx.qdcInversion != NULL) ? ctx.qdcInversion->get(qc) : NULL;
+		finishQDC<MODE>(qc, out, b.qTeq[k], b.qTi[k], table, b.eventFlags[j]);
+	}
+}
+
+template <unsigned... MODES>
+static std::array<CalibrateBatchFunction, N_MODES> makeCalibrateBatchTable(std::integer_sequence<unsigned, MODES...>)
+{
+	return {{ &calibrateBatch<MODES>... }};
+}
+
+// calibrateBatch() for each calibration mode
+static const std::array<CalibrateBatchFunction, N_MODES> calibrateBatchByMode = makeCalibrateBatchTable(std::make_integer_sequence<unsigned, N_MODES>());
+
+static CalibrationContext makeContext(SystemConfig *systemConfig, EventStream *eventStream)
+{
+	CalibrationContext ctx;
+	ctx.systemConfig = systemConfig;
+	ctx.triggerID = eventStream->getTriggerID();
+	ctx.clockPeriod = 1./eventStream->getFrequency()*1e12;
+	ctx.mode = 0;
+	if(systemConfig->useTDCCalibration()) ctx.mode |= MODE_TDC;
+	if(systemConfig->useQDCCalibration()) ctx.mode |= MODE_QDC;
+	if(systemConfig->useEnergyCalibration()) ctx.mode |= MODE_ENERGY;
+	if(systemConfig->useTimeOffsetCalibration()) ctx.mode |= MODE_TIME_OFFSET;
+	if(systemConfig->useXYZ()) ctx.mode |= MODE_XYZ;
+	ctx.calibrateBatch = calibrateBatchByMode[ctx.mode];
+	ctx.qdcInversion = systemConfig->getQDCInversionCache();
+	return ctx;
+}
+
+HitCalibrator::HitCalibrator(SystemConfig *systemConfig, EventStream *eventStream, StageMetrics *metrics) :
+	systemConfig(systemConfig), eventStream(eventStream), metrics(metrics)
+{
+	nReceived = metrics->counter("hits_received");
+	nReceivedInvalid = metrics->counter("hits_invalid");
+	nTDCCalibrationMissing = metrics->counter("hits_missing_tdc_calibration");
+	nQDCCalibrationMissing = metrics->counter("hits_missing_qdc_calibration");
+	nEnergyCalibrationMissing = metrics->counter("hits_missing_energy_calibration");
+	nXYZMissing = metrics->counter("hits_missing_xyz");
+	nSent = metrics->counter("hits_passed");
+}
+
+void HitCalibrator::accumulate(Counters &local)
+{
+	nReceived->add(local.nReceived);
+	nReceivedInvalid->add(local.nReceivedInvalid);
+	nTDCCalibrationMissing->add(local.nTDCCalibrationMissing);
+	nQDCCalibrationMissing->add(local.nQDCCalibrationMissing);
+	nEnergyCalibrationMissing->add(local.nEnergyCalibrationMissing);
+	nXYZMissing->add(local.nXYZMissing);
+	nSent->add(local.nSent);
+}
+
+void HitCalibrator::report()
+{
+	Metrics::Snapshot s = metrics->snapshot();
+	int64_t nReceived = metrics->get(s, "hits_received");
+	int64_t nReceivedInvalid = metrics->get(s, "hits_invalid");
+	int64_t nTDCCalibrationMissing = metrics->get(s, "hits_missing_tdc_calibration");
+	int64_t nQDCCalibrationMissing = metrics->get(s, "hits_missing_qdc_calibration");
+	int64_t nEnergyCalibrationMissing = metrics->get(s, "hits_missing_energy_calibration");
+	int64_t nXYZMissing = metrics->get(s, "hits_missing_xyz");
+	int64_t nSent = metrics->get(s, "hits_passed");
+	fprintf(stderr, " hits received\n");
+	fprintf(stderr, "  %10ld total\n", nReceived);
+	fprintf(stderr, "  %10ld (%4.1f%%) invalid\n", nReceivedInvalid, 100.0 * nReceivedInvalid / nReceived);
+	fprintf(stderr, " hits dropped\n");
+	fprintf(stderr, "  %10ld (%4.1f%%) missing TDC calibration\n", nTDCCalibrationMissing, 100.0 * nTDCCalibrationMissing / nReceived);
+	fprintf(stderr, "  %10ld (%4.1f%%) missing QDC calibration\n", nQDCCalibrationMissing, 100.0 * nQDCCalibrationMissing / nReceived);
+	if(systemConfig->useEnergyCalibration())
+		fprintf(stderr, "  %10ld (%4.1f%%) missing Energy calibration\n", nEnergyCalibrationMissing, 100.0 * nEnergyCalibrationMissing / nReceived);
+	fprintf(stderr, "  %10ld (%4.1f%%) missing XYZ information\n", nXYZMissing, 100.0 * nXYZMissing / nReceived);
+	fprintf(stderr, " hits passed\n");
+	fprintf(stderr, "  %10ld (%4.1f%%)\n", nSent, 100.0 * nSent / nReceived);
+	if(systemConfig->getQDCInversionCache() != NULL)
+		systemConfig->getQDCInversionCache()->report();
+}
+
+void HitCalibrator::calibrate(RawHit *hits, unsigned N, EventBuffer<Hit> *outBuffer, Counters &counters)
+{
+	CalibrationContext ctx = makeContext(systemConfig, eventStream);
+
+	CalibrationBatch batch;
+	for(unsigned begin = 0; begin < N; begin += CalibrationBatch::SIZE) {
+		unsigned n = std::min(N - begin, CalibrationBatch::SIZE);
+		for(unsigned j = 0; j < n; j++) {
+			RawHit &in = hits[begin + j];
+			HitInput hi = { in.valid, in.qdcMode, in.time, in.timeEnd, in.channelID, in.tfine, in.efine, in.tacID };
+			batch.in[j] = hi;
+		}
+
+		ctx.calibrateBatch(ctx, batch, n);
+
+		for(unsigned j = 0; j < n; j++) {
+			uint8_t eventFlags = batch.eventFlags[j];
+			counters.account(eventFlags);
+			if(eventFlags != 0) continue;
+
+			HitOutput &ho = batch.out[j];
+			Hit &out = outBuffer->getWriteSlot();
+			out.raw = &hits[begin + j];
+			out.time = ho.time;
+			out.timeEnd = ho.timeEnd;
+			out.energy = ho.energy;
+			out.region = ho.region;
+			out.xi = ho.xi;
+			out.yi = ho.yi;
+			out.x = ho.x;
+			out.y = ho.y;
+			out.z = ho.z;
 			out.valid = true;
 			outBuffer->pushWriteSlot();
-			lSent += 1;
 		}
 	}
-	
-	atomicAdd(nReceived, lReceived);
-	atomicAdd(nReceivedInvalid, lReceivedInvalid);
-	atomicAdd(nTDCCalibrationMissing, lTDCCalibrationMissing);
-	atomicAdd(nQDCCalibrationMissing, lQDCCalibrationMissing);
-	atomicAdd(nEnergyCalibrationMissing, lEnergyCalibrationMissing);	
-	atomicAdd(nXYZMissing, lXYZMissing);
-	atomicAdd(nSent, lSent);
-	
+}
+
+ProcessHit::ProcessHit(SystemConfig *systemConfig, EventStream *eventStream, EventSink<Hit> *sink) :
+UnorderedEventHandler<RawHit, Hit>(sink, "ProcessHit"), calibrator(systemConfig, eventStream, metrics)
+{
+}
+
+EventBuffer<Hit> * ProcessHit::handleEvents (EventBuffer<RawHit> *inBuffer)
+{
+	// TODO Add instrumentation
+	unsigned N =  inBuffer->getSize();
+
+	EventBuffer<Hit> * outBuffer = new EventBuffer<Hit>(N, inBuffer);
+
+	HitCalibrator::Counters counters;
+	calibrator.calibrate(inBuffer->getPtr(), N, outBuffer, counters);
+
+	calibrator.accumulate(counters);
 	return outBuffer;
 }
 
 void ProcessHit::report()
 {
 	fprintf(stderr, ">> ProcessHit report\n");
-	fprintf(stderr, " hits received\n");
-	fprintf(stderr, "  %10lu total\n", nReceived);
-	fprintf(stderr, "  %10lu (%4.1f%%) invalid\n", nReceivedInvalid, 100.0 * nReceivedInvalid / nReceived);
-	fprintf(stderr, " hits dropped\n");
-	fprintf(stderr, "  %10lu (%4.1f%%) missing TDC calibration\n", nTDCCalibrationMissing, 100.0 * nTDCCalibrationMissing / nReceived);
-	fprintf(stderr, "  %10lu (%4.1f%%) missing QDC calibration\n", nQDCCalibrationMissing, 100.0 * nQDCCalibrationMissing / nReceived);
-	if(systemConfig->useEnergyCalibration())
-		fprintf(stderr, "  %10lu (%4.1f%%) missing Energy calibration\n", nEnergyCalibrationMissing, 100.0 * nEnergyCalibrationMissing / nReceived);
-	fprintf(stderr, "  %10lu (%4.1f%%) missing XYZ information\n", nXYZMissing, 100.0 * nXYZMissing / nReceived);
-	fprintf(stderr, " hits passed\n");
-	fprintf(stderr, "  %10lu (%4.1f%%)\n", nSent, 100.0 * nSent / nReceived);
-	
+	calibrator.report();
 	UnorderedEventHandler<RawHit, Hit>::report();
 }
+
+ColumnarProcessHit::ColumnarProcessHit(SystemConfig *systemConfig, EventStream *eventStream, EventSink<HitColumns> *sink) :
+UnorderedEventHandler<RawHitColumns, HitColumns>(sink, "ColumnarProcessHit"), calibrator(systemConfig, eventStream, metrics)
+{
+}
+
+EventBuffer<HitColumns> * ColumnarProcessHit::handleEvents (EventBuffer<RawHitColumns> *inBuffer)
+{
+	unsigned N =  inBuffer->getSize();
+
+	EventBuffer<HitColumns> * outBuffer = new EventBuffer<HitColumns>(N, inBuffer, inBuffer);
+
+	CalibrationContext ctx = makeContext(calibrator.getSystemConfig(), calibrator.getEventStream());
+	HitCalibrator::Counters counters;
+
+	CalibrationBatch batch;
+	size_t used = 0;
+	for(unsigned begin = 0; begin < N; begin += CalibrationBatch::SIZE) {
+		unsigned n = std::min(N - begin, CalibrationBatch::SIZE);
+		for(unsigned j = 0; j < n; j++) {
+			unsigned i = begin + j;
+			HitInput hi = {
+				inBuffer->valid[i], inBuffer->qdcMode[i],
+				inBuffer->time[i], inBuffer->timeEnd[i],
+				inBuffer->channelID[i],
+				inBuffer->tfine[i], inBuffer->efine[i], inBuffer->tacID[i]
+			};
+			batch.in[j] = hi;
+		}
+
+		ctx.calibrateBatch(ctx, batch, n);
+
+		for(unsigned j = 0; j < n; j++) {
+			uint8_t eventFlags = batch.eventFlags[j];
+			HitOutput &ho = batch.out[j];
+			counters.account(eventFlags);
+
+			// Always write the row, only advance the output when the hit is kept
+			outBuffer->time[used] = ho.time;
+			outBuffer->timeEnd[used] = ho.timeEnd;
+			outBuffer->energy[used] = ho.energy;
+			outBuffer->channelID[used] = batch.in[j].channelID;
+			outBuffer->rawIndex[used] = begin + j;
+			outBuffer->region[used] = ho.region;
+			outBuffer->xi[used] = ho.xi;
+			outBuffer->yi[used] = ho.yi;
+			outBuffer->x[used] = ho.x;
+			outBuffer->y[used] = ho.y;
+			outBuffer->z[used] = ho.z;
+			outBuffer->valid[used] = true;
+			used += (eventFlags == 0) ? 1 : 0;
+		}
+	}
+	outBuffer->setUsed(used);
+
+	calibrator.accumulate(counters);
+	return outBuffer;
+}
+
+void ColumnarProcessHit::report()
+{
+	fprintf(stderr, ">> ColumnarProcessHit report\n");
+	calibrator.report();
+	UnorderedEventHandler<RawHitColumns, HitColumns>::report();
+}
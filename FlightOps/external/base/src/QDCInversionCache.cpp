@@ -0,0 +1,155 @@
+#include "QDCInversionCache.h"
+#include <math.h>
+#include <stdio.h>
+
+using namespace PETSYS;
+
+QDCInversionTable QDCInversionCache::unavailable;
+
+// Newton–Raphson steps used to fill the tables, much tighter than the per hit solver's 0.05
+static const float TABLE_STOP_STEP = 1E-3;
+static const int TABLE_MAX_ITERATIONS = 100;
+
+static inline float polynomial(SystemConfig::QacConfig &cq, float t)
+{
+	return (((((((((cq.p9 * t + cq.p8) * t + cq.p7) * t + cq.p6) * t + cq.p5) * t + cq.p4) * t + cq.p3) * t + cq.p2) * t + cq.p1) * t + cq.p0);
+}
+
+static inline float derivative(SystemConfig::QacConfig &cq, float t)
+{
+	return ((((((((9 * cq.p9 * t + 8 * cq.p8) * t + 7 * cq.p7) * t + 6 * cq.p6) * t + 5 * cq.p5) * t + 4 * cq.p4) * t + 3 * cq.p3) * t + 2 * cq.p2) * t + cq.p1);
+}
+
+// Solves P(t) = efine from start, returns false if it did not converge
+static bool solve(SystemConfig::QacConfig &cq, float efine, float start, float &t)
+{
+	t = start;
+	for(int iter = 0; iter < TABLE_MAX_ITERATIONS; iter++) {
+		float delta = - (polynomial(cq, t) - efine) / derivative(cq, t);
+		if(delta < -10.0) delta = -10.0;
+		if(delta > +10.0) delta = +10.0;
+		t = t + delta;
+		if(fabsf(delta) < TABLE_STOP_STEP) return true;
+	}
+	return false;
+}
+
+QDCInversionCache::QDCInversionCache(Settings settings, bool useEnergyCalibration) :
+	settings(settings), useEnergyCalibration(useEnergyCalibration),
+	bytesUsed(0), nBuilt(0), nOverBudget(0), nNotInvertible(0)
+{
+	pthread_mutex_init(&lock, NULL);
+}
+
+QDCInversionCache::~QDCInversionCache()
+{
+	for(auto table : tables) {
+		delete [] table->energy;
+		delete table;
+	}
+	pthread_mutex_destroy(&lock);
+}
+
+size_t QDCInversionCache::getTableBytes()
+{
+	size_t bytes = sizeof(QDCInversionTable);
+	if(useEnergyCalibration)
+		bytes += sizeof(float) * (unsigned)((settings.energyMax - settings.energyMin) / settings.energyStep + 1);
+	return bytes;
+}
+
+QDCInversionTable *QDCInversionCache::build(SystemConfig::QdcTacConfig &qc)
+{
+	size_t bytes = getTableBytes();
+	QDCInversionTable *table = &unavailable;
+
+	if(qc.q.p1 == 0) {
+		// No QDC calibration for this channel, hits will be dropped anyway
+	}
+	else if(bytesUsed.fetch_add(bytes) + bytes > settings.maxBytes) {
+		bytesUsed -= bytes;
+		nOverBudget += 1;
+	}
+	else {
+		table = makeTable(qc.q, qc.energy);
+		if(table == NULL) {
+			bytesUsed -= bytes;
+			nNotInvertible += 1;
+			table = &unavailable;
+		}
+	}
+
+	// Another thread may have built this one meanwhile
+	QDCInversionTable *expected = NULL;
+	if(!__atomic_compare_exchange_n(&qc.qdcInversion, &expected, table, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		if(table != &unavailable) {
+			delete [] table->energy;
+			delete table;
+			bytesUsed -= bytes;
+		}
+		return expected;
+	}
+
+	if(table != &unavailable) {
+		nBuilt += 1;
+		pthread_mutex_lock(&lock);
+		tables.push_back(table);
+		pthread_mutex_unlock(&lock);
+	}
+	return table;
+}
+
+QDCInversionTable *QDCInversionCache::makeTable(SystemConfig::QacConfig &cq, SystemConfig::EnergyConfig &cen)
+{
+	QDCInversionTable *table = new QDCInversionTable();
+
+	// Each solution starts from the previous one
+	float start = 0;
+	float tLast = NAN;
+	bool valid = true;
+	for(unsigned efine = 0; efine < QDCInversionTable::N_EFINE; efine++) {
+		float t;
+		if(!solve(cq, efine, start, t)) {
+			table->tEq[efine] = NAN;
+			continue;
+		}
+		table->tEq[efine] = t;
+		start = t;
+
+		// Only a monotonic P has a single root, which the per hit solver finds from any starting point
+		if(derivative(cq, t) <= 0) valid = false;
+		if(tLast == tLast) {
+			if(t <= tLast) valid = false;
+			if(derivative(cq, 0.5f * (t + tLast)) <= 0) valid = false;
+		}
+		tLast = t;
+	}
+
+	if(!valid) {
+		delete table;
+		return NULL;
+	}
+
+	table->energy = NULL;
+	table->nEnergy = 0;
+	table->energyMin = settings.energyMin;
+	table->energyInvStep = 1.0f / settings.energyStep;
+	if(useEnergyCalibration) {
+		table->nEnergy = (unsigned)((settings.energyMax - settings.energyMin) / settings.energyStep + 1);
+		table->energy = new float[table->nEnergy];
+		for(unsigned i = 0; i < table->nEnergy; i++) {
+			float e = settings.energyMin + i * settings.energyStep;
+			table->energy[i] = cen.p0 * pow(cen.p1,pow(e,cen.p2)) + cen.p3 * e - cen.p0;
+		}
+	}
+	return table;
+}
+
+void QDCInversionCache::report()
+{
+	u_int64_t bytes = bytesUsed;
+	fprintf(stderr, " QDC inversion tables\n");
+	fprintf(stderr, "  %10lu built (%4.1f MiB of %4.1f MiB)\n", (u_int64_t)nBuilt, bytes / 1048576.0, settings.maxBytes / 1048576.0);
+	fprintf(stderr, "  %10lu over memory budget, using exact solver\n", (u_int64_t)nOverBudget);
+	fprintf(stderr, "  %10lu not invertible, using exact solver\n", (u_int64_t)nNotInvertible);
+}
@@ -1,24 +1,36 @@
 #include "SimpleGrouper.h"
 #include <vector>
+#include <algorithm>
 #include <math.h>
 
 using namespace PETSYS;
 using namespace std;
 
 SimpleGrouper::SimpleGrouper(SystemConfig *systemConfig, EventSink<GammaPhoton> *sink) :
-	systemConfig(systemConfig), UnorderedEventHandler<Hit, GammaPhoton>(sink)
+	systemConfig(systemConfig), UnorderedEventHandler<Hit, GammaPhoton>(sink, "SimpleGrouper")
 {
-	for(int i = 0; i < GammaPhoton::maxHits; i++)
-		nPhotonsHits[i] = 0;
-	
-	nHitsReceived = 0;
-	nHitsReceivedValid = 0;
-	nPhotonsFound = 0;
-	nPhotonsHitsOverflow = 0;
-	nPhotonsHitsUnderflow = 0;
-	nPhotonsLowEnergy = 0;
-	nPhotonsHighEnergy = 0;
-	nPhotonsPassed = 0;
+	nHitsReceived = metrics->counter("hits_received");
+	nHitsReceivedValid = metrics->counter("hits_valid");
+	nPhotonsFound = metrics->counter("photons_found");
+	nPhotonsHits = metrics->histogram("photon_hits", Metrics::Histogram::LINEAR, GammaPhoton::maxHits + 1);
+	nPhotonsHitsOverflow = metrics->counter("photons_hits_overflow");
+	nPhotonsHitsUnderflow = metrics->counter("photons_hits_underflow");
+	nPhotonsLowEnergy = metrics->counter("photons_low_energy");
+	nPhotonsHighEnergy = metrics->counter("photons_high_energy");
+	nPhotonsPassed = metrics->counter("photons_passed");
+	nOverlapsStitched = metrics->counter("overlaps_stitched");
+	nOverlapsSplit = metrics->counter("overlaps_split");
+
+	// Multi-hit neighbours of each trigger region, used by the indexed engine
+	unsigned nRegions = systemConfig->getNTriggerRegions();
+	neighbourStart.push_back(0);
+	for(unsigned r = 0; r < nRegions; r++) {
+		for(unsigned r2 = 0; r2 < nRegions; r2++) {
+			if(systemConfig->isMultiHitAllowed(r2, r))
+				neighbours.push_back(r2);
+		}
+		neighbourStart.push_back(neighbours.size());
+	}
 }
 
 SimpleGrouper::~SimpleGrouper()
@@ -31,96 +43,224 @@ void SimpleGrouper::report()
 	if (maxHits > GammaPhoton::maxHits) maxHits = maxHits;
 	int minHits = systemConfig->sw_trigger_group_min_hits;
 
+	Metrics::Snapshot s = metrics->snapshot();
+	int64_t nHitsReceived = metrics->get(s, "hits_received");
+	int64_t nHitsReceivedValid = metrics->get(s, "hits_valid");
+	int64_t nPhotonsFound = metrics->get(s, "photons_found");
+	const Metrics::Value *nPhotonsHits = s.find(metrics->getStage(), "photon_hits");
+	int64_t nPhotonsHitsOverflow = metrics->get(s, "photons_hits_overflow");
+	int64_t nPhotonsHitsUnderflow = metrics->get(s, "photons_hits_underflow");
+	int64_t nPhotonsLowEnergy = metrics->get(s, "photons_low_energy");
+	int64_t nPhotonsHighEnergy = metrics->get(s, "photons_high_energy");
+	int64_t nPhotonsPassed = metrics->get(s, "photons_passed");
+	int64_t nOverlapsStitched = metrics->get(s, "overlaps_stitched");
+	int64_t nOverlapsSplit = metrics->get(s, "overlaps_split");
+
 	fprintf(stderr, ">> SimpleGrouper report\n");
 	fprintf(stderr, " hits received\n");
-	fprintf(stderr, "  %10lu total\n", nHitsReceived);
-	fprintf(stderr, "  %10lu (%4.1f%%) invalid\n", nHitsReceived - nHitsReceivedValid, 100.0 * (nHitsReceived - nHitsReceivedValid)/nHitsReceived);
+	fprintf(stderr, "  %10ld total\n", nHitsReceived);
+	fprintf(stderr, "  %10ld (%4.1f%%) invalid\n", nHitsReceived - nHitsReceivedValid, 100.0 * (nHitsReceived - nHitsReceivedValid)/nHitsReceived);
 	fprintf(stderr, " photons found\n");
-	fprintf(stderr, "  %10lu total\n", nPhotonsFound);
-	for(int i = 0; i < maxHits; i++) {
-		float fraction = nPhotonsHits[i]/((float)nPhotonsFound);
+	fprintf(stderr, "  %10ld total\n", nPhotonsFound);
+	for(int i = 0; nPhotonsHits != NULL && i < maxHits && i+1 < (int)nPhotonsHits->buckets.size(); i++) {
+		float fraction = nPhotonsHits->buckets[i+1]/((float)nPhotonsFound);
 		if(fraction > 0.05) {
-			fprintf(stderr, "  %10lu (%4.1f%%) with %d hits\n", nPhotonsHits[i], 100.0*fraction, i+1);
+			fprintf(stderr, "  %10lu (%4.1f%%) with %d hits\n", nPhotonsHits->buckets[i+1], 100.0*fraction, i+1);
 		}
 	}
 	fprintf(stderr, "  %4.1f hits/photon\n", float(nHitsReceived)/nPhotonsFound);
 	fprintf(stderr, " photons rejected\n");
-	fprintf(stderr, "  %10lu (%4.1f%%) with more than %d hits\n", nPhotonsHitsOverflow, 100.0*nPhotonsHitsOverflow/nPhotonsFound, maxHits);
-	fprintf(stderr, "  %10lu (%4.1f%%) with less than %d hits\n", nPhotonsHitsUnderflow, 100.0*nPhotonsHitsUnderflow/nPhotonsFound, minHits);
-	fprintf(stderr, "  %10lu (%4.1f%%) failed minimum energy\n", nPhotonsLowEnergy, 100.0*nPhotonsLowEnergy/nPhotonsFound);
-	fprintf(stderr, "  %10lu (%4.1f%%) failed maximim energy\n", nPhotonsHighEnergy, 100.0*nPhotonsHighEnergy/nPhotonsFound);
+	fprintf(stderr, "  %10ld (%4.1f%%) with more than %d hits\n", nPhotonsHitsOverflow, 100.0*nPhotonsHitsOverflow/nPhotonsFound, maxHits);
+	fprintf(stderr, "  %10ld (%4.1f%%) with less than %d hits\n", nPhotonsHitsUnderflow, 100.0*nPhotonsHitsUnderflow/nPhotonsFound, minHits);
+	fprintf(stderr, "  %10ld (%4.1f%%) failed minimum energy\n", nPhotonsLowEnergy, 100.0*nPhotonsLowEnergy/nPhotonsFound);
+	fprintf(stderr, "  %10ld (%4.1f%%) failed maximim energy\n", nPhotonsHighEnergy, 100.0*nPhotonsHighEnergy/nPhotonsFound);
 	fprintf(stderr, " photons passed\n");
-	fprintf(stderr, "  %10lu (%4.1f%%) passed\n", nPhotonsPassed, 100.0*nPhotonsPassed/nPhotonsFound);
+	fprintf(stderr, "  %10ld (%4.1f%%) passed\n", nPhotonsPassed, 100.0*nPhotonsPassed/nPhotonsFound);
+	if(nOverlapsStitched + nOverlapsSplit > 0) {
+		fprintf(stderr, " buffer overlaps\n");
+		fprintf(stderr, "  %10ld cut at a gap\n", nOverlapsStitched);
+		fprintf(stderr, "  %10ld (%4.1f%%) without a gap, split at the buffer boundary\n", nOverlapsSplit, 100.0*nOverlapsSplit/(nOverlapsStitched + nOverlapsSplit));
+	}
 			
 	UnorderedEventHandler<Hit, GammaPhoton>::report();
 }
 
-EventBuffer<GammaPhoton> * SimpleGrouper::handleEvents(EventBuffer<Hit> *inBuffer)
+struct GroupParameters {
+	double timeWindow1;
+	float radius2;
+	float minEnergy;
+	float maxEnergy;
+	int maxHits;
+	int minHits;
+};
+
+struct GroupCounters {
+	u_int64_t *lPhotonsHits;
+	u_int64_t lHitsReceived;
+	u_int64_t lHitsReceivedValid;
+	u_int64_t lPhotonsFound;
+	u_int64_t lPhotonsHitsOverflow;
+	u_int64_t lPhotonsHitsUnderflow;
+	u_int64_t lPhotonsLowEnergy;
+	u_int64_t lPhotonsHighEnergy;
+	u_int64_t lPhotonsPassed;
+};
+
+// Scratch space reused by each worker thread
+static thread_local vector<char> taken;
+static thread_local vector<unsigned> regionStart;
+static thread_local vector<unsigned> regionHits;
+static thread_local vector<unsigned> regionCursor;
+static thread_local vector<unsigned> candidates;
+
+/*
+ * Puts hits in order of decreasing energy, keeping the order of hits with equal energy.
+ * This is the order the original bubble sort produced: the highest energy hit is selected
+ * and moved to the front, and the remaining hits are only sorted if they are not yet in order.
+ * NaN energies do not have a well defined order, so the bubble sort is kept for those.
+ */
+static void sortByEnergy(Hit **hits, int nHits)
+{
+	bool hasNaN = false;
+	int kMax = 0;
+	for(int k = 0; k < nHits; k++) {
+		float e = hits[k]->energy;
+		if(e != e) hasNaN = true;
+		if(e > hits[kMax]->energy) kMax = k;
+	}
+
+	if(hasNaN) {
+		bool sorted = false;
+		while(!sorted) {
+			sorted = true;
+			for(int k = 1; k < nHits; k++) {
+				if(hits[k-1]->energy < hits[k]->energy) {
+					sorted = false;
+					Hit *tmp = hits[k-1];
+					hits[k-1] = hits[k];
+					hits[k] = tmp;
+				}
+			}
+		}
+		return;
+	}
+
+	rotate(hits, hits + kMax, hits + kMax + 1);
+	for(int k = 2; k < nHits; k++) {
+		if(hits[k-1]->energy < hits[k]->energy) {
+			stable_sort(hits + 1, hits + nHits, [](Hit *a, Hit *b) { return a->energy > b->energy; });
+			break;
+		}
+	}
+}
+
+/*
+ * Builds a photon from its hits, nHits may exceed p.maxHits in which case
+ * only the first p.maxHits hits are in hits[].
+ * hits[] is the free space at the end of hitIndex, which is kept if the photon is passed.
+ */
+static void emitPhoton(Hit **hits, int nHits, const GroupParameters &p, EventBuffer<Hit *> *hitIndex, EventBuffer<GammaPhoton> *outBuffer, GroupCounters &c)
 {
+	uint8_t eventFlags = 0x0;
+	if(nHits > p.maxHits) {
+		// Flag this event has having excessive hits	
+		eventFlags |= 0x1;
+		// and set the number of hits to maximum hits, as code below depends on it
+		nHits = p.maxHits;
+	}
+	else if (nHits < p.minHits) {
+		eventFlags |= 0x8;
+	}
 	
-	double timeWindow1 = systemConfig->sw_trigger_group_time_window;
-	float radius2 = (systemConfig->sw_trigger_group_max_distance)*(systemConfig->sw_trigger_group_max_distance);
-	float minEnergy = systemConfig->sw_trigger_group_min_energy;
-	float maxEnergy = systemConfig->sw_trigger_group_max_energy;
-	int maxHits = systemConfig->sw_trigger_group_max_hits;
-	if (maxHits > GammaPhoton::maxHits) maxHits = maxHits;
-	int minHits = systemConfig->sw_trigger_group_min_hits;
+	// Put highest energy hit first
+	sortByEnergy(hits, nHits);
+	
+	// Assemble the output structure
+	GammaPhoton &photon = outBuffer->getWriteSlot();
+	photon.hits = hits;
+	photon.nHits = nHits;
+	photon.region = photon.hits[0]->region;
+	photon.time = photon.hits[0]->time;
+	photon.x = photon.hits[0]->x;
+	photon.y = photon.hits[0]->y;
+	photon.z = photon.hits[0]->z;
+	photon.energy = photon.hits[0]->energy;
+
+	if(photon.energy < p.minEnergy) eventFlags |= 0x2;
+	if(photon.energy > p.maxEnergy) eventFlags |= 0x4;
 
 	
-	u_int64_t lPhotonsHits[maxHits];
-	for(int i = 0; i < maxHits; i++) {
-		lPhotonsHits[i] = 0;
+	// Count photons
+	c.lPhotonsFound += 1;
+	if((eventFlags & 0x1) == 0) {
+		c.lPhotonsHits[photon.nHits-1] += 1;
 	}
+	else {
+		c.lPhotonsHitsOverflow += 1;
+	}
+
+	if((eventFlags & 0x8) != 0) c.lPhotonsHitsUnderflow += 1;
 	
-	u_int64_t lHitsReceived = 0;
-	u_int64_t lHitsReceivedValid = 0;
-	u_int64_t lPhotonsFound = 0;
-	u_int64_t lPhotonsHitsOverflow = 0;
-	u_int64_t lPhotonsHitsUnderflow = 0;
-	u_int64_t lPhotonsLowEnergy = 0;
-	u_int64_t lPhotonsHighEnergy = 0;
-	u_int64_t lPhotonsPassed = 0;
+	if((eventFlags & 0x2) != 0) c.lPhotonsLowEnergy += 1;
+	if((eventFlags & 0x4) != 0) c.lPhotonsHighEnergy += 1;
+	
+	if(eventFlags == 0) {
+		c.lPhotonsPassed += 1;
+		photon.valid = true;
+		outBuffer->pushWriteSlot();
+		hitIndex->setUsed(hitIndex->getSize() + nHits);
+	}
+}
 
-	unsigned N =  inBuffer->getSize();
-	EventBuffer<GammaPhoton> * outBuffer = new EventBuffer<GammaPhoton>(N, inBuffer);
-	vector<bool> taken(N, false);
-	Hit * hits[maxHits];
+// Visiting one neighbour region costs about as much as checking this many hits
+static const unsigned NEIGHBOUR_COST = 2;
+
+static inline bool isNear(Hit &hit, Hit &hit2, const GroupParameters &p)
+{
+	if(fabs(hit.time - hit2.time) > p.timeWindow1) return false;
+
+	float u = hit.x - hit2.x;
+	float v = hit.y - hit2.y;
+	float w = hit.z - hit2.z;
+	float d2 = u*u + v*v + w*w;
+	return d2 <= p.radius2;
+}
+
+// Compares each seed hit with all following hits, until one is too late
+static void groupScan(SystemConfig *systemConfig, Hit *buffer, unsigned N, const GroupParameters &p, EventBuffer<Hit *> *hitIndex, EventBuffer<GammaPhoton> *outBuffer, GroupCounters &c)
+{
+	taken.assign(N, 0);
 	
 	for(unsigned i = 0; i < N; i++) {
 		// Do accounting first
-		Hit &hit = inBuffer->get(i);
-		lHitsReceived += 1;
+		Hit &hit = buffer[i];
+		c.lHitsReceived += 1;
 
 		if(!hit.valid) continue;
-		lHitsReceivedValid += 1;
+		c.lHitsReceivedValid += 1;
 
 		if (taken[i]) continue;
 		taken[i] = true;
 			
-		uint8_t eventFlags = 0x0;
+		// Hits are gathered directly into the hit index, which has room for every hit in the buffer
+		Hit **hits = hitIndex->getPtr() + hitIndex->getSize();
 		hits[0] = &hit;
 		int nHits = 1;
 				
 		for(int j = i+1; j < N; j++) {
-			Hit &hit2 = inBuffer->get(j);
+			Hit &hit2 = buffer[j];
 			if(!hit2.valid) continue;
 
 			if(taken[j]) continue;
 			
 			// Stop searching for more hits for this photon
-			if((hit2.time - hit.time) > (timeWindow1 + MAX_UNORDER)) break;
+			if((hit2.time - hit.time) > (p.timeWindow1 + MAX_UNORDER)) break;
 			
 			if(!systemConfig->isMultiHitAllowed(hit2.region, hit.region)) continue;
-			if(fabs(hit.time - hit2.time) > timeWindow1) continue;
-
-			float u = hit.x - hit2.x;
-			float v = hit.y - hit2.y;
-			float w = hit.z - hit2.z;
-			float d2 = u*u + v*v + w*w;
-			if(d2 > radius2) continue;
+			if(!isNear(hit, hit2, p)) continue;
 			
 			taken[j] = true;
-			if(nHits >= maxHits) {
+			if(nHits >= p.maxHits) {
 				// Increase the hit count but don't actually add a hit
 				nHits++;
 			}
@@ -129,83 +269,241 @@ EventBuffer<GammaPhoton> * SimpleGrouper::handleEvents(EventBuffer<Hit> *inBuffe
 				nHits++;
 			}
 		}
-		
-		if(nHits > maxHits) {
-			// Flag this event has having excessive hits	
-			eventFlags |= 0x1;
-			// and set the number of hits to maximum hits, as code below depends on it
-			nHits = maxHits;
+
+		emitPhoton(hits, nHits, p, hitIndex, outBuffer, c);
+	}
+}
+
+/*
+ * Same photons as groupScan, but only visiting candidates from the seed's neighbour regions.
+ *
+ * Valid hits are bucketed by trigger region, in buffer order. For each seed the time slice
+ * to search is the buffer range up to the hit where groupScan would stop: the first later
+ * valid hit not yet taken which is more than timeWindow1 + MAX_UNORDER after the seed.
+ * That limit only moves forward while seeds come in time order, so it is found incrementally.
+ */
+static void groupIndexed(SystemConfig *systemConfig, const vector<unsigned> &neighbourStart, const vector<unsigned> &neighbours,
+		Hit *buffer, unsigned N, const GroupParameters &p, EventBuffer<Hit *> *hitIndex, EventBuffer<GammaPhoton> *outBuffer, GroupCounters &c)
+{
+	unsigned nRegions = neighbourStart.size() - 1;
+	double scanLimit = p.timeWindow1 + MAX_UNORDER;
+
+	taken.assign(N, 0);
+	regionStart.assign(nRegions + 1, 0);
+	for(unsigned i = 0; i < N; i++) {
+		Hit &hit = buffer[i];
+		if(hit.valid && (unsigned)hit.region < nRegions)
+			regionStart[hit.region + 1] += 1;
+	}
+	for(unsigned r = 0; r < nRegions; r++)
+		regionStart[r + 1] += regionStart[r];
+	regionCursor.assign(regionStart.begin(), regionStart.end() - 1);
+	regionHits.resize(regionStart[nRegions]);
+	for(unsigned i = 0; i < N; i++) {
+		Hit &hit = buffer[i];
+		if(hit.valid && (unsigned)hit.region < nRegions)
+			regionHits[regionCursor[hit.region]++] = i;
+	}
+	regionCursor.assign(regionStart.begin(), regionStart.end() - 1);
+
+	unsigned sliceEnd = 0;
+	double sliceSeedTime = 0;
+
+	for(unsigned i = 0; i < N; i++) {
+		// Do accounting first
+		Hit &hit = buffer[i];
+		c.lHitsReceived += 1;
+
+		if(!hit.valid) continue;
+		c.lHitsReceivedValid += 1;
+
+		if (taken[i]) continue;
+		taken[i] = true;
+
+		// Hits before the previous limit were either not eligible or not too late for the previous seed,
+		// so they are not too late for this one if it is not earlier
+		unsigned j = (sliceEnd > i && hit.time >= sliceSeedTime) ? sliceEnd : i + 1;
+		for(; j < N; j++) {
+			Hit &hit2 = buffer[j];
+			if(!hit2.valid || taken[j]) continue;
+			if((hit2.time - hit.time) > scanLimit) break;
 		}
-		else if (nHits < minHits) {
-			eventFlags |= 0x8;
+		sliceEnd = j;
+		sliceSeedTime = hit.time;
+
+		// Candidates from each neighbour region, in buffer order within the region.
+		// When visiting the neighbour regions costs more than the slice has hits, the slice is walked instead.
+		candidates.clear();
+		bool merged = false;
+		unsigned nNeighbours = 0;
+		if((unsigned)hit.region < nRegions)
+			nNeighbours = neighbourStart[hit.region + 1] - neighbourStart[hit.region];
+
+		if(nNeighbours * NEIGHBOUR_COST > sliceEnd - i) {
+			for(unsigned j2 = i + 1; j2 < sliceEnd; j2++) {
+				Hit &hit2 = buffer[j2];
+				if(!hit2.valid || taken[j2]) continue;
+				if(!systemConfig->isMultiHitAllowed(hit2.region, hit.region)) continue;
+				if(!isNear(hit, hit2, p)) continue;
+				candidates.push_back(j2);
+			}
 		}
-		
-		// Buble sorting to put highest energy event first
-		bool sorted = false;
-		while(!sorted) {
-			sorted = true;
-			for(int k = 1; k < nHits; k++) {
-				if(hits[k-1]->energy < hits[k]->energy) {
-					sorted = false;
-					Hit *tmp = hits[k-1];
-					hits[k-1] = hits[k];
-					hits[k] = tmp;
+		else if(nNeighbours > 0) {
+			for(unsigned n = neighbourStart[hit.region]; n < neighbourStart[hit.region + 1]; n++) {
+				unsigned r = neighbours[n];
+				unsigned k = regionCursor[r];
+				unsigned end = regionStart[r + 1];
+				while(k < end && regionHits[k] <= i) k++;
+				regionCursor[r] = k;
+
+				size_t before = candidates.size();
+				for(; k < end && regionHits[k] < sliceEnd; k++) {
+					unsigned j2 = regionHits[k];
+					if(taken[j2]) continue;
+					if(!isNear(hit, buffer[j2], p)) continue;
+					candidates.push_back(j2);
 				}
+				if(before > 0 && candidates.size() > before) merged = true;
 			}
 		}
-		
-		
-		// Assemble the output structure
-		GammaPhoton &photon = outBuffer->getWriteSlot();
-		for(int k = 0; k < nHits; k++) {
-			photon.hits[k] = hits[k];
-		}
-		
-		photon.nHits = nHits;
-		photon.region = photon.hits[0]->region;
-		photon.time = photon.hits[0]->time;
-		photon.x = photon.hits[0]->x;
-		photon.y = photon.hits[0]->y;
-		photon.z = photon.hits[0]->z;
-		photon.energy = photon.hits[0]->energy;
-
-		if(photon.energy < minEnergy) eventFlags |= 0x2;
-		if(photon.energy > maxEnergy) eventFlags |= 0x4;
-
-		
-		// Count photons
-		lPhotonsFound += 1;
-		if((eventFlags & 0x1) == 0) {
-			lPhotonsHits[photon.nHits-1] += 1;
-		}
-		else {
-			lPhotonsHitsOverflow += 1;
+		if(merged) sort(candidates.begin(), candidates.end());
+
+		// Hits are gathered directly into the hit index, which has room for every hit in the buffer
+		Hit **hits = hitIndex->getPtr() + hitIndex->getSize();
+		hits[0] = &hit;
+		int nHits = 1;
+		for(unsigned j2 : candidates) {
+			taken[j2] = true;
+			if(nHits >= p.maxHits) {
+				// Increase the hit count but don't actually add a hit
+				nHits++;
+			}
+			else {
+				hits[nHits] = &buffer[j2];
+				nHits++;
+			}
 		}
 
-		if((eventFlags & 0x8) != 0) lPhotonsHitsUnderflow += 1;
-		
-		if((eventFlags & 0x2) != 0) lPhotonsLowEnergy += 1;
-		if((eventFlags & 0x4) != 0) lPhotonsHighEnergy += 1;
-		
-		if(eventFlags == 0) {
-			lPhotonsPassed += 1;
-			photon.valid = true;
-			outBuffer->pushWriteSlot();
+		emitPhoton(hits, nHits, p, hitIndex, outBuffer, c);
+	}
+}
+
+/*
+ * Buffer overlap (see RawReader::setBufferOverlap)
+ *
+ * A buffer with a trailing overlap and the next buffer both hold the hits of the overlap frames.
+ * Both cut the overlap at the same point: the first hit more than the overlap gap after every earlier hit,
+ * or the end of the overlap if there is no hit in the last gap. Hits before the overlap are earlier than its start.
+ * Hits before the cut belong to the first buffer, the others to the next one.
+ * The cut only depends on the integer coarse times of the overlap hits, which both buffers have in the same order
+ * (CoarseSorter), so they always agree and no hit is grouped twice.
+ * The gap is wider than the grouping and coincidence searches, so no photon or coincidence can span the cut
+ * and results do not depend on where the buffers were split.
+ * An overlap without such a gap is cut at its start, which is where the buffers were split without overlap.
+ */
+static long long getOverlapGap(SystemConfig *systemConfig)
+{
+	// Calibrated times are taken to be within MAX_UNORDER/2 of the coarse time
+	double window = max(systemConfig->sw_trigger_group_time_window, systemConfig->sw_trigger_coincidence_time_window);
+	return (long long)ceil(window + 3 * MAX_UNORDER);
+}
+
+unsigned SimpleGrouper::getBufferOverlapFrames(SystemConfig *systemConfig)
+{
+	// Leave room for a few gaps, so a cut is usually found
+	long long gap = getOverlapGap(systemConfig);
+	return (4 * gap) / 1024 + 1;
+}
+
+// First hit with coarse time t or later
+static unsigned findCoarseTime(Hit *buffer, unsigned N, long long t)
+{
+	return lower_bound(buffer, buffer + N, t, [](const Hit &hit, long long t) { return hit.raw->time < t; }) - buffer;
+}
+
+// Cut of the overlap [begin, end), in coarse time relative to the buffer
+static long long findOverlapCut(Hit *buffer, unsigned N, long long begin, long long end, long long gap, bool &found)
+{
+	long long last = begin;
+	for(unsigned i = findCoarseTime(buffer, N, begin); i < N; i++) {
+		long long t = buffer[i].raw->time;
+		if(t >= end) break;
+		if(t - last > gap) {
+			found = true;
+			return t;
 		}
+		last = t;
 	}
+	found = (end - last) > gap;
+	return found ? end : begin;
+}
+
+EventBuffer<GammaPhoton> * SimpleGrouper::handleEvents(EventBuffer<Hit> *inBuffer)
+{
+	GroupParameters p;
+	p.timeWindow1 = systemConfig->sw_trigger_group_time_window;
+	p.radius2 = (systemConfig->sw_trigger_group_max_distance)*(systemConfig->sw_trigger_group_max_distance);
+	p.minEnergy = systemConfig->sw_trigger_group_min_energy;
+	p.maxEnergy = systemConfig->sw_trigger_group_max_energy;
+	p.maxHits = systemConfig->sw_trigger_group_max_hits;
+	if (p.maxHits > GammaPhoton::maxHits) p.maxHits = p.maxHits;
+	p.minHits = systemConfig->sw_trigger_group_min_hits;
+
+	u_int64_t lPhotonsHits[p.maxHits];
+	for(int i = 0; i < p.maxHits; i++) {
+		lPhotonsHits[i] = 0;
+	}
+
+	GroupCounters c;
+	c.lPhotonsHits = lPhotonsHits;
+	c.lHitsReceived = 0;
+	c.lHitsReceivedValid = 0;
+	c.lPhotonsFound = 0;
+	c.lPhotonsHitsOverflow = 0;
+	c.lPhotonsHitsUnderflow = 0;
+	c.lPhotonsLowEnergy = 0;
+	c.lPhotonsHighEnergy = 0;
+	c.lPhotonsPassed = 0;
 
-	for(int i = 0; i < maxHits; i++)
-		atomicAdd(nPhotonsHits[i], lPhotonsHits[i]);
+	// Only group the hits this buffer owns
+	Hit *buffer = inBuffer->getPtr();
+	unsigned N =  inBuffer->getSize();
+	unsigned begin = 0;
+	unsigned end = N;
+	long long gap = getOverlapGap(systemConfig);
+	bool found;
+	if(inBuffer->hasLeadingOverlap()) {
+		long long cut = findOverlapCut(buffer, N, 0, inBuffer->getLeadingOverlapEnd() - inBuffer->getTMin(), gap, found);
+		begin = findCoarseTime(buffer, N, cut);
+	}
+	if(inBuffer->hasTrailingOverlap()) {
+		long long cut = findOverlapCut(buffer, N, inBuffer->getTrailingOverlapBegin() - inBuffer->getTMin(),
+				inBuffer->getTrailingOverlapEnd() - inBuffer->getTMin(), gap, found);
+		end = max(begin, findCoarseTime(buffer, N, cut));
+		(found ? nOverlapsStitched : nOverlapsSplit)->increment();
+	}
+
+	// Each hit belongs to at most one photon, so N entries are enough for the hit index
+	EventBuffer<Hit *> * hitIndex = new EventBuffer<Hit *>(N, inBuffer);
+	EventBuffer<GammaPhoton> * outBuffer = new EventBuffer<GammaPhoton>(N, hitIndex);
+	if(systemConfig->sw_trigger_group_engine == SystemConfig::GROUP_ENGINE_INDEXED)
+		groupIndexed(systemConfig, neighbourStart, neighbours, buffer + begin, end - begin, p, hitIndex, outBuffer, c);
+	else
+		groupScan(systemConfig, buffer + begin, end - begin, p, hitIndex, outBuffer, c);
+
+	for(int i = 0; i < p.maxHits; i++) {
+		if(lPhotonsHits[i] != 0)
+			nPhotonsHits->record(i+1, lPhotonsHits[i]);
+	}
 	
-	atomicAdd(nHitsReceived, lHitsReceived);
-	atomicAdd(nHitsReceivedValid, lHitsReceivedValid);
-	atomicAdd(nPhotonsFound, lPhotonsFound);
-	atomicAdd(nPhotonsHitsOverflow, lPhotonsHitsOverflow);
-	atomicAdd(nPhotonsHitsUnderflow, lPhotonsHitsUnderflow);
-	atomicAdd(nPhotonsLowEnergy, lPhotonsLowEnergy);
-	atomicAdd(nPhotonsHighEnergy, lPhotonsHighEnergy);
-	atomicAdd(nPhotonsPassed, lPhotonsPassed);
+	nHitsReceived->add(c.lHitsReceived);
+	nHitsReceivedValid->add(c.lHitsReceivedValid);
+	nPhotonsFound->add(c.lPhotonsFound);
+	nPhotonsHitsOverflow->add(c.lPhotonsHitsOverflow);
+	nPhotonsHitsUnderflow->add(c.lPhotonsHitsUnderflow);
+	nPhotonsLowEnergy->add(c.lPhotonsLowEnergy);
+	nPhotonsHighEnergy->add(c.lPhotonsHighEnergy);
+	nPhotonsPassed->add(c.lPhotonsPassed);
 	
 	return outBuffer;
 }
-
@@ -1,12 +1,15 @@
 #include "SystemConfig.h"
+#include "QDCInversionCache.h"
 #include <stdio.h>
 #include <assert.h>
 #include <errno.h>
 #include <boost/regex.hpp>
 #include <string.h>
+#include <strings.h>
 #include <libgen.h>
 #include <limits.h>
 #include <string>
+#include <vector>
 #include <boost/algorithm/string/replace.hpp>
 #include <sstream>
 
@@ -127,6 +130,18 @@ SystemConfig *SystemConfig::fromFile(const char *configFileName, u_int64_t mask)
 	}
 
 	// Load trigger configuration
+	const char *groupEngine = iniparser_getstring(configFile, "sw_trigger:group_engine", "scan");
+	if(strcasecmp(groupEngine, "indexed") == 0) {
+		config->sw_trigger_group_engine = GROUP_ENGINE_INDEXED;
+	}
+	else if(strcasecmp(groupEngine, "scan") == 0) {
+		config->sw_trigger_group_engine = GROUP_ENGINE_SCAN;
+	}
+	else {
+		std::ostringstream oss;
+		oss << "ERROR: unknown group_engine '" << groupEngine << "' in section 'sw_trigger' of '" << configFileName << "'";
+		throw std::runtime_error(oss.str());
+	}
 	 config->sw_trigger_group_max_hits = iniparser_getint(configFile, "sw_trigger:group_max_hits", 64);
 	 config->sw_trigger_group_min_hits = iniparser_getint(configFile, "sw_trigger:group_min_hits", 1);
 	 config->sw_trigger_group_min_energy = iniparser_getdouble(configFile, "sw_trigger:group_min_energy", -1E6);
@@ -134,7 +149,83 @@ SystemConfig *SystemConfig::fromFile(const char *configFileName, u_int64_t mask)
 	 config->sw_trigger_group_max_distance = iniparser_getdouble(configFile, "sw_trigger:group_max_distance", 100.0);
 	 config->sw_trigger_group_time_window = iniparser_getdouble(configFile, "sw_trigger:group_time_window", 20.0);
 	 config->sw_trigger_coincidence_time_window =  iniparser_getdouble(configFile, "sw_trigger:coincidence_time_window", 2.0);
+	const char *coincidenceEngine = iniparser_getstring(configFile, "sw_trigger:coincidence_engine", "scan");
+	if(strcasecmp(coincidenceEngine, "indexed") == 0) {
+		config->sw_trigger_coincidence_engine = COINCIDENCE_ENGINE_INDEXED;
+	}
+	else if(strcasecmp(coincidenceEngine, "scan") == 0) {
+		config->sw_trigger_coincidence_engine = COINCIDENCE_ENGINE_SCAN;
+	}
+	else {
+		std::ostringstream oss;
+		oss << "ERROR: unknown coincidence_engine '" << coincidenceEngine << "' in section 'sw_trigger' of '" << configFileName << "'";
+		throw std::runtime_error(oss.str());
+	}
+	config->sw_trigger_coincidence_max_photons = iniparser_getint(configFile, "sw_trigger:coincidence_max_photons", 2);
+	if(config->sw_trigger_coincidence_max_photons < 2) {
+		std::ostringstream oss;
+		oss << "ERROR: coincidence_max_photons must be at least 2 in section 'sw_trigger' of '" << configFileName << "'";
+		throw std::runtime_error(oss.str());
+	}
+
+	// Processing pipeline configuration
+	config->processing_fused_decode = iniparser_getboolean(configFile, "processing:fused_decode", 0) != 0;
+	config->processing_trace_file_prefix = iniparser_getstring(configFile, "processing:trace_file_prefix", (char *)"");
+	config->processing_trace_events_per_thread = iniparser_getint(configFile, "processing:trace_events_per_thread", 65536);
+	if(config->processing_trace_events_per_thread < 1) {
+		std::ostringstream oss;
+		oss << "ERROR: trace_events_per_thread must be at least 1 in section 'processing' of '" << configFileName << "'";
+		throw std::runtime_error(oss.str());
+	}
+	config->processing_buffer_size = iniparser_getint(configFile, "processing:buffer_size", 4096);
+	config->processing_buffer_size_min = iniparser_getint(configFile, "processing:buffer_size_min", 1024);
+	config->processing_buffer_size_max = iniparser_getint(configFile, "processing:buffer_size_max", 32768);
+	if(config->processing_buffer_size < 0 || config->processing_buffer_size_min < 1
+		|| config->processing_buffer_size_max < config->processing_buffer_size_min) {
+		std::ostringstream oss;
+		oss << "ERROR: buffer_size must be 0 or more and 1 <= buffer_size_min <= buffer_size_max in section 'processing' of '" << configFileName << "'";
+		throw std::runtime_error(oss.str());
+	}
+	config->processing_parallel_steps = iniparser_getint(configFile, "processing:parallel_steps", 1);
+	if(config->processing_parallel_steps < 1) {
+		std::ostringstream oss;
+		oss << "ERROR: parallel_steps must be at least 1 in section 'processing' of '" << configFileName << "'";
+		throw std::runtime_error(oss.str());
+	}
+	config->processing_affinity.nWorkers = iniparser_getint(configFile, "processing:workers", 0);
+	if(config->processing_affinity.nWorkers < 0) {
+		std::ostringstream oss;
+		oss << "ERROR: workers must be 0 or more in section 'processing' of '" << configFileName << "'";
+		throw std::runtime_error(oss.str());
+	}
+	const char *cpusKeys[Affinity::N_ROLES] = { "processing:reader_cpus", "processing:worker_cpus", "processing:writer_cpus" };
+	for(int role = 0; role < Affinity::N_ROLES; role++) {
+		const char *cpus = iniparser_getstring(configFile, cpusKeys[role], (char *)"");
+		if(!Affinity::parseCPUList(cpus, config->processing_affinity.cpus[role])) {
+			std::ostringstream oss;
+			oss << "ERROR: invalid CPU list '" << cpus << "' for " << (cpusKeys[role] + strlen("processing:")) << " in section 'processing' of '" << configFileName << "'";
+			throw std::runtime_error(oss.str());
+		}
+	}
+
+	// QDC inversion lookup tables
+	if(config->hasQDCCalibration) {
+		QDCInversionCache::Settings settings;
+		settings.maxBytes = (size_t)(iniparser_getdouble(configFile, "qdc_lookup:max_memory", 256) * 1048576);
+		settings.energyMin = iniparser_getdouble(configFile, "qdc_lookup:energy_min", -64.0);
+		settings.energyMax = iniparser_getdouble(configFile, "qdc_lookup:energy_max", 960.0);
+		settings.energyStep = iniparser_getdouble(configFile, "qdc_lookup:energy_step", 0.5);
+		if(settings.energyStep <= 0 || settings.energyMax <= settings.energyMin) {
+			std::ostringstream oss;
+			oss << "ERROR: invalid energy range in section 'qdc_lookup' of '" << configFileName << "'";
+			throw std::runtime_error(oss.str());
+		}
+		if(settings.maxBytes > 0)
+			config->qdcInversionCache = new QDCInversionCache(settings, config->hasEnergyCalibration);
+	}
 	
+	config->buildChannelIndex();
+
 	iniparser_freedict(configFile);
 	delete [] fn;
 	delete [] path;
@@ -160,6 +251,13 @@ SystemConfig::SystemConfig()
 	hasTDCCalibration = false;
 	hasQDCCalibration = false;
 	hasXYZ = false;
+	qdcInversionCache = NULL;
+	processing_fused_decode = false;
+	processing_trace_events_per_thread = 65536;
+	processing_buffer_size = 4096;
+	processing_buffer_size_min = 1024;
+	processing_buffer_size_max = 32768;
+	processing_parallel_steps = 1;
 	
 	channelConfig = new ChannelConfig *[PATH_MAX];
 	for(unsigned n = 0; n < PATH_MAX; n++) {
@@ -184,17 +282,100 @@ SystemConfig::SystemConfig()
 		nullChannelConfig.t0 = 0.0;
 	}
 	
-	coincidenceTriggerMap = new bool[MAX_TRIGGER_REGIONS * MAX_TRIGGER_REGIONS];
-	for(int i = 0; i < MAX_TRIGGER_REGIONS * MAX_TRIGGER_REGIONS; i++)
-		coincidenceTriggerMap[i] = false;
-	
-	multihitTriggerMap = new bool[MAX_TRIGGER_REGIONS * MAX_TRIGGER_REGIONS];
-	for(int i = 0; i < MAX_TRIGGER_REGIONS * MAX_TRIGGER_REGIONS; i++)
-		multihitTriggerMap[i] = false;
+	// Filled by loadTriggerMap()
+	nTriggerRegions = 0;
+	coincidenceTriggerMap = NULL;
+	multihitTriggerMap = NULL;
+
+	channelIndex = new unsigned *[PATH_MAX];
+	for(unsigned n = 0; n < PATH_MAX; n++) {
+		channelIndex[n] = NULL;
+	}
+	tdcConfig = NULL;
+	qdcConfig = NULL;
+	channelGeometry = NULL;
+	buildChannelIndex();
+}
+
+void SystemConfig::freeChannelIndex()
+{
+	for(unsigned n = 0; n < PATH_MAX; n++) {
+		delete [] channelIndex[n];
+		channelIndex[n] = NULL;
+	}
+	delete [] tdcConfig;
+	delete [] qdcConfig;
+	delete [] channelGeometry;
+	tdcConfig = NULL;
+	qdcConfig = NULL;
+	channelGeometry = NULL;
+}
+
+/*
+ * Numbers the configured channels densely, in channelID order, and copies
+ * their configuration into the per hit arrays.
+ * Channels left with nullChannelConfig all share NULL_CHANNEL_INDEX.
+ */
+void SystemConfig::buildChannelIndex()
+{
+	freeChannelIndex();
+
+	nChannels = 1;
+	for(unsigned n = 0; n < PATH_MAX; n++) {
+		if(channelConfig[n] == NULL) continue;
+		for(unsigned i = 0; i < 4096; i++) {
+			if(memcmp(&channelConfig[n][i], &nullChannelConfig, sizeof(ChannelConfig)) != 0) nChannels += 1;
+		}
+	}
+
+	tdcConfig = new TdcTacConfig[nChannels * 4];
+	if(hasQDCCalibration) qdcConfig = new QdcTacConfig[nChannels * 4];
+	channelGeometry = new ChannelGeometry[nChannels];
+
+	copyChannel(NULL_CHANNEL_INDEX, nullChannelConfig);
+	unsigned index = NULL_CHANNEL_INDEX + 1;
+	for(unsigned n = 0; n < PATH_MAX; n++) {
+		if(channelConfig[n] == NULL) continue;
+		channelIndex[n] = new unsigned[4096];
+		for(unsigned i = 0; i < 4096; i++) {
+			ChannelConfig &cc = channelConfig[n][i];
+			if(memcmp(&cc, &nullChannelConfig, sizeof(ChannelConfig)) == 0) {
+				channelIndex[n][i] = NULL_CHANNEL_INDEX;
+				continue;
+			}
+			channelIndex[n][i] = index;
+			copyChannel(index, cc);
+			index += 1;
+		}
+	}
+}
+
+void SystemConfig::copyChannel(unsigned index, ChannelConfig &cc)
+{
+	for(unsigned tacID = 0; tacID < 4; tacID++) {
+		tdcConfig[index * 4 + tacID].t = cc.tac_T[tacID];
+		tdcConfig[index * 4 + tacID].e = cc.tac_E[tacID];
+		if(qdcConfig != NULL) {
+			qdcConfig[index * 4 + tacID].q = cc.qac_Q[tacID];
+			qdcConfig[index * 4 + tacID].energy = cc.eCal[tacID];
+			qdcConfig[index * 4 + tacID].qdcInversion = NULL;
+		}
+	}
+	ChannelGeometry &g = channelGeometry[index];
+	g.x = cc.x;
+	g.y = cc.y;
+	g.z = cc.z;
+	g.xi = cc.xi;
+	g.yi = cc.yi;
+	g.triggerRegion = cc.triggerRegion;
+	g.t0 = cc.t0;
 }
 
 SystemConfig::~SystemConfig()
 {
+	delete qdcInversionCache;
+	freeChannelIndex();
+	delete [] channelIndex;
 	delete [] multihitTriggerMap;
 	delete [] coincidenceTriggerMap;
 	
@@ -203,7 +384,7 @@ SystemConfig::~SystemConfig()
 			delete [] channelConfig[n];
 		}
 	}
-	delete channelConfig;
+	delete [] channelConfig;
 }
 
 
@@ -440,6 +621,14 @@ void SystemConfig::loadTriggerMap(SystemConfig *config, const char *fn)
     oss << "Could not open '" << fn << "' for reading: " << strerror(errno);
     throw std::runtime_error(oss.str());
 	}
+	struct TriggerMapEntry {
+		unsigned r1;
+		unsigned r2;
+		char c;
+	};
+	std::vector<TriggerMapEntry> entries;
+	unsigned nRegions = 0;
+
 	char line[PATH_MAX];
 	int lineNumber = 0;
 	while(fscanf(f, "%[^\n]\n", line) == 1) {
@@ -474,10 +663,35 @@ void SystemConfig::loadTriggerMap(SystemConfig *config, const char *fn)
       throw std::runtime_error(oss.str());
 		}
 		
-		config->coincidenceTriggerMap[r1 * MAX_TRIGGER_REGIONS + r2] = (c == 'C');
-		config->coincidenceTriggerMap[r2 * MAX_TRIGGER_REGIONS + r1] = (c == 'C');
-		config->multihitTriggerMap[r1 * MAX_TRIGGER_REGIONS + r2] = (c == 'M');
-		config->multihitTriggerMap[r2 * MAX_TRIGGER_REGIONS + r1] = (c == 'M');
+		TriggerMapEntry entry = { (unsigned)r1, (unsigned)r2, c };
+		entries.push_back(entry);
+		if((unsigned)r1 >= nRegions) nRegions = r1 + 1;
+		if((unsigned)r2 >= nRegions) nRegions = r2 + 1;
 	}
 	fclose(f);
+
+	// Size the maps to the regions actually used
+	size_t nWords = ((size_t)nRegions * nRegions + 63) / 64;
+	delete [] config->coincidenceTriggerMap;
+	delete [] config->multihitTriggerMap;
+	config->nTriggerRegions = nRegions;
+	config->coincidenceTriggerMap = new u_int64_t[nWords]();
+	config->multihitTriggerMap = new u_int64_t[nWords]();
+
+	for(auto &e : entries) {
+		setTriggerMap(config->coincidenceTriggerMap, nRegions, e.r1, e.r2, e.c == 'C');
+		setTriggerMap(config->coincidenceTriggerMap, nRegions, e.r2, e.r1, e.c == 'C');
+		setTriggerMap(config->multihitTriggerMap, nRegions, e.r1, e.r2, e.c == 'M');
+		setTriggerMap(config->multihitTriggerMap, nRegions, e.r2, e.r1, e.c == 'M');
+	}
+}
+
+void SystemConfig::setTriggerMap(u_int64_t *map, unsigned nRegions, unsigned r1, unsigned r2, bool value)
+{
+	unsigned bit = r1 * nRegions + r2;
+	u_int64_t mask = 1ULL << (bit % 64);
+	if(value)
+		map[bit / 64] |= mask;
+	else
+		map[bit / 64] &= ~mask;
 }
@@ -1,7 +1,9 @@
 #define __PETSYS_THREADPOOL_CPP__DEFINED__
 #include "ThreadPool.h"
+#include "Affinity.h"
 #include <unistd.h>
 #include <stdio.h>
+#include <sched.h>
 #include <climits>
 
 using namespace PETSYS;
@@ -9,32 +11,130 @@ using namespace std;
 
 
 namespace PETSYS {
-	BaseThreadPool::BaseThreadPool() {
+
+	/*
+	 * Bounded multi-producer/multi-consumer lock-free queue (D. Vyukov's algorithm).
+	 * The owning worker and any thief dequeue from the same end,
+	 * which keeps jobs roughly in submission (sequence number) order.
+	 */
+	class BaseThreadPool::JobQueue {
+	public:
+		JobQueue(size_t minCapacity) {
+			size_t capacity = 2;
+			while(capacity < minCapacity) capacity *= 2;
+			mask = capacity - 1;
+			cells = new cell_t[capacity];
+			for(size_t i = 0; i < capacity; i++)
+				cells[i].sequence.store(i, memory_order_relaxed);
+			enqueuePos.store(0, memory_order_relaxed);
+			dequeuePos.store(0, memory_order_relaxed);
+		};
+
+		~JobQueue() {
+			delete [] cells;
+		};
+
+		bool push(const job_t &job) {
+			size_t pos = enqueuePos.load(memory_order_relaxed);
+			cell_t *cell;
+			while(true) {
+				cell = &cells[pos & mask];
+				size_t seq = cell->sequence.load(memory_order_acquire);
+				intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+				if(dif == 0) {
+					if(enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+						break;
+				}
+				else if(dif < 0) {
+					// Queue is full
+					return false;
+				}
+				else {
+					pos = enqueuePos.load(memory_order_relaxed);
+				}
+			}
+			cell->job = job;
+			cell->sequence.store(pos + 1, memory_order_release);
+			return true;
+		};
+
+		bool pop(job_t &job) {
+			size_t pos = dequeuePos.load(memory_order_relaxed);
+			cell_t *cell;
+			while(true) {
+				cell = &cells[pos & mask];
+				size_t seq = cell->sequence.load(memory_order_acquire);
+				intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+				if(dif == 0) {
+					if(dequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+						break;
+				}
+				else if(dif < 0) {
+					// Queue is empty
+					return false;
+				}
+				else {
+					pos = dequeuePos.load(memory_order_relaxed);
+				}
+			}
+			job = cell->job;
+			cell->sequence.store(pos + mask + 1, memory_order_release);
+			return true;
+		};
+
+	private:
+		struct cell_t {
+			std::atomic<size_t> sequence;
+			job_t job;
+		};
+
+		cell_t *cells;
+		size_t mask;
+		alignas(64) std::atomic<size_t> enqueuePos;
+		alignas(64) std::atomic<size_t> dequeuePos;
+	};
+
+
+	BaseThreadPool::BaseThreadPool(int nWorkers, int maxQueueSize) {
 		auto nCPU = sysconf(_SC_NPROCESSORS_ONLN);
 
-		queue = std::deque<job_t>();
-		maxQueueSize = nCPU/4;
+		if(maxQueueSize <= 0) maxQueueSize = nCPU/4;
 		if(maxQueueSize < 1) maxQueueSize = 1;
+		this->maxQueueSize = maxQueueSize;
+
+		if(nWorkers <= 0) nWorkers = Affinity::getDefaultNWorkers();
+		if(nWorkers < 1) nWorkers = 1;
+		this->nWorkers = nWorkers;
+
+		nextWorker = 0;
+		nQueued = 0;
+		nIdleWaiting = 0;
+
+		mQueued = Metrics::gauge("ThreadPool", "queued");
+		mRunning = Metrics::gauge("ThreadPool", "running");
+		mAdmissionWaits = Metrics::counter("ThreadPool", "admission_waits");
 
 		terminate = false;
 		pthread_mutex_init(&lock, NULL);
 		pthread_cond_init(&cond_queued, NULL);
-		pthread_cond_init(&cond_dequeued, NULL);
-		pthread_cond_init(&cond_completed, NULL);
 
-		nWorkers = nCPU;
+		// Admission is not atomic with respect to concurrent producers,
+		// so leave some headroom over maxQueueSize in each worker queue
+		size_t queueCapacity = 2 * maxQueueSize + 16;
+
 		workers = new worker_t[nWorkers];
 		for(int i = 0; i < nWorkers; i++) {
 			workers[i].pool = this;
-			workers[i].isBusy = false;
+			workers[i].index = i;
+			workers[i].queue = new JobQueue(queueCapacity);
+		}
+		for(int i = 0; i < nWorkers; i++) {
 			pthread_create(&workers[i].thread, NULL, thread_routine, &workers[i]);
 		}
 
 	};
-	
-	BaseThreadPool::~BaseThreadPool() {
-		this->completeQueue();
 
+	BaseThreadPool::~BaseThreadPool() {
 		pthread_mutex_lock(&lock);
 		terminate = true;
 		pthread_cond_broadcast(&cond_queued);
@@ -44,75 +144,194 @@ namespace PETSYS {
 			pthread_join(workers[i].thread, NULL);
 		}
 
+		for(int i = 0; i < nWorkers; i++) {
+			delete workers[i].queue;
+		}
 		delete [] workers;
 
-		pthread_cond_destroy(&cond_completed);
-		pthread_cond_destroy(&cond_dequeued);
 		pthread_cond_destroy(&cond_queued);
 		pthread_mutex_destroy(&lock);
 	}
-	
-	void BaseThreadPool::queueTask(void *buffer, void *sink)
+
+	BaseThreadPool *BaseThreadPool::getShared()
 	{
-		pthread_mutex_lock(&lock);
-		while(queue.size() >= maxQueueSize) {
-			pthread_cond_wait(&cond_dequeued, &lock);
+		static BaseThreadPool *shared = new BaseThreadPool();
+		return shared;
+	}
+
+	void BaseThreadPool::queueJob(const job_t &job)
+	{
+		nQueued += 1;
+		mQueued->add(1);
+		unsigned target = nextWorker.fetch_add(1, memory_order_relaxed);
+		while(!workers[target % nWorkers].queue->push(job)) {
+			// Only possible with several producers racing past admission, or several groups
+			target += 1;
+			if((target % nWorkers) == 0) sched_yield();
 		}
-		
-		job_t job = {
-				.b = buffer,
-				.s = sink
-			};
 
-		queue.push_back(job);
-		pthread_cond_signal(&cond_queued);
-		pthread_mutex_unlock(&lock);
+		if(nIdleWaiting.load() > 0) {
+			pthread_mutex_lock(&lock);
+			pthread_cond_signal(&cond_queued);
+			pthread_mutex_unlock(&lock);
+		}
 	}
-	
-	void BaseThreadPool::completeQueue()
+
+	bool BaseThreadPool::findJob(worker_t *self, job_t &job)
 	{
-		pthread_mutex_lock(&lock);
-		while (!queue.empty()) {
-			pthread_cond_wait(&cond_dequeued, &lock);
-		}
+		// Own queue first, then try to steal from the other workers
+		if(self->queue->pop(job))
+			return true;
 
-		for(int i = 0; i < nWorkers; i++) {
-			if(workers[i].isBusy) {
-				pthread_cond_wait(&cond_completed, &lock);
-			}	
+		for(int i = 1; i < nWorkers; i++) {
+			worker_t *victim = &workers[(self->index + i) % nWorkers];
+			if(victim->queue->pop(job))
+				return true;
 		}
-		pthread_mutex_unlock(&lock);
-	}	
+		return false;
+	}
 
 	void * BaseThreadPool::thread_routine(void *arg)
 	{
 		worker_t *self = (worker_t *)arg;
 		BaseThreadPool *pool = self->pool;
+		const int maxSpins = 64;
 
-		pthread_mutex_lock(&pool->lock);
-		while(!pool->terminate) {
-			if(pool->queue.empty()) {
-				pthread_cond_wait(&pool->cond_queued, &pool->lock);
+		Affinity::pinThread(Affinity::WORKER, self->index);
+
+		if(Trace::isEnabled()) {
+			char name[32];
+			snprintf(name, sizeof(name), "ThreadPool worker %d", self->index);
+			Trace::setThreadName(name);
+		}
+
+		int spins = 0;
+		while(true) {
+			job_t job;
+			if(pool->findJob(self, job)) {
+				spins = 0;
+				pool->nQueued -= 1;
+				pool->mQueued->add(-1);
+				pool->mRunning->add(1);
+				job.group->dequeued();
+
+				u_int64_t t0 = Metrics::now();
+				job.run(job.b, job.s);
+				pool->mRunning->add(-1);
+				job.group->completed(Metrics::now() - t0);
 				continue;
 			}
 
-			auto job = pool->queue.front();
-			pool->queue.pop_front();
-			self->isBusy = true;
-			pthread_cond_signal(&pool->cond_dequeued);
-			pthread_mutex_unlock(&pool->lock);
-			
-			pool->runTask(job.b, job.s);
+			if(pool->terminate.load())
+				break;
+
+			// A job may be in flight between admission and push; spin briefly before parking
+			if(spins < maxSpins) {
+				spins += 1;
+				sched_yield();
+				continue;
+			}
+			spins = 0;
 
 			pthread_mutex_lock(&pool->lock);
-			self->isBusy = false;
-			pthread_cond_signal(&pool->cond_completed);
+			pool->nIdleWaiting += 1;
+			while(pool->nQueued.load() == 0 && !pool->terminate.load()) {
+				pthread_cond_wait(&pool->cond_queued, &pool->lock);
+			}
+			pool->nIdleWaiting -= 1;
+			pthread_mutex_unlock(&pool->lock);
 		}
-		pthread_mutex_unlock(&pool->lock);
 		return NULL;
 	}
-	
-	
-	
-}
 
+
+	TaskGroup::TaskGroup(BaseThreadPool *pool, int maxQueueSize) :
+		pool(pool)
+	{
+		this->maxQueueSize = (maxQueueSize > 0) ? maxQueueSize : pool->getMaxQueueSize();
+		nQueued = 0;
+		nPending = 0;
+		nTasksCompleted = 0;
+		busyTime = 0;
+		nAdmissionWaiting = 0;
+		nCompletionWaiting = 0;
+		nCompleting = 0;
+		pthread_cond_init(&cond_dequeued, NULL);
+		pthread_cond_init(&cond_completed, NULL);
+	}
+
+	TaskGroup::~TaskGroup()
+	{
+		complete();
+		pthread_cond_destroy(&cond_completed);
+		pthread_cond_destroy(&cond_dequeued);
+	}
+
+	void TaskGroup::queueJob(void *buffer, void *sink, void (*run)(void *, void *))
+	{
+		// Backpressure: wait for workers to pick up some jobs of this group
+		if(nQueued.load() >= maxQueueSize) {
+			pool->mAdmissionWaits->increment();
+			pthread_mutex_lock(&pool->lock);
+			nAdmissionWaiting += 1;
+			while(nQueued.load() >= maxQueueSize) {
+				pthread_cond_wait(&cond_dequeued, &pool->lock);
+			}
+			nAdmissionWaiting -= 1;
+			pthread_mutex_unlock(&pool->lock);
+		}
+
+		BaseThreadPool::job_t job = {
+				.b = buffer,
+				.s = sink,
+				.run = run,
+				.group = this
+			};
+
+		nPending += 1;
+		nQueued += 1;
+		pool->queueJob(job);
+	}
+
+	void TaskGroup::dequeued()
+	{
+		nQueued -= 1;
+		if(nAdmissionWaiting.load() > 0) {
+			pthread_mutex_lock(&pool->lock);
+			pthread_cond_signal(&cond_dequeued);
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+
+	void TaskGroup::completed(u_int64_t time)
+	{
+		// complete() waits for nCompleting too, as the group may be deleted as soon as it returns
+		nCompleting += 1;
+		busyTime.fetch_add(time, memory_order_relaxed);
+		nTasksCompleted.fetch_add(1, memory_order_relaxed);
+		if((nPending -= 1) == 0 && nCompletionWaiting.load() > 0) {
+			pthread_mutex_lock(&pool->lock);
+			pthread_cond_broadcast(&cond_completed);
+			pthread_mutex_unlock(&pool->lock);
+		}
+		nCompleting -= 1;
+	}
+
+	void TaskGroup::complete()
+	{
+		if(nPending.load() > 0) {
+			pthread_mutex_lock(&pool->lock);
+			nCompletionWaiting += 1;
+			while (nPending.load() > 0) {
+				pthread_cond_wait(&cond_completed, &pool->lock);
+			}
+			nCompletionWaiting -= 1;
+			pthread_mutex_unlock(&pool->lock);
+		}
+
+		// The last worker may still be signalling
+		while(nCompleting.load() > 0)
+			sched_yield();
+	}
+
+}
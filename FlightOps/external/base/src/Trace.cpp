@@ -0,0 +1,214 @@
+#include "Trace.h"
+#include "Metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <string>
+#include <vector>
+#include <set>
+
+using namespace PETSYS;
+using namespace std;
+
+std::atomic<bool> Trace::enabled(false);
+
+namespace {
+
+	struct Event {
+		u_int64_t time;			// ns, Metrics::now()
+		const char *name;
+		u_int64_t seqN;
+		u_int64_t size;
+		char phase;			// 'B', 'E' or 'i', as in the trace format
+	};
+
+	// Events of one thread, the oldest being overwritten when full
+	struct Ring {
+		Event *events;
+		size_t capacity;
+		atomic<u_int64_t> head;		// Events written so far
+		long tid;
+		string threadName;
+		atomic<bool> retired;		// The thread has exited
+
+		Ring(size_t capacity) : capacity(capacity), head(0), retired(false) {
+			events = new Event[capacity];
+			tid = syscall(SYS_gettid);
+		};
+		~Ring() {
+			delete [] events;
+		};
+	};
+
+	struct Registry {
+		pthread_mutex_t lock;
+		vector<Ring *> rings;
+		set<string> names;
+		size_t eventsPerThread;
+
+		Registry() {
+			pthread_mutex_init(&lock, NULL);
+			eventsPerThread = Trace::DEFAULT_EVENTS_PER_THREAD;
+		};
+	};
+
+	// Never destroyed: thread_local rings are retired into it during exit
+	Registry &registry()
+	{
+		static Registry *r = new Registry();
+		return *r;
+	}
+
+	// Ring of the calling thread, created on its first event and kept until written out after the thread exits
+	struct LocalRing {
+		Ring *ring;
+
+		LocalRing() : ring(NULL) {};
+		~LocalRing() {
+			if(ring != NULL) ring->retired.store(true, memory_order_release);
+		};
+
+		Ring *get() {
+			if(ring == NULL) {
+				Registry &r = registry();
+				pthread_mutex_lock(&r.lock);
+				ring = new Ring(r.eventsPerThread);
+				r.rings.push_back(ring);
+				pthread_mutex_unlock(&r.lock);
+			}
+			return ring;
+		};
+	};
+
+	thread_local LocalRing localRing;
+
+	void record(char phase, const char *name, u_int64_t seqN, u_int64_t size)
+	{
+		Ring *ring = localRing.get();
+		u_int64_t n = ring->head.load(memory_order_relaxed);
+		Event &e = ring->events[n % ring->capacity];
+		e.time = Metrics::now();
+		e.name = name;
+		e.seqN = seqN;
+		e.size = size;
+		e.phase = phase;
+		ring->head.store(n + 1, memory_order_release);
+	}
+
+	void writeJSONString(FILE *f, const char *s)
+	{
+		fputc('"', f);
+		for(; *s != 0; s++) {
+			if(*s == '"' || *s == '\\') fputc('\\', f);
+			fputc(*s, f);
+		}
+		fputc('"', f);
+	}
+}
+
+void Trace::enable(size_t eventsPerThread)
+{
+	Registry &r = registry();
+	pthread_mutex_lock(&r.lock);
+	// Applies to threads which have not traced anything yet
+	r.eventsPerThread = (eventsPerThread > 0) ? eventsPerThread : 1;
+	pthread_mutex_unlock(&r.lock);
+	enabled.store(true, memory_order_relaxed);
+}
+
+void Trace::disable()
+{
+	enabled.store(false, memory_order_relaxed);
+}
+
+const char *Trace::intern(const char *name)
+{
+	Registry &r = registry();
+	pthread_mutex_lock(&r.lock);
+	const char *s = r.names.insert(name).first->c_str();
+	pthread_mutex_unlock(&r.lock);
+	return s;
+}
+
+void Trace::setThreadName(const char *name)
+{
+	localRing.get()->threadName = name;
+}
+
+void Trace::begin(const char *name, u_int64_t seqN, u_int64_t size)
+{
+	record('B', name, seqN, size);
+}
+
+void Trace::end(const char *name, u_int64_t seqN, u_int64_t size)
+{
+	record('E', name, seqN, size);
+}
+
+void Trace::instant(const char *name, u_int64_t seqN, u_int64_t size)
+{
+	record('i', name, seqN, size);
+}
+
+/*
+ * {"traceEvents": [{"name": stage, "ph": "B", "ts": us, "pid": pid, "tid": tid, "args": {"seqN": n, "in": N}},
+ *                  {"name": stage, "ph": "E", ..., "args": {"seqN": n, "out": N}}, ...]}
+ * Events of a thread whose ring was overwritten may start with unmatched ends, which viewers ignore.
+ */
+bool Trace::writeJSON(const char *fileName)
+{
+	FILE *f = fopen(fileName, "w");
+	if(f == NULL) return false;
+
+	Registry &r = registry();
+	pid_t pid = getpid();
+	pthread_mutex_lock(&r.lock);
+	fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+	bool first = true;
+	u_int64_t nDropped = 0;
+	for(Ring *ring : r.rings) {
+		if(!ring->threadName.empty()) {
+			fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %ld, \"args\": {\"name\": ",
+				first ? "" : ",\n", pid, ring->tid);
+			writeJSONString(f, ring->threadName.c_str());
+			fprintf(f, "}}");
+			first = false;
+		}
+
+		u_int64_t head = ring->head.load(memory_order_acquire);
+		u_int64_t n0 = (head > ring->capacity) ? head - ring->capacity : 0;
+		nDropped += n0;
+		for(u_int64_t n = n0; n < head; n++) {
+			Event &e = ring->events[n % ring->capacity];
+			fprintf(f, "%s{\"name\": ", first ? "" : ",\n");
+			writeJSONString(f, e.name);
+			fprintf(f, ", \"cat\": \"pipeline\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %ld",
+				e.phase, e.time * 1E-3, pid, ring->tid);
+			if(e.phase == 'i') fprintf(f, ", \"s\": \"t\"");
+			fprintf(f, ", \"args\": {\"seqN\": %lu, \"%s\": %lu}}",
+				(unsigned long)e.seqN, (e.phase == 'E') ? "out" : "in", (unsigned long)e.size);
+			first = false;
+		}
+	}
+	fprintf(f, "\n]}\n");
+
+	// Start over, releasing the rings of threads which have exited
+	for(auto i = r.rings.begin(); i != r.rings.end(); ) {
+		Ring *ring = *i;
+		if(ring->retired.load(memory_order_acquire)) {
+			delete ring;
+			i = r.rings.erase(i);
+		}
+		else {
+			ring->head.store(0, memory_order_relaxed);
+			i++;
+		}
+	}
+	pthread_mutex_unlock(&r.lock);
+
+	if(nDropped > 0)
+		fprintf(stderr, "WARNING: %lu trace events were overwritten, increase the number of trace events per thread\n", (unsigned long)nDropped);
+	return fclose(f) == 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Affinity benchmark for the event pipeline.
+ *
+ * A reader thread fills buffers of raw hits, as RawReader does, and queues them to a ThreadPool
+ * whose workers sort them and build a buffer of hits over them, as CoarseSorter and ProcessHit do.
+ * The same work is run with the threads left to the scheduler and pinned by an Affinity policy,
+ * the pinned workers taking their buffers from their own NUMA node.
+ */
+#include <Affinity.h>
+#include <ThreadPool.h>
+#include <EventBuffer.h>
+#include <EventSourceSink.h>
+#include <Event.h>
+#include <CoarseSorter.h>
+#include <BufferPool.h>
+#include <Instrumentation.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+
+using namespace PETSYS;
+using namespace std;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1E-9 * ts.tv_nsec;
+}
+
+class HitSink : public EventSink<RawHit> {
+public:
+	HitSink(int nPasses) : nPasses(nPasses), nHits(0), checksum(0) { };
+	virtual void pushT0(double) { };
+	virtual void pushEvents(EventBuffer<RawHit> *buffer) {
+		unsigned N = buffer->getSize();
+		CoarseSorter::sortInPlace(buffer->getPtr(), N);
+
+		EventBuffer<Hit> *outBuffer = new EventBuffer<Hit>(N, buffer);
+		for(unsigned i = 0; i < N; i++) {
+			RawHit &raw = buffer->get(i);
+			Hit &hit = outBuffer->getWriteSlot();
+			hit.raw = &raw;
+			hit.valid = raw.valid;
+			hit.time = raw.time;
+			hit.timeEnd = raw.timeEnd;
+			hit.energy = raw.efine;
+			outBuffer->pushWriteSlot();
+		}
+
+		// Further stages going over the hits
+		u_int64_t sum = 0;
+		for(int pass = 0; pass < nPasses; pass++) {
+			for(unsigned i = 0; i < N; i++) {
+				Hit &hit = outBuffer->get(i);
+				hit.energy = hit.energy * 1.001f + 1;
+				sum += hit.raw->channelID + (u_int64_t)hit.time;
+			}
+		}
+
+		atomicAdd(nHits, N);
+		atomicAdd(checksum, sum);
+		// Deletes buffer, its parent
+		delete outBuffer;
+	};
+	virtual void finish() { };
+	virtual void report() { };
+
+	int nPasses;
+	u_int64_t nHits;
+	u_int64_t checksum;
+};
+
+// Pushes nBuffers buffers of bufferSize raw hits, written by the calling thread, and returns the hits per second
+static double runBenchmark(long nBuffers, unsigned bufferSize, int nPasses)
+{
+	BaseThreadPool *pool = new BaseThreadPool();
+	HitSink *sink = new HitSink(nPasses);
+	Affinity::ScopedPin pin(Affinity::READER);
+
+	double t0 = now();
+	{
+		TaskGroup tasks(pool);
+		unsigned seed = 1;
+		for(long n = 0; n < nBuffers; n++) {
+			EventBuffer<RawHit> *buffer = new EventBuffer<RawHit>(bufferSize, n, n * 1024);
+			for(unsigned i = 0; i < bufferSize; i++) {
+				seed = seed * 1103515245 + 12345;
+				RawHit &raw = buffer->getWriteSlot();
+				raw.valid = true;
+				raw.qdcMode = false;
+				raw.channelID = (seed >> 8) % 4096;
+				raw.frameID = i / 64;
+				raw.time = raw.frameID * 1024 + (seed >> 20) % 1024;
+				raw.timeEnd = raw.time + 100;
+				raw.tcoarse = raw.time % 1024;
+				raw.ecoarse = raw.timeEnd % 1024;
+				raw.tfine = seed % 1024;
+				raw.efine = (seed >> 10) % 1024;
+				raw.tacID = seed % 4;
+				buffer->pushWriteSlot();
+			}
+			tasks.queueTask(buffer, sink);
+		}
+		tasks.complete();
+	}
+	double t1 = now();
+
+	double rate = sink->nHits / (t1 - t0);
+	delete sink;
+	delete pool;
+	return rate;
+}
+
+static void displayHelp(char *program)
+{
+	fprintf(stderr, "Usage: %s [options]\n", program);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  --buffers N \t\t Number of buffers (default: 20000)\n");
+	fprintf(stderr, "  --buffer-size N \t Hits per buffer (default: 4096)\n");
+	fprintf(stderr, "  --passes N \t\t Passes over each buffer of hits (default: 4)\n");
+	fprintf(stderr, "  --workers N \t\t Pool workers (default: one per worker CPU)\n");
+	fprintf(stderr, "  --reader-cpus LIST \t CPUs of the reader thread when pinned (default: 0)\n");
+	fprintf(stderr, "  --worker-cpus LIST \t CPUs of the workers when pinned (default: all online CPUs)\n");
+	fprintf(stderr, "  --help \t\t Show this help message and exit\n");
+}
+
+int main(int argc, char *argv[])
+{
+	long nBuffers = 20000;
+	unsigned bufferSize = 4096;
+	int nPasses = 4;
+	int nWorkers = 0;
+	int nCPU = sysconf(_SC_NPROCESSORS_ONLN);
+	string readerCPUs = "0";
+	string workerCPUs = (nCPU > 1) ? "0-" + to_string(nCPU - 1) : "0";
+
+	static struct option longOptions[] = {
+		{ "help", no_argument, 0, 0 },
+		{ "buffers", required_argument, 0, 0 },
+		{ "buffer-size", required_argument, 0, 0 },
+		{ "passes", required_argument, 0, 0 },
+		{ "workers", required_argument, 0, 0 },
+		{ "reader-cpus", required_argument, 0, 0 },
+		{ "worker-cpus", required_argument, 0, 0 },
+		{ NULL, 0, 0, 0 }
+	};
+
+	while(true) {
+		int optionIndex = 0;
+		int c = getopt_long(argc, argv, "", longOptions, &optionIndex);
+		if(c == -1) break;
+		if(c != 0) {
+			displayHelp(argv[0]);
+			return 1;
+		}
+		switch(optionIndex) {
+			case 0: displayHelp(argv[0]); return 0;
+			case 1: nBuffers = boost::lexical_cast<long>(optarg); break;
+			case 2: bufferSize = boost::lexical_cast<unsigned>(optarg); break;
+			case 3: nPasses = boost::lexical_cast<int>(optarg); break;
+			case 4: nWorkers = boost::lexical_cast<int>(optarg); break;
+			case 5: readerCPUs = optarg; break;
+			case 6: workerCPUs = optarg; break;
+		}
+	}
+
+	Affinity::Policy unpinned;
+	unpinned.nWorkers = nWorkers;
+	Affinity::Policy pinned = unpinned;
+	if(!Affinity::parseCPUList(readerCPUs.c_str(), pinned.cpus[Affinity::READER])
+		|| !Affinity::parseCPUList(workerCPUs.c_str(), pinned.cpus[Affinity::WORKER])) {
+		fprintf(stderr, "Invalid CPU list\n");
+		return 1;
+	}
+
+	Affinity::setPolicy(unpinned);
+	double unpinnedRate = runBenchmark(nBuffers, bufferSize, nPasses);
+	int unpinnedWorkers = Affinity::getDefaultNWorkers();
+
+	Affinity::setPolicy(pinned);
+	Affinity::Policy policy = Affinity::getPolicy();
+	double pinnedRate = runBenchmark(nBuffers, bufferSize, nPasses);
+	int pinnedWorkers = Affinity::getDefaultNWorkers();
+
+	printf("# buffers = %ld, hits/buffer = %u, passes = %d\n", nBuffers, bufferSize, nPasses);
+	printf("# pinned: reader on CPUs %s, workers on CPUs %s\n",
+		Affinity::toString(policy.cpus[Affinity::READER]).c_str(), Affinity::toString(policy.cpus[Affinity::WORKER]).c_str());
+	printf("#  mode      workers        hits/s      ns/hit\n");
+	printf("   unpinned  %7d  %12.0f  %10.2f\n", unpinnedWorkers, unpinnedRate, 1E9 / unpinnedRate);
+	printf("   pinned    %7d  %12.0f  %10.2f\n", pinnedWorkers, pinnedRate, 1E9 / pinnedRate);
+	printf("# pinned/unpinned = %.2f\n", pinnedRate / unpinnedRate);
+	return 0;
+}
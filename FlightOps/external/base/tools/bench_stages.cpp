@@ -0,0 +1,933 @@
+/*
+ * Stage benchmark for the base event pipeline.
+ *
+ * Generates deterministic synthetic RawHit buffers and a matching set of
+ * calibration / mapping tables, then times each stage's handleEvents() in isolation.
+ * Besides the rate, each stage reports the heap and BufferPool allocations made while it ran
+ * and the peak resident set size.
+ * Runs offline: no hardware, no ROOT.
+ */
+#include <Event.h>
+#include <EventBuffer.h>
+#include <ColumnarEventBuffer.h>
+#include <SystemConfig.h>
+#include <CoarseSorter.h>
+#include <ProcessHit.h>
+#include <SimpleGrouper.h>
+#include <CoincidenceGrouper.h>
+#include <CalibrationKernel.h>
+#include <QDCInversionCache.h>
+#include <BufferPool.h>
+#include <math.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+
+using namespace PETSYS;
+using namespace std;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1E-9 * ts.tv_nsec;
+}
+
+// Every operator new of the program is counted; new and delete are kept out of line so that their malloc() and free() are not matched against each other
+static atomic<u_int64_t> nHeapAllocations(0);
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+	nHeapAllocations.fetch_add(1, memory_order_relaxed);
+	void *ptr = malloc(size > 0 ? size : 1);
+	if(ptr == NULL) throw bad_alloc();
+	return ptr;
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+// Replaced too, so that sized deallocations also free() what operator new above malloc()ed
+__attribute__((noinline)) void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+// Heap allocations plus EventBuffer blocks the BufferPool could not recycle
+static u_int64_t countAllocations()
+{
+	BufferPool::Stats stats = BufferPool::getStats();
+	return nHeapAllocations.load(memory_order_relaxed) + stats.nAllocations - stats.nPoolHits;
+}
+
+// Resets the peak resident set size (VmHWM), returning false if the kernel does not allow it
+static bool resetPeakRSS()
+{
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+	if(f == NULL) return false;
+	bool ok = fputs("5", f) >= 0;
+	ok = (fclose(f) == 0) && ok;
+	return ok;
+}
+
+// Peak resident set size in bytes, since the last resetPeakRSS()
+static size_t getPeakRSS()
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	if(f != NULL) {
+		char line[256];
+		unsigned long kb;
+		while(fgets(line, sizeof(line), f) != NULL) {
+			if(sscanf(line, "VmHWM: %lu kB", &kb) == 1) {
+				fclose(f);
+				return kb * 1024;
+			}
+		}
+		fclose(f);
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss * 1024L;
+}
+
+/*
+ * Time and allocations of the intervals between start() and stop(),
+ * and the peak resident set size from its creation.
+ */
+class Meter {
+public:
+	Meter() : seconds(0), nAllocations(0) { resetPeakRSS(); };
+	void start() {
+		a0 = countAllocations();
+		t0 = now();
+	};
+	void stop() {
+		seconds += now() - t0;
+		nAllocations += countAllocations() - a0;
+	};
+
+	double seconds;
+	u_int64_t nAllocations;
+private:
+	double t0;
+	u_int64_t a0;
+};
+
+// Small deterministic generator, so that runs are comparable across builds
+class Random {
+public:
+	Random(u_int64_t seed) : state(seed * 6364136223846793005ULL + 1442695040888963407ULL) { };
+	u_int64_t next() {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 2685821657736338717ULL;
+	};
+	unsigned uniform(unsigned n) { return next() % n; };
+private:
+	u_int64_t state;
+};
+
+struct BenchOptions {
+	long nHits;
+	unsigned bufferSize;
+	unsigned nChannels;
+	unsigned hitsPerFrame;
+	unsigned occupancy;
+	unsigned qdcPercent;
+	unsigned seed;
+	unsigned nRegions;
+};
+
+static unsigned makeGID(unsigned n)
+{
+	unsigned channelID = n % 64;
+	unsigned chipID = (n / 64) % 64;
+	unsigned slaveID = (n / 4096) % 32;
+	unsigned portID = n / (4096 * 32);
+	return channelID | (chipID << 6) | (slaveID << 12) | (portID << 17);
+}
+
+class SyntheticStream : public EventStream {
+public:
+	double getFrequency() { return 200E6; };
+	int getTriggerID() { return -1; };
+};
+
+/*
+ * Writes calibration and mapping tables for nChannels channels into dir
+ * and returns the name of the configuration file.
+ * config_exact.ini is the same configuration with the QDC lookup tables disabled.
+ */
+static string writeConfiguration(const char *dir, unsigned nChannels)
+{
+	string fnEnergy = string(dir) + "/energy_calibration.tsv";
+	string fnConfigExact = string(dir) + "/config_exact.ini";
+	string fnTDC = string(dir) + "/tdc_calibration.tsv";
+	string fnQDC = string(dir) + "/qdc_calibration.tsv";
+	string fnMap = string(dir) + "/map_channel.tsv";
+	string fnTrigger = string(dir) + "/map_trigger.tsv";
+	string fnConfig = string(dir) + "/config.ini";
+
+	FILE *f = fopen(fnTDC.c_str(), "w");
+	for(unsigned n = 0; n < nChannels; n++) {
+		unsigned gid = makeGID(n);
+		for(unsigned tac = 0; tac < 4; tac++) {
+			fprintf(f, "%u\t%u\t%u\t%u\t%u\tT\t%f\t%f\t%f\t%f\n", gid >> 17, (gid >> 12) % 32, (gid >> 6) % 64, gid % 64, tac, 0.1, 300.0, 150.0, -3.0);
+			fprintf(f, "%u\t%u\t%u\t%u\t%u\tE\t%f\t%f\t%f\t%f\n", gid >> 17, (gid >> 12) % 32, (gid >> 6) % 64, gid % 64, tac, 0.1, 300.0, 150.0, -3.0);
+		}
+	}
+	fclose(f);
+
+	// Monotonic QDC response over the range of integration times generated by makeRawHits()
+	f = fopen(fnQDC.c_str(), "w");
+	for(unsigned n = 0; n < nChannels; n++) {
+		unsigned gid = makeGID(n);
+		for(unsigned tac = 0; tac < 4; tac++) {
+			fprintf(f, "%u\t%u\t%u\t%u\t%u", gid >> 17, (gid >> 12) % 32, (gid >> 6) % 64, gid % 64, tac);
+			fprintf(f, "\t%g\t%g\t%g\t%g\t%g\t%g\t%g\t%g\t%g\t%g\n", -10.0 + 0.5 * tac, 2.0 + 0.001 * (n % 16), -2E-3, 1E-6, -1E-10, 0.0, 0.0, 0.0, 0.0, 0.0);
+		}
+	}
+	fclose(f);
+
+	f = fopen(fnEnergy.c_str(), "w");
+	for(unsigned n = 0; n < nChannels; n++) {
+		unsigned gid = makeGID(n);
+		for(unsigned tac = 0; tac < 4; tac++) {
+			fprintf(f, "%u\t%u\t%u\t%u\t%u", gid >> 17, (gid >> 12) % 32, (gid >> 6) % 64, gid % 64, tac);
+			fprintf(f, "\t%g\t%g\t%g\t%g\n", 50.0, 1.002, 1.0, 0.5);
+		}
+	}
+	fclose(f);
+
+	f = fopen(fnMap.c_str(), "w");
+	for(unsigned n = 0; n < nChannels; n++) {
+		unsigned gid = makeGID(n);
+		fprintf(f, "%u\t%u\t%u\t%u\t%u\t%u\t%u\t%f\t%f\t%f\n", gid >> 17, (gid >> 12) % 32, (gid >> 6) % 64, gid % 64,
+			n / 256, n % 16, (n / 16) % 16, 3.2 * (n % 16), 3.2 * ((n / 16) % 16), 10.0 * (n / 256));
+	}
+	fclose(f);
+
+	f = fopen(fnTrigger.c_str(), "w");
+	unsigned nRegions = (nChannels + 255) / 256;
+	for(unsigned r1 = 0; r1 < nRegions; r1++) {
+		fprintf(f, "%u\t%u\tM\n", r1, r1);
+		for(unsigned r2 = r1 + 1; r2 < nRegions; r2++)
+			fprintf(f, "%u\t%u\tC\n", r1, r2);
+	}
+	fclose(f);
+
+	for(int exact = 0; exact < 2; exact++) {
+		f = fopen(exact ? fnConfigExact.c_str() : fnConfig.c_str(), "w");
+		fprintf(f, "[main]\n");
+		fprintf(f, "tdc_calibration_table = %%CDIR%%/tdc_calibration.tsv\n");
+		fprintf(f, "qdc_calibration_table = %%CDIR%%/qdc_calibration.tsv\n");
+		fprintf(f, "energy_calibration_table = %%CDIR%%/energy_calibration.tsv\n");
+		fprintf(f, "channel_map = %%CDIR%%/map_channel.tsv\n");
+		fprintf(f, "trigger_map = %%CDIR%%/map_trigger.tsv\n");
+		if(exact) fprintf(f, "[qdc_lookup]\nmax_memory = 0\n");
+		fclose(f);
+	}
+
+	return fnConfig;
+}
+
+/*
+ * Buffers of hits with hitsPerFrame hits per frame, unsorted inside each frame.
+ * Hits come from occupancy percent of the channels, spread evenly over all of them.
+ */
+static vector<EventBuffer<RawHit> *> makeRawHits(BenchOptions &options)
+{
+	Random random(options.seed);
+	vector<EventBuffer<RawHit> *> buffers;
+	unsigned nActive = (options.nChannels * options.occupancy + 99) / 100;
+	if(nActive < 1) nActive = 1;
+
+	long nHits = 0;
+	unsigned long frameID = 0;
+	unsigned seqN = 0;
+	while(nHits < options.nHits) {
+		EventBuffer<RawHit> *buffer = new EventBuffer<RawHit>(options.bufferSize, seqN, frameID * 1024);
+		while(buffer->getSize() + options.hitsPerFrame <= options.bufferSize && nHits < options.nHits) {
+			for(unsigned k = 0; k < options.hitsPerFrame; k++) {
+				RawHit &hit = buffer->getWriteSlot();
+				hit.valid = true;
+				unsigned n = (unsigned long)random.uniform(nActive) * options.nChannels / nActive;
+				hit.qdcMode = (n % 100) < options.qdcPercent;
+				hit.channelID = makeGID(n);
+				hit.tacID = random.uniform(4);
+				hit.frameID = frameID - (buffer->getTMin() / 1024);
+				hit.tcoarse = random.uniform(1024);
+				hit.ecoarse = (hit.tcoarse + 50 + random.uniform(200)) % 1024;
+				hit.tfine = 100 + random.uniform(300);
+				hit.efine = 100 + random.uniform(300);
+				hit.time = hit.frameID * 1024 + hit.tcoarse;
+				hit.timeEnd = hit.frameID * 1024 + hit.ecoarse;
+				if((hit.timeEnd - hit.time) < -256) hit.timeEnd += 1024;
+				buffer->pushWriteSlot();
+				nHits += 1;
+			}
+			frameID += 1;
+		}
+		buffer->setTMax(frameID * 1024);
+		buffers.push_back(buffer);
+		seqN += 1;
+	}
+	return buffers;
+}
+
+/*
+ * Writes a trigger map for a PET style ring of nRegions regions, each in coincidence
+ * with the opposite eighth of the ring, and returns the name of a configuration file using it.
+ */
+static string writeRingConfiguration(const char *dir, unsigned nRegions)
+{
+	string fnTrigger = string(dir) + "/map_trigger_ring.tsv";
+	string fnConfig = string(dir) + "/config_ring.ini";
+
+	FILE *f = fopen(fnTrigger.c_str(), "w");
+	for(unsigned r1 = 0; r1 < nRegions; r1++) {
+		fprintf(f, "%u\t%u\tM\n", r1, r1);
+		for(unsigned r2 = r1 + 1; r2 < nRegions; r2++) {
+			unsigned d = r2 - r1;
+			if(d > nRegions / 2) d = nRegions - d;
+			if(d >= nRegions / 2 - nRegions / 16)
+				fprintf(f, "%u\t%u\tC\n", r1, r2);
+		}
+	}
+	fclose(f);
+
+	f = fopen(fnConfig.c_str(), "w");
+	fprintf(f, "[main]\n");
+	fprintf(f, "channel_map = %%CDIR%%/map_channel.tsv\n");
+	fprintf(f, "trigger_map = %%CDIR%%/map_trigger_ring.tsv\n");
+	fclose(f);
+	return fnConfig;
+}
+
+/*
+ * Buffers of photons from a ring of nRegions regions at a singles rate of rate Hz, with a clock of frequency Hz.
+ * A third of the singles are back to back pairs, the others are random; times are jittered by a few clocks.
+ */
+static vector<EventBuffer<GammaPhoton> *> makePhotons(BenchOptions &options, long nPhotons, double rate, double frequency, unsigned nRegions)
+{
+	Random random(options.seed);
+	vector<EventBuffer<GammaPhoton> *> buffers;
+	double meanInterval = frequency / rate;
+
+	double t = 0;
+	unsigned seqN = 0;
+	long n = 0;
+	while(n < nPhotons) {
+		long long tMin = (long long)(t / 1024) * 1024;
+		EventBuffer<GammaPhoton> *buffer = new EventBuffer<GammaPhoton>(options.bufferSize, seqN, tMin);
+		while(buffer->getSize() + 2 <= options.bufferSize && n < nPhotons) {
+			t += -meanInterval * log((random.uniform(1U << 30) + 1.0) / (1U << 30));
+			unsigned region = random.uniform(nRegions);
+			bool pair = random.uniform(3) == 0;
+			for(int k = 0; k < (pair ? 2 : 1); k++) {
+				GammaPhoton &photon = buffer->getWriteSlot();
+				photon.valid = true;
+				photon.region = (k == 0) ? region : (region + nRegions / 2 + random.uniform(nRegions / 16 + 1)) % nRegions;
+				photon.time = t - tMin + 0.01 * random.uniform(400);
+				photon.energy = 511;
+				photon.x = photon.y = photon.z = 0;
+				photon.nHits = 0;
+				photon.hits = NULL;
+				buffer->pushWriteSlot();
+				n += 1;
+			}
+		}
+		buffer->setTMax((long long)(t / 1024 + 1) * 1024);
+		buffers.push_back(buffer);
+		seqN += 1;
+	}
+	return buffers;
+}
+
+static EventBuffer<GammaPhoton> *copyPhotons(EventBuffer<GammaPhoton> *in)
+{
+	EventBuffer<GammaPhoton> *out = new EventBuffer<GammaPhoton>(in->getSize(), in->getSeqN(), in->getTMin());
+	memcpy((void*)out->getPtr(), (void*)in->getPtr(), sizeof(GammaPhoton) * in->getSize());
+	out->setUsed(in->getSize());
+	out->setTMax(in->getTMax());
+	return out;
+}
+
+static EventBuffer<RawHit> *copyBuffer(EventBuffer<RawHit> *in)
+{
+	EventBuffer<RawHit> *out = new EventBuffer<RawHit>(in->getSize(), in->getSeqN(), in->getTMin());
+	memcpy((void*)out->getPtr(), (void*)in->getPtr(), sizeof(RawHit) * in->getSize());
+	out->setUsed(in->getSize());
+	out->setTMax(in->getTMax());
+	return out;
+}
+
+static EventBuffer<RawHitColumns> *copyColumns(EventBuffer<RawHit> *in)
+{
+	EventBuffer<RawHitColumns> *out = new EventBuffer<RawHitColumns>(in->getSize(), in->getSeqN(), in->getTMin());
+	for(size_t n = 0; n < in->getSize(); n++)
+		out->set(n, in->get(n));
+	out->setUsed(in->getSize());
+	out->setTMax(in->getTMax());
+	return out;
+}
+
+// Expose the protected handleEvents() of each stage
+struct BenchCoarseSorter : public CoarseSorter {
+	BenchCoarseSorter() : CoarseSorter(new NullSink<RawHit>()) { };
+	using CoarseSorter::handleEvents;
+};
+struct BenchColumnarCoarseSorter : public ColumnarCoarseSorter {
+	BenchColumnarCoarseSorter() : ColumnarCoarseSorter(new NullSink<RawHitColumns>()) { };
+	using ColumnarCoarseSorter::handleEvents;
+};
+struct BenchProcessHit : public ProcessHit {
+	BenchProcessHit(SystemConfig *config, EventStream *stream) : ProcessHit(config, stream, new NullSink<Hit>()) { };
+	using ProcessHit::handleEvents;
+};
+struct BenchColumnarProcessHit : public ColumnarProcessHit {
+	BenchColumnarProcessHit(SystemConfig *config, EventStream *stream) : ColumnarProcessHit(config, stream, new NullSink<HitColumns>()) { };
+	using ColumnarProcessHit::handleEvents;
+};
+struct BenchSimpleGrouper : public SimpleGrouper {
+	BenchSimpleGrouper(SystemConfig *config) : SimpleGrouper(config, new NullSink<GammaPhoton>()) { };
+	using SimpleGrouper::handleEvents;
+};
+struct BenchCoincidenceGrouper : public CoincidenceGrouper {
+	BenchCoincidenceGrouper(SystemConfig *config) : CoincidenceGrouper(config, new NullSink<Coincidence>()) { };
+	using CoincidenceGrouper::handleEvents;
+};
+
+/*
+ * Runs both coincidence engines on each buffer and returns the number of buffers
+ * where they do not give the same coincidences, with photons referred to by position.
+ */
+static unsigned compareCoincidenceEngines(SystemConfig *config, vector<EventBuffer<GammaPhoton> *> &buffers, long &nCoincidences)
+{
+	unsigned nDifferent = 0;
+	nCoincidences = 0;
+	SystemConfig::CoincidenceEngine engine = config->sw_trigger_coincidence_engine;
+	for(auto b : buffers) {
+		vector<long> result[2];
+		for(int indexed = 0; indexed < 2; indexed++) {
+			config->sw_trigger_coincidence_engine = indexed ? SystemConfig::COINCIDENCE_ENGINE_INDEXED : SystemConfig::COINCIDENCE_ENGINE_SCAN;
+			BenchCoincidenceGrouper grouper(config);
+			EventBuffer<GammaPhoton> *in = copyPhotons(b);
+			EventBuffer<Coincidence> *out = grouper.handleEvents(in);
+			for(size_t i = 0; i < out->getSize(); i++) {
+				Coincidence &c = out->get(i);
+				result[indexed].push_back(-c.nPhotons);
+				result[indexed].push_back(c.getSeed() - in->getPtr());
+				for(int k = 0; k < c.nPhotons; k++)
+					result[indexed].push_back(c.getPhoton(k) - in->getPtr());
+			}
+			if(indexed) nCoincidences += out->getSize();
+			delete out;
+		}
+		if(result[0] != result[1]) nDifferent += 1;
+	}
+	config->sw_trigger_coincidence_engine = engine;
+	return nDifferent;
+}
+
+/*
+ * Checks that both coincidence engines point Coincidence::seed at the seed of a coincidence of 3 photons
+ * in which the seed is in the lowest region and the other two are only in coincidence with the seed.
+ * Returns the number of engines which get it wrong.
+ */
+static unsigned checkCoincidenceSeed(const char *dir)
+{
+	string fnTrigger = string(dir) + "/map_trigger_seed.tsv";
+	string fnConfig = string(dir) + "/config_seed.ini";
+
+	FILE *f = fopen(fnTrigger.c_str(), "w");
+	for(unsigned r = 0; r < 3; r++)
+		fprintf(f, "%u\t%u\tM\n", r, r);
+	fprintf(f, "0\t1\tC\n0\t2\tC\n");
+	fclose(f);
+
+	f = fopen(fnConfig.c_str(), "w");
+	fprintf(f, "[main]\n");
+	fprintf(f, "channel_map = %%CDIR%%/map_channel.tsv\n");
+	fprintf(f, "trigger_map = %%CDIR%%/map_trigger_seed.tsv\n");
+	fprintf(f, "[sw_trigger]\n");
+	fprintf(f, "coincidence_max_photons = 3\n");
+	fclose(f);
+
+	SystemConfig *config = SystemConfig::fromFile(fnConfig.c_str(), SystemConfig::LOAD_MAPPING);
+	EventBuffer<GammaPhoton> *photons = new EventBuffer<GammaPhoton>(3, 0, 0);
+	short regions[3] = { 0, 1, 2 };
+	for(int k = 0; k < 3; k++) {
+		GammaPhoton &photon = photons->getWriteSlot();
+		photon.valid = true;
+		photon.region = regions[k];
+		photon.time = 100 + 0.5 * k;
+		photon.energy = 511;
+		photon.x = photon.y = photon.z = 0;
+		photon.nHits = 0;
+		photon.hits = NULL;
+		photons->pushWriteSlot();
+	}
+	photons->setTMax(1024);
+
+	unsigned nWrong = 0;
+	for(int indexed = 0; indexed < 2; indexed++) {
+		config->sw_trigger_coincidence_engine = indexed ? SystemConfig::COINCIDENCE_ENGINE_INDEXED : SystemConfig::COINCIDENCE_ENGINE_SCAN;
+		BenchCoincidenceGrouper grouper(config);
+		EventBuffer<GammaPhoton> *in = copyPhotons(photons);
+		EventBuffer<Coincidence> *out = grouper.handleEvents(in);
+		bool ok = out->getSize() == 1;
+		if(ok) {
+			Coincidence &c = out->get(0);
+			ok = (c.nPhotons == 3) && (c.getSeed() == in->getPtr()) && (c.getPhoton(0)->region == 2);
+		}
+		if(!ok) {
+			fprintf(stderr, "ERROR: %s coincidence engine does not keep the seed of a 3 photon coincidence\n", indexed ? "indexed" : "scan");
+			nWrong += 1;
+		}
+		delete out;
+	}
+	delete photons;
+	delete config;
+	return nWrong;
+}
+
+static void printResult(const char *stage, const char *variant, long nHits, Meter &meter, double bytesPerHit)
+{
+	printf("  %-18s %-14s %14.0f %10.2f %10.1f %10lu %10.1f\n", stage, variant, nHits / meter.seconds, 1E9 * meter.seconds / nHits,
+		bytesPerHit, (unsigned long)meter.nAllocations, getPeakRSS() / 1048576.0);
+}
+
+/*
+ * Times stage->handleEvents() over all buffers.
+ * makeInput() builds a fresh input for each call (untimed) since the output owns its input.
+ */
+template <class TStage, class TInput, class TSource, class TMakeInput>
+static Meter timeStage(TStage *stage, vector<TSource *> &buffers, TMakeInput makeInput)
+{
+	Meter meter;
+	for(auto b : buffers) {
+		TInput *in = makeInput(b);
+		meter.start();
+		auto out = stage->handleEvents(in);
+		meter.stop();
+		delete out;
+	}
+	return meter;
+}
+
+// Times filling a new TOutput buffer with the events of each buffer, one by one, and deleting it
+template <class TOutput, class TSource>
+static Meter timeFill(vector<TSource *> &buffers)
+{
+	Meter meter;
+	for(auto b : buffers) {
+		meter.start();
+		TOutput *out = new TOutput(b->getSize(), b->getSeqN(), b->getTMin());
+		for(size_t n = 0; n < b->getSize(); n++)
+			out->push(b->get(n));
+		out->setTMax(b->getTMax());
+		delete out;
+		meter.stop();
+	}
+	return meter;
+}
+
+/*
+ * Calibration solver inputs for every hit of the sorted buffers,
+ * with the original per hit Newton–Raphson loop from ProcessHit as a reference.
+ */
+struct QDCProblem {
+	long n;
+	vector<float> a0, a1, a2, fine, q;
+	vector<float> p[10];
+	vector<float> efine, ti;
+
+	QDCProblem(SystemConfig *config, vector<EventBuffer<RawHit> *> &buffers) : n(0) {
+		for(auto b : buffers) {
+			for(size_t i = 0; i < b->getSize(); i++) {
+				RawHit &hit = b->get(i);
+				unsigned index = config->getChannelIndex(hit.channelID);
+				SystemConfig::TacConfig &ct = config->getTdcConfig(index, hit.tacID).t;
+				SystemConfig::QacConfig &cq = config->getQdcConfig(index, hit.tacID).q;
+				a0.push_back(ct.a0); a1.push_back(ct.a1); a2.push_back(ct.a2); fine.push_back(hit.tfine);
+				float c[10] = { cq.p0, cq.p1, cq.p2, cq.p3, cq.p4, cq.p5, cq.p6, cq.p7, cq.p8, cq.p9 };
+				for(int k = 0; k < 10; k++) p[k].push_back(c[k]);
+				efine.push_back(hit.efine);
+				ti.push_back(hit.timeEnd - hit.time);
+				n += 1;
+			}
+		}
+		q.resize(n);
+	};
+
+	Meter timeTDC() {
+		Meter meter;
+		meter.start();
+		CalibrationKernel::solveTDC(n, a0.data(), a1.data(), a2.data(), fine.data(), q.data());
+		meter.stop();
+		return meter;
+	};
+
+	Meter timeQDC(float *tEq) {
+		float *pp[10];
+		for(int k = 0; k < 10; k++) pp[k] = p[k].data();
+		Meter meter;
+		meter.start();
+		CalibrationKernel::solveQDC(n, pp, efine.data(), ti.data(), tEq);
+		meter.stop();
+		return meter;
+	};
+
+	void solveReference(float *tEq) {
+		for(long i = 0; i < n; i++) {
+			float t_eq = ti[i];
+			float delta = 0;
+			int iter = 0;
+			do {
+				float f = (p[0][i] - efine[i]);
+				float f_ = 0;
+				float tk = 1;
+				for(int k = 1; k < 10; k++) {
+					f_ += p[k][i] * tk * k;
+					tk *= t_eq;
+					f += p[k][i] * tk;
+				}
+				delta = - f / f_;
+				if(delta < -10.0) delta = -10.0;
+				if(delta > +10.0) delta = +10.0;
+				t_eq = t_eq + delta;
+				iter += 1;
+			} while ((fabs(delta) > 0.05) && (iter < 100));
+			tEq[i] = t_eq;
+		}
+	};
+};
+
+/*
+ * Compares the QDC inversion tables with the exact solver over the calibrated range, where t_eq - ti is
+ * on the energy grid of the tables: every efine the tables cover, integration times from 0 to 400 clocks,
+ * on the first 16 channels (all the QDC responses of writeConfiguration()) and their 4 TACs.
+ * Sets the largest differences in t_eq and in calibrated energy, relative to the exact energy,
+ * and returns false if they exceed the exact solver's stopping step (0.05 clocks) or 0.1%.
+ * Further away from ti, the exact solver runs out of iterations before it reaches t_eq.
+ */
+static bool checkQDCInversion(SystemConfig *config, double &maxTEqError, double &maxEnergyError)
+{
+	const unsigned N = QDCInversionTable::N_EFINE;
+	maxTEqError = 0;
+	maxEnergyError = 0;
+	unsigned nChannels = config->getNChannels() < 16 ? config->getNChannels() : 16;
+	for(unsigned index = 0; index < nChannels; index++) {
+		for(unsigned tac = 0; tac < 4; tac++) {
+			SystemConfig::QdcTacConfig &qc = config->getQdcConfig(index, tac);
+			const QDCInversionTable *table = config->getQDCInversionCache()->get(qc);
+			if(table == NULL) continue;
+
+			SystemConfig::QacConfig &cq = qc.q;
+			SystemConfig::EnergyConfig &cen = qc.energy;
+			float c[10] = { cq.p0, cq.p1, cq.p2, cq.p3, cq.p4, cq.p5, cq.p6, cq.p7, cq.p8, cq.p9 };
+			vector<float> p[10];
+			for(int k = 0; k < 10; k++) p[k].assign(N, c[k]);
+			float *pp[10];
+			for(int k = 0; k < 10; k++) pp[k] = p[k].data();
+			vector<float> efine(N), ti(N), tEq(N);
+			for(unsigned e = 0; e < N; e++) efine[e] = e;
+
+			float energyMax = table->energyMin + (table->nEnergy - 1) / table->energyInvStep;
+			for(int t = 0; t <= 400; t += 4) {
+				ti.assign(N, t);
+				CalibrationKernel::solveQDC(N, pp, efine.data(), ti.data(), tEq.data());
+				for(unsigned e = 0; e < N; e++) {
+					float tCached;
+					if(!table->solve(e, tCached)) continue;
+					if(!(tCached - t >= table->energyMin && tCached - t <= energyMax)) continue;
+					maxTEqError = fmax(maxTEqError, fabs(tCached - tEq[e]));
+
+					// As ProcessHit does, from the exact and the cached t_eq
+					float eExact = tEq[e] - t;
+					eExact = cen.p0 * pow(cen.p1,pow(eExact,cen.p2)) + cen.p3 * eExact - cen.p0;
+					float eCached = tCached - t;
+					float calibrated;
+					if(!table->calibrateEnergy(eCached, calibrated))
+						calibrated = cen.p0 * pow(cen.p1,pow(eCached,cen.p2)) + cen.p3 * eCached - cen.p0;
+					maxEnergyError = fmax(maxEnergyError, fabs(calibrated - eExact) / fmax(1.0, fabs(eExact)));
+				}
+			}
+		}
+	}
+	return maxTEqError <= 0.05 && maxEnergyError <= 1E-3;
+}
+
+static void displayHelp(char *program)
+{
+	fprintf(stderr, "Usage: %s [optional arguments]\n", program);
+	fprintf(stderr, "Optional flags:\n");
+	fprintf(stderr,  "  --hits N \t\t Total number of hits. Default: 4000000\n");
+	fprintf(stderr,  "  --buffer N \t\t Hits per buffer. Default: 2048\n");
+	fprintf(stderr,  "  --channels N \t\t Number of channels. Default: 1024\n");
+	fprintf(stderr,  "  --hitsPerFrame N \t Hits per frame. Default: 8\n");
+	fprintf(stderr,  "  --occupancy N \t Percentage of channels with hits. Default: 100\n");
+	fprintf(stderr,  "  --qdc N \t\t Percentage of channels in QDC mode. Default: 50\n");
+	fprintf(stderr,  "  --regions N \t\t Trigger regions for the coincidence benchmark. Default: 256\n");
+	fprintf(stderr,  "  --seed N \t\t Random seed. Default: 1\n");
+	fprintf(stderr,  "  --help \t\t Show this help message and exit \n");
+}
+
+int main(int argc, char *argv[])
+{
+	BenchOptions options = { 4000000, 2048, 1024, 8, 100, 50, 1, 256 };
+
+	static struct option longOptions[] = {
+		{ "help", no_argument, 0, 0 },
+		{ "hits", required_argument, 0, 0 },
+		{ "buffer", required_argument, 0, 0 },
+		{ "channels", required_argument, 0, 0 },
+		{ "hitsPerFrame", required_argument, 0, 0 },
+		{ "seed", required_argument, 0, 0 },
+		{ "qdc", required_argument, 0, 0 },
+		{ "regions", required_argument, 0, 0 },
+		{ "occupancy", required_argument, 0, 0 },
+		{ NULL, 0, 0, 0 }
+	};
+
+	while(true) {
+		int optionIndex = 0;
+		int c = getopt_long(argc, argv, "", longOptions, &optionIndex);
+		if(c == -1) break;
+		if(c != 0) {
+			displayHelp(argv[0]);
+			return 1;
+		}
+		switch(optionIndex) {
+			case 0: displayHelp(argv[0]); return 0;
+			case 1: options.nHits = boost::lexical_cast<long>(optarg); break;
+			case 2: options.bufferSize = boost::lexical_cast<unsigned>(optarg); break;
+			case 3: options.nChannels = boost::lexical_cast<unsigned>(optarg); break;
+			case 4: options.hitsPerFrame = boost::lexical_cast<unsigned>(optarg); break;
+			case 5: options.seed = boost::lexical_cast<unsigned>(optarg); break;
+			case 6: options.qdcPercent = boost::lexical_cast<unsigned>(optarg); break;
+			case 7: options.nRegions = boost::lexical_cast<unsigned>(optarg); break;
+			case 8: options.occupancy = boost::lexical_cast<unsigned>(optarg); break;
+			default: displayHelp(argv[0]); return 1;
+		}
+	}
+	if(options.hitsPerFrame > options.bufferSize) options.hitsPerFrame = options.bufferSize;
+	if(options.occupancy > 100) options.occupancy = 100;
+
+	char dir[] = "/tmp/bench_stages_XXXXXX";
+	if(mkdtemp(dir) == NULL) {
+		fprintf(stderr, "Could not create temporary directory\n");
+		return 1;
+	}
+	string configFileName = writeConfiguration(dir, options.nChannels);
+	SystemConfig *config = SystemConfig::fromFile(configFileName.c_str(), SystemConfig::LOAD_TDC_CALIBRATION | SystemConfig::LOAD_QDC_CALIBRATION | SystemConfig::LOAD_MAPPING);
+	string configExactFileName = string(dir) + "/config_exact.ini";
+	SystemConfig *configExact = SystemConfig::fromFile(configExactFileName.c_str(), SystemConfig::LOAD_TDC_CALIBRATION | SystemConfig::LOAD_QDC_CALIBRATION | SystemConfig::LOAD_MAPPING);
+	SyntheticStream stream;
+
+	vector<EventBuffer<RawHit> *> buffers = makeRawHits(options);
+	long nHits = 0;
+	for(auto b : buffers) nHits += b->getSize();
+
+	// Sorted input for ProcessHit, as in the real chain
+	BenchCoarseSorter sorter;
+	vector<EventBuffer<RawHit> *> sorted;
+	for(auto b : buffers) {
+		EventBuffer<RawHit> *s = sorter.handleEvents(copyBuffer(b));
+		sorted.push_back(copyBuffer(s));
+		delete s;
+	}
+
+	EventBuffer<RawHitColumns> *probeRaw = new EventBuffer<RawHitColumns>(0, 0, 0);
+	EventBuffer<HitColumns> *probeHit = new EventBuffer<HitColumns>(0, probeRaw, probeRaw);
+	size_t aosRawBytes = sizeof(RawHit);
+	size_t aosHitBytes = sizeof(Hit);
+	size_t soaRawBytes = probeRaw->getBytesPerEvent();
+	size_t soaHitBytes = probeHit->getBytesPerEvent();
+	delete probeHit;
+
+	printf("# hits = %ld, buffer = %u, channels = %u, occupancy = %u%%, hits/frame = %u, QDC channels = %u%%\n",
+		nHits, options.bufferSize, options.nChannels, options.occupancy, options.hitsPerFrame, options.qdcPercent);
+	unsigned nDense = config->getNChannels();
+	printf("# channel configuration: %u dense indexes, %.1f KiB TDC + %.1f KiB QDC + %.1f KiB geometry (ChannelConfig: %.1f KiB)\n",
+		nDense, nDense * 4 * sizeof(SystemConfig::TdcTacConfig) / 1024.0, nDense * 4 * sizeof(SystemConfig::QdcTacConfig) / 1024.0,
+		nDense * sizeof(SystemConfig::ChannelGeometry) / 1024.0, nDense * sizeof(SystemConfig::ChannelConfig) / 1024.0);
+	printf("# allocs: heap and new EventBuffer blocks while timed; peak RSS: %s\n",
+		resetPeakRSS() ? "high-water mark during the stage" : "high-water mark of the process, the kernel does not allow a reset");
+	printf("# %-18s %-14s %14s %10s %10s %10s %10s\n", "stage", "variant", "hits/s", "ns/hit", "bytes/hit", "allocs", "peak MiB");
+
+	Meter t;
+	t = timeFill<EventBuffer<RawHit> >(buffers);
+	printResult("EventBuffer", "AoS/fill", nHits, t, aosRawBytes);
+	t = timeFill<EventBuffer<RawHitColumns> >(buffers);
+	printResult("EventBuffer", "SoA/fill", nHits, t, soaRawBytes);
+
+	BenchColumnarCoarseSorter columnarSorter;
+	t = timeStage<BenchCoarseSorter, EventBuffer<RawHit> >(&sorter, buffers, copyBuffer);
+	printResult("CoarseSorter", "AoS", nHits, t, aosRawBytes);
+	t = timeStage<BenchColumnarCoarseSorter, EventBuffer<RawHitColumns> >(&columnarSorter, buffers, copyColumns);
+	printResult("CoarseSorter", "SoA", nHits, t, soaRawBytes);
+	t = timeStage<BenchCoarseSorter, EventBuffer<RawHit> >(&sorter, sorted, copyBuffer);
+	printResult("CoarseSorter", "AoS/sorted", nHits, t, aosRawBytes);
+
+	BenchProcessHit processHit(config, &stream);
+	BenchColumnarProcessHit columnarProcessHit(config, &stream);
+	BenchProcessHit exactProcessHit(configExact, &stream);
+	// QDC lookup tables against the exact solver; this also builds the tables ahead of timing
+	double maxEnergyError = 0;
+	for(auto b : sorted) {
+		EventBuffer<Hit> *lut = processHit.handleEvents(copyBuffer(b));
+		EventBuffer<Hit> *exact = exactProcessHit.handleEvents(copyBuffer(b));
+		for(size_t i = 0; i < lut->getSize() && i < exact->getSize(); i++)
+			maxEnergyError = fmax(maxEnergyError, fabs(lut->get(i).energy - exact->get(i).energy));
+		delete lut;
+		delete exact;
+	}
+	printf("# ProcessHit lookup tables: max |energy - exact| = %g\n", maxEnergyError);
+
+	t = timeStage<BenchProcessHit, EventBuffer<RawHit> >(&processHit, sorted, copyBuffer);
+	printResult("ProcessHit", "AoS", nHits, t, aosRawBytes + aosHitBytes);
+	t = timeStage<BenchColumnarProcessHit, EventBuffer<RawHitColumns> >(&columnarProcessHit, sorted, copyColumns);
+	printResult("ProcessHit", "SoA", nHits, t, soaRawBytes + soaHitBytes);
+	t = timeStage<BenchProcessHit, EventBuffer<RawHit> >(&exactProcessHit, sorted, copyBuffer);
+	printResult("ProcessHit", "AoS/exact", nHits, t, aosRawBytes + aosHitBytes);
+
+	// ProcessHit in each calibration mode, which selects the specialization of the hit transform
+	struct { const char *name; u_int64_t mask; } modes[] = {
+		{ "mode/none", 0 },
+		{ "mode/T", SystemConfig::LOAD_TDC_CALIBRATION },
+		{ "mode/T+XYZ", SystemConfig::LOAD_TDC_CALIBRATION | SystemConfig::LOAD_MAPPING },
+		{ "mode/T+Q+XYZ", SystemConfig::LOAD_TDC_CALIBRATION | SystemConfig::LOAD_QDC_CALIBRATION | SystemConfig::LOAD_MAPPING },
+		{ "mode/T+Q+E+XYZ", SystemConfig::LOAD_TDC_CALIBRATION | SystemConfig::LOAD_QDC_CALIBRATION | SystemConfig::LOAD_ENERGY_CALIBRATION | SystemConfig::LOAD_MAPPING }
+	};
+	for(auto &mode : modes) {
+		SystemConfig *modeConfig = SystemConfig::fromFile(configFileName.c_str(), mode.mask);
+		BenchProcessHit modeProcessHit(modeConfig, &stream);
+		// Untimed pass building the QDC lookup tables
+		for(auto b : sorted) delete modeProcessHit.handleEvents(copyBuffer(b));
+		t = timeStage<BenchProcessHit, EventBuffer<RawHit> >(&modeProcessHit, sorted, copyBuffer);
+		printResult("ProcessHit", mode.name, nHits, t, aosRawBytes + aosHitBytes);
+		delete modeConfig;
+	}
+
+	// SimpleGrouper engines on the hits from ProcessHit, which the photons' buffers own
+	auto makeHits = [&processHit](EventBuffer<RawHit> *b) { return processHit.handleEvents(copyBuffer(b)); };
+	SystemConfig::GroupEngine groupEngine = config->sw_trigger_group_engine;
+	for(int indexed = 0; indexed < 2; indexed++) {
+		config->sw_trigger_group_engine = indexed ? SystemConfig::GROUP_ENGINE_INDEXED : SystemConfig::GROUP_ENGINE_SCAN;
+		BenchSimpleGrouper grouper(config);
+		long nPhotons = 0;
+		for(auto b : sorted) {
+			EventBuffer<GammaPhoton> *out = grouper.handleEvents(makeHits(b));
+			nPhotons += out->getSize();
+			delete out;
+		}
+		printf("# SimpleGrouper %s: %ld photons\n", indexed ? "indexed" : "scan", nPhotons);
+		t = timeStage<BenchSimpleGrouper, EventBuffer<Hit> >(&grouper, sorted, makeHits);
+		printResult("SimpleGrouper", indexed ? "indexed" : "scan", nHits, t, aosHitBytes + sizeof(GammaPhoton));
+	}
+	config->sw_trigger_group_engine = groupEngine;
+
+
+	// ProcessHit and the bare calibration solvers with each kernel implementation, the one selected at startup marked with a *
+	CalibrationKernel::ISA defaultISA = CalibrationKernel::getISA();
+	printf("# CalibrationKernel: %s selected at startup (*)\n", CalibrationKernel::getISAName(defaultISA));
+	QDCProblem problem(config, sorted);
+	vector<float> reference(problem.n);
+	problem.solveReference(reference.data());
+	double exactSeconds[CalibrationKernel::AVX2 + 1] = { 0 };
+	for(int isa = CalibrationKernel::SCALAR; isa <= CalibrationKernel::AVX2; isa++) {
+		if(!CalibrationKernel::setISA(CalibrationKernel::ISA(isa))) continue;
+		string variant = string("exact/") + CalibrationKernel::getISAName(CalibrationKernel::ISA(isa)) + (isa == defaultISA ? "*" : "");
+		t = timeStage<BenchProcessHit, EventBuffer<RawHit> >(&exactProcessHit, sorted, copyBuffer);
+		printResult("ProcessHit", variant.c_str(), nHits, t, aosRawBytes + aosHitBytes);
+		exactSeconds[isa] = t.seconds;
+	}
+	if(exactSeconds[defaultISA] > exactSeconds[CalibrationKernel::SCALAR]) {
+		printf("# WARNING: exact ProcessHit is slower with the selected %s kernel than with the scalar one\n",
+			CalibrationKernel::getISAName(defaultISA));
+	}
+	for(int isa = CalibrationKernel::SCALAR; isa <= CalibrationKernel::AVX2; isa++) {
+		if(!CalibrationKernel::setISA(CalibrationKernel::ISA(isa))) continue;
+		string name = string(CalibrationKernel::getISAName(CalibrationKernel::ISA(isa))) + (isa == defaultISA ? "*" : "");
+		const char *variant = name.c_str();
+		t = problem.timeTDC();
+		printResult("solveTDC", variant, problem.n, t, 5 * sizeof(float));
+		vector<float> result(problem.n);
+		t = problem.timeQDC(result.data());
+		printResult("solveQDC", variant, problem.n, t, 13 * sizeof(float));
+		double maxError = 0;
+		for(long k = 0; k < problem.n; k++)
+			maxError = fmax(maxError, fabs(result[k] - reference[k]));
+		printf("# solveQDC %s: max |t_eq - reference| = %g clocks over %ld hits\n", variant, maxError, problem.n);
+	}
+	CalibrationKernel::setISA(defaultISA);
+
+	SystemConfig *energyConfig = SystemConfig::fromFile(configFileName.c_str(), SystemConfig::LOAD_ALL);
+	double maxTEqError, maxRelativeEnergyError;
+	bool inversionOK = checkQDCInversion(energyConfig, maxTEqError, maxRelativeEnergyError);
+	printf("# QDC inversion tables against the exact solver over the calibrated range: max |t_eq - exact| = %g clocks, max |energy - exact| = %g of the energy\n",
+		maxTEqError, maxRelativeEnergyError);
+	delete energyConfig;
+	if(!inversionOK) {
+		fprintf(stderr, "ERROR: QDC inversion tables differ from the exact solver by more than 0.05 clocks or 0.1%% of the energy\n");
+		exit(1);
+	}
+
+	if(checkCoincidenceSeed(dir) != 0) exit(1);
+	printf("# CoincidenceGrouper: seed of a 3 photon coincidence kept by both engines\n");
+
+	// CoincidenceGrouper engines at increasing singles rates, on a quarter as many photons as hits
+	string ringConfigFileName = writeRingConfiguration(dir, options.nRegions);
+	SystemConfig *ringConfig = SystemConfig::fromFile(ringConfigFileName.c_str(), SystemConfig::LOAD_MAPPING);
+	printf("# CoincidenceGrouper: %u regions, %ld photons\n", options.nRegions, options.nHits / 4);
+	double rates[] = { 1E6, 10E6, 100E6 };
+	for(double rate : rates) {
+		vector<EventBuffer<GammaPhoton> *> photons = makePhotons(options, options.nHits / 4, rate, stream.getFrequency(), options.nRegions);
+		long nPhotons = 0;
+		for(auto b : photons) nPhotons += b->getSize();
+
+		for(int maxPhotons = 2; maxPhotons <= 4; maxPhotons += 2) {
+			ringConfig->sw_trigger_coincidence_max_photons = maxPhotons;
+			long nCoincidences;
+			unsigned nDifferent = compareCoincidenceEngines(ringConfig, photons, nCoincidences);
+			printf("# CoincidenceGrouper %g MHz, max %d photons: %ld coincidences, engines differ on %u buffers\n", rate / 1E6, maxPhotons, nCoincidences, nDifferent);
+		}
+		ringConfig->sw_trigger_coincidence_max_photons = 2;
+
+		for(int indexed = 0; indexed < 2; indexed++) {
+			ringConfig->sw_trigger_coincidence_engine = indexed ? SystemConfig::COINCIDENCE_ENGINE_INDEXED : SystemConfig::COINCIDENCE_ENGINE_SCAN;
+			BenchCoincidenceGrouper grouper(ringConfig);
+			t = timeStage<BenchCoincidenceGrouper, EventBuffer<GammaPhoton> >(&grouper, photons, copyPhotons);
+			char variant[32];
+			sprintf(variant, "%s/%gMHz", indexed ? "indexed" : "scan", rate / 1E6);
+			printResult("CoincidenceGrouper", variant, nPhotons, t, sizeof(GammaPhoton));
+		}
+		for(auto b : photons) delete b;
+	}
+	delete ringConfig;
+
+	for(auto b : buffers) delete b;
+	for(auto b : sorted) delete b;
+	delete config;
+	delete configExact;
+
+	string cmd = string("rm -rf ") + dir;
+	if(system(cmd.c_str()) != 0) {
+		fprintf(stderr, "WARNING: could not remove '%s'\n", dir);
+	}
+	return 0;
+}
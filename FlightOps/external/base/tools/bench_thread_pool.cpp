@@ -0,0 +1,222 @@
+/*
+ * Contention benchmark for ThreadPool.
+ *
+ * Pushes a large number of small EventBuffers through the work-stealing ThreadPool
+ * and through a reference copy of the previous single-deque pool, for several worker counts.
+ * Each task spins for a configurable amount of time to emulate per-buffer processing.
+ */
+#include <ThreadPool.h>
+#include <EventBuffer.h>
+#include <EventSourceSink.h>
+#include <Instrumentation.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <deque>
+#include <vector>
+#include <pthread.h>
+#include <boost/lexical_cast.hpp>
+
+using namespace PETSYS;
+using namespace std;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1E-9 * ts.tv_nsec;
+}
+
+class SpinSink : public EventSink<int> {
+public:
+	SpinSink(double workNs) : workNs(workNs), nBuffers(0) { };
+	virtual void pushT0(double) { };
+	virtual void pushEvents(EventBuffer<int> *buffer) {
+		double t0 = now();
+		while((now() - t0) * 1E9 < workNs);
+		atomicIncrement(nBuffers);
+		delete buffer;
+	};
+	virtual void finish() { };
+	virtual void report() { };
+
+	double workNs;
+	u_int64_t nBuffers;
+};
+
+/*
+ * Reference implementation of the previous pool:
+ * one std::deque, one mutex and three condition variables.
+ */
+class ReferencePool {
+public:
+	ReferencePool(int nWorkers, int maxQueueSize)
+	: nWorkers(nWorkers), maxQueueSize(maxQueueSize), nBusy(0), terminate(false)
+	{
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&cond_queued, NULL);
+		pthread_cond_init(&cond_dequeued, NULL);
+		pthread_cond_init(&cond_completed, NULL);
+		threads = new pthread_t[nWorkers];
+		for(int i = 0; i < nWorkers; i++)
+			pthread_create(&threads[i], NULL, thread_routine, this);
+	};
+
+	~ReferencePool() {
+		completeQueue();
+		pthread_mutex_lock(&lock);
+		terminate = true;
+		pthread_cond_broadcast(&cond_queued);
+		pthread_mutex_unlock(&lock);
+		for(int i = 0; i < nWorkers; i++)
+			pthread_join(threads[i], NULL);
+		delete [] threads;
+		pthread_cond_destroy(&cond_completed);
+		pthread_cond_destroy(&cond_dequeued);
+		pthread_cond_destroy(&cond_queued);
+		pthread_mutex_destroy(&lock);
+	};
+
+	void queueTask(EventBuffer<int> *buffer, EventSink<int> *sink) {
+		pthread_mutex_lock(&lock);
+		while(queue.size() >= (size_t)maxQueueSize)
+			pthread_cond_wait(&cond_dequeued, &lock);
+		queue.push_back(make_pair(buffer, sink));
+		pthread_cond_signal(&cond_queued);
+		pthread_mutex_unlock(&lock);
+	};
+
+	void completeQueue() {
+		pthread_mutex_lock(&lock);
+		while(!queue.empty() || nBusy > 0)
+			pthread_cond_wait(&cond_completed, &lock);
+		pthread_mutex_unlock(&lock);
+	};
+
+private:
+	static void *thread_routine(void *arg) {
+		ReferencePool *pool = (ReferencePool *)arg;
+		pthread_mutex_lock(&pool->lock);
+		while(!pool->terminate) {
+			if(pool->queue.empty()) {
+				pthread_cond_wait(&pool->cond_queued, &pool->lock);
+				continue;
+			}
+			auto job = pool->queue.front();
+			pool->queue.pop_front();
+			pool->nBusy += 1;
+			pthread_cond_signal(&pool->cond_dequeued);
+			pthread_mutex_unlock(&pool->lock);
+
+			job.second->pushEvents(job.first);
+
+			pthread_mutex_lock(&pool->lock);
+			pool->nBusy -= 1;
+			pthread_cond_broadcast(&pool->cond_completed);
+		}
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	};
+
+	int nWorkers;
+	int maxQueueSize;
+	int nBusy;
+	bool terminate;
+	pthread_t *threads;
+	deque<pair<EventBuffer<int> *, EventSink<int> *> > queue;
+	pthread_mutex_t lock;
+	pthread_cond_t cond_queued;
+	pthread_cond_t cond_dequeued;
+	pthread_cond_t cond_completed;
+};
+
+template <class TPool>
+static double runBenchmark(TPool *pool, long nTasks, double workNs)
+{
+	SpinSink *sink = new SpinSink(workNs);
+	double t0 = now();
+	for(long n = 0; n < nTasks; n++) {
+		pool->queueTask(new EventBuffer<int>(0, n, 0), sink);
+	}
+	pool->completeQueue();
+	double t1 = now();
+	if(sink->nBuffers != (u_int64_t)nTasks) {
+		fprintf(stderr, "ERROR: %lu tasks completed, expected %ld\n", sink->nBuffers, nTasks);
+		exit(1);
+	}
+	delete sink;
+	return nTasks / (t1 - t0);
+}
+
+static void displayHelp(char *program)
+{
+	fprintf(stderr, "Usage: %s [optional arguments]\n", program);
+	fprintf(stderr, "Optional flags:\n");
+	fprintf(stderr,  "  --tasks N \t\t Number of buffers to push through the pool. Default: 200000\n");
+	fprintf(stderr,  "  --work ns \t\t Time spent per buffer, in ns. Default: 1000\n");
+	fprintf(stderr,  "  --workers N \t\t Only run with N workers. Default: 1, 2, 4, ... up to the number of CPUs\n");
+	fprintf(stderr,  "  --queue N \t\t Maximum queue depth. Default: nCPU/4\n");
+	fprintf(stderr,  "  --help \t\t Show this help message and exit \n");
+}
+
+int main(int argc, char *argv[])
+{
+	long nTasks = 200000;
+	double workNs = 1000;
+	int onlyWorkers = 0;
+	int nCPU = sysconf(_SC_NPROCESSORS_ONLN);
+	int maxQueueSize = nCPU/4 > 0 ? nCPU/4 : 1;
+
+	static struct option longOptions[] = {
+		{ "help", no_argument, 0, 0 },
+		{ "tasks", required_argument, 0, 0 },
+		{ "work", required_argument, 0, 0 },
+		{ "workers", required_argument, 0, 0 },
+		{ "queue", required_argument, 0, 0 },
+		{ NULL, 0, 0, 0 }
+	};
+
+	while(true) {
+		int optionIndex = 0;
+		int c = getopt_long(argc, argv, "", longOptions, &optionIndex);
+		if(c == -1) break;
+		if(c != 0) {
+			displayHelp(argv[0]);
+			return 1;
+		}
+		switch(optionIndex) {
+			case 0: displayHelp(argv[0]); return 0;
+			case 1: nTasks = boost::lexical_cast<long>(optarg); break;
+			case 2: workNs = boost::lexical_cast<double>(optarg); break;
+			case 3: onlyWorkers = boost::lexical_cast<int>(optarg); break;
+			case 4: maxQueueSize = boost::lexical_cast<int>(optarg); break;
+			default: displayHelp(argv[0]); return 1;
+		}
+	}
+
+	vector<int> workerCounts;
+	if(onlyWorkers > 0) {
+		workerCounts.push_back(onlyWorkers);
+	}
+	else {
+		for(int n = 1; n < nCPU; n *= 2) workerCounts.push_back(n);
+		workerCounts.push_back(nCPU);
+	}
+
+	printf("# tasks = %ld, work = %.0f ns/task, queue depth = %d\n", nTasks, workNs, maxQueueSize);
+	printf("# %8s %16s %16s %8s\n", "workers", "reference [t/s]", "stealing [t/s]", "ratio");
+	for(auto n : workerCounts) {
+		ReferencePool *reference = new ReferencePool(n, maxQueueSize);
+		double rateReference = runBenchmark(reference, nTasks, workNs);
+		delete reference;
+
+		ThreadPool<int> *pool = new ThreadPool<int>(n, maxQueueSize);
+		double rateStealing = runBenchmark(pool, nTasks, workNs);
+		delete pool;
+
+		printf("  %8d %16.0f %16.0f %8.2f\n", n, rateReference, rateStealing, rateStealing/rateReference);
+	}
+	return 0;
+}
@@ -4,14 +4,44 @@
 #include <EventSourceSink.h>
 #include <Event.h>
 #include <UnorderedEventHandler.h>
+#include <ProcessHit.h>
+#include <ThreadPool.h>
 #include <event_decode.h>
 
 #include <vector>
+#include <string>
 
 static const unsigned MAX_NUMBER_CHANNELS = 4194304;
 
 namespace PETSYS {
 
+	/*! Set of channels, as a bitset over gChannelID. An empty mask holds no channel. */
+	class ChannelMask {
+	public:
+		ChannelMask() { };
+
+		void add(unsigned gChannelID);
+		bool empty() const { return bits.empty(); };
+		bool contains(unsigned gChannelID) const {
+			unsigned k = gChannelID / 64;
+			return k < bits.size() && ((bits[k] >> (gChannelID % 64)) & 1) != 0;
+		};
+
+		/*! Moves the words of the channels in the mask to the start of eventWords, keeping their order,
+		 * and returns their number.
+		 */
+		int filter(uint64_t *eventWords, int N) const;
+
+		/*! Parses a comma separated list of "portID/slaveID/chipID" (a whole ASIC),
+		 * "portID/slaveID/chipID/channelID" and gChannelID ranges ("N" or "N-M").
+		 * Throws std::runtime_error if it is not valid.
+		 */
+		static ChannelMask parse(const char *s);
+
+	private:
+		std::vector<uint64_t> bits;
+	};
+
 	class RawReader : public EventStream {
 	private:
 		struct UndecodedHit {
@@ -29,6 +59,23 @@ namespace PETSYS {
 			RawReader *reader;
 		};
 
+		/*! Decoder, CoarseSorter and ProcessHit in one stage.
+		 * Hits are handled a few frames at a time, while still in cache, and the undecoded buffer
+		 * is released as soon as it is decoded.
+		 */
+		class FusedDecoder : public UnorderedEventHandler<UndecodedHit, Hit> {
+		public:
+			FusedDecoder(RawReader *reader, SystemConfig *systemConfig, EventSink<Hit> *sink);
+			void report();
+		protected:
+			virtual EventBuffer<Hit> * handleEvents (EventBuffer<UndecodedHit> *inBuffer);
+		private:
+			RawReader *reader;
+			HitCalibrator calibrator;
+			Metrics::Counter *nBuffersInOrder;
+			Metrics::Counter *nBuffersFramesUnordered;
+		};
+
 
 	public:
 		~RawReader();
@@ -40,11 +87,75 @@ namespace PETSYS {
 
 		bool getNextStep();
 		void getStepValue(float &step1, float &step2);
-		void processStep(bool verbose, EventSink<RawHit> *pipeline);
+
+		/*! Data file range and values of a step, as listed in the index */
+		struct StepRange {
+			unsigned long long begin;
+			unsigned long long end;
+			float stepValue1;
+			float stepValue2;
+		};
+		/*! Appends the steps which getNextStep() has not reached yet to steps.
+		 * Returns false, reading nothing, while the data is still being acquired (temporary index).
+		 */
+		bool readStepIndex(std::vector<StepRange> &steps);
+		/*! Makes step the current step, in place of getNextStep() */
+		void setStep(const StepRange &step);
+		/*! Opens another reader of the same data file, with the same settings but its own file position
+		 * and pipeline, so that steps given with setStep() can be processed concurrently.
+		 */
+		RawReader *openCursor();
+		/*! Reads the current step through pipeline, whose buffers are processed by the workers of pool
+		 * (BaseThreadPool::getShared() when NULL). The pipeline is deleted at the end of the step,
+		 * unless kept with setKeepPipeline().
+		 */
+		void processStep(bool verbose, EventSink<RawHit> *pipeline, BaseThreadPool *pool = NULL);
+
+		/*! Same as processStep() followed by CoarseSorter and ProcessHit, done in a single stage
+		 * (see SystemConfig::processing_fused_decode).
+		 */
+		void processStep(bool verbose, SystemConfig *systemConfig, EventSink<Hit> *pipeline, BaseThreadPool *pool = NULL);
+
+		/*! Keeps the pipeline after each step, so that passing the same pipeline to the next processStep()
+		 * reuses its stages instead of building them again. A kept pipeline is deleted when another one
+		 * is passed, or with the reader.
+		 */
+		void setKeepPipeline(bool keep);
+
+		/*! Makes each buffer also carry the first nFrames frames of the next buffer (0, the default, disables it).
+		 * Buffers record their overlap, see AbstractEventBuffer::getTrailingOverlapBegin(),
+		 * so only pipelines whose stages take a single owner for the overlapping events should use it,
+		 * such as SimpleGrouper (see SimpleGrouper::getBufferOverlapFrames()).
+		 */
+		void setBufferOverlap(unsigned nFrames);
+
+		/*! Buffers hold whole frames, and are closed once they would exceed nEvents events
+		 * (DEFAULT_BUFFER_SIZE unless set), or as adapted by setAdaptiveBufferSize().
+		 */
+		void setBufferSize(unsigned nEvents);
+		/*! Adapts the buffer size while reading, within [minEvents, maxEvents], from the time
+		 * the pipeline takes per buffer and the idle time of the workers.
+		 * The size reached is kept for the next steps.
+		 */
+		void setAdaptiveBufferSize(unsigned minEvents, unsigned maxEvents);
+		unsigned getBufferSize() { return bufferSize; };
+
+		/*! Only reads the hits of the channels in mask, or of all channels if it is empty (the default).
+		 * Event words of other channels are dropped as each frame is read, before any buffer takes them,
+		 * and frames left without words are skipped. What was dropped is counted by the RawReader
+		 * metrics words_masked, frames_masked and bytes_masked.
+		 */
+		void setChannelMask(const ChannelMask &mask);
+
+		static const unsigned DEFAULT_BUFFER_SIZE = 4096;
 
 	private:
 		RawReader();
 		void processRange(unsigned long begin, unsigned long end, bool verbose, EventSink<RawHit> *pipeline);
+		void readStep(bool verbose, BaseThreadPool *pool);
+		void deletePipeline();
+		static void decodeHit(RawReader *reader, UndecodedHit &in, RawHit &out);
+		void appendFrame(EventBuffer<UndecodedHit> *buffer, long long firstFrame, long long frameID, const uint64_t *eventWords, int N);
 
 		FILE *indexFile;
 		bool indexIsTemp;
@@ -57,6 +168,7 @@ namespace PETSYS {
 
 
 		int dataFile;
+		std::string dataFileName;
 		char *dataFileBuffer;
 		char *dataFileBufferPtr;
 		char *dataFileBufferEnd;
@@ -65,6 +177,17 @@ namespace PETSYS {
 		unsigned frequency;
 		bool qdcMode[MAX_NUMBER_CHANNELS];		
 		int triggerID;
+		unsigned bufferOverlapFrames;
+		unsigned bufferSize;
+		bool bufferSizeAdaptive;
+		unsigned bufferSizeMin;
+		unsigned bufferSizeMax;
+		ChannelMask channelMask;
+
+		bool keepPipeline;
+		// Decoding stage heading the pipeline, and the pipeline it was made for
+		EventSink<UndecodedHit> *decoder;
+		void *decodedPipeline;
 		
 		
 	};
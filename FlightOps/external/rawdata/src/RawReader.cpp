@@ -1,6 +1,10 @@
 #include <shm_raw.h>
 #include "RawReader.h"
 #include <ThreadPool.h>
+#include <BufferPool.h>
+#include <Trace.h>
+#include <Affinity.h>
+#include <CoarseSorter.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -38,7 +42,9 @@ static void normalizeLine(char *line) {
 
 
 RawReader::RawReader() :
-	dataFile(-1), indexFile(NULL)
+	dataFile(-1), indexFile(NULL), bufferOverlapFrames(0),
+	bufferSize(DEFAULT_BUFFER_SIZE), bufferSizeAdaptive(false), bufferSizeMin(DEFAULT_BUFFER_SIZE), bufferSizeMax(DEFAULT_BUFFER_SIZE),
+	keepPipeline(false), decoder(NULL), decodedPipeline(NULL)
 {
 	assert(dataFileBufferSize >= MaxRawDataFrameSize * sizeof(uint64_t));
 	dataFileBuffer = new char[dataFileBufferSize];
@@ -48,6 +54,7 @@ RawReader::RawReader() :
 
 RawReader::~RawReader()
 {
+	deletePipeline();
 	delete [] dataFileBuffer;
 	close(dataFile);
 
@@ -82,6 +89,7 @@ RawReader *RawReader::openFile(const char *fnPrefix)
 
 
 	sprintf(fName, "%s.rawf", fnPrefix);
+	reader->dataFileName = fName;
 	reader->dataFile = open(fName, O_RDONLY);
 	if(reader->dataFile == -1) {
 		//fprintf(stderr, "Could not open '%s' for reading: %s\n", fName, strerror(errno));
@@ -234,6 +242,9 @@ int RawReader::readFromDataFile(char *buf, int count)
 
 bool  RawReader::getNextStep() {
 
+	// Cursors have no index
+	if(indexFile == NULL) return false;
+
 	if(!indexIsTemp) {
     long long discard1, discard2;
     int r = fscanf(indexFile, "%llu\t%llu\t%lld\t%lld\t%f\t%f\n",
@@ -270,6 +281,50 @@ void  RawReader::getStepValue(float &step1, float &step2)
 
 }
 
+bool RawReader::readStepIndex(std::vector<StepRange> &steps)
+{
+	if(indexFile == NULL || indexIsTemp) return false;
+
+	while(getNextStep()) {
+		StepRange step = { stepBegin, stepEnd, stepValue1, stepValue2 };
+		steps.push_back(step);
+	}
+	return true;
+}
+
+void RawReader::setStep(const StepRange &step)
+{
+	stepBegin = step.begin;
+	stepEnd = step.end;
+	stepValue1 = step.stepValue1;
+	stepValue2 = step.stepValue2;
+}
+
+RawReader *RawReader::openCursor()
+{
+	RawReader *cursor = new RawReader();
+	cursor->indexIsTemp = false;
+	cursor->dataFileName = dataFileName;
+	cursor->dataFile = open(dataFileName.c_str(), O_RDONLY);
+	if(cursor->dataFile == -1) {
+		std::ostringstream oss;
+		oss << "Could not open '" << dataFileName << "' for reading: " << strerror(errno);
+		delete cursor;
+		throw std::runtime_error(oss.str());
+	}
+
+	cursor->frequency = frequency;
+	cursor->triggerID = triggerID;
+	memcpy(cursor->qdcMode, qdcMode, sizeof(qdcMode));
+	cursor->bufferOverlapFrames = bufferOverlapFrames;
+	cursor->bufferSize = bufferSize;
+	cursor->bufferSizeAdaptive = bufferSizeAdaptive;
+	cursor->bufferSizeMin = bufferSizeMin;
+	cursor->bufferSizeMax = bufferSizeMax;
+	cursor->channelMask = channelMask;
+	return cursor;
+}
+
 unsigned long long RawReader::getStepBegin() {
 	return stepBegin;
 }
@@ -289,16 +344,227 @@ unsigned long long RawReader::getStepEnd() {
 	return stepEnd;
 }
 
-void RawReader::processStep(bool verbose, EventSink<RawHit> *sink)
+void RawReader::setBufferOverlap(unsigned nFrames)
+{
+	bufferOverlapFrames = nFrames;
+}
+
+void RawReader::setBufferSize(unsigned nEvents)
+{
+	bufferSize = max(nEvents, 1U);
+	bufferSizeAdaptive = false;
+	bufferSizeMin = bufferSize;
+	bufferSizeMax = bufferSize;
+}
+
+void RawReader::setAdaptiveBufferSize(unsigned minEvents, unsigned maxEvents)
+{
+	bufferSizeMin = max(minEvents, 1U);
+	bufferSizeMax = max(maxEvents, bufferSizeMin);
+	bufferSize = min(max(bufferSize, bufferSizeMin), bufferSizeMax);
+	bufferSizeAdaptive = true;
+}
+
+/*
+ * Buffer size adaptation: every ADAPT_INTERVAL buffers, the task time of the step and idle time since the last
+ * adaptation decide if the buffer size is doubled or halved.
+ * Tasks shorter than MIN_TASK_TIME spend too much in per buffer overhead, so buffers grow.
+ * Tasks longer than MAX_TASK_TIME, with workers idle more than MAX_IDLE_FRACTION of the time,
+ * leave too few buffers to share among the workers, so buffers shrink.
+ */
+static const unsigned ADAPT_INTERVAL = 16;
+static const u_int64_t MIN_TASK_TIME = 250000;		// ns
+static const u_int64_t MAX_TASK_TIME = 4000000;		// ns
+static const double MAX_IDLE_FRACTION = 0.25;
+
+namespace {
+	struct BufferSizeController {
+		u_int64_t lastTime;
+		u_int64_t lastBusyTime;
+		u_int64_t lastNTasks;
+
+		BufferSizeController(TaskGroup &tasks) {
+			lastTime = Metrics::now();
+			lastBusyTime = tasks.getBusyTime();
+			lastNTasks = tasks.getNTasksCompleted();
+		};
+
+		// With a shared pool, only the time spent on this step's tasks counts as busy
+		unsigned adapt(TaskGroup &tasks, unsigned size, unsigned minSize, unsigned maxSize) {
+			u_int64_t time = Metrics::now();
+			u_int64_t busyTime = tasks.getBusyTime();
+			u_int64_t nTasks = tasks.getNTasksCompleted();
+			// Not enough tasks completed yet to tell
+			if(nTasks - lastNTasks < ADAPT_INTERVAL / 2) return size;
+
+			double taskTime = double(busyTime - lastBusyTime) / (nTasks - lastNTasks);
+			double idleFraction = 1.0 - double(busyTime - lastBusyTime) / (double(time - lastTime) * tasks.getPool()->getNWorkers());
+			lastTime = time;
+			lastBusyTime = busyTime;
+			lastNTasks = nTasks;
+
+			if(taskTime < MIN_TASK_TIME)
+				size = min(2 * size, maxSize);
+			else if(taskTime > MAX_TASK_TIME && idleFraction > MAX_IDLE_FRACTION)
+				size = max(size / 2, minSize);
+			return size;
+		};
+	};
+}
+
+/*
+ * Appends the N event words of a frame to a buffer starting at frame firstFrame.
+ */
+void RawReader::appendFrame(EventBuffer<UndecodedHit> *buffer, long long firstFrame, long long frameID, const uint64_t *eventWords, int N)
+{
+	buffer->reserve(buffer->getUsed() + N);
+	UndecodedHit *p = buffer->getPtr() + buffer->getUsed();
+	for(int i = 0; i < N; i++) {
+		p[i].frameID = frameID - firstFrame;
+		p[i].eventWord = eventWords[i];
+	}
+	buffer->setUsed(buffer->getUsed() + N);
+}
+
+void RawReader::processStep(bool verbose, EventSink<RawHit> *sink, BaseThreadPool *pool)
+{
+	if(decoder == NULL || decodedPipeline != sink) {
+		deletePipeline();
+		decoder = new Decoder(this, sink);
+		decodedPipeline = sink;
+	}
+	readStep(verbose, pool);
+}
+
+void RawReader::processStep(bool verbose, SystemConfig *systemConfig, EventSink<Hit> *sink, BaseThreadPool *pool)
+{
+	if(decoder == NULL || decodedPipeline != sink) {
+		deletePipeline();
+		decoder = new FusedDecoder(this, systemConfig, sink);
+		decodedPipeline = sink;
+	}
+	readStep(verbose, pool);
+}
+
+void RawReader::setChannelMask(const ChannelMask &mask)
+{
+	channelMask = mask;
+}
+
+void ChannelMask::add(unsigned gChannelID)
+{
+	assert(gChannelID < MAX_NUMBER_CHANNELS);
+	if(bits.empty()) bits.assign(MAX_NUMBER_CHANNELS / 64, 0);
+	bits[gChannelID / 64] |= 1ULL << (gChannelID % 64);
+}
+
+int ChannelMask::filter(uint64_t *eventWords, int N) const
+{
+	// Every word is copied and only kept ones advance n, so there is no branch to mispredict
+	int n = 0;
+	for(int i = 0; i < N; i++) {
+		uint64_t word = eventWords[i];
+		eventWords[n] = word;
+		n += contains(RawEventWord(word).getChannelID()) ? 1 : 0;
+	}
+	return n;
+}
+
+ChannelMask ChannelMask::parse(const char *s)
+{
+	ChannelMask mask;
+	std::string list(s);
+	size_t begin = 0;
+	while(begin <= list.size()) {
+		size_t end = list.find(',', begin);
+		if(end == std::string::npos) end = list.size();
+		std::string item = list.substr(begin, end - begin);
+		begin = end + 1;
+
+		unsigned portID, slaveID, chipID, channelID, first, last;
+		char extra;
+		if(sscanf(item.c_str(), "%u/%u/%u/%u %c", &portID, &slaveID, &chipID, &channelID, &extra) == 4
+			&& portID < 32 && slaveID < 32 && chipID < 64 && channelID < 64) {
+			first = (portID << 17) | (slaveID << 12) | (chipID << 6) | channelID;
+			last = first;
+		}
+		else if(sscanf(item.c_str(), "%u/%u/%u %c", &portID, &slaveID, &chipID, &extra) == 3
+			&& portID < 32 && slaveID < 32 && chipID < 64) {
+			first = (portID << 17) | (slaveID << 12) | (chipID << 6);
+			last = first + 63;
+		}
+		else if(sscanf(item.c_str(), "%u-%u %c", &first, &last, &extra) == 2) {
+		}
+		else if(sscanf(item.c_str(), "%u %c", &first, &extra) == 1) {
+			last = first;
+		}
+		else {
+			first = 1;
+			last = 0;
+		}
+
+		if(first > last || last >= MAX_NUMBER_CHANNELS) {
+			std::ostringstream oss;
+			oss << "Invalid channel mask item '" << item << "' in '" << s << "'";
+			throw std::runtime_error(oss.str());
+		}
+		for(unsigned gChannelID = first; gChannelID <= last; gChannelID++)
+			mask.add(gChannelID);
+	}
+	return mask;
+}
+
+void RawReader::setKeepPipeline(bool keep)
+{
+	keepPipeline = keep;
+}
+
+void RawReader::deletePipeline()
 {
-	auto pool = new ThreadPool<UndecodedHit>();
-	auto mysink = new Decoder(this, sink);
+	// The decoding stage deletes the rest of the pipeline
+	delete decoder;
+	decoder = NULL;
+	decodedPipeline = NULL;
+}
+
+/*
+ * Reads the current step into buffers of undecoded hits and passes them to the decoding stage,
+ * which is deleted with the rest of the pipeline at the end unless the pipeline is kept.
+ */
+void RawReader::readStep(bool verbose, BaseThreadPool *pool)
+{
+	EventSink<UndecodedHit> *mysink = decoder;
+	// Jobs of this step, sharing the pool with any other pipelines
+	TaskGroup tasks((pool != NULL) ? pool : BaseThreadPool::getShared());
 	mysink->pushT0(0);
+
+	// The calling thread is only lent to the reader for this step
+	Affinity::ScopedPin pin(Affinity::READER);
+	if(Trace::isEnabled()) Trace::setThreadName("RawReader");
+	StageMetrics metrics("RawReader");
+	Metrics::Counter *mFrames = metrics.counter("frames");
+	Metrics::Counter *mFramesLost0 = metrics.counter("frames_lost_all");
+	Metrics::Counter *mFramesLostN = metrics.counter("frames_lost_some");
+	Metrics::Counter *mEventsNoLost = metrics.counter("events");
+	Metrics::Counter *mEventsSomeLost = metrics.counter("events_some_lost");
+	Metrics::Counter *mWordsMasked = metrics.counter("words_masked");
+	Metrics::Counter *mFramesMasked = metrics.counter("frames_masked");
+	Metrics::Counter *mBytesMasked = metrics.counter("bytes_masked");
+	Metrics::Counter *mBuffers = metrics.counter("buffers");
+	Metrics::Histogram *mBufferEvents = metrics.histogram("buffer_events");
+	Metrics::Gauge *mBufferSize = metrics.gauge("buffer_size");
+	mBufferSize->set(bufferSize);
+	BufferSizeController sizeController(tasks);
+	unsigned minBufferSize = bufferSize;
+	unsigned maxBufferSize = bufferSize;
 	
 	RawDataFrame *dataFrame = new RawDataFrame;
 	EventBuffer<UndecodedHit> *outBuffer = NULL; 
 	size_t seqN = 0;
 	long long currentBufferFirstFrame = 0;
+	// Previous buffer, still receiving its trailing overlap
+	EventBuffer<UndecodedHit> *pendingBuffer = NULL;
+	long long pendingBufferFirstFrame = 0;
 	
 	long long lastFrameID = -1;
 	bool lastFrameWasLost0 = false;
@@ -307,6 +573,54 @@ void RawReader::processStep(bool verbose, EventSink<RawHit> *sink)
 	long long nFramesLostN = 0;
 	long long nEventsNoLost = 0;
 	long long nEventsSomeLost = 0;
+	long long nWordsMasked = 0;
+	long long nFramesMasked = 0;
+	// Counts already published to metrics
+	long long pFrames = 0, pFramesLost0 = 0, pFramesLostN = 0, pEventsNoLost = 0, pEventsSomeLost = 0;
+	long long pWordsMasked = 0, pFramesMasked = 0;
+	// Publishes the counts of the frames read so far
+	auto publishCounts = [&]() {
+		mFrames->add(nFrames - pFrames);
+		mFramesLost0->add(nFramesLost0 - pFramesLost0);
+		mFramesLostN->add(nFramesLostN - pFramesLostN);
+		mEventsNoLost->add(nEventsNoLost - pEventsNoLost);
+		mEventsSomeLost->add(nEventsSomeLost - pEventsSomeLost);
+		mWordsMasked->add(nWordsMasked - pWordsMasked);
+		mFramesMasked->add(nFramesMasked - pFramesMasked);
+		// Frames skipped whole also save their header
+		mBytesMasked->add((nWordsMasked - pWordsMasked) * sizeof(uint64_t) + (nFramesMasked - pFramesMasked) * 2 * sizeof(uint64_t));
+		pFrames = nFrames;
+		pFramesLost0 = nFramesLost0;
+		pFramesLostN = nFramesLostN;
+		pEventsNoLost = nEventsNoLost;
+		pEventsSomeLost = nEventsSomeLost;
+		pWordsMasked = nWordsMasked;
+		pFramesMasked = nFramesMasked;
+	};
+	auto queueBuffer = [&](EventBuffer<UndecodedHit> *buffer) {
+		publishCounts();
+		mBuffers->increment();
+		mBufferEvents->record(buffer->getSize());
+		if(bufferSizeAdaptive && (buffer->getSeqN() % ADAPT_INTERVAL) == ADAPT_INTERVAL - 1) {
+			unsigned newSize = sizeController.adapt(tasks, bufferSize, bufferSizeMin, bufferSizeMax);
+			if(newSize != bufferSize) {
+				bufferSize = newSize;
+				mBufferSize->set(bufferSize);
+				minBufferSize = min(minBufferSize, bufferSize);
+				maxBufferSize = max(maxBufferSize, bufferSize);
+				if(Trace::isEnabled()) Trace::instant("RawReader buffer size", buffer->getSeqN(), bufferSize);
+			}
+		}
+		if(Trace::isEnabled()) {
+			// Queueing blocks while the step has too many jobs waiting
+			u_int64_t seqN = buffer->getSeqN();
+			Trace::begin("RawReader queue", seqN, buffer->getSize());
+			tasks.queueTask(buffer, mysink);
+			Trace::end("RawReader queue", seqN, 0);
+			return;
+		}
+		tasks.queueTask(buffer, mysink);
+	};
 	
 	// Set file handle to start of step
 	lseek(dataFile, getStepBegin(), SEEK_SET);
@@ -363,42 +677,78 @@ void RawReader::processStep(bool verbose, EventSink<RawHit> *sink)
 		assert(r == N*sizeof(uint64_t));
 		currentPosition += r;
 
-		// Blocksize
-		// Best block size from profiling: 2048
-		// but handle larger frames correctly
-		size_t allocSize = max(N, 2048);
+		if(!channelMask.empty()) {
+			int nKept = channelMask.filter(dataFrame->data + 2, N);
+			nWordsMasked += N - nKept;
+			N = nKept;
+			if(N == 0) {
+				nFramesMasked += 1;
+				continue;
+			}
+		}
+
+		// Handle frames larger than a buffer correctly
+		size_t allocSize = max((unsigned)N, bufferSize);
+
+		// The previous buffer has its whole trailing overlap
+		if((pendingBuffer != NULL) && (frameID >= currentBufferFirstFrame + bufferOverlapFrames)) {
+			queueBuffer(pendingBuffer);
+			pendingBuffer = NULL;
+		}
+
 		if(outBuffer == NULL) {
 			currentBufferFirstFrame = dataFrame->getFrameID();
 			outBuffer = new EventBuffer<UndecodedHit>(allocSize, seqN, currentBufferFirstFrame * 1024);
 			seqN += 1;
 		}
-		else if((outBuffer->getFree() < N) || ((frameID - currentBufferFirstFrame) > (1LL << 32))) {
-			// Buffer is full or buffer is covering too much time
-			pool->queueTask(outBuffer, mysink);
+		else if(((outBuffer->getUsed() + N > bufferSize) || ((frameID - currentBufferFirstFrame) > (1LL << 32)))
+			&& (frameID >= currentBufferFirstFrame + bufferOverlapFrames)) {
+			// Buffer is full or buffer is covering too much time,
+			// but it is not closed before its leading overlap is complete
+			if(bufferOverlapFrames > 0) {
+				// Keep it until it has a copy of the first frames of the next buffer
+				outBuffer->setTrailingOverlap(frameID * 1024, (frameID + bufferOverlapFrames) * 1024);
+				pendingBuffer = outBuffer;
+				pendingBufferFirstFrame = currentBufferFirstFrame;
+			}
+			else {
+				queueBuffer(outBuffer);
+			}
 			currentBufferFirstFrame = dataFrame->getFrameID();
 			outBuffer = new EventBuffer<UndecodedHit>(allocSize, seqN, currentBufferFirstFrame * 1024);
+			if(bufferOverlapFrames > 0)
+				outBuffer->setLeadingOverlap((frameID + bufferOverlapFrames) * 1024);
 			seqN += 1;
 		}
 
-		UndecodedHit *p = outBuffer->getPtr() + outBuffer->getUsed();
-		for(int i = 0; i < N; i++) {
-			p[i].frameID = frameID - currentBufferFirstFrame;
-			p[i].eventWord = dataFrame->data[2+i];
-		}
-		outBuffer->setUsed(outBuffer->getUsed() + N);
+		appendFrame(outBuffer, currentBufferFirstFrame, frameID, dataFrame->data + 2, N);
 		outBuffer->setTMax((frameID + 1) * 1024);
+		if(pendingBuffer != NULL)
+			appendFrame(pendingBuffer, pendingBufferFirstFrame, frameID, dataFrame->data + 2, N);
 	}
 	
+	if(pendingBuffer != NULL) {
+		queueBuffer(pendingBuffer);
+		pendingBuffer = NULL;
+	}
+
 	if(outBuffer != NULL) {
-		pool->queueTask(outBuffer, mysink);
+		queueBuffer(outBuffer);
 		outBuffer = NULL;
 	}
+	// Frames after the last buffer, which had no events
+	publishCounts();
 	
-	pool->completeQueue();
-	delete pool;
+	tasks.complete();
 	
 	mysink->finish();
 	if(verbose) {
+		Metrics::Snapshot ms = metrics.snapshot();
+		long long nFrames = metrics.get(ms, "frames");
+		long long nFramesLost0 = metrics.get(ms, "frames_lost_all");
+		long long nFramesLostN = metrics.get(ms, "frames_lost_some");
+		long long nEventsNoLost = metrics.get(ms, "events");
+		long long nEventsSomeLost = metrics.get(ms, "events_some_lost");
 		fprintf(stderr, "RawReader report\n");
 		fprintf(stderr, "step values: %f %f\n", stepValue1, stepValue2);
 		fprintf(stderr, " data frames\n");
@@ -409,20 +759,54 @@ void RawReader::processStep(bool verbose, EventSink<RawHit> *sink)
 		fprintf(stderr, " %10lld total\n", nEventsNoLost + nEventsSomeLost);
 		long long goodFrames = nFrames - nFramesLost0 - nFramesLostN;
 		fprintf(stderr, " %10.1f events per frame avergage\n", 1.0 * nEventsNoLost / goodFrames);
-		sink->report();
+		if(!channelMask.empty()) {
+			long long nWordsMasked = metrics.get(ms, "words_masked");
+			fprintf(stderr, " %10lld (%4.1f%%) dropped by the channel mask\n", nWordsMasked, 100.0 * nWordsMasked / (nEventsNoLost + nEventsSomeLost));
+			fprintf(stderr, " %10ld frames skipped, %.1f MiB not decoded\n", metrics.get(ms, "frames_masked"), metrics.get(ms, "bytes_masked") / 1048576.0);
+		}
+		const Metrics::Value *bufferEvents = ms.find(metrics.getStage(), "buffer_events");
+		fprintf(stderr, " buffers\n");
+		fprintf(stderr, " %10ld total\n", metrics.get(ms, "buffers"));
+		if(bufferEvents != NULL && bufferEvents->value > 0)
+			fprintf(stderr, " %10.1f events per buffer average\n", double(bufferEvents->sum) / bufferEvents->value);
+		if(bufferSizeAdaptive)
+			fprintf(stderr, " %10u events target (adaptive, %u to %u during step, bounds %u to %u)\n",
+				bufferSize, minBufferSize, maxBufferSize, bufferSizeMin, bufferSizeMax);
+		else
+			fprintf(stderr, " %10u events target (fixed)\n", bufferSize);
+		mysink->report();
+		BufferPool::report();
 	}
 
 	delete dataFrame;
-	delete sink;
+	if(!keepPipeline) deletePipeline();
 	
 }
 
 RawReader::Decoder::Decoder(RawReader *reader, EventSink<RawHit> *sink) : 
-	UnorderedEventHandler<RawReader::UndecodedHit, RawHit>(sink), reader(reader)
+	UnorderedEventHandler<RawReader::UndecodedHit, RawHit>(sink, "Decoder"), reader(reader)
 {
 }
 
 
+inline void RawReader::decodeHit(RawReader *reader, UndecodedHit &in, RawHit &out)
+{
+	RawEventWord e = RawEventWord(in.eventWord);
+	out.channelID = e.getChannelID();
+	out.qdcMode = reader->isQDC(out.channelID);
+	out.tacID = e.getTacID();
+	out.frameID = in.frameID;
+	out.tcoarse = e.getTCoarse();
+	out.tfine = e.getTFine();
+	out.ecoarse = e.getECoarse();
+	out.efine = e.getEFine();
+
+	out.time = in.frameID * 1024 + out.tcoarse;
+	out.timeEnd = in.frameID * 1024 + out.ecoarse;
+	if((out.timeEnd - out.time) < -256) out.timeEnd += 1024;
+	out.valid = true;
+}
+
 EventBuffer<RawHit> * RawReader::Decoder::handleEvents(EventBuffer<RawReader::UndecodedHit > *inBuffer)
 {
 	unsigned N =  inBuffer->getSize();
@@ -432,20 +816,7 @@ EventBuffer<RawHit> * RawReader::Decoder::handleEvents(EventBuffer<RawReader::Un
 	UndecodedHit *pe = pi + N;
 	RawHit *po = outBuffer->getPtr();
 	for(; pi < pe; pi++, po++) {
-		RawEventWord e = RawEventWord(pi->eventWord);
-		po->channelID = e.getChannelID();
-		po->qdcMode = reader->isQDC(po->channelID);
-		po->tacID = e.getTacID();
-		po->frameID = pi->frameID;
-		po->tcoarse = e.getTCoarse();
-		po->tfine = e.getTFine();
-		po->ecoarse = e.getECoarse();
-		po->efine = e.getEFine();
-
-		po->time = pi->frameID * 1024 + po->tcoarse;
-		po->timeEnd = pi->frameID * 1024 + po->ecoarse;
-		if((po->timeEnd - po->time) < -256) po->timeEnd += 1024;
-		po->valid = true;
+		decodeHit(reader, *pi, *po);
 	}
 	outBuffer->setUsed(N);
 	return outBuffer;
@@ -454,5 +825,86 @@ EventBuffer<RawHit> * RawReader::Decoder::handleEvents(EventBuffer<RawReader::Un
 
 void RawReader::Decoder::report()
 {
+	Metrics::Snapshot s = metrics->snapshot();
+	fprintf(stderr, ">> Decoder report\n");
+	fprintf(stderr, " events decoded\n");
+	fprintf(stderr, "  %10ld\n", metrics->get(s, "events"));
 	UnorderedEventHandler<RawReader::UndecodedHit,RawHit>::report();
 }
+
+// Hits decoded, sorted and calibrated at a time by FusedDecoder, rounded up to whole frames
+static const unsigned FUSED_CHUNK_SIZE = 256;
+
+RawReader::FusedDecoder::FusedDecoder(RawReader *reader, SystemConfig *systemConfig, EventSink<Hit> *sink) :
+	UnorderedEventHandler<RawReader::UndecodedHit, Hit>(sink, "FusedDecoder"), reader(reader), calibrator(systemConfig, reader, metrics)
+{
+	nBuffersInOrder = metrics->counter("buffers_in_order");
+	nBuffersFramesUnordered = metrics->counter("buffers_frames_unordered");
+}
+
+EventBuffer<Hit> * RawReader::FusedDecoder::handleEvents(EventBuffer<RawReader::UndecodedHit > *inBuffer)
+{
+	unsigned N =  inBuffer->getSize();
+
+	// The decoded hits take the place of the undecoded buffer, which is not kept
+	EventBuffer<RawHit> *rawBuffer = new EventBuffer<RawHit>(N, inBuffer->getSeqN(), inBuffer->getTMin());
+	rawBuffer->setTMax(inBuffer->getTMax());
+	rawBuffer->setLeadingOverlap(inBuffer->getLeadingOverlapEnd());
+	rawBuffer->setTrailingOverlap(inBuffer->getTrailingOverlapBegin(), inBuffer->getTrailingOverlapEnd());
+	rawBuffer->setUsed(N);
+	EventBuffer<Hit> *outBuffer = new EventBuffer<Hit>(N, rawBuffer);
+
+	UndecodedHit *pi = inBuffer->getPtr();
+	RawHit *hits = rawBuffer->getPtr();
+	HitCalibrator::Counters counters;
+	bool moved = false;
+	bool framesInOrder = true;
+
+	// Frames come in order from processStep(), so each chunk of whole frames can be sorted on its own
+	unsigned begin = 0;
+	unsigned end = 0;
+	while(end < N) {
+		for(; end < N; end++) {
+			if(end > 0 && pi[end].frameID != pi[end-1].frameID) {
+				if(pi[end].frameID < pi[end-1].frameID) framesInOrder = false;
+				if(!framesInOrder || (end - begin) >= FUSED_CHUNK_SIZE) break;
+			}
+			decodeHit(reader, pi[end], hits[end]);
+		}
+		if(!framesInOrder) break;
+
+		moved |= CoarseSorter::sortInPlace(hits + begin, end - begin);
+		calibrator.calibrate(hits + begin, end - begin, outBuffer, counters);
+		begin = end;
+	}
+
+	if(!framesInOrder) {
+		// Decode the rest and start over with the whole buffer, as CoarseSorter and ProcessHit would
+		for(; end < N; end++)
+			decodeHit(reader, pi[end], hits[end]);
+		outBuffer->setUsed(0);
+		counters = HitCalibrator::Counters();
+		CoarseSorter::sortInPlace(hits, N);
+		calibrator.calibrate(hits, N, outBuffer, counters);
+		nBuffersFramesUnordered->increment();
+	}
+	else if(!moved) {
+		nBuffersInOrder->increment();
+	}
+	delete inBuffer;
+
+	calibrator.accumulate(counters);
+	return outBuffer;
+}
+
+void RawReader::FusedDecoder::report()
+{
+	Metrics::Snapshot s = metrics->snapshot();
+	fprintf(stderr, ">> FusedDecoder report\n");
+	fprintf(stderr, " events decoded\n");
+	fprintf(stderr, "  %10ld\n", metrics->get(s, "events"));
+	fprintf(stderr, "  %10ld buffers already in order\n", metrics->get(s, "buffers_in_order"));
+	fprintf(stderr, "  %10ld buffers with frames out of order\n", metrics->get(s, "buffers_frames_unordered"));
+	calibrator.report();
+	UnorderedEventHandler<RawReader::UndecodedHit, Hit>::report();
+}
@@ -0,0 +1,649 @@
+/*
+ * Synthetic raw data generator.
+ *
+ * Writes <prefix>.rawf and <prefix>.idxf (and <prefix>.modf in mixed mode) in the format written by write_raw
+ * and read by RawReader, from a simple model of a detector:
+ * decays at a fixed rate give one photon, or a back to back pair in opposite trigger regions,
+ * and each photon fires a cluster of neighbouring channels of its region.
+ *
+ * The data is generated in blocks of frames, each from its own seed derived from the global one,
+ * so the output only depends on the options and not on the number of threads.
+ * Hits pushed past the end of their block by the time skew and jitter are dropped.
+ */
+#include <shm_raw.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+
+using namespace std;
+
+static const unsigned BLOCK_FRAMES = 4096;
+static const unsigned STEP_GAP_FRAMES = 1024;
+static const uint64_t FRAME_LOST = 1ULL << 16;
+static const unsigned MAX_FRAME_EVENTS = (PETSYS::MaxRawDataFrameSize - 2) < 0x7FFF ? (PETSYS::MaxRawDataFrameSize - 2) : 0x7FFF;
+
+enum Mode { MODE_TOT, MODE_QDC, MODE_MIXED };
+
+// Small deterministic generator, so that files are the same across builds
+class Random {
+public:
+	Random(uint64_t seed) : state(seed * 6364136223846793005ULL + 1442695040888963407ULL) { if(state == 0) state = 1; };
+	uint64_t next() {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 2685821657736338717ULL;
+	};
+	unsigned uniform(unsigned n) { return (next() >> 32) * n >> 32; };
+	double uniform01() { return (next() >> 11) * (1.0 / 9007199254740992.0); };
+	double gauss() {
+		double u1 = uniform01();
+		double u2 = uniform01();
+		return sqrt(-2 * log(1 - u1)) * cos(2 * M_PI * u2);
+	};
+	long long poisson(double mean) {
+		if(mean <= 0) return 0;
+		if(mean < 50) {
+			double l = exp(-mean);
+			long long k = 0;
+			double p = uniform01();
+			while(p > l) {
+				p *= uniform01();
+				k += 1;
+			}
+			return k;
+		}
+		long long k = llround(mean + sqrt(mean) * gauss());
+		return (k > 0) ? k : 0;
+	};
+private:
+	uint64_t state;
+};
+
+// splitmix64, for the seeds of the blocks
+static uint64_t mixSeed(uint64_t seed, uint64_t n)
+{
+	uint64_t z = seed + (n + 1) * 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+struct Channel {
+	unsigned gid;
+	bool qdc;
+	double skew;		// clocks
+};
+
+struct Region {
+	vector<unsigned> channels;	// Indexes into the channel list, in map order
+	unsigned opposite;		// Region of the other photon of a pair
+};
+
+struct Model {
+	double frequency;
+	double decayRate;
+	double coincidenceFraction;
+	double meanClusterSize;
+	unsigned maxClusterSize;
+	double jitter;			// clocks
+	double lostFraction;
+	double partialLostFraction;
+	vector<Channel> channels;
+	vector<Region> regions;
+};
+
+struct BlockSpec {
+	unsigned step;
+	long long firstFrame;
+	unsigned nFrames;
+	bool stepBegin;
+	bool stepEnd;
+	uint64_t seed;
+};
+
+// Frames of a block, ready to be written
+struct BlockData {
+	vector<uint64_t> words;
+	long long nHits;
+	long long nFramesLost;
+	long long lastFrameWritten;
+};
+
+/*
+ * Generates the frames of a block; each thread has its own generator.
+ */
+class BlockGenerator {
+public:
+	BlockGenerator(const Model &model) : model(model) { };
+	void generate(const BlockSpec &spec, BlockData &data);
+
+private:
+	void addPhoton(Random &random, const BlockSpec &spec, BlockData &data, unsigned frame, double t, unsigned region);
+
+	const Model &model;
+	// Hits pushed into later frames by the time skew and jitter
+	vector<pair<unsigned, uint64_t> > pending;
+};
+
+static inline unsigned rawFine(unsigned v)
+{
+	// RawEventWord adds 27 when decoding
+	return (v + 1024 - 27) % 1024;
+}
+
+// Appends the hits of the current frame to data.words and keeps those of later frames in pending
+void BlockGenerator::addPhoton(Random &random, const BlockSpec &spec, BlockData &data, unsigned frame, double t, unsigned region)
+{
+	const Region &r = model.regions[region];
+	unsigned nChannels = r.channels.size();
+
+	// Geometric cluster size with the given mean, limited by the region size
+	unsigned k = 1;
+	double pMore = 1.0 - 1.0 / model.meanClusterSize;
+	while(k < model.maxClusterSize && k < nChannels && random.uniform01() < pMore) k++;
+
+	unsigned first = random.uniform(nChannels);
+	double energy = 511;
+	for(unsigned j = 0; j < k; j++) {
+		const Channel &channel = model.channels[r.channels[(first + j) % nChannels]];
+		// One draw for all the random fields of the hit
+		uint64_t bits = random.next();
+
+		double share = energy;
+		if(j < k - 1) share = energy * (0.5 + 0.3 / 65536 * (bits & 0xFFFF));
+		energy -= share;
+
+		double ht = t + channel.skew + model.jitter / 65536 * ((bits >> 16) & 0xFFFF);
+		long long c = (long long)ht;
+		unsigned hitFrame = c >> 10;
+		if(hitFrame >= spec.nFrames) continue;
+		double phase = ht - c;
+
+		unsigned tcoarse = c & 1023;
+		unsigned tfine = 100 + (unsigned)((1 - phase) * 300);
+		unsigned ecoarse, efine;
+		if(channel.qdc) {
+			// Integration window and charge
+			ecoarse = (c + 100 + ((bits >> 32) & 0xFFFF) * 50 / 65536) & 1023;
+			efine = min(1023U, 50 + (unsigned)(share * 1.5));
+		}
+		else {
+			// Time over threshold
+			ecoarse = (c + 20 + (unsigned)(share * 0.3)) & 1023;
+			efine = 100 + ((bits >> 32) & 0xFFFF) * 300 / 65536;
+		}
+		uint64_t word = uint64_t(rawFine(efine))
+			| (uint64_t(rawFine(tfine)) << 10)
+			| (uint64_t(ecoarse) << 20)
+			| (uint64_t(tcoarse) << 30)
+			| (((bits >> 48) & 3) << 40)
+			| (uint64_t(channel.gid) << 42);
+		if(hitFrame == frame)
+			data.words.push_back(word);
+		else
+			pending.push_back(make_pair(hitFrame, word));
+	}
+}
+
+void BlockGenerator::generate(const BlockSpec &spec, BlockData &data)
+{
+	Random random(spec.seed);
+	pending.clear();
+	data.words.clear();
+	data.nHits = 0;
+	data.nFramesLost = 0;
+
+	double frameDecays = model.decayRate * 1024 / model.frequency;
+	unsigned nRegions = model.regions.size();
+	bool lastEmpty = false;
+	bool lastAllLost = false;
+	bool lossEnabled = (model.lostFraction > 0) || (model.partialLostFraction > 0);
+	for(unsigned f = 0; f < spec.nFrames; f++) {
+		// Header, filled in below
+		size_t header = data.words.size();
+		data.words.push_back(0);
+		data.words.push_back(0);
+
+		for(size_t k = 0; k < pending.size(); ) {
+			if(pending[k].first == f) {
+				data.words.push_back(pending[k].second);
+				pending[k] = pending.back();
+				pending.pop_back();
+			}
+			else {
+				k++;
+			}
+		}
+
+		long long nDecays = random.poisson(frameDecays);
+		for(long long n = 0; n < nDecays; n++) {
+			double t = (f + random.uniform01()) * 1024;
+			unsigned region = random.uniform(nRegions);
+			addPhoton(random, spec, data, f, t, region);
+			if(random.uniform01() < model.coincidenceFraction)
+				addPhoton(random, spec, data, f, t, model.regions[region].opposite);
+		}
+
+		unsigned N = data.words.size() - header - 2;
+		bool lost = false;
+		if(lossEnabled) {
+			double u = random.uniform01();
+			if(u < model.lostFraction) {
+				N = 0;
+				lost = true;
+			}
+			else if(u < model.lostFraction + model.partialLostFraction && N > 0) {
+				N = N / 2;
+				lost = true;
+			}
+		}
+		if(N > MAX_FRAME_EVENTS) {
+			N = MAX_FRAME_EVENTS;
+			lost = true;
+		}
+		if(lost) data.nFramesLost += 1;
+
+		// As write_raw, only the first of a run of empty or of all lost frames is written,
+		// RawReader accounts the frames skipped after it as the same.
+		// The first and last frames of a step are always written.
+		bool empty = (N == 0) && !lost;
+		bool allLost = (N == 0) && lost;
+		bool mustWrite = (f == 0) || (spec.stepEnd && f == spec.nFrames - 1);
+		bool skip = !mustWrite && ((empty && lastEmpty) || (allLost && lastAllLost));
+		lastEmpty = empty;
+		lastAllLost = allLost;
+		if(skip) {
+			data.words.resize(header);
+			continue;
+		}
+
+		long long frameID = spec.firstFrame + f;
+		data.words.resize(header + 2 + N);
+		data.words[header] = uint64_t(frameID) | (uint64_t(N + 2) << 36);
+		data.words[header + 1] = uint64_t(N) | (lost ? FRAME_LOST : 0);
+		data.nHits += N;
+		data.lastFrameWritten = frameID;
+	}
+}
+
+struct Worker {
+	pthread_t thread;
+	BlockGenerator *generator;
+	const BlockSpec *spec;
+	BlockData *data;
+};
+
+static void *workerRoutine(void *arg)
+{
+	Worker *worker = (Worker *)arg;
+	worker->generator->generate(*worker->spec, *worker->data);
+	return NULL;
+}
+
+// Channels of a channel map file (portID slaveID chipID channelID region ...) grouped by region
+static bool loadChannelMap(const char *fn, vector<Channel> &channels, vector<vector<unsigned> > &regionChannels)
+{
+	FILE *f = fopen(fn, "r");
+	if(f == NULL) {
+		fprintf(stderr, "Could not open '%s' for reading: %s\n", fn, strerror(errno));
+		return false;
+	}
+	map<int, unsigned> regionIndex;
+	char line[1024];
+	while(fgets(line, sizeof(line), f) != NULL) {
+		char *comment = strchr(line, '#');
+		if(comment != NULL) *comment = 0;
+		unsigned portID, slaveID, chipID, channelID;
+		int region;
+		if(sscanf(line, "%u %u %u %u %d", &portID, &slaveID, &chipID, &channelID, &region) != 5) continue;
+		Channel channel = { channelID | (chipID << 6) | (slaveID << 12) | (portID << 17), false, 0 };
+		auto r = regionIndex.find(region);
+		if(r == regionIndex.end()) {
+			r = regionIndex.insert(make_pair(region, (unsigned)regionIndex.size())).first;
+			regionChannels.resize(regionIndex.size());
+		}
+		regionChannels[r->second].push_back(channels.size());
+		channels.push_back(channel);
+	}
+	fclose(f);
+	return true;
+}
+
+static void displayHelp(char *program)
+{
+	fprintf(stderr, "Usage: %s -o <output prefix> [optional arguments]\n", program);
+	fprintf(stderr, "Arguments:\n");
+	fprintf(stderr, "  -o \t\t\t Output file prefix: writes <prefix>.rawf, <prefix>.idxf and, in mixed mode, <prefix>.modf\n");
+	fprintf(stderr, "Optional flags:\n");
+	fprintf(stderr, "  --mode MODE \t\t tot, qdc or mixed (QDC on even ASICs). Default: qdc\n");
+	fprintf(stderr, "  --frequency F \t System clock frequency in Hz. Default: 200E6\n");
+	fprintf(stderr, "  --rate R \t\t Decays per second. Default: 1E6\n");
+	fprintf(stderr, "  --coincidences F \t Fraction of decays giving a back to back photon pair. Default: 0.3\n");
+	fprintf(stderr, "  --cluster N \t\t Mean number of hits per photon. Default: 2\n");
+	fprintf(stderr, "  --max-cluster N \t Maximum number of hits per photon. Default: 16\n");
+	fprintf(stderr, "  --channels N \t\t Number of channels, without a channel map. Default: 1024\n");
+	fprintf(stderr, "  --region-channels N \t Channels per trigger region, without a channel map. Default: 64\n");
+	fprintf(stderr, "  --channel-map FILE \t Take channels and trigger regions from a channel map\n");
+	fprintf(stderr, "  --time-skew T \t Channel time offsets, uniform from 0 to T ns. Default: 2\n");
+	fprintf(stderr, "  --jitter T \t\t Hit time jitter, uniform from 0 to T ns. Default: 0.5\n");
+	fprintf(stderr, "  --steps N \t\t Number of steps. Default: 1\n");
+	fprintf(stderr, "  --step-time T \t Acquisition time of each step in seconds. Default: 1\n");
+	fprintf(stderr, "  --step1 V[:I] \t Step 1 value of the first step and increment per step. Default: 0:1\n");
+	fprintf(stderr, "  --step2 V[:I] \t Step 2 value of the first step and increment per step. Default: 0:0\n");
+	fprintf(stderr, "  --lost-frames F \t Fraction of frames with all events lost. Default: 0\n");
+	fprintf(stderr, "  --partial-lost F \t Fraction of frames with some events lost. Default: 0\n");
+	fprintf(stderr, "  --trigger-id N \t Trigger ID written to the header. Default: none\n");
+	fprintf(stderr, "  --seed N \t\t Random seed. Default: 1\n");
+	fprintf(stderr, "  --threads N \t\t Generator threads. Default: number of CPUs\n");
+	fprintf(stderr, "  --help \t\t Show this help message and exit \n");
+}
+
+static void parseStepValue(const char *s, float &value, float &increment)
+{
+	string v = s;
+	size_t colon = v.find(':');
+	value = boost::lexical_cast<float>(v.substr(0, colon));
+	if(colon != string::npos) increment = boost::lexical_cast<float>(v.substr(colon + 1));
+}
+
+static void writeError(const char *fn)
+{
+	fprintf(stderr, "ERROR writing to %s: %d %s\n", fn, errno, strerror(errno));
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	char *outputFilePrefix = NULL;
+	char *channelMapFileName = NULL;
+	Mode mode = MODE_QDC;
+	Model model;
+	model.frequency = 200E6;
+	model.decayRate = 1E6;
+	model.coincidenceFraction = 0.3;
+	model.meanClusterSize = 2;
+	model.maxClusterSize = 16;
+	model.lostFraction = 0;
+	model.partialLostFraction = 0;
+	double timeSkew = 2.0;
+	double jitter = 0.5;
+	unsigned nChannels = 1024;
+	unsigned regionChannels = 64;
+	unsigned nSteps = 1;
+	double stepTime = 1.0;
+	float step1 = 0, step1Increment = 1;
+	float step2 = 0, step2Increment = 0;
+	int triggerID = -1;
+	uint64_t seed = 1;
+	int nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	static struct option longOptions[] = {
+		{ "help", no_argument, 0, 0 },
+		{ "mode", required_argument, 0, 0 },
+		{ "frequency", required_argument, 0, 0 },
+		{ "rate", required_argument, 0, 0 },
+		{ "coincidences", required_argument, 0, 0 },
+		{ "cluster", required_argument, 0, 0 },
+		{ "max-cluster", required_argument, 0, 0 },
+		{ "channels", required_argument, 0, 0 },
+		{ "region-channels", required_argument, 0, 0 },
+		{ "channel-map", required_argument, 0, 0 },
+		{ "time-skew", required_argument, 0, 0 },
+		{ "jitter", required_argument, 0, 0 },
+		{ "steps", required_argument, 0, 0 },
+		{ "step-time", required_argument, 0, 0 },
+		{ "step1", required_argument, 0, 0 },
+		{ "step2", required_argument, 0, 0 },
+		{ "lost-frames", required_argument, 0, 0 },
+		{ "partial-lost", required_argument, 0, 0 },
+		{ "trigger-id", required_argument, 0, 0 },
+		{ "seed", required_argument, 0, 0 },
+		{ "threads", required_argument, 0, 0 },
+		{ NULL, 0, 0, 0 }
+	};
+
+	try {
+		while(true) {
+			int optionIndex = 0;
+			int c = getopt_long(argc, argv, "o:", longOptions, &optionIndex);
+			if(c == -1) break;
+			if(c == 'o') {
+				outputFilePrefix = optarg;
+				continue;
+			}
+			if(c != 0) {
+				displayHelp(argv[0]);
+				return 1;
+			}
+			switch(optionIndex) {
+				case 0: displayHelp(argv[0]); return 0;
+				case 1:
+					if(strcmp(optarg, "tot") == 0) mode = MODE_TOT;
+					else if(strcmp(optarg, "qdc") == 0) mode = MODE_QDC;
+					else if(strcmp(optarg, "mixed") == 0) mode = MODE_MIXED;
+					else {
+						fprintf(stderr, "Unknown mode '%s'\n", optarg);
+						return 1;
+					}
+					break;
+				case 2: model.frequency = boost::lexical_cast<double>(optarg); break;
+				case 3: model.decayRate = boost::lexical_cast<double>(optarg); break;
+				case 4: model.coincidenceFraction = boost::lexical_cast<double>(optarg); break;
+				case 5: model.meanClusterSize = boost::lexical_cast<double>(optarg); break;
+				case 6: model.maxClusterSize = boost::lexical_cast<unsigned>(optarg); break;
+				case 7: nChannels = boost::lexical_cast<unsigned>(optarg); break;
+				case 8: regionChannels = boost::lexical_cast<unsigned>(optarg); break;
+				case 9: channelMapFileName = optarg; break;
+				case 10: timeSkew = boost::lexical_cast<double>(optarg); break;
+				case 11: jitter = boost::lexical_cast<double>(optarg); break;
+				case 12: nSteps = boost::lexical_cast<unsigned>(optarg); break;
+				case 13: stepTime = boost::lexical_cast<double>(optarg); break;
+				case 14: parseStepValue(optarg, step1, step1Increment); break;
+				case 15: parseStepValue(optarg, step2, step2Increment); break;
+				case 16: model.lostFraction = boost::lexical_cast<double>(optarg); break;
+				case 17: model.partialLostFraction = boost::lexical_cast<double>(optarg); break;
+				case 18: triggerID = boost::lexical_cast<int>(optarg); break;
+				case 19: seed = boost::lexical_cast<uint64_t>(optarg); break;
+				case 20: nThreads = boost::lexical_cast<int>(optarg); break;
+				default: displayHelp(argv[0]); return 1;
+			}
+		}
+	}
+	catch(boost::bad_lexical_cast &e) {
+		fprintf(stderr, "Invalid value for option '%s'\n", optarg);
+		return 1;
+	}
+
+	if(outputFilePrefix == NULL) {
+		fprintf(stderr, "-o must be specified\n");
+		displayHelp(argv[0]);
+		return 1;
+	}
+	if(model.frequency <= 0 || model.frequency > 0xFFFFFFFFUL || model.decayRate < 0 || stepTime <= 0
+		|| model.coincidenceFraction < 0 || model.coincidenceFraction > 1
+		|| model.lostFraction < 0 || model.partialLostFraction < 0 || model.lostFraction + model.partialLostFraction > 1
+		|| model.meanClusterSize < 1 || model.maxClusterSize < 1 || timeSkew < 0 || jitter < 0
+		|| (triggerID < -1) || (triggerID > 0x7FFF)) {
+		fprintf(stderr, "Invalid options\n");
+		displayHelp(argv[0]);
+		return 1;
+	}
+	if(nThreads < 1) nThreads = 1;
+
+	// Channels and trigger regions
+	vector<vector<unsigned> > regionChannelList;
+	if(channelMapFileName != NULL) {
+		if(!loadChannelMap(channelMapFileName, model.channels, regionChannelList)) return 1;
+	}
+	else {
+		if(regionChannels < 1) regionChannels = 1;
+		for(unsigned n = 0; n < nChannels; n++) {
+			unsigned gid = (n % 64) | (((n / 64) % 64) << 6) | (((n / 4096) % 32) << 12) | ((n / (4096 * 32)) << 17);
+			Channel channel = { gid, false, 0 };
+			if(n % regionChannels == 0) regionChannelList.resize(regionChannelList.size() + 1);
+			regionChannelList.back().push_back(n);
+			model.channels.push_back(channel);
+		}
+	}
+	if(model.channels.empty()) {
+		fprintf(stderr, "No channels\n");
+		return 1;
+	}
+	unsigned nRegions = regionChannelList.size();
+	for(unsigned r = 0; r < nRegions; r++) {
+		Region region = { regionChannelList[r], (r + nRegions / 2) % nRegions };
+		model.regions.push_back(region);
+	}
+
+	Random random(seed);
+	double clocksPerNs = model.frequency * 1E-9;
+	model.jitter = jitter * clocksPerNs;
+	for(Channel &channel : model.channels) {
+		unsigned chipID = (channel.gid >> 6) % 64;
+		channel.qdc = (mode == MODE_QDC) || (mode == MODE_MIXED && chipID % 2 == 0);
+		channel.skew = timeSkew * clocksPerNs * random.uniform01();
+	}
+
+	string fNameRaw = string(outputFilePrefix) + ".rawf";
+	string fNameIdx = string(outputFilePrefix) + ".idxf";
+	string fNameMod = string(outputFilePrefix) + ".modf";
+
+	FILE *dataFile = fopen(fNameRaw.c_str(), "wb");
+	if(dataFile == NULL) {
+		fprintf(stderr, "Could not open '%s' for writing: %s\n", fNameRaw.c_str(), strerror(errno));
+		return 1;
+	}
+	FILE *indexFile = fopen(fNameIdx.c_str(), "w");
+	if(indexFile == NULL) {
+		fprintf(stderr, "Could not open '%s' for writing: %s\n", fNameIdx.c_str(), strerror(errno));
+		return 1;
+	}
+	if(mode == MODE_MIXED) {
+		FILE *modeFile = fopen(fNameMod.c_str(), "w");
+		if(modeFile == NULL) {
+			fprintf(stderr, "Could not open '%s' for writing: %s\n", fNameMod.c_str(), strerror(errno));
+			return 1;
+		}
+		for(Channel &channel : model.channels) {
+			unsigned g = channel.gid;
+			if(fprintf(modeFile, "%u\t%u\t%u\t%u\t%s\n", g >> 17, (g >> 12) % 32, (g >> 6) % 64, g % 64, channel.qdc ? "qdc" : "tot") < 0)
+				writeError(fNameMod.c_str());
+		}
+		if(fclose(modeFile) != 0) writeError(fNameMod.c_str());
+	}
+
+	// 64 byte header, as write_raw
+	uint64_t header[8];
+	for(int i = 0; i < 8; i++)
+		header[i] = 0;
+	double acquisitionStartTime = 0;
+	header[0] |= uint32_t(model.frequency);
+	header[0] |= (mode == MODE_QDC ? 0x1UL : 0x0UL) << 32;
+	memcpy(header+1, &acquisitionStartTime, sizeof(double));
+	if(triggerID != -1) header[2] = 0x8000 + triggerID;
+	if(mode == MODE_MIXED) header[3] = 0x1UL;
+	if(fwrite((void *)&header, sizeof(uint64_t), 8, dataFile) != 8) writeError(fNameRaw.c_str());
+
+	// Blocks of all steps, each step starting STEP_GAP_FRAMES after the previous one
+	vector<BlockSpec> blocks;
+	long long stepFrames = llround(stepTime * model.frequency / 1024);
+	if(stepFrames < 1) stepFrames = 1;
+	long long frameID = 0;
+	for(unsigned step = 0; step < nSteps; step++) {
+		for(long long f = 0; f < stepFrames; f += BLOCK_FRAMES) {
+			BlockSpec block;
+			block.step = step;
+			block.firstFrame = frameID + f;
+			block.nFrames = min((long long)BLOCK_FRAMES, stepFrames - f);
+			block.stepBegin = (f == 0);
+			block.stepEnd = (f + BLOCK_FRAMES >= stepFrames);
+			block.seed = mixSeed(seed, blocks.size());
+			blocks.push_back(block);
+		}
+		frameID += stepFrames + STEP_GAP_FRAMES;
+	}
+
+	vector<BlockGenerator *> generators;
+	for(int i = 0; i < nThreads; i++)
+		generators.push_back(new BlockGenerator(model));
+
+	fprintf(stderr, "INFO: Writing data to '%s' and index to '%s'\n", fNameRaw.c_str(), fNameIdx.c_str());
+	struct timespec t0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	// Batches of one block per thread: the next batch is generated while the current one is written,
+	// into two sets of buffers used in turn
+	long long nHits = 0;
+	long long nFramesLost = 0;
+	long stepStartOffset = 0;
+	long long stepFirstFrameID = 0;
+	vector<BlockData> data[2] = { vector<BlockData>(nThreads), vector<BlockData>(nThreads) };
+	vector<Worker> workers(nThreads);
+	int nRunning = 0;
+	auto startBatch = [&](size_t begin, int set) {
+		nRunning = min((size_t)nThreads, blocks.size() - begin);
+		for(int i = 0; i < nRunning; i++) {
+			workers[i].generator = generators[i];
+			workers[i].spec = &blocks[begin + i];
+			workers[i].data = &data[set][i];
+			pthread_create(&workers[i].thread, NULL, workerRoutine, &workers[i]);
+		}
+	};
+	auto joinBatch = [&]() {
+		for(int i = 0; i < nRunning; i++)
+			pthread_join(workers[i].thread, NULL);
+	};
+
+	startBatch(0, 0);
+	joinBatch();
+	int set = 0;
+	for(size_t begin = 0; begin < blocks.size(); begin += nThreads, set = 1 - set) {
+		size_t end = min(begin + nThreads, blocks.size());
+		bool more = end < blocks.size();
+		if(more) startBatch(end, 1 - set);
+
+		for(size_t b = begin; b < end; b++) {
+			const BlockSpec &spec = blocks[b];
+			BlockData &block = data[set][b - begin];
+			if(spec.stepBegin) {
+				stepStartOffset = ftell(dataFile);
+				stepFirstFrameID = spec.firstFrame;
+			}
+			if(fwrite(block.words.data(), sizeof(uint64_t), block.words.size(), dataFile) != block.words.size())
+				writeError(fNameRaw.c_str());
+			nHits += block.nHits;
+			nFramesLost += block.nFramesLost;
+			if(spec.stepEnd) {
+				if(fflush(dataFile) != 0) writeError(fNameRaw.c_str());
+				if(fprintf(indexFile, "%ld\t%ld\t%lld\t%lld\t%f\t%f\n", stepStartOffset, ftell(dataFile), stepFirstFrameID, block.lastFrameWritten,
+						step1 + spec.step * step1Increment, step2 + spec.step * step2Increment) < 0)
+					writeError(fNameIdx.c_str());
+			}
+		}
+		if(more) joinBatch();
+	}
+
+	if(fclose(indexFile) != 0) writeError(fNameIdx.c_str());
+	long bytes = ftell(dataFile);
+	if(fclose(dataFile) != 0) writeError(fNameRaw.c_str());
+	for(BlockGenerator *generator : generators)
+		delete generator;
+
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double elapsed = (t1.tv_sec - t0.tv_sec) + 1E-9 * (t1.tv_nsec - t0.tv_nsec);
+	fprintf(stderr, "INFO: %u steps, %lld frames (%lld with events lost), %lld events, %.1f MB in %.2f s (%.1f MB/s)\n",
+		nSteps, nSteps * stepFrames, nFramesLost, nHits, bytes / 1E6, elapsed, bytes / 1E6 / elapsed);
+	return 0;
+}
@@ -14,6 +14,7 @@
 #include <functional>
 #include <map>
 #include <shm_raw.h>
+#include <Affinity.h>
 #include <boost/lexical_cast.hpp>
 #include <pthread.h>
 #include <unistd.h>
@@ -71,6 +72,9 @@ int main(int argc, char *argv[])
 	bool acqStdMode = (argv[6][0] == 'N');
 	int triggerID = boost::lexical_cast<int>(argv[7]);
 
+	// From the environment, PETSYS_WRITER_CPUS
+	PETSYS::Affinity::pinThread(PETSYS::Affinity::WRITER);
+
 	PETSYS::SHM_RAW *shm = new PETSYS::SHM_RAW(shmObjectPath);
 	  
 	char fNameRaw[1024];
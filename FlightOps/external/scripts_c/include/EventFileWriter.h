@@ -0,0 +1,102 @@
+#pragma once
+#include <stdio.h>
+#include <sys/types.h>
+#include <string>
+#include <OrderedEventHandler.h>
+#include "FileType.h"
+
+class TFile;
+class TTree;
+
+namespace PETSYS {
+
+/*! Output file handling shared by the raw data converters' writers.
+ * Opens the output as text (fName), binary (fName.ldat and fName.lidx) or ROOT (fName, with "data" and "index" TTrees),
+ * writes the step index and, with splitTime > 0, moves on to a new file part every splitTime seconds of data,
+ * renaming each part with its number. Output to /dev/null is FILE_NULL, whatever fileType is.
+ *
+ * A subclass adds its fields to the data TTree in addBranches() and must call openFile() at the end of its constructor.
+ * Its addEvents() calls beginBuffer() for each buffer, then writes the events sampleEvent() accepts
+ * to dataFile, or through fillData() for ROOT.
+ */
+class EventFileWriter {
+public:
+	EventFileWriter(const char *fName, double frequency, FILE_TYPE fileType, int eventFractionToWrite, float splitTime);
+	virtual ~EventFileWriter();
+
+	/*! The step of the events which follow */
+	void setStep(float step1, float step2);
+	/*! Writes the index entry of the current step */
+	void closeStep();
+
+protected:
+	/*! Adds the fields of an event to the data TTree, after "step1" and "step2" */
+	virtual void addBranches(TTree *hData, int bufsize) = 0;
+
+	void openFile();
+
+	/*! Starts a buffer of events at bufferTMin (in clock cycles), moving on to the next file part if needed */
+	void beginBuffer(long long bufferTMin);
+
+	/*! Counts an event and tells whether it is in the fraction of events to write */
+	inline bool sampleEvent() {
+		long long n = eventCounter;
+		eventCounter += 1;
+		return (n % 1024) < eventFractionToWrite;
+	};
+
+	/*! Fills the data TTree with the current step and the fields set by the subclass */
+	void fillData();
+
+	std::string fName;
+	double frequency;
+	FILE_TYPE fileType;
+	int eventFractionToWrite;
+	long long eventCounter;
+	float step1;
+	float step2;
+
+	FILE *dataFile;
+
+private:
+	void closeFile();
+	void renameFile();
+
+	double fileSplitTime;
+	long long currentFilePartIndex;
+
+	FILE *indexFile;
+	off_t stepBegin;
+
+	TTree *hData;
+	TTree *hIndex;
+	TFile *hFile;
+	// ROOT Tree fields
+	float		brStep1;
+	float		brStep2;
+	long long 	brStepBegin;
+	long long 	brStepEnd;
+};
+
+/*! Passes the buffers of a pipeline, in order, to the addEvents() of a writer */
+template <class TEvent, class TWriter>
+class FileWriteHelper : public OrderedEventHandler<TEvent, TEvent> {
+private:
+	TWriter *writer;
+public:
+	FileWriteHelper(TWriter *writer, const char *name, EventSink<TEvent> *sink) :
+		OrderedEventHandler<TEvent, TEvent>(sink, name),
+		writer(writer)
+	{
+	};
+
+	EventBuffer<TEvent> * handleEvents(EventBuffer<TEvent> *buffer) {
+		writer->addEvents(buffer);
+		return buffer;
+	};
+
+	void pushT0(double) { };
+	void report() { };
+};
+
+}
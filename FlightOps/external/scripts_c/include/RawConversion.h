@@ -0,0 +1,41 @@
+#pragma once
+#include <string>
+#include <Event.h>
+#include <EventSourceSink.h>
+#include <SystemConfig.h>
+#include <RawReader.h>
+#include "EventFileWriter.h"
+
+namespace PETSYS {
+
+/*! Reader and configuration of a raw data conversion, set up the same way for every converter.
+ * The constructor checks the mandatory arguments, opens the raw data (keeping only the channels of channelMask, if not empty),
+ * loads the configuration (without QDC and energy calibration for ToT data), sets the affinity policy before
+ * the reader and the thread pool start, sets the reader's buffer size from processing:buffer_size
+ * and enables tracing if processing:trace_file_prefix is set. Errors are thrown as std::runtime_error.
+ */
+class RawConversion {
+public:
+	RawConversion(const std::string &configFileName, const std::string &inputFilePrefix, const std::string &outputFileName, const std::string &channelMask);
+	/*! Disables tracing and deletes the reader, with its pipeline, and the configuration */
+	~RawConversion();
+
+	RawReader *getReader() { return reader; };
+	SystemConfig *getConfig() { return config; };
+
+	/*! Processes the steps one after the other through CoarseSorter and ProcessHit (or the fused decoder) into hitSink,
+	 * with writer set to each step and its index entry written at the end of the step.
+	 * The pipeline is built once and kept by the reader across steps. With tracing, a trace is written for each step.
+	 */
+	void processSteps(EventSink<Hit> *hitSink, EventFileWriter *writer);
+
+	/*! Writes the trace to <trace_file_prefix><suffix>.json, if tracing */
+	void writeTrace(const std::string &suffix);
+
+private:
+	RawReader *reader;
+	SystemConfig *config;
+	bool tracing;
+};
+
+}
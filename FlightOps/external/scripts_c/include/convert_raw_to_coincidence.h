@@ -0,0 +1,17 @@
+#pragma once
+#include <string>
+#include <SystemConfig.h>
+#include "FileType.h"
+
+/*! Converts raw data to coincidences, running RawReader, CoarseSorter, ProcessHit, SimpleGrouper and CoincidenceGrouper in one process.
+ * Each coincidence is written as pairs of its seed photon with each of the others,
+ * a pair as the combinations of their first hitLimitToWrite hits in which at least one of the two hits is the first of its photon.
+ */
+bool runConvertRawToCoincidence(const std::string& configFileName,
+                                const std::string& inputFilePrefix,
+                                const std::string& outputFileName,
+                                PETSYS::FILE_TYPE fileType = PETSYS::FILE_TEXT,
+                                long long eventFractionToWrite = 1024,
+                                double fileSplitTime = 0.0,
+                                int hitLimitToWrite = 1,
+                                const std::string& channelMask = "");
@@ -0,0 +1,16 @@
+#pragma once
+#include <string>
+#include <SystemConfig.h>
+#include "FileType.h"
+
+/*! Converts raw data to groups (GammaPhoton), running RawReader, CoarseSorter, ProcessHit and SimpleGrouper in one process.
+ * Each group is written as its first hitLimitToWrite hits, with the number of hits of the group and the index of the hit.
+ */
+bool runConvertRawToGroup(const std::string& configFileName,
+                          const std::string& inputFilePrefix,
+                          const std::string& outputFileName,
+                          PETSYS::FILE_TYPE fileType = PETSYS::FILE_TEXT,
+                          long long eventFractionToWrite = 1024,
+                          double fileSplitTime = 0.0,
+                          int hitLimitToWrite = 1,
+                          const std::string& channelMask = "");
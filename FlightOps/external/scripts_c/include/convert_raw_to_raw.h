@@ -5,5 +5,6 @@
 bool runConvertRawToRaw(const std::string& configFileName,
                         const std::string& inputFilePrefix,
                         const std::string& outputFileName,
-                        long long eventFractionToWrite = 1024);
+                        long long eventFractionToWrite = 1024,
+                        const std::string& channelMask = "");
 
@@ -8,5 +8,6 @@ bool runConvertRawToSingles(const std::string& configFileName,
                             const std::string& outputFileName,
                             PETSYS::FILE_TYPE fileType = PETSYS::FILE_TEXT,
                             long long eventFractionToWrite = 1024,
-                            double fileSplitTime = 0.0);
+                            double fileSplitTime = 0.0,
+                            const std::string& channelMask = "");
 
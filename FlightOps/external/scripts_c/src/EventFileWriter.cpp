@@ -0,0 +1,178 @@
+#include "EventFileWriter.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include <TFile.h>
+#include <TTree.h>
+
+using namespace PETSYS;
+
+EventFileWriter::EventFileWriter(const char *fName, double frequency, FILE_TYPE fileType, int eventFractionToWrite, float splitTime)
+{
+	this->fName = std::string(fName);
+	this->frequency = frequency;
+	this->fileType = (strcmp(fName, "/dev/null") != 0) ? fileType : FILE_NULL;
+	this->eventFractionToWrite = eventFractionToWrite;
+	this->eventCounter = 0;
+	this->step1 = 0;
+	this->step2 = 0;
+
+	this->fileSplitTime = splitTime * frequency; // Convert from seconds to clock cycles
+	this->currentFilePartIndex = 0;
+
+	dataFile = NULL;
+	indexFile = NULL;
+	hData = NULL;
+	hIndex = NULL;
+	hFile = NULL;
+}
+
+EventFileWriter::~EventFileWriter()
+{
+	closeFile();
+	if(fileSplitTime > 0) {
+		renameFile();
+	}
+}
+
+void EventFileWriter::openFile()
+{
+	stepBegin = 0;
+	if (fileType == FILE_ROOT){
+		hFile = new TFile(fName.c_str(), "RECREATE");
+		int bs = 512*1024;
+
+		hData = new TTree("data", "Event List", 2);
+		hData->Branch("step1", &brStep1, bs);
+		hData->Branch("step2", &brStep2, bs);
+		addBranches(hData, bs);
+
+		hIndex = new TTree("index", "Step Index", 2);
+		hIndex->Branch("step1", &brStep1, bs);
+		hIndex->Branch("step2", &brStep2, bs);
+		hIndex->Branch("stepBegin", &brStepBegin, bs);
+		hIndex->Branch("stepEnd", &brStepEnd, bs);
+	}
+	else if(fileType == FILE_BINARY) {
+		char *fName2 = new char[1024];
+		sprintf(fName2, "%s.ldat", fName.c_str());
+		dataFile = fopen(fName2, "w");
+		sprintf(fName2, "%s.lidx", fName.c_str());
+		indexFile = fopen(fName2, "w");
+		assert(dataFile != NULL);
+		assert(indexFile != NULL);
+		delete [] fName2;
+	}
+	else if (fileType == FILE_TEXT) {
+		dataFile = fopen(fName.c_str(), "w");
+		assert(dataFile != NULL);
+		indexFile = NULL;
+	}
+}
+
+void EventFileWriter::closeFile()
+{
+	if (fileType == FILE_ROOT){
+		hFile->Write();
+		hFile->Close();
+	}
+	else if(fileType == FILE_BINARY) {
+		fclose(dataFile);
+		fclose(indexFile);
+	}
+	else if (fileType == FILE_TEXT) {
+		fclose(dataFile);
+	}
+}
+
+void EventFileWriter::setStep(float step1, float step2)
+{
+	this->step1 = step1;
+	this->step2 = step2;
+}
+
+void EventFileWriter::closeStep()
+{
+	if (fileType == FILE_ROOT){
+		brStepBegin = stepBegin;
+		brStepEnd = hData->GetEntries();
+		brStep1 = step1;
+		brStep2 = step2;
+		hIndex->Fill();
+		stepBegin = hData->GetEntries();
+	}
+	else if(fileType == FILE_BINARY) {
+		fprintf(indexFile, "%ld\t%ld\t%e\t%e\n", stepBegin, ftell(dataFile), step1, step2);
+		stepBegin = ftell(dataFile);
+	}
+	else {
+		// Do nothing
+	}
+}
+
+void EventFileWriter::renameFile()
+{
+	char *fName1 = new char[1024];
+	char *fName2 = new char[1024];
+	if(fileType == FILE_BINARY) {
+		// Binary output consists of two files and fName is their common prefix
+
+		sprintf(fName1, "%s.ldat", fName.c_str());
+		sprintf(fName2, "%s_%08lld.ldat", fName.c_str(), currentFilePartIndex);
+		int r = rename(fName1, fName2);
+		assert(r == 0);
+
+		sprintf(fName1, "%s.lidx", fName.c_str());
+		sprintf(fName2, "%s_%08lld.lidx", fName.c_str(), currentFilePartIndex);
+		r = rename(fName1, fName2);
+		assert(r == 0);
+
+	}
+	else {
+		// ROOT or text output consists of a single file and fName is the complete fileName
+		strcpy(fName1, fName.c_str());
+		char *p = rindex(fName1, '.');
+
+		if(p == NULL) {
+			// If fName lacks a "." append the file part number at the end of the file name
+			sprintf(fName2, "%s_%08lld", fName1, currentFilePartIndex);
+			int r = rename(fName1, fName2);
+			assert(r == 0);
+		}
+		else {
+			// Insert the file part number before the extension
+			char tmp = *p;
+			*p = '\0';
+			sprintf(fName2, "%s_%08lld.%s", fName1, currentFilePartIndex, p+1);
+			*p = tmp;
+			int r = rename(fName1, fName2);
+			assert(r == 0);
+		}
+
+	}
+	delete [] fName2;
+	delete [] fName1;
+}
+
+void EventFileWriter::beginBuffer(long long bufferTMin)
+{
+	long long filePartIndex = (int)floor(bufferTMin / fileSplitTime);
+
+	if((fileSplitTime > 0) && (filePartIndex > currentFilePartIndex)) {
+		closeStep();
+		closeFile();
+		renameFile();
+
+		openFile();
+		currentFilePartIndex = filePartIndex;
+	}
+}
+
+void EventFileWriter::fillData()
+{
+	brStep1 = step1;
+	brStep2 = step2;
+	hData->Fill();
+}
@@ -0,0 +1,86 @@
+#include "RawConversion.h"
+
+#include <stdio.h>
+#include <sstream>
+#include <stdexcept>
+#include <CoarseSorter.h>
+#include <ProcessHit.h>
+#include <Trace.h>
+#include <Affinity.h>
+
+using namespace PETSYS;
+
+RawConversion::RawConversion(const std::string &configFileName, const std::string &inputFilePrefix, const std::string &outputFileName, const std::string &channelMask)
+{
+	if (configFileName.empty() || inputFilePrefix.empty() || outputFileName.empty()) {
+		std::ostringstream oss;
+		oss << "Error: config, input, and output arguments are mandatory.";
+		throw std::runtime_error(oss.str());
+	}
+
+	reader = RawReader::openFile(inputFilePrefix.c_str());
+	// Hits of other channels are dropped as they are read
+	if(!channelMask.empty())
+		reader->setChannelMask(ChannelMask::parse(channelMask.c_str()));
+
+	// If data was taken in ToT mode, do not attempt to load these files
+	unsigned long long mask = SystemConfig::LOAD_ALL;
+	if(reader->isTOT()) {
+		mask ^= (SystemConfig::LOAD_QDC_CALIBRATION | SystemConfig::LOAD_ENERGY_CALIBRATION);
+	}
+	config = SystemConfig::fromFile(configFileName.c_str(), mask);
+	// Before the reader and the thread pool start
+	Affinity::setPolicy(config->processing_affinity);
+
+	if(config->processing_buffer_size > 0)
+		reader->setBufferSize(config->processing_buffer_size);
+	else
+		reader->setAdaptiveBufferSize(config->processing_buffer_size_min, config->processing_buffer_size_max);
+
+	tracing = !config->processing_trace_file_prefix.empty();
+	if(tracing) Trace::enable(config->processing_trace_events_per_thread);
+}
+
+RawConversion::~RawConversion()
+{
+	if(tracing) Trace::disable();
+	delete reader;
+	delete config;
+}
+
+void RawConversion::processSteps(EventSink<Hit> *hitSink, EventFileWriter *writer)
+{
+	EventSink<RawHit> *pipeline = NULL;
+	if(!config->processing_fused_decode) {
+		pipeline = new CoarseSorter(
+				new ProcessHit(config, reader,
+				hitSink
+				));
+	}
+	reader->setKeepPipeline(true);
+
+	int stepIndex = 0;
+	while(reader->getNextStep()) {
+		float step1, step2;
+		reader->getStepValue(step1, step2);
+		printf("Processing step %d: (%f, %f)\n", stepIndex+1, step1, step2);
+		fflush(stdout);
+		writer->setStep(step1, step2);
+		if(config->processing_fused_decode)
+			reader->processStep(true, config, hitSink);
+		else
+			reader->processStep(true, pipeline);
+
+		writer->closeStep();
+		writeTrace("_" + std::to_string(stepIndex + 1));
+		stepIndex += 1;
+	}
+}
+
+void RawConversion::writeTrace(const std::string &suffix)
+{
+	if(!tracing) return;
+	std::string traceFileName = config->processing_trace_file_prefix + suffix + ".json";
+	if(!Trace::writeJSON(traceFileName.c_str()))
+		fprintf(stderr, "WARNING: could not write trace to '%s'\n", traceFileName.c_str());
+}
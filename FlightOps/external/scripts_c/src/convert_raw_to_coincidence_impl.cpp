@@ -0,0 +1,232 @@
+#include "convert_raw_to_coincidence.h"
+#include "FileType.h"
+#include "EventFileWriter.h"
+#include "RawConversion.h"
+
+#include <RawReader.h>
+#include <string>
+#include <SystemConfig.h>
+#include <SimpleGrouper.h>
+#include <CoincidenceGrouper.h>
+
+#include <TTree.h>
+
+using namespace std;
+using namespace PETSYS;
+
+// Output fields of a hit of one of the photons of a coincidence, for all file types
+struct OutputCoincidenceHit {
+	unsigned short	mh_n;
+	unsigned short	mh_j;
+	long long	time;
+	unsigned int	channelID;
+	float		tot;
+	float		energy;
+	unsigned short	tacID;
+	int		xi;
+	int		yi;
+	float		x;
+	float		y;
+	float		z;
+};
+
+// tMin is the time of the hit's buffer, in ps
+static inline void makeOutputCoincidenceHit(GammaPhoton &p, int j, long long tMin, double Tps, float Tns, OutputCoincidenceHit &e)
+{
+	Hit &hit = *p.hits[j];
+	float Eunit = hit.raw->qdcMode ? 1.0 : Tns;
+
+	e.mh_n = p.nHits;
+	e.mh_j = j;
+	e.time = ((long long)(hit.time * Tps)) + tMin;
+	e.channelID = hit.raw->channelID;
+	e.tot = (hit.timeEnd - hit.time) * Tps;
+	e.energy = hit.energy * Eunit;
+	e.tacID = hit.raw->tacID;
+	e.xi = hit.xi;
+	e.yi = hit.yi;
+	e.x = hit.x;
+	e.y = hit.y;
+	e.z = hit.z;
+}
+
+class CoincidenceFileWriter : public EventFileWriter {
+private:
+	int hitLimitToWrite;
+
+	// ROOT Tree fields of the hits of the first ([0]) and second ([1]) photon
+	unsigned short	brN[2];
+	unsigned short	brJ[2];
+	long long	brTime[2];
+	unsigned int	brChannelID[2];
+	float		brToT[2];
+	float		brEnergy[2];
+	unsigned short	brTacID[2];
+	int		brXi[2];
+	int		brYi[2];
+	float		brX[2];
+	float		brY[2];
+	float		brZ[2];
+
+	// mh_n saturates at 255, groups are limited to sw_trigger:group_max_hits hits
+	struct CoincidenceEvent {
+		unsigned char mh_n1;
+		unsigned char mh_j1;
+		long long time1;
+		float e1;
+		int id1;
+
+		unsigned char mh_n2;
+		unsigned char mh_j2;
+		long long time2;
+		float e2;
+		int id2;
+	} __attribute__((__packed__));
+
+protected:
+	void addBranches(TTree *hData, int bs) {
+		for(int k = 0; k < 2; k++) {
+			std::string s = std::to_string(k + 1);
+			hData->Branch(("mh_n" + s).c_str(), &brN[k], bs);
+			hData->Branch(("mh_j" + s).c_str(), &brJ[k], bs);
+			hData->Branch(("time" + s).c_str(), &brTime[k], bs);
+			hData->Branch(("channelID" + s).c_str(), &brChannelID[k], bs);
+			hData->Branch(("tot" + s).c_str(), &brToT[k], bs);
+			hData->Branch(("energy" + s).c_str(), &brEnergy[k], bs);
+			hData->Branch(("tacID" + s).c_str(), &brTacID[k], bs);
+			hData->Branch(("xi" + s).c_str(), &brXi[k], bs);
+			hData->Branch(("yi" + s).c_str(), &brYi[k], bs);
+			hData->Branch(("x" + s).c_str(), &brX[k], bs);
+			hData->Branch(("y" + s).c_str(), &brY[k], bs);
+			hData->Branch(("z" + s).c_str(), &brZ[k], bs);
+		}
+	};
+
+public:
+	CoincidenceFileWriter(const char *fName, double frequency, FILE_TYPE fileType, int eventFractionToWrite, float splitTime, int hitLimitToWrite) :
+		EventFileWriter(fName, frequency, fileType, eventFractionToWrite, splitTime),
+		hitLimitToWrite(hitLimitToWrite)
+	{
+		openFile();
+	};
+
+	void writeCoincidenceHits(OutputCoincidenceHit &e1, OutputCoincidenceHit &e2) {
+		if (fileType == FILE_ROOT){
+			OutputCoincidenceHit *e[2] = { &e1, &e2 };
+			for(int k = 0; k < 2; k++) {
+				brN[k] = e[k]->mh_n;
+				brJ[k] = e[k]->mh_j;
+				brTime[k] = e[k]->time;
+				brChannelID[k] = e[k]->channelID;
+				brToT[k] = e[k]->tot;
+				brEnergy[k] = e[k]->energy;
+				brTacID[k] = e[k]->tacID;
+				brXi[k] = e[k]->xi;
+				brYi[k] = e[k]->yi;
+				brX[k] = e[k]->x;
+				brY[k] = e[k]->y;
+				brZ[k] = e[k]->z;
+			}
+
+			fillData();
+		}
+		else if(fileType == FILE_BINARY) {
+			CoincidenceEvent eo = {
+				(unsigned char)(e1.mh_n < 255 ? e1.mh_n : 255),
+				(unsigned char)e1.mh_j,
+				e1.time,
+				e1.energy,
+				(int)e1.channelID,
+
+				(unsigned char)(e2.mh_n < 255 ? e2.mh_n : 255),
+				(unsigned char)e2.mh_j,
+				e2.time,
+				e2.energy,
+				(int)e2.channelID
+			};
+			fwrite(&eo, sizeof(eo), 1, dataFile);
+		}
+		else if (fileType == FILE_TEXT) {
+			fprintf(dataFile, "%d\t%d\t%lld\t%f\t%d\t%d\t%d\t%lld\t%f\t%d\n",
+				e1.mh_n, e1.mh_j,
+				e1.time,
+				e1.energy,
+				(int)e1.channelID,
+				e2.mh_n, e2.mh_j,
+				e2.time,
+				e2.energy,
+				(int)e2.channelID
+				);
+		}
+	};
+
+	// Writes the combinations of the first hitLimitToWrite hits of p1 and p2 in which one of the hits is the first of its photon
+	void writePair(GammaPhoton &p1, GammaPhoton &p2, long long tMin, double Tps, float Tns) {
+		int limit1 = (hitLimitToWrite < p1.nHits) ? hitLimitToWrite : p1.nHits;
+		int limit2 = (hitLimitToWrite < p2.nHits) ? hitLimitToWrite : p2.nHits;
+		for(int m = 0; m < limit1; m++) {
+			OutputCoincidenceHit e1;
+			makeOutputCoincidenceHit(p1, m, tMin, Tps, Tns, e1);
+			for(int n = 0; n < limit2; n++) {
+				if(m != 0 && n != 0) break;
+				OutputCoincidenceHit e2;
+				makeOutputCoincidenceHit(p2, n, tMin, Tps, Tns, e2);
+				writeCoincidenceHits(e1, e2);
+			}
+		}
+	};
+
+	void addEvents(EventBuffer<Coincidence> *buffer) {
+		beginBuffer(buffer->getTMin());
+		if(fileType == FILE_NULL) return;
+
+		double Tps = 1E12/frequency;
+		float Tns = Tps / 1000;
+		long long tMin = buffer->getTMin() * (long long)Tps;
+
+		int N = buffer->getSize();
+		for (int i = 0; i < N; i++) {
+			if(!sampleEvent()) continue;
+
+			Coincidence &c = buffer->get(i);
+			if(!c.valid) continue;
+
+			// Only pairs with the seed passed the trigger map and the coincidence window.
+			// Each pair is written in photon order, so the photon of the higher region comes first as for 2 photons.
+			for(int k = 0; k < c.nPhotons; k++) {
+				if(k == c.seed) continue;
+				int k1 = (k < c.seed) ? k : c.seed;
+				int k2 = (k < c.seed) ? c.seed : k;
+				writePair(*c.photons[k1], *c.photons[k2], tMin, Tps, Tns);
+			}
+		}
+	};
+};
+
+bool runConvertRawToCoincidence(const std::string& configFileName,
+                                const std::string& inputFilePrefix,
+                                const std::string& outputFileName,
+                                FILE_TYPE fileType,
+                                long long eventFractionToWrite,
+                                double fileSplitTime,
+                                int hitLimitToWrite,
+                                const std::string& channelMask)
+{
+	RawConversion conversion(configFileName, inputFilePrefix, outputFileName, channelMask);
+	RawReader *reader = conversion.getReader();
+	SystemConfig *config = conversion.getConfig();
+	// Groups and coincidences do not depend on where the buffers are split
+	reader->setBufferOverlap(SimpleGrouper::getBufferOverlapFrames(config));
+
+	CoincidenceFileWriter *coincidenceFileWriter = new CoincidenceFileWriter(outputFileName.c_str(), reader->getFrequency(), fileType, eventFractionToWrite, fileSplitTime, hitLimitToWrite);
+	conversion.processSteps(
+		new SimpleGrouper(config,
+		new CoincidenceGrouper(config,
+		new FileWriteHelper<Coincidence, CoincidenceFileWriter>(coincidenceFileWriter, "CoincidenceFileWriter",
+		new NullSink<Coincidence>()
+		))),
+		coincidenceFileWriter);
+	delete coincidenceFileWriter;
+
+	return true;
+}
@@ -0,0 +1,185 @@
+#include "convert_raw_to_group.h"
+#include "FileType.h"
+#include "EventFileWriter.h"
+#include "RawConversion.h"
+
+#include <RawReader.h>
+#include <string>
+#include <SystemConfig.h>
+#include <SimpleGrouper.h>
+
+#include <TTree.h>
+
+using namespace std;
+using namespace PETSYS;
+
+// Output fields of a hit of a group, for all file types
+struct OutputGroupHit {
+	long long	time;
+	unsigned int	channelID;
+	float		tot;
+	float		energy;
+	unsigned short	tacID;
+	int		xi;
+	int		yi;
+	float		x;
+	float		y;
+	float		z;
+};
+
+// tMin is the time of the hit's buffer, in ps
+static inline void makeOutputGroupHit(Hit &hit, long long tMin, double Tps, float Tns, OutputGroupHit &e)
+{
+	float Eunit = hit.raw->qdcMode ? 1.0 : Tns;
+
+	e.time = ((long long)(hit.time * Tps)) + tMin;
+	e.channelID = hit.raw->channelID;
+	e.tot = (hit.timeEnd - hit.time) * Tps;
+	e.energy = hit.energy * Eunit;
+	e.tacID = hit.raw->tacID;
+	e.xi = hit.xi;
+	e.yi = hit.yi;
+	e.x = hit.x;
+	e.y = hit.y;
+	e.z = hit.z;
+}
+
+class GroupFileWriter : public EventFileWriter {
+private:
+	int hitLimitToWrite;
+
+	// ROOT Tree fields
+	unsigned short	brN;
+	unsigned short	brJ;
+	long long	brTime;
+	unsigned int	brChannelID;
+	float		brToT;
+	float		brEnergy;
+	unsigned short	brTacID;
+	int		brXi;
+	int		brYi;
+	float		brX;
+	float		brY;
+	float		brZ;
+
+	// mh_n saturates at 255, groups are limited to sw_trigger:group_max_hits hits
+	struct GroupEvent {
+		unsigned char mh_n;
+		unsigned char mh_j;
+		long long time;
+		float e;
+		int id;
+	} __attribute__((__packed__));
+
+protected:
+	void addBranches(TTree *hData, int bs) {
+		hData->Branch("mh_n", &brN, bs);
+		hData->Branch("mh_j", &brJ, bs);
+		hData->Branch("time", &brTime, bs);
+		hData->Branch("channelID", &brChannelID, bs);
+		hData->Branch("tot", &brToT, bs);
+		hData->Branch("energy", &brEnergy, bs);
+		hData->Branch("tacID", &brTacID, bs);
+		hData->Branch("xi", &brXi, bs);
+		hData->Branch("yi", &brYi, bs);
+		hData->Branch("x", &brX, bs);
+		hData->Branch("y", &brY, bs);
+		hData->Branch("z", &brZ, bs);
+	};
+
+public:
+	GroupFileWriter(const char *fName, double frequency, FILE_TYPE fileType, int eventFractionToWrite, float splitTime, int hitLimitToWrite) :
+		EventFileWriter(fName, frequency, fileType, eventFractionToWrite, splitTime),
+		hitLimitToWrite(hitLimitToWrite)
+	{
+		openFile();
+	};
+
+	void writeGroupHit(int n, int j, OutputGroupHit &e) {
+		if (fileType == FILE_ROOT){
+			brN = n;
+			brJ = j;
+			brTime = e.time;
+			brChannelID = e.channelID;
+			brToT = e.tot;
+			brEnergy = e.energy;
+			brTacID = e.tacID;
+			brXi = e.xi;
+			brYi = e.yi;
+			brX = e.x;
+			brY = e.y;
+			brZ = e.z;
+
+			fillData();
+		}
+		else if(fileType == FILE_BINARY) {
+			GroupEvent eo = {
+				(unsigned char)(n < 255 ? n : 255),
+				(unsigned char)j,
+				e.time,
+				e.energy,
+				(int)e.channelID
+			};
+			fwrite(&eo, sizeof(eo), 1, dataFile);
+		}
+		else if (fileType == FILE_TEXT) {
+			fprintf(dataFile, "%d\t%d\t%lld\t%f\t%d\n",
+				n, j,
+				e.time,
+				e.energy,
+				(int)e.channelID
+				);
+		}
+	};
+
+	void addEvents(EventBuffer<GammaPhoton> *buffer) {
+		beginBuffer(buffer->getTMin());
+		if(fileType == FILE_NULL) return;
+
+		double Tps = 1E12/frequency;
+		float Tns = Tps / 1000;
+		long long tMin = buffer->getTMin() * (long long)Tps;
+
+		int N = buffer->getSize();
+		for (int i = 0; i < N; i++) {
+			if(!sampleEvent()) continue;
+
+			GammaPhoton &p = buffer->get(i);
+			if(!p.valid) continue;
+
+			int limit = (hitLimitToWrite < p.nHits) ? hitLimitToWrite : p.nHits;
+			for(int m = 0; m < limit; m++) {
+				OutputGroupHit e;
+				makeOutputGroupHit(*p.hits[m], tMin, Tps, Tns, e);
+				writeGroupHit(p.nHits, m, e);
+			}
+		}
+	};
+};
+
+bool runConvertRawToGroup(const std::string& configFileName,
+                          const std::string& inputFilePrefix,
+                          const std::string& outputFileName,
+                          FILE_TYPE fileType,
+                          long long eventFractionToWrite,
+                          double fileSplitTime,
+                          int hitLimitToWrite,
+                          const std::string& channelMask)
+{
+	RawConversion conversion(configFileName, inputFilePrefix, outputFileName, channelMask);
+	RawReader *reader = conversion.getReader();
+	SystemConfig *config = conversion.getConfig();
+	// Groups do not depend on where the buffers are split
+	reader->setBufferOverlap(SimpleGrouper::getBufferOverlapFrames(config));
+
+	GroupFileWriter *groupFileWriter = new GroupFileWriter(outputFileName.c_str(), reader->getFrequency(), fileType, eventFractionToWrite, fileSplitTime, hitLimitToWrite);
+	conversion.processSteps(
+		new SimpleGrouper(config,
+		new FileWriteHelper<GammaPhoton, GroupFileWriter>(groupFileWriter, "GroupFileWriter",
+		new NullSink<GammaPhoton>()
+		)),
+		groupFileWriter);
+	delete groupFileWriter;
+
+	return true;
+}
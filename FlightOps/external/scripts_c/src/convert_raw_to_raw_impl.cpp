@@ -155,6 +155,12 @@ public:
 	{
 	};
 	
+	/*! The step of the events which follow, for a pipeline kept across steps */
+	void setStep(float step1, float step2) {
+		this->step1 = step1;
+		this->step2 = step2;
+	};
+
 	EventBuffer<RawHit> * handleEvents(EventBuffer<RawHit> *buffer) {
 		dataFileWriter->addEvents(step1, step2,buffer);
 		return buffer;
@@ -186,7 +192,8 @@ static void displayUsage(char *argv0)
 bool runConvertRawToRaw(const std::string& configFileName,
                         const std::string& inputFilePrefix,
                         const std::string& outputFileName,
-                        long long eventFractionToWrite)
+                        long long eventFractionToWrite,
+                        const std::string& channelMask)
 {
   if (configFileName.empty() || inputFilePrefix.empty() || outputFileName.empty()) {
     //cerr << "Error: config, input, and output arguments are mandatory." << endl;
@@ -221,9 +228,16 @@ bool runConvertRawToRaw(const std::string& configFileName,
   }
 
 	RawReader *reader = RawReader::openFile(inputFilePrefix.c_str());
+	// Hits of other channels are dropped as they are read
+	if(!channelMask.empty())
+		reader->setChannelMask(ChannelMask::parse(channelMask.c_str()));
 	
 	DataFileWriter *dataFileWriter = new DataFileWriter(outputFileName.c_str(), FILE_ROOT, eventFractionToWrite);
 
+	// The pipeline is built once and kept by the reader across steps
+	WriteHelper *writeHelper = new WriteHelper(dataFileWriter, 0, 0, new NullSink<RawHit>());
+	reader->setKeepPipeline(true);
+
 	int stepIndex = 0;
 	while(reader->getNextStep()) {
 		float step1, step2;
@@ -231,10 +245,8 @@ bool runConvertRawToRaw(const std::string& configFileName,
 
 		printf("Processing step %d: (%f, %f)\n", stepIndex+1, step1, step2);
 		fflush(stdout);
-		reader->processStep(true,
-				new WriteHelper(dataFileWriter, step1, step2,
-				new NullSink<RawHit>()
-				));
+		writeHelper->setStep(step1, step2);
+		reader->processStep(true, writeHelper);
 		
 		dataFileWriter->closeStep(step1, step2);
 		stepIndex += 1;
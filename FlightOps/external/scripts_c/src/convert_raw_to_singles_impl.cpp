@@ -1,13 +1,19 @@
 #include "convert_raw_to_singles.h"
 #include "FileType.h"
+#include "EventFileWriter.h"
+#include "RawConversion.h"
 
 #include <RawReader.h>
 #include <OrderedEventHandler.h>
 #include <getopt.h>
 #include <assert.h>
 #include <math.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
 #include <iostream>
 #include <string>
+#include <vector>
 #include <SystemConfig.h>
 #include <CoarseSorter.h>
 #include <ProcessHit.h>
@@ -16,7 +22,6 @@
 
 #include <boost/lexical_cast.hpp>
 
-#include <TFile.h>
 #include <TTree.h>
 
 using namespace std;
@@ -24,29 +29,125 @@ using namespace PETSYS;
 
 //enum FILE_TYPE { FILE_TEXT, FILE_BINARY, FILE_ROOT, FILE_NULL };
 
-class DataFileWriter {
+// Output fields of a hit, for all file types
+struct OutputSingle {
+	long long	time;
+	unsigned int	channelID;
+	float		tot;
+	float		energy;
+	unsigned short	tacID;
+	int		xi;
+	int		yi;
+	float		x;
+	float		y;
+	float		z;
+	float		tqT;
+	float		tqE;
+};
+
+// tMin is the time of the hit's buffer, in ps
+static inline void makeOutputSingle(Hit &hit, long long tMin, double Tps, float Tns, OutputSingle &e)
+{
+	float Eunit = hit.raw->qdcMode ? 1.0 : Tns;
+
+	e.time = ((long long)(hit.time * Tps)) + tMin;
+	e.channelID = hit.raw->channelID;
+	e.tot = (hit.timeEnd - hit.time) * Tps;
+	e.energy = hit.energy * Eunit;
+	e.tacID = hit.raw->tacID;
+	e.tqT = hit.raw->time - hit.time;
+	e.tqE = (hit.raw->timeEnd - hit.timeEnd);
+	e.x = hit.x;
+	e.y = hit.y;
+	e.z = hit.z;
+	e.xi = hit.xi;
+	e.yi = hit.yi;
+}
+
+/*
+ * Hits of one step, kept in a temporary file until DataFileWriter::addShard() writes them out,
+ * so that steps processed concurrently are written in step order.
+ * Each buffer is stored as a ShardBuffer followed by the valid hits, with their index in the buffer,
+ * which is all DataFileWriter needs to write them as if it had received the buffer itself.
+ */
+class StepShard {
+public:
+	struct ShardBuffer {
+		long long tMin;
+		long long nEvents;
+		long long nSingles;
+	};
+	struct ShardSingle {
+		long long index;
+		OutputSingle e;
+	};
+
+	StepShard(double frequency) : frequency(frequency), failed(false) {
+		file = tmpfile();
+		if(file == NULL) {
+			std::ostringstream oss;
+			oss << "ERROR: could not create temporary file for step data: " << strerror(errno);
+			throw std::runtime_error(oss.str());
+		}
+	};
+
+	~StepShard() {
+		fclose(file);
+	};
+
+	void addEvents(EventBuffer<Hit> *buffer) {
+		double Tps = 1E12/frequency;
+		float Tns = Tps / 1000;
+		long long tMin = buffer->getTMin() * (long long)Tps;
+
+		int N = buffer->getSize();
+		singles.clear();
+		for (int i = 0; i < N; i++) {
+			Hit &hit = buffer->get(i);
+			if(!hit.valid) continue;
+			ShardSingle s;
+			s.index = i;
+			makeOutputSingle(hit, tMin, Tps, Tns, s.e);
+			singles.push_back(s);
+		}
+
+		ShardBuffer b = { buffer->getTMin(), N, (long long)singles.size() };
+		if(fwrite(&b, sizeof(b), 1, file) != 1) failed = true;
+		if(singles.size() > 0 && fwrite(singles.data(), sizeof(ShardSingle), singles.size(), file) != singles.size()) failed = true;
+	};
+
+	/*! Rewinds the file for reading the buffers back */
+	void rewind() {
+		if(fflush(file) != 0 || fseek(file, 0, SEEK_SET) != 0) failed = true;
+		if(failed) {
+			std::ostringstream oss;
+			oss << "ERROR: could not write temporary file for step data: " << strerror(errno);
+			throw std::runtime_error(oss.str());
+		}
+	};
+
+	bool readBuffer(ShardBuffer &b) {
+		return fread(&b, sizeof(b), 1, file) == 1;
+	};
+
+	void readSingle(ShardSingle &s) {
+		if(fread(&s, sizeof(s), 1, file) != 1) {
+			std::ostringstream oss;
+			oss << "ERROR: could not read temporary file for step data";
+			throw std::runtime_error(oss.str());
+		}
+	};
+
 private:
-	std::string fName;
+	FILE *file;
 	double frequency;
-	FILE_TYPE fileType;
-	int eventFractionToWrite;
-	long long eventCounter;
-	double fileSplitTime;
-	long long currentFilePartIndex;
-
-	FILE *dataFile;
-	FILE *indexFile;
-	off_t stepBegin;
-	
-	TTree *hData;
-	TTree *hIndex;
-	TFile *hFile;
-	// ROOT Tree fields
-	float		brStep1;
-	float		brStep2;
-	long long 	brStepBegin;
-	long long 	brStepEnd;
+	bool failed;
+	std::vector<ShardSingle> singles;
+};
 
+class DataFileWriter : public EventFileWriter {
+private:
+	// ROOT Tree fields
 	long long	brTime;
 	unsigned int	brChannelID;
 	float		brToT;
@@ -66,160 +167,66 @@ private:
 		float e;
 		int id;  
 	} __attribute__((__packed__));
+
+protected:
+	void addBranches(TTree *hData, int bs) {
+		hData->Branch("time", &brTime, bs);
+		hData->Branch("channelID", &brChannelID, bs);
+		hData->Branch("tot", &brToT, bs);
+		hData->Branch("energy", &brEnergy, bs);
+		hData->Branch("tacID", &brTacID, bs);
+		hData->Branch("xi", &brXi, bs);
+		hData->Branch("yi", &brYi, bs);
+		hData->Branch("x", &brX, bs);
+		hData->Branch("y", &brY, bs);
+		hData->Branch("z", &brZ, bs);
+		hData->Branch("tqT", &brTQT, bs);
+		hData->Branch("tqE", &brTQE, bs);
+	};
 	
 public:
-	DataFileWriter(const char *fName, double frequency, FILE_TYPE fileType, int eventFractionToWrite, float splitTime) {
-		this->fName = std::string(fName);
-		this->frequency = frequency;
-		this->fileType = (strcmp(fName, "/dev/null") != 0) ? fileType : FILE_NULL;
-		this->eventFractionToWrite = eventFractionToWrite;
-		this->eventCounter = 0;
-
-		this->fileSplitTime = splitTime * frequency; // Convert from seconds to clock cycles
-		this->currentFilePartIndex = 0;
-
+	DataFileWriter(const char *fName, double frequency, FILE_TYPE fileType, int eventFractionToWrite, float splitTime) :
+		EventFileWriter(fName, frequency, fileType, eventFractionToWrite, splitTime)
+	{
 		openFile();
 	};
 
-	void openFile() {
-		stepBegin = 0;
+	void writeSingle(OutputSingle &e) {
 		if (fileType == FILE_ROOT){
-			hFile = new TFile(fName.c_str(), "RECREATE");
-			int bs = 512*1024;
-
-			hData = new TTree("data", "Event List", 2);
-			hData->Branch("step1", &brStep1, bs);
-			hData->Branch("step2", &brStep2, bs);
-			hData->Branch("time", &brTime, bs);
-			hData->Branch("channelID", &brChannelID, bs);
-			hData->Branch("tot", &brToT, bs);
-			hData->Branch("energy", &brEnergy, bs);
-			hData->Branch("tacID", &brTacID, bs);
-			hData->Branch("xi", &brXi, bs);
-			hData->Branch("yi", &brYi, bs);
-			hData->Branch("x", &brX, bs);
-			hData->Branch("y", &brY, bs);
-			hData->Branch("z", &brZ, bs);
-			hData->Branch("tqT", &brTQT, bs);
-			hData->Branch("tqE", &brTQE, bs);
+			brTime = e.time;
+			brChannelID = e.channelID;
+			brToT = e.tot;
+			brEnergy = e.energy;
+			brTacID = e.tacID;
+			brTQT = e.tqT;
+			brTQE = e.tqE;
+			brX = e.x;
+			brY = e.y;
+			brZ = e.z;
+			brXi = e.xi;
+			brYi = e.yi;
 			
-			hIndex = new TTree("index", "Step Index", 2);
-			hIndex->Branch("step1", &brStep1, bs);
-			hIndex->Branch("step2", &brStep2, bs);
-			hIndex->Branch("stepBegin", &brStepBegin, bs);
-			hIndex->Branch("stepEnd", &brStepEnd, bs);
+			fillData();
 		}
 		else if(fileType == FILE_BINARY) {
-			char *fName2 = new char[1024];
-			sprintf(fName2, "%s.ldat", fName.c_str());
-			dataFile = fopen(fName2, "w");
-			sprintf(fName2, "%s.lidx", fName.c_str());
-			indexFile = fopen(fName2, "w");
-			assert(dataFile != NULL);
-			assert(indexFile != NULL);
-			delete [] fName2;
+			SingleEvent eo = {
+				e.time,
+				e.energy,
+				(int)e.channelID
+			};
+			fwrite(&eo, sizeof(eo), 1, dataFile);
 		}
 		else if (fileType == FILE_TEXT) {
-			dataFile = fopen(fName.c_str(), "w");
-			assert(dataFile != NULL);
-			indexFile = NULL;
-		}
-	};
-	
-	~DataFileWriter() {
-		closeFile();
-		if(fileSplitTime > 0) {
-			renameFile();
+			fprintf(dataFile, "%lld\t%f\t%d\n",
+				e.time,
+				e.energy,
+				(int)e.channelID
+				);
 		}
 	};
 
-	void closeFile() {
-		if (fileType == FILE_ROOT){
-			hFile->Write();
-			hFile->Close();
-		}
-		else if(fileType == FILE_BINARY) {
-			fclose(dataFile);
-			fclose(indexFile);
-		}
-		else if (fileType == FILE_TEXT) {
-			fclose(dataFile);
-		}
-	};
-	
-	void closeStep(float step1, float step2) {
-		if (fileType == FILE_ROOT){
-			brStepBegin = stepBegin;
-			brStepEnd = hData->GetEntries();
-			brStep1 = step1;
-			brStep2 = step2;
-			hIndex->Fill();
-			stepBegin = hData->GetEntries();
-		}
-		else if(fileType == FILE_BINARY) {
-			fprintf(indexFile, "%ld\t%ld\t%e\t%e\n", stepBegin, ftell(dataFile), step1, step2);
-			stepBegin = ftell(dataFile);
-		}
-		else {
-			// Do nothing
-		}
-	};
-
-
-	void renameFile() {
-		char *fName1 = new char[1024];
-		char *fName2 = new char[1024];
-		if(fileType == FILE_BINARY) {
-			// Binary output consists of two files and fName is their common prefix
-
-			sprintf(fName1, "%s.ldat", fName.c_str());
-			sprintf(fName2, "%s_%08lld.ldat", fName.c_str(), currentFilePartIndex);
-			int r = rename(fName1, fName2);
-			assert(r == 0);
-
-			sprintf(fName1, "%s.lidx", fName.c_str());
-			sprintf(fName2, "%s_%08lld.lidx", fName.c_str(), currentFilePartIndex);
-			r = rename(fName1, fName2);
-			assert(r == 0);
-
-		}
-		else {
-			// ROOT or text output consists of a single file and fName is the complete fileName
-			strcpy(fName1, fName.c_str());
-			char *p = rindex(fName1, '.');
-
-			if(p == NULL) {
-				// If fName lacks a "." append the file part number at the end of the file name
-				sprintf(fName2, "%s_%08lld", fName1, currentFilePartIndex);
-				int r = rename(fName1, fName2);
-				assert(r == 0);
-			}
-			else {
-				// Insert the file part number before the extension
-				char tmp = *p;
-				*p = '\0';
-				sprintf(fName2, "%s_%08lld.%s", fName1, currentFilePartIndex, p+1);
-				*p = tmp;
-				int r = rename(fName1, fName2);
-				assert(r == 0);
-			}
-
-		}
-		delete [] fName2;
-		delete [] fName1;
-	};
-	
-	void addEvents(float step1, float step2,EventBuffer<Hit> *buffer) {
-		long long filePartIndex = (int)floor(buffer->getTMin() / fileSplitTime);
-
-		if((fileSplitTime > 0) && (filePartIndex > currentFilePartIndex)) {
-			closeStep(step1, step2);
-			closeFile();
-			renameFile();
-
-			openFile();
-			currentFilePartIndex = filePartIndex;
-		}
+	void addEvents(EventBuffer<Hit> *buffer) {
+		beginBuffer(buffer->getTMin());
 		
 		double Tps = 1E12/frequency;
 		float Tns = Tps / 1000;
@@ -227,76 +234,187 @@ public:
 
 		int N = buffer->getSize();
 		for (int i = 0; i < N; i++) {
-			long long tmpCounter = eventCounter;
-			eventCounter += 1;
-			if((tmpCounter % 1024) >= eventFractionToWrite) continue;
+			if(!sampleEvent()) continue;
 
 			Hit &hit = buffer->get(i);
 			if(!hit.valid) continue;
 
-			float Eunit = hit.raw->qdcMode ? 1.0 : Tns;
-			
-			if (fileType == FILE_ROOT){
-				brStep1 = step1;
-				brStep2 = step2;
-				
-				brTime = ((long long)(hit.time * Tps)) + tMin;
-				brChannelID = hit.raw->channelID;
-				brToT = (hit.timeEnd - hit.time) * Tps;
-				brEnergy = hit.energy * Eunit;
-				brTacID = hit.raw->tacID;
-				brTQT = hit.raw->time - hit.time;
-				brTQE = (hit.raw->timeEnd - hit.timeEnd);
-				brX = hit.x;
-				brY = hit.y;
-				brZ = hit.z;
-				brXi = hit.xi;
-				brYi = hit.yi;
-				
-				hData->Fill();
-			}
-			else if(fileType == FILE_BINARY) {
-				SingleEvent eo = {
-					((long long)(hit.time * Tps)) + tMin,
-					hit.energy * Eunit,
-					(int)hit.raw->channelID
-				};
-				fwrite(&eo, sizeof(eo), 1, dataFile);
-			}
-			else if (fileType == FILE_TEXT) {
-				fprintf(dataFile, "%lld\t%f\t%d\n",
-					((long long)(hit.time * Tps)) + tMin,
-					hit.energy * Eunit,
-					(int)hit.raw->channelID
-					);
-			}
+			OutputSingle e;
+			makeOutputSingle(hit, tMin, Tps, Tns, e);
+			writeSingle(e);
 		}
 		
 	}
+
+	/*! Writes the events of a step processed separately, as addEvents() would have written its buffers */
+	void addShard(StepShard *shard) {
+		shard->rewind();
+		StepShard::ShardBuffer b;
+		while(shard->readBuffer(b)) {
+			beginBuffer(b.tMin);
+			for(long long k = 0; k < b.nSingles; k++) {
+				StepShard::ShardSingle s;
+				shard->readSingle(s);
+				long long tmpCounter = eventCounter + s.index;
+				if((tmpCounter % 1024) >= eventFractionToWrite) continue;
+				writeSingle(s.e);
+			}
+			eventCounter += b.nEvents;
+		}
+	};
 	
 };
 
-class WriteHelper : public OrderedEventHandler<Hit, Hit> {
+class ShardWriteHelper : public OrderedEventHandler<Hit, Hit> {
 private: 
-	DataFileWriter *dataFileWriter;
-	float step1;
-	float step2;
+	StepShard *shard;
 public:
-	WriteHelper(DataFileWriter *dataFileWriter, float step1, float step2, EventSink<Hit> *sink) :
-		OrderedEventHandler<Hit, Hit>(sink),
-		dataFileWriter(dataFileWriter), step1(step1), step2(step2)
+	ShardWriteHelper(EventSink<Hit> *sink) :
+		OrderedEventHandler<Hit, Hit>(sink, "DataFileWriter"),
+		shard(NULL)
 	{
 	};
 	
+	/*! The shard of the step whose events follow */
+	void setShard(StepShard *shard) {
+		this->shard = shard;
+	};
+
 	EventBuffer<Hit> * handleEvents(EventBuffer<Hit> *buffer) {
-		dataFileWriter->addEvents(step1, step2,buffer);
+		shard->addEvents(buffer);
 		return buffer;
 	};
 	
-	void pushT0(double t0) { };
+	void pushT0(double) { };
 	void report() { };
 };
 
+/*
+ * Steps processed concurrently by a few threads, each with its own reader cursor and pipeline.
+ * Threads take the next step not started and hand over its shard when done.
+ */
+struct ParallelSteps {
+	RawReader *reader;
+	SystemConfig *config;
+	std::vector<RawReader::StepRange> steps;
+	std::vector<StepShard *> shards;		// NULL until the step is done
+	size_t nextStep;
+	std::string error;				// First error of any thread
+	pthread_mutex_t lock;
+	pthread_cond_t cond_done;
+};
+
+static void *processStepsThread(void *arg)
+{
+	ParallelSteps *ps = (ParallelSteps *)arg;
+	RawReader *cursor = NULL;
+	try {
+		cursor = ps->reader->openCursor();
+		// Built with the first step, the cursor owns it from then on
+		ShardWriteHelper *writeHelper = NULL;
+		EventSink<RawHit> *pipeline = NULL;
+		cursor->setKeepPipeline(true);
+
+		while(true) {
+			pthread_mutex_lock(&ps->lock);
+			size_t stepIndex = ps->nextStep;
+			ps->nextStep = (ps->error.empty() && stepIndex < ps->steps.size()) ? stepIndex + 1 : ps->steps.size();
+			pthread_mutex_unlock(&ps->lock);
+			if(stepIndex >= ps->steps.size()) break;
+
+			RawReader::StepRange &step = ps->steps[stepIndex];
+			printf("Processing step %lu: (%f, %f)\n", stepIndex+1, step.stepValue1, step.stepValue2);
+			fflush(stdout);
+			StepShard *shard = new StepShard(cursor->getFrequency());
+			if(writeHelper == NULL) {
+				writeHelper = new ShardWriteHelper(new NullSink<Hit>());
+				if(!ps->config->processing_fused_decode) {
+					pipeline = new CoarseSorter(
+							new ProcessHit(ps->config, cursor,
+							writeHelper
+							));
+				}
+			}
+			writeHelper->setShard(shard);
+			cursor->setStep(step);
+			// Reports of concurrent steps would be interleaved
+			if(ps->config->processing_fused_decode)
+				cursor->processStep(false, ps->config, writeHelper);
+			else
+				cursor->processStep(false, pipeline);
+
+			pthread_mutex_lock(&ps->lock);
+			ps->shards[stepIndex] = shard;
+			pthread_cond_broadcast(&ps->cond_done);
+			pthread_mutex_unlock(&ps->lock);
+		}
+	}
+	catch(std::exception &e) {
+		pthread_mutex_lock(&ps->lock);
+		if(ps->error.empty()) ps->error = e.what();
+		pthread_cond_broadcast(&ps->cond_done);
+		pthread_mutex_unlock(&ps->lock);
+	}
+	// Deletes the pipeline
+	delete cursor;
+	return NULL;
+}
+
+/*
+ * Processes the steps with config->processing_parallel_steps threads
+ * and writes them to dataFileWriter in step order as they complete.
+ */
+static void processStepsInParallel(RawReader *reader, SystemConfig *config, std::vector<RawReader::StepRange> &steps, DataFileWriter *dataFileWriter)
+{
+	ParallelSteps ps;
+	ps.reader = reader;
+	ps.config = config;
+	ps.steps = steps;
+	ps.shards.assign(steps.size(), NULL);
+	ps.nextStep = 0;
+	pthread_mutex_init(&ps.lock, NULL);
+	pthread_cond_init(&ps.cond_done, NULL);
+
+	size_t nThreads = std::min(steps.size(), (size_t)config->processing_parallel_steps);
+	std::vector<pthread_t> threads(nThreads);
+	for(size_t n = 0; n < nThreads; n++)
+		pthread_create(&threads[n], NULL, processStepsThread, (void *)&ps);
+
+	for(size_t stepIndex = 0; stepIndex < steps.size(); stepIndex++) {
+		pthread_mutex_lock(&ps.lock);
+		while(ps.shards[stepIndex] == NULL && ps.error.empty())
+			pthread_cond_wait(&ps.cond_done, &ps.lock);
+		StepShard *shard = ps.shards[stepIndex];
+		ps.shards[stepIndex] = NULL;
+		pthread_mutex_unlock(&ps.lock);
+		if(shard == NULL) break;
+
+		dataFileWriter->setStep(steps[stepIndex].stepValue1, steps[stepIndex].stepValue2);
+		try {
+			dataFileWriter->addShard(shard);
+		}
+		catch(std::exception &e) {
+			pthread_mutex_lock(&ps.lock);
+			if(ps.error.empty()) ps.error = e.what();
+			pthread_mutex_unlock(&ps.lock);
+			delete shard;
+			break;
+		}
+		dataFileWriter->closeStep();
+		delete shard;
+	}
+
+	for(size_t n = 0; n < nThreads; n++)
+		pthread_join(threads[n], NULL);
+	for(StepShard *shard : ps.shards)
+		delete shard;
+	pthread_cond_destroy(&ps.cond_done);
+	pthread_mutex_destroy(&ps.lock);
+
+	if(!ps.error.empty())
+		throw std::runtime_error(ps.error);
+}
+
 static void displayHelp(char * program)
 {
 	fprintf(stderr, "Usage: %s --config <config_file> -i <input_file_prefix> -o <output_file_prefix> [optional arguments]\n", program);
@@ -309,6 +427,7 @@ static void displayHelp(char * program)
 	fprintf(stderr,  "  --writeRoot \t\t Set the output data format to ROOT TTree\n");
 	fprintf(stderr,  "  --writeFraction N \t\t Fraction of events to write. Default: 100%%.\n");
 	fprintf(stderr,  "  --splitTime t \t\t Split output into different files every t seconds.\n");
+	fprintf(stderr,  "  --channelMask LIST \t Only convert these channels: portID/slaveID/chipID[/channelID] or gChannelID ranges, comma separated.\n");
 	fprintf(stderr,  "  --help \t\t Show this help message and exit \n");	
 	
 };
@@ -323,70 +442,32 @@ bool runConvertRawToSingles(const std::string& configFileName,
                             const std::string& outputFileName,
                             FILE_TYPE fileType,
                             long long eventFractionToWrite,
-                            double fileSplitTime)
+                            double fileSplitTime,
+                            const std::string& channelMask)
 {
-  if (configFileName.empty() || inputFilePrefix.empty() || outputFileName.empty()) {
-    //cerr << "Error: config, input, and output arguments are mandatory." << endl;
-    //return false;
-    std::ostringstream oss;
-    oss << "Error: config, input, and output arguments are mandatory.";
-    throw std::runtime_error(oss.str());
-  }
-
-	if(configFileName == NULL) {
-		//fprintf(stderr, "--config must be specified\n");
-		//exit(1);
-    std::ostringstream oss;
-    oss << "ERROR: --config must be specified";
-    throw std::runtime_error(oss.str());
-	}
-	
-	if(inputFilePrefix == NULL) {
-		//fprintf(stderr, "-i must be specified\n");
-		//exit(1);
-    std::ostringstream oss;
-    oss << "ERROR: -i must be specified";
-    throw std::runtime_error(oss.str());
-	}
+	RawConversion conversion(configFileName, inputFilePrefix, outputFileName, channelMask);
+	RawReader *reader = conversion.getReader();
+	SystemConfig *config = conversion.getConfig();
 
-	if(outputFileName == NULL) {
-		//fprintf(stderr, "-o must be specified\n");
-		//exit(1);
-    std::ostringstream oss;
-    oss << "ERROR: -o must be specified";
-    throw std::runtime_error(oss.str());
-	}
+	DataFileWriter *dataFileWriter = new DataFileWriter(outputFileName.c_str(), reader->getFrequency(),  fileType, eventFractionToWrite, fileSplitTime);
 
-	RawReader *reader = RawReader::openFile(inputFilePrefix.c_str());
-	
-	// If data was taken in ToT mode, do not attempt to load these files
-	unsigned long long mask = SystemConfig::LOAD_ALL;
-	if(reader->isTOT()) {
-		mask ^= (SystemConfig::LOAD_QDC_CALIBRATION | SystemConfig::LOAD_ENERGY_CALIBRATION);
+	std::vector<RawReader::StepRange> steps;
+	if(config->processing_parallel_steps > 1 && reader->readStepIndex(steps)) {
+		if(config->processing_buffer_size == 0) {
+			// Adaptive buffer boundaries depend on timing, steps processed concurrently would then not match sequential output
+			fprintf(stderr, "WARNING: adaptive buffer_size is not supported with parallel_steps > 1, using %u events per buffer\n", RawReader::DEFAULT_BUFFER_SIZE);
+			reader->setBufferSize(RawReader::DEFAULT_BUFFER_SIZE);
+		}
+		processStepsInParallel(reader, config, steps, dataFileWriter);
+		conversion.writeTrace("");
 	}
-	SystemConfig *config = SystemConfig::fromFile(configFileName.c_str(), mask);
-	
-	DataFileWriter *dataFileWriter = new DataFileWriter(outputFileName.c_str(), reader->getFrequency(),  fileType, eventFractionToWrite, fileSplitTime);
-	
-	int stepIndex = 0;
-	while(reader->getNextStep()) {
-		float step1, step2;
-		reader->getStepValue(step1, step2);
-		printf("Processing step %d: (%f, %f)\n", stepIndex+1, step1, step2);
-		fflush(stdout);
-		reader->processStep(true,
-				new CoarseSorter(
-				new ProcessHit(config, reader,
-				new WriteHelper(dataFileWriter, step1, step2,
-				new NullSink<Hit>()
-				))));
-		
-		dataFileWriter->closeStep(step1, step2);
-		stepIndex += 1;
+	else {
+		conversion.processSteps(
+			new FileWriteHelper<Hit, DataFileWriter>(dataFileWriter, "DataFileWriter",
+			new NullSink<Hit>()),
+			dataFileWriter);
 	}
-
 	delete dataFileWriter;
-	delete reader;
 
 	return true;
 }
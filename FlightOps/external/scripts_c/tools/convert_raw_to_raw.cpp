@@ -13,11 +13,14 @@ int main(int argc, char** argv) {
     std::string inputFilePrefix;
     std::string outputFileName;
     long long eventFractionToWrite = 1024;
+    std::string channelMask;
 
     static struct option longOptions[] = {
         { "help",           no_argument,       0, 0 },
         { "config",         required_argument, 0, 0 },
-        { "writeFraction",  required_argument }
+        { "writeFraction",  required_argument, 0, 0 },
+        { "channelMask",    required_argument, 0, 0 },
+        { NULL,             0,                 0, 0 }
     };
 
     while (true) {
@@ -41,12 +44,13 @@ int main(int argc, char** argv) {
                     return 0;
                 case 1: configFileName = optarg; break;
                 case 2: eventFractionToWrite = std::llround(1024 * boost::lexical_cast<float>(optarg) / 100.0); break;
+                case 3: channelMask = optarg; break;
                 default: return 1;
             }
         }
     }
 
-    if (!runConvertRawToRaw(configFileName, inputFilePrefix, outputFileName, eventFractionToWrite)) {
+    if (!runConvertRawToRaw(configFileName, inputFilePrefix, outputFileName, eventFractionToWrite, channelMask)) {
         std::cerr << "Conversion from raw to singles failed.\n";
         return 1;
     }
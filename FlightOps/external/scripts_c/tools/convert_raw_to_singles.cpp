@@ -15,6 +15,7 @@ int main(int argc, char** argv) {
     FILE_TYPE fileType = FILE_TEXT;
     long long eventFractionToWrite = 1024;
     double fileSplitTime = 0.0;
+    std::string channelMask;
 
     static struct option longOptions[] = {
         { "help",           no_argument,       0, 0 },
@@ -22,7 +23,9 @@ int main(int argc, char** argv) {
         { "writeBinary",    no_argument,       0, 0 },
         { "writeRoot",      no_argument,       0, 0 },
         { "writeFraction",  required_argument, 0, 0 },
-        { "splitTime",      required_argument, 0, 0 }
+        { "splitTime",      required_argument, 0, 0 },
+        { "channelMask",    required_argument, 0, 0 },
+        { NULL,             0,                 0, 0 }
     };
 
     while (true) {
@@ -50,12 +53,13 @@ int main(int argc, char** argv) {
                 case 3: fileType = FILE_ROOT; break;
                 case 4: eventFractionToWrite = std::llround(1024 * boost::lexical_cast<float>(optarg) / 100.0); break;
                 case 5: fileSplitTime = boost::lexical_cast<double>(optarg); break;
+                case 6: channelMask = optarg; break;
                 default: return 1;
             }
         }
     }
 
-    if (!runConvertRawToSingles(configFileName, inputFilePrefix, outputFileName, fileType, eventFractionToWrite, fileSplitTime)) {
+    if (!runConvertRawToSingles(configFileName, inputFilePrefix, outputFileName, fileType, eventFractionToWrite, fileSplitTime, channelMask)) {
         std::cerr << "Conversion from raw to singles failed.\n";
         return 1;
     }
@@ -30,14 +30,37 @@ public:
     bool runPetsysConvertRawToRaw(const std::string& configFileName,
                                   const std::string& inputFilePrefix,
                                   const std::string& outputFileName,
-                                  long long eventFractionToWrite = 1024);
+                                  long long eventFractionToWrite = 1024,
+                                  const std::string& channelMask = "");
 
     bool runPetsysConvertRawToSingles(const std::string& configFileName,
                                       const std::string& inputFilePrefix,
                                       const std::string& outputFileName,
                                       PETSYS::FILE_TYPE fileType = PETSYS::FILE_TEXT,
                                       long long eventFractionToWrite = 1024,
-                                      double fileSplitTime = 0.0);
+                                      double fileSplitTime = 0.0,
+                                      const std::string& channelMask = "");
+
+    bool runPetsysConvertRawToGroup(const std::string& configFileName,
+                                    const std::string& inputFilePrefix,
+                                    const std::string& outputFileName,
+                                    PETSYS::FILE_TYPE fileType = PETSYS::FILE_TEXT,
+                                    long long eventFractionToWrite = 1024,
+                                    double fileSplitTime = 0.0,
+                                    int hitLimitToWrite = 1,
+                                    const std::string& channelMask = "");
+
+    bool runPetsysConvertRawToCoincidence(const std::string& configFileName,
+                                          const std::string& inputFilePrefix,
+                                          const std::string& outputFileName,
+                                          PETSYS::FILE_TYPE fileType = PETSYS::FILE_TEXT,
+                                          long long eventFractionToWrite = 1024,
+                                          double fileSplitTime = 0.0,
+                                          int hitLimitToWrite = 1,
+                                          const std::string& channelMask = "");
+
+    // Snapshot of the pipeline metrics as JSON, safe to poll while a conversion runs
+    std::string getPipelineMetricsJSON() const;
 
 private:
     template<typename Func, typename... Args>
@@ -27,6 +27,8 @@ enum class TOFCommandCode : uint16_t {
     RUN_PROCESS_QDC_CALIBRATION            = 0x5202,
     RUN_CONVERT_RAW_TO_RAW                 = 0x5203,
     RUN_CONVERT_RAW_TO_SINGLES             = 0x5204,
+    RUN_CONVERT_RAW_TO_GROUP               = 0x5205,
+    RUN_CONVERT_RAW_TO_COINCIDENCE         = 0x5206,
 
     ACK                                    = 0x5FFF,
     CALLBACK                               = 0x5FFE,
@@ -66,6 +68,8 @@ inline std::ostream& operator<<(std::ostream& os, TOFCommandCode code) {
         case TOFCommandCode::RUN_PROCESS_QDC_CALIBRATION:          return os << "RUN_PROCESS_QDC_CALIBRATION";
         case TOFCommandCode::RUN_CONVERT_RAW_TO_RAW:               return os << "RUN_CONVERT_RAW_TO_RAW";
         case TOFCommandCode::RUN_CONVERT_RAW_TO_SINGLES:           return os << "RUN_CONVERT_RAW_TO_SINGLES";
+        case TOFCommandCode::RUN_CONVERT_RAW_TO_GROUP:             return os << "RUN_CONVERT_RAW_TO_GROUP";
+        case TOFCommandCode::RUN_CONVERT_RAW_TO_COINCIDENCE:       return os << "RUN_CONVERT_RAW_TO_COINCIDENCE";
 
         case TOFCommandCode::ACK:                                  return os << "ACK";
         case TOFCommandCode::CALLBACK:                             return os << "CALLBACK";
@@ -106,6 +110,8 @@ inline CommunicationCodes toCommCode(TOFCommandCode code) {
         case TOFCommandCode::RUN_PROCESS_QDC_CALIBRATION:          return CommunicationCodes::TOF_Run_Process_QDC_Calibration;
         case TOFCommandCode::RUN_CONVERT_RAW_TO_RAW:               return CommunicationCodes::TOF_Run_Convert_Raw_To_Raw;
         case TOFCommandCode::RUN_CONVERT_RAW_TO_SINGLES:           return CommunicationCodes::TOF_Run_Convert_Raw_To_Singles;
+        case TOFCommandCode::RUN_CONVERT_RAW_TO_GROUP:             return CommunicationCodes::TOF_Run_Convert_Raw_To_Group;
+        case TOFCommandCode::RUN_CONVERT_RAW_TO_COINCIDENCE:       return CommunicationCodes::TOF_Run_Convert_Raw_To_Coincidence;
 
         case TOFCommandCode::ACK:                                  return CommunicationCodes::TOF_ACK;
         case TOFCommandCode::CALLBACK:                             return CommunicationCodes::TOF_Callback;
@@ -142,6 +148,8 @@ inline TOFCommandCode toTOFCommand(CommunicationCodes code) {
         case CommunicationCodes::TOF_Run_Process_QDC_Calibration:          return TOFCommandCode::RUN_PROCESS_QDC_CALIBRATION;
         case CommunicationCodes::TOF_Run_Convert_Raw_To_Raw:               return TOFCommandCode::RUN_CONVERT_RAW_TO_RAW;
         case CommunicationCodes::TOF_Run_Convert_Raw_To_Singles:           return TOFCommandCode::RUN_CONVERT_RAW_TO_SINGLES;
+        case CommunicationCodes::TOF_Run_Convert_Raw_To_Group:             return TOFCommandCode::RUN_CONVERT_RAW_TO_GROUP;
+        case CommunicationCodes::TOF_Run_Convert_Raw_To_Coincidence:       return TOFCommandCode::RUN_CONVERT_RAW_TO_COINCIDENCE;
 
         case CommunicationCodes::TOF_ACK:                                  return TOFCommandCode::ACK;
         case CommunicationCodes::TOF_Callback:                             return TOFCommandCode::CALLBACK;
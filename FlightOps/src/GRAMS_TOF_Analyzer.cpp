@@ -4,6 +4,9 @@
 #include "process_qdc_calibration.h"
 #include "convert_raw_to_raw.h"
 #include "convert_raw_to_singles.h"
+#include "convert_raw_to_group.h"
+#include "convert_raw_to_coincidence.h"
+#include "Metrics.h"
 
 bool GRAMS_TOF_Analyzer::runPetsysProcessThresholdCalibration(
     const std::string& configFile,
@@ -50,12 +53,13 @@ bool GRAMS_TOF_Analyzer::runPetsysConvertRawToRaw(
     const std::string& configFileName,
     const std::string& inputFilePrefix,
     const std::string& outputFileName,
-    long long eventFractionToWrite)
+    long long eventFractionToWrite,
+    const std::string& channelMask)
 {
     return safeRun("runPetsysConvertRawToRaw",
                    runConvertRawToRaw,
                    configFileName, inputFilePrefix, outputFileName,
-                   eventFractionToWrite);
+                   eventFractionToWrite, channelMask);
 }
 
 bool GRAMS_TOF_Analyzer::runPetsysConvertRawToSingles(
@@ -64,11 +68,49 @@ bool GRAMS_TOF_Analyzer::runPetsysConvertRawToSingles(
     const std::string& outputFileName,
     PETSYS::FILE_TYPE fileType,
     long long eventFractionToWrite,
-    double fileSplitTime)
+    double fileSplitTime,
+    const std::string& channelMask)
 {
     return safeRun("runPetsysConvertRawToSingles",
                    runConvertRawToSingles,
                    configFileName, inputFilePrefix, outputFileName,
-                   fileType, eventFractionToWrite, fileSplitTime);
+                   fileType, eventFractionToWrite, fileSplitTime, channelMask);
+}
+
+bool GRAMS_TOF_Analyzer::runPetsysConvertRawToGroup(
+    const std::string& configFileName,
+    const std::string& inputFilePrefix,
+    const std::string& outputFileName,
+    PETSYS::FILE_TYPE fileType,
+    long long eventFractionToWrite,
+    double fileSplitTime,
+    int hitLimitToWrite,
+    const std::string& channelMask)
+{
+    return safeRun("runPetsysConvertRawToGroup",
+                   runConvertRawToGroup,
+                   configFileName, inputFilePrefix, outputFileName,
+                   fileType, eventFractionToWrite, fileSplitTime, hitLimitToWrite, channelMask);
+}
+
+bool GRAMS_TOF_Analyzer::runPetsysConvertRawToCoincidence(
+    const std::string& configFileName,
+    const std::string& inputFilePrefix,
+    const std::string& outputFileName,
+    PETSYS::FILE_TYPE fileType,
+    long long eventFractionToWrite,
+    double fileSplitTime,
+    int hitLimitToWrite,
+    const std::string& channelMask)
+{
+    return safeRun("runPetsysConvertRawToCoincidence",
+                   runConvertRawToCoincidence,
+                   configFileName, inputFilePrefix, outputFileName,
+                   fileType, eventFractionToWrite, fileSplitTime, hitLimitToWrite, channelMask);
 }
 
+
+std::string GRAMS_TOF_Analyzer::getPipelineMetricsJSON() const
+{
+    return PETSYS::Metrics::snapshot().toJSON();
+}
@@ -425,6 +425,56 @@ GRAMS_TOF_CommandDispatch::GRAMS_TOF_CommandDispatch(
         }
     };
 
+    // RUN_CONVERT_RAW_TO_GROUP
+    table_[TOFCommandCode::RUN_CONVERT_RAW_TO_GROUP] = [&](const std::vector<int>& argv) {
+        try {
+            auto timestampStr = config.getLatestTimestamp(config.getSTG0Dir(), "run");
+            Logger::instance().warn("[GRAMS_TOF_CommandDispatch] Converting raw to group...");
+            PETSYS::FILE_TYPE fileType = argv.size() > 0 ? static_cast<PETSYS::FILE_TYPE>(argv[0]) : PETSYS::FILE_ROOT;
+            long long eventFractionToWrite = argv.size() > 1 ? static_cast<long long>(argv[1]) : 1024;
+            double fileSplitTime = argv.size() > 2 ? static_cast<double>(argv[2]) : 0.0;
+            int hitLimitToWrite = argv.size() > 3 ? argv[3] : 1;
+
+            return analyzer_.runPetsysConvertRawToGroup(
+                config.getConfigFilePath(),
+                config.getFileByTimestamp(config.getSTG0Dir(), "run", timestampStr),
+                config.makeFilePathWithTimestamp(config.getSTG1Dir(), "run", timestampStr, "root_group"),
+                fileType,
+                eventFractionToWrite,
+                fileSplitTime,
+                hitLimitToWrite
+            );
+        } catch (...) {
+            Logger::instance().error("[GRAMS_TOF_CommandDispatch] Exception in RUN_CONVERT_RAW_TO_GROUP");
+            return false;
+        }
+    };
+
+    // RUN_CONVERT_RAW_TO_COINCIDENCE
+    table_[TOFCommandCode::RUN_CONVERT_RAW_TO_COINCIDENCE] = [&](const std::vector<int>& argv) {
+        try {
+            auto timestampStr = config.getLatestTimestamp(config.getSTG0Dir(), "run");
+            Logger::instance().warn("[GRAMS_TOF_CommandDispatch] Converting raw to coincidence...");
+            PETSYS::FILE_TYPE fileType = argv.size() > 0 ? static_cast<PETSYS::FILE_TYPE>(argv[0]) : PETSYS::FILE_ROOT;
+            long long eventFractionToWrite = argv.size() > 1 ? static_cast<long long>(argv[1]) : 1024;
+            double fileSplitTime = argv.size() > 2 ? static_cast<double>(argv[2]) : 0.0;
+            int hitLimitToWrite = argv.size() > 3 ? argv[3] : 1;
+
+            return analyzer_.runPetsysConvertRawToCoincidence(
+                config.getConfigFilePath(),
+                config.getFileByTimestamp(config.getSTG0Dir(), "run", timestampStr),
+                config.makeFilePathWithTimestamp(config.getSTG1Dir(), "run", timestampStr, "root_coincidence"),
+                fileType,
+                eventFractionToWrite,
+                fileSplitTime,
+                hitLimitToWrite
+            );
+        } catch (...) {
+            Logger::instance().error("[GRAMS_TOF_CommandDispatch] Exception in RUN_CONVERT_RAW_TO_COINCIDENCE");
+            return false;
+        }
+    };
+
     // HEART_BEAT
     table_[TOFCommandCode::HEART_BEAT] = [&](const std::vector<int>&) {
         try {